@@ -283,7 +283,8 @@ event_wait(struct event_base *evb, int timeout)
         }
 
         if (errno == EINTR) {
-            continue;
+            /* let the event loop act on the signal that interrupted us */
+            return 0;
         }
 
         log_error("epoll wait on e %d with %d events failed: %s", ep, nevent,
@@ -317,10 +318,20 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
         goto error;
     }
 
+    ev.data.fd = st->wakeup[0];
+    ev.events = EPOLLIN;
+
+    status = epoll_ctl(ep, EPOLL_CTL_ADD, st->wakeup[0], &ev);
+    if (status < 0) {
+        log_error("epoll ctl on e %d sd %d failed: %s", ep, st->wakeup[0],
+                  strerror(errno));
+        goto error;
+    }
+
     for (;;) {
         int n;
 
-        n = epoll_wait(ep, &ev, 1, st->interval);
+        n = epoll_wait(ep, &ev, 1, st->timeout);
         if (n < 0) {
             if (errno == EINTR) {
                 continue;
@@ -331,6 +342,11 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
         }
 
         cb(st, &n);
+
+        /* stats descriptor handed off on upgrade or stats destroyed */
+        if (st->sd < 0) {
+            break;
+        }
     }
 
 error:
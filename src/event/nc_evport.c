@@ -273,7 +273,12 @@ event_wait(struct event_base *evb, int timeout)
          */
         status = port_getn(evp, event, nevent, &nreturned, tsp);
         if (status < 0) {
-            if (errno == EINTR || errno == EAGAIN) {
+            if (errno == EINTR) {
+                /* let the event loop act on the signal that interrupted us */
+                return 0;
+            }
+
+            if (errno == EAGAIN) {
                 continue;
             }
 
@@ -369,19 +374,25 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
         goto error;
     }
 
-    /* port_getn should block indefinitely if st->interval < 0 */
-    if (st->interval < 0) {
-        tsp = NULL;
-    } else {
-        tsp = &ts;
-        tsp->tv_sec = st->interval / 1000LL;
-        tsp->tv_nsec = (st->interval % 1000LL) * 1000000LL;
+    status = port_associate(evp, PORT_SOURCE_FD, st->wakeup[0], POLLIN, NULL);
+    if (status < 0) {
+        log_error("port associate on evp %d sd %d failed: %s", evp,
+                  st->wakeup[0], strerror(errno));
+        goto error;
     }
 
-
     for (;;) {
         unsigned int nreturned = 1;
 
+        /* port_getn should block indefinitely if st->timeout < 0 */
+        if (st->timeout < 0) {
+            tsp = NULL;
+        } else {
+            tsp = &ts;
+            tsp->tv_sec = st->timeout / 1000LL;
+            tsp->tv_nsec = (st->timeout % 1000LL) * 1000000LL;
+        }
+
         status = port_getn(evp, &event, 1, &nreturned, tsp);
         if (status != NC_OK) {
             if (errno == EINTR || errno == EAGAIN) {
@@ -397,7 +408,7 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
 
         ASSERT(nreturned <= 1);
 
-        if (nreturned == 1) {
+        if (nreturned == 1 && (int)event.portev_object == st->sd) {
             /* re-associate monitoring descriptor with the port */
             status = port_associate(evp, PORT_SOURCE_FD, st->sd, POLLIN, NULL);
             if (status < 0) {
@@ -407,6 +418,11 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
         }
 
         cb(st, &nreturned);
+
+        /* stats descriptor handed off on upgrade or stats destroyed */
+        if (st->sd < 0) {
+            break;
+        }
     }
 
 error:
@@ -334,7 +334,8 @@ event_wait(struct event_base *evb, int timeout)
         }
 
         if (errno == EINTR) {
-            continue;
+            /* let the event loop act on the signal that interrupted us */
+            return 0;
         }
 
         log_error("kevent on kq %d with %d events failed: %s", kq, evb->nevent,
@@ -350,7 +351,7 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
 {
     struct stats *st = arg;
     int status, kq;
-    struct kevent change, event;
+    struct kevent change[2], event;
     struct timespec ts, *tsp;
 
     kq = kqueue();
@@ -359,21 +360,22 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
         return;
     }
 
-    EV_SET(&change, st->sd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
-
-    /* kevent should block indefinitely if st->interval < 0 */
-    if (st->interval < 0) {
-        tsp = NULL;
-    } else {
-        tsp = &ts;
-        tsp->tv_sec = st->interval / 1000LL;
-        tsp->tv_nsec = (st->interval % 1000LL) * 1000000LL;
-    }
+    EV_SET(&change[0], st->sd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    EV_SET(&change[1], st->wakeup[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
 
     for (;;) {
         int nreturned;
 
-        nreturned = kevent(kq, &change, 1, &event, 1, tsp);
+        /* kevent should block indefinitely if st->timeout < 0 */
+        if (st->timeout < 0) {
+            tsp = NULL;
+        } else {
+            tsp = &ts;
+            tsp->tv_sec = st->timeout / 1000LL;
+            tsp->tv_nsec = (st->timeout % 1000LL) * 1000000LL;
+        }
+
+        nreturned = kevent(kq, change, 2, &event, 1, tsp);
         if (nreturned < 0) {
             if (errno == EINTR) {
                 continue;
@@ -399,6 +401,11 @@ event_loop_stats(event_stats_cb_t cb, void *arg)
         }
 
         cb(st, &nreturned);
+
+        /* stats descriptor handed off on upgrade or stats destroyed */
+        if (st->sd < 0) {
+            break;
+        }
     }
 
 error:
@@ -27,6 +27,8 @@
 #include <nc_core.h>
 #include <nc_conf.h>
 #include <nc_signal.h>
+#include <nc_upgrade.h>
+#include <nc_dns.h>
 
 #define NC_CONF_PATH        "conf/nutcracker.yml"
 
@@ -41,6 +43,11 @@
 
 #define NC_PID_FILE         NULL
 
+#define NC_UPGRADE_PATH     NULL
+#define NC_DRAIN_TIMEOUT    UPGRADE_DRAIN_TIMEOUT
+
+#define NC_RESOLVE_INTERVAL DNS_RESOLVE_INTERVAL
+
 #define NC_MBUF_SIZE        MBUF_SIZE
 #define NC_MBUF_MIN_SIZE    MBUF_MIN_SIZE
 #define NC_MBUF_MAX_SIZE    MBUF_MAX_SIZE
@@ -65,10 +72,13 @@ static struct option long_options[] = {
     { "stats-addr",     required_argument,  NULL,   'a' },
     { "pid-file",       required_argument,  NULL,   'p' },
     { "mbuf-size",      required_argument,  NULL,   'm' },
+    { "upgrade-socket", required_argument,  NULL,   'u' },
+    { "drain-timeout",  required_argument,  NULL,   'w' },
+    { "dns-interval",   required_argument,  NULL,   'r' },
     { NULL,             0,                  NULL,    0  }
 };
 
-static char short_options[] = "hVtdDv:o:c:s:i:a:p:m:";
+static char short_options[] = "hVtdDv:o:c:s:i:a:p:m:u:w:r:";
 
 static rstatus_t
 nc_daemonize(int dump_core)
@@ -205,6 +215,8 @@ nc_show_usage(void)
         "Usage: nutcracker [-?hVdDt] [-v verbosity level] [-o output file]" CRLF
         "                  [-c conf file] [-s stats port] [-a stats addr]" CRLF
         "                  [-i stats interval] [-p pid file] [-m mbuf size]" CRLF
+        "                  [-u upgrade socket] [-w drain timeout]" CRLF
+        "                  [-r dns interval]" CRLF
         "");
     log_stderr(
         "Options:" CRLF
@@ -222,13 +234,19 @@ nc_show_usage(void)
         "  -i, --stats-interval=N : set stats aggregation interval in msec (default: %d msec)" CRLF
         "  -p, --pid-file=S       : set pid file (default: %s)" CRLF
         "  -m, --mbuf-size=N      : set size of mbuf chunk in bytes (default: %d bytes)" CRLF
+        "  -u, --upgrade-socket=S : set upgrade socket for hot upgrades (default: %s)" CRLF
+        "  -w, --drain-timeout=N  : set drain timeout on upgrade in msec (default: %d msec)" CRLF
+        "  -r, --dns-interval=N   : set interval to re-resolve server names in msec (default: %s)" CRLF
         "",
         NC_LOG_DEFAULT, NC_LOG_MIN, NC_LOG_MAX,
         NC_LOG_PATH != NULL ? NC_LOG_PATH : "stderr",
         NC_CONF_PATH,
         NC_STATS_PORT, NC_STATS_ADDR, NC_STATS_INTERVAL,
         NC_PID_FILE != NULL ? NC_PID_FILE : "off",
-        NC_MBUF_SIZE);
+        NC_MBUF_SIZE,
+        NC_UPGRADE_PATH != NULL ? NC_UPGRADE_PATH : "off",
+        NC_DRAIN_TIMEOUT,
+        NC_RESOLVE_INTERVAL != 0 ? "on" : "off");
 }
 
 static rstatus_t
@@ -300,6 +318,11 @@ nc_set_default_options(struct instance *nci)
     nci->pid = (pid_t)-1;
     nci->pid_filename = NULL;
     nci->pidfile = 0;
+
+    nci->upgrade_filename = NC_UPGRADE_PATH;
+    nci->drain_timeout = NC_DRAIN_TIMEOUT;
+
+    nci->resolve_interval = NC_RESOLVE_INTERVAL;
 }
 
 static rstatus_t
@@ -405,11 +428,36 @@ nc_get_options(int argc, char **argv, struct instance *nci)
             nci->mbuf_chunk_size = (size_t)value;
             break;
 
+        case 'u':
+            nci->upgrade_filename = optarg;
+            break;
+
+        case 'w':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("nutcracker: option -w requires a number");
+                return NC_ERROR;
+            }
+
+            nci->drain_timeout = value;
+            break;
+
+        case 'r':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("nutcracker: option -r requires a number");
+                return NC_ERROR;
+            }
+
+            nci->resolve_interval = value;
+            break;
+
         case '?':
             switch (optopt) {
             case 'o':
             case 'c':
             case 'p':
+            case 'u':
                 log_stderr("nutcracker: option -%c requires a file name",
                            optopt);
                 break;
@@ -418,6 +466,8 @@ nc_get_options(int argc, char **argv, struct instance *nci)
             case 'v':
             case 's':
             case 'i':
+            case 'w':
+            case 'r':
                 log_stderr("nutcracker: option -%c requires a number", optopt);
                 break;
 
@@ -449,15 +499,23 @@ static bool
 nc_test_conf(struct instance *nci)
 {
     struct conf *cf;
+    rstatus_t status;
+
+    status = dns_init(0);
+    if (status != NC_OK) {
+        return false;
+    }
 
     cf = conf_create(nci->conf_filename);
     if (cf == NULL) {
         log_stderr("nutcracker: configuration file '%s' syntax is invalid",
                    nci->conf_filename);
+        dns_deinit();
         return false;
     }
 
     conf_destroy(cf);
+    dns_deinit();
 
     log_stderr("nutcracker: configuration file '%s' syntax is ok",
                nci->conf_filename);
@@ -488,6 +546,11 @@ nc_pre_run(struct instance *nci)
         return status;
     }
 
+    status = dns_init(nci->resolve_interval);
+    if (status != NC_OK) {
+        return status;
+    }
+
     if (nci->pid_filename) {
         status = nc_create_pidfile(nci);
         if (status != NC_OK) {
@@ -509,6 +572,8 @@ nc_post_run(struct instance *nci)
 
     signal_deinit();
 
+    dns_deinit();
+
     nc_print_done();
 
     log_deinit();
@@ -533,6 +598,11 @@ nc_run(struct instance *nci)
         }
     }
 
+    /* pid file belongs to the process that took over on upgrade */
+    if (upgrade_handed_off(ctx)) {
+        nci->pidfile = 0;
+    }
+
     core_stop(ctx);
 }
 
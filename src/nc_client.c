@@ -129,6 +129,8 @@ client_close(struct context *ctx, struct conn *conn)
 
     client_close_stats(ctx, conn->owner, conn->err, conn->eof);
 
+    conn_tmo_delete(conn);
+
     if (conn->sd < 0) {
         conn->unref(conn);
         conn_put(conn);
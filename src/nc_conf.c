@@ -18,6 +18,7 @@
 #include <nc_core.h>
 #include <nc_conf.h>
 #include <nc_server.h>
+#include <nc_dns.h>
 #include <proto/nc_proto.h>
 
 #define DEFINE_ACTION(_hash, _name) string(#_name),
@@ -41,6 +42,20 @@ static struct string dist_strings[] = {
 };
 #undef DEFINE_ACTION
 
+#define DEFINE_ACTION(_ack, _name) string(#_name),
+static struct string ack_strings[] = {
+    ACK_CODEC( DEFINE_ACTION )
+    null_string
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_throttle, _name) string(#_name),
+static struct string throttle_strings[] = {
+    THROTTLE_CODEC( DEFINE_ACTION )
+    null_string
+};
+#undef DEFINE_ACTION
+
 static struct command conf_commands[] = {
     { string("listen"),
       conf_set_listen,
@@ -62,6 +77,34 @@ static struct command conf_commands[] = {
       conf_set_num,
       offsetof(struct conf_pool, timeout) },
 
+    { string("timeout_limit"),
+      conf_set_num,
+      offsetof(struct conf_pool, timeout_limit) },
+
+    { string("timeout_factor"),
+      conf_set_num,
+      offsetof(struct conf_pool, timeout_factor) },
+
+    { string("timeout_min"),
+      conf_set_num,
+      offsetof(struct conf_pool, timeout_min) },
+
+    { string("timeout_max"),
+      conf_set_num,
+      offsetof(struct conf_pool, timeout_max) },
+
+    { string("timeout_per_kb"),
+      conf_set_num,
+      offsetof(struct conf_pool, timeout_per_kb) },
+
+    { string("queue_timeout"),
+      conf_set_num,
+      offsetof(struct conf_pool, queue_timeout) },
+
+    { string("connect_timeout"),
+      conf_set_num,
+      offsetof(struct conf_pool, connect_timeout) },
+
     { string("backlog"),
       conf_set_num,
       offsetof(struct conf_pool, backlog) },
@@ -82,10 +125,106 @@ static struct command conf_commands[] = {
       conf_set_bool,
       offsetof(struct conf_pool, auto_eject_hosts) },
 
+    { string("retry_reads"),
+      conf_set_bool,
+      offsetof(struct conf_pool, retry_reads) },
+
+    { string("retry_budget"),
+      conf_set_num,
+      offsetof(struct conf_pool, retry_budget) },
+
+    { string("replicas"),
+      conf_set_num,
+      offsetof(struct conf_pool, replicas) },
+
+    { string("write_ack"),
+      conf_set_ack,
+      offsetof(struct conf_pool, write_ack) },
+
+    { string("hedge_reads"),
+      conf_set_bool,
+      offsetof(struct conf_pool, hedge_reads) },
+
+    { string("hedge_budget"),
+      conf_set_num,
+      offsetof(struct conf_pool, hedge_budget) },
+
     { string("server_connections"),
       conf_set_num,
       offsetof(struct conf_pool, server_connections) },
 
+    { string("server_connections_min"),
+      conf_set_num,
+      offsetof(struct conf_pool, server_connections_min) },
+
+    { string("server_connections_max"),
+      conf_set_num,
+      offsetof(struct conf_pool, server_connections_max) },
+
+    { string("server_connections_depth"),
+      conf_set_num,
+      offsetof(struct conf_pool, server_connections_depth) },
+
+    { string("server_connections_shared"),
+      conf_set_bool,
+      offsetof(struct conf_pool, server_connections_shared) },
+
+    { string("server_pipeline"),
+      conf_set_num,
+      offsetof(struct conf_pool, server_pipeline) },
+
+    { string("server_pipeline_latency"),
+      conf_set_num,
+      offsetof(struct conf_pool, server_pipeline_latency) },
+
+    { string("server_flush_delay"),
+      conf_set_num,
+      offsetof(struct conf_pool, server_flush_delay) },
+
+    { string("server_flush_requests"),
+      conf_set_num,
+      offsetof(struct conf_pool, server_flush_requests) },
+
+    { string("server_flush_bytes"),
+      conf_set_num,
+      offsetof(struct conf_pool, server_flush_bytes) },
+
+    { string("max_server_queue"),
+      conf_set_num,
+      offsetof(struct conf_pool, max_server_queue) },
+
+    { string("max_server_queue_bytes"),
+      conf_set_num,
+      offsetof(struct conf_pool, max_server_queue_bytes) },
+
+    { string("rate_limit"),
+      conf_set_num,
+      offsetof(struct conf_pool, rate_limit) },
+
+    { string("rate_limit_bytes"),
+      conf_set_num,
+      offsetof(struct conf_pool, rate_limit_bytes) },
+
+    { string("client_rate_limit"),
+      conf_set_num,
+      offsetof(struct conf_pool, client_rate_limit) },
+
+    { string("client_rate_limit_bytes"),
+      conf_set_num,
+      offsetof(struct conf_pool, client_rate_limit_bytes) },
+
+    { string("rate_limit_action"),
+      conf_set_throttle,
+      offsetof(struct conf_pool, rate_limit_action) },
+
+    { string("batch_keys"),
+      conf_set_num,
+      offsetof(struct conf_pool, batch_keys) },
+
+    { string("batch_weight"),
+      conf_set_num,
+      offsetof(struct conf_pool, batch_weight) },
+
     { string("server_retry_timeout"),
       conf_set_num,
       offsetof(struct conf_pool, server_retry_timeout) },
@@ -94,10 +233,42 @@ static struct command conf_commands[] = {
       conf_set_num,
       offsetof(struct conf_pool, server_failure_limit) },
 
+    { string("health_check_interval"),
+      conf_set_num,
+      offsetof(struct conf_pool, health_check_interval) },
+
+    { string("outlier_interval"),
+      conf_set_num,
+      offsetof(struct conf_pool, outlier_interval) },
+
+    { string("outlier_factor"),
+      conf_set_num,
+      offsetof(struct conf_pool, outlier_factor) },
+
+    { string("outlier_max_ejection"),
+      conf_set_num,
+      offsetof(struct conf_pool, outlier_max_ejection) },
+
+    { string("stage_sampling"),
+      conf_set_num,
+      offsetof(struct conf_pool, stage_sampling) },
+
+    { string("slowlog_slower_than"),
+      conf_set_num,
+      offsetof(struct conf_pool, slowlog_slower_than) },
+
+    { string("slowlog_max_len"),
+      conf_set_num,
+      offsetof(struct conf_pool, slowlog_max_len) },
+
     { string("servers"),
       conf_add_server,
       offsetof(struct conf_pool, server) },
 
+    { string("read_replicas"),
+      conf_add_server,
+      offsetof(struct conf_pool, read_replica) },
+
     null_command
 };
 
@@ -110,6 +281,7 @@ conf_server_init(struct conf_server *cs)
     cs->weight = 0;
 
     memset(&cs->info, 0, sizeof(cs->info));
+    cs->dns_idx = UINT32_MAX;
 
     cs->valid = 0;
 
@@ -148,6 +320,7 @@ conf_server_each_transform(void *elem, void *data)
     s->family = cs->info.family;
     s->addrlen = cs->info.addrlen;
     s->addr = (struct sockaddr *)&cs->info.addr;
+    s->dns_idx = cs->dns_idx;
 
     s->ns_conn_q = 0;
     TAILQ_INIT(&s->s_conn_q);
@@ -155,6 +328,25 @@ conf_server_each_transform(void *elem, void *data)
     s->next_retry = 0LL;
     s->failure_count = 0;
 
+    s->health_conn = NULL;
+    s->health_failures = 0;
+    s->unhealthy = 0;
+
+    memset(&s->latency, 0, sizeof(s->latency));
+    s->timeout = 0;
+    s->nrequest = 0;
+    s->nrequest_bytes = 0;
+
+    s->master = NULL;
+    s->replica_idx = 0;
+    s->nreplica = 0;
+
+    s->prev_idx = UINT32_MAX;
+    s->retired = 0;
+
+    s->shared = NULL;
+    s->share = NULL;
+
     log_debug(LOG_VERB, "transform to server %"PRIu32" '%.*s'",
               s->idx, s->pname.len, s->pname.data);
 
@@ -179,6 +371,13 @@ conf_pool_init(struct conf_pool *cp, struct string *name)
     cp->distribution = CONF_UNSET_DIST;
 
     cp->timeout = CONF_UNSET_NUM;
+    cp->timeout_limit = CONF_UNSET_NUM;
+    cp->timeout_factor = CONF_UNSET_NUM;
+    cp->timeout_min = CONF_UNSET_NUM;
+    cp->timeout_max = CONF_UNSET_NUM;
+    cp->timeout_per_kb = CONF_UNSET_NUM;
+    cp->queue_timeout = CONF_UNSET_NUM;
+    cp->connect_timeout = CONF_UNSET_NUM;
     cp->backlog = CONF_UNSET_NUM;
 
     cp->client_connections = CONF_UNSET_NUM;
@@ -186,11 +385,43 @@ conf_pool_init(struct conf_pool *cp, struct string *name)
     cp->redis = CONF_UNSET_NUM;
     cp->preconnect = CONF_UNSET_NUM;
     cp->auto_eject_hosts = CONF_UNSET_NUM;
+    cp->retry_reads = CONF_UNSET_NUM;
+    cp->retry_budget = CONF_UNSET_NUM;
+    cp->replicas = CONF_UNSET_NUM;
+    cp->write_ack = CONF_UNSET_ACK;
+    cp->hedge_reads = CONF_UNSET_NUM;
+    cp->hedge_budget = CONF_UNSET_NUM;
     cp->server_connections = CONF_UNSET_NUM;
+    cp->server_connections_min = CONF_UNSET_NUM;
+    cp->server_connections_max = CONF_UNSET_NUM;
+    cp->server_connections_depth = CONF_UNSET_NUM;
+    cp->server_connections_shared = CONF_UNSET_NUM;
+    cp->server_pipeline = CONF_UNSET_NUM;
+    cp->server_pipeline_latency = CONF_UNSET_NUM;
+    cp->server_flush_delay = CONF_UNSET_NUM;
+    cp->server_flush_requests = CONF_UNSET_NUM;
+    cp->server_flush_bytes = CONF_UNSET_NUM;
+    cp->max_server_queue = CONF_UNSET_NUM;
+    cp->max_server_queue_bytes = CONF_UNSET_NUM;
+    cp->rate_limit = CONF_UNSET_NUM;
+    cp->rate_limit_bytes = CONF_UNSET_NUM;
+    cp->client_rate_limit = CONF_UNSET_NUM;
+    cp->client_rate_limit_bytes = CONF_UNSET_NUM;
+    cp->rate_limit_action = CONF_UNSET_THROTTLE;
+    cp->batch_keys = CONF_UNSET_NUM;
+    cp->batch_weight = CONF_UNSET_NUM;
     cp->server_retry_timeout = CONF_UNSET_NUM;
     cp->server_failure_limit = CONF_UNSET_NUM;
+    cp->health_check_interval = CONF_UNSET_NUM;
+    cp->outlier_interval = CONF_UNSET_NUM;
+    cp->outlier_factor = CONF_UNSET_NUM;
+    cp->outlier_max_ejection = CONF_UNSET_NUM;
+    cp->stage_sampling = CONF_UNSET_NUM;
+    cp->slowlog_slower_than = CONF_UNSET_NUM;
+    cp->slowlog_max_len = CONF_UNSET_NUM;
 
     array_null(&cp->server);
+    array_null(&cp->read_replica);
 
     cp->valid = 0;
 
@@ -206,6 +437,14 @@ conf_pool_init(struct conf_pool *cp, struct string *name)
         return status;
     }
 
+    status = array_init(&cp->read_replica, CONF_DEFAULT_SERVERS,
+                        sizeof(struct conf_server));
+    if (status != NC_OK) {
+        array_deinit(&cp->server);
+        string_deinit(&cp->name);
+        return status;
+    }
+
     log_debug(LOG_VVERB, "init conf pool %p, '%.*s'", cp, name->len, name->data);
 
     return NC_OK;
@@ -224,9 +463,89 @@ conf_pool_deinit(struct conf_pool *cp)
     }
     array_deinit(&cp->server);
 
+    while (array_n(&cp->read_replica) != 0) {
+        conf_server_deinit(array_pop(&cp->read_replica));
+    }
+    array_deinit(&cp->read_replica);
+
     log_debug(LOG_VVERB, "deinit conf pool %p", cp);
 }
 
+/*
+ * Apply the directives of conf pool cp to server pool sp. Besides the
+ * initial transform, this applies a reloaded configuration to a running
+ * pool, so only the configured fields are set here and none of the
+ * runtime state of the pool
+ */
+void
+conf_pool_apply(struct conf_pool *cp, struct server_pool *sp)
+{
+    sp->name = cp->name;
+    sp->addrstr = cp->listen.pname;
+    sp->port = (uint16_t)cp->listen.port;
+
+    sp->family = cp->listen.info.family;
+    sp->addrlen = cp->listen.info.addrlen;
+    sp->addr = (struct sockaddr *)&cp->listen.info.addr;
+
+    sp->key_hash_type = cp->hash;
+    sp->key_hash = hash_algos[cp->hash];
+    sp->dist_type = cp->distribution;
+    sp->hash_tag = cp->hash_tag;
+
+    sp->redis = cp->redis ? 1 : 0;
+    sp->timeout = cp->timeout;
+    sp->timeout_limit = (uint32_t)cp->timeout_limit;
+    sp->timeout_factor = (uint32_t)cp->timeout_factor;
+    sp->timeout_min = cp->timeout_min;
+    sp->timeout_max = cp->timeout_max;
+    sp->timeout_per_kb = cp->timeout_per_kb;
+    sp->queue_timeout = (int64_t)cp->queue_timeout * 1000LL;
+    sp->connect_timeout = cp->connect_timeout;
+    sp->backlog = cp->backlog;
+
+    sp->client_connections = (uint32_t)cp->client_connections;
+
+    sp->server_connections = (uint32_t)cp->server_connections_max;
+    sp->server_connections_min = (uint32_t)cp->server_connections_min;
+    sp->server_connections_depth = (uint32_t)cp->server_connections_depth;
+    sp->server_connections_shared = cp->server_connections_shared ? 1 : 0;
+    sp->server_pipeline = (uint32_t)cp->server_pipeline;
+    sp->server_pipeline_latency = (int64_t)cp->server_pipeline_latency * 1000LL;
+    sp->server_flush_delay = (int64_t)cp->server_flush_delay;
+    sp->server_flush_requests = (uint32_t)cp->server_flush_requests;
+    sp->server_flush_bytes = (uint32_t)cp->server_flush_bytes;
+    sp->max_server_queue = (uint32_t)cp->max_server_queue;
+    sp->max_server_queue_bytes = (uint32_t)cp->max_server_queue_bytes;
+    sp->rate_limit = (uint32_t)cp->rate_limit;
+    sp->rate_limit_bytes = (uint32_t)cp->rate_limit_bytes;
+    sp->client_rate_limit = (uint32_t)cp->client_rate_limit;
+    sp->client_rate_limit_bytes = (uint32_t)cp->client_rate_limit_bytes;
+    sp->rate_limit_action = cp->rate_limit_action;
+    sp->rate_limited = (cp->rate_limit != 0 || cp->rate_limit_bytes != 0 ||
+                        cp->client_rate_limit != 0 ||
+                        cp->client_rate_limit_bytes != 0) ? 1 : 0;
+    sp->batch_keys = (uint32_t)cp->batch_keys;
+    sp->batch_weight = (uint32_t)cp->batch_weight;
+    sp->server_retry_timeout = (int64_t)cp->server_retry_timeout * 1000LL;
+    sp->server_failure_limit = (uint32_t)cp->server_failure_limit;
+    sp->health_check_interval = cp->health_check_interval;
+    sp->outlier_interval = (int64_t)cp->outlier_interval * 1000LL;
+    sp->outlier_factor = (uint32_t)cp->outlier_factor;
+    sp->outlier_max_ejection = (uint32_t)cp->outlier_max_ejection;
+    sp->stage_sampling = (uint32_t)cp->stage_sampling;
+    sp->slowlog_slower_than = cp->slowlog_slower_than;
+    sp->slowlog_max_len = (uint32_t)cp->slowlog_max_len;
+    sp->auto_eject_hosts = cp->auto_eject_hosts ? 1 : 0;
+    sp->retry_reads = cp->retry_reads ? 1 : 0;
+    sp->retry_budget = (uint32_t)cp->retry_budget;
+    sp->replicas = (uint32_t)cp->replicas;
+    sp->write_ack = cp->write_ack;
+    sp->hedge_reads = cp->hedge_reads ? 1 : 0;
+    sp->hedge_budget = (uint32_t)cp->hedge_budget;
+    sp->preconnect = cp->preconnect ? 1 : 0;
+}
+
 rstatus_t
 conf_pool_each_transform(void *elem, void *data)
 {
@@ -248,42 +567,35 @@ conf_pool_each_transform(void *elem, void *data)
     TAILQ_INIT(&sp->c_conn_q);
 
     array_null(&sp->server);
+    array_null(&sp->read_replica);
+    array_null(&sp->retired);
+    array_null(&sp->retired_replica);
     sp->ncontinuum = 0;
     sp->nserver_continuum = 0;
     sp->continuum = NULL;
     sp->nlive_server = 0;
     sp->next_rebuild = 0LL;
 
-    sp->name = cp->name;
-    sp->addrstr = cp->listen.pname;
-    sp->port = (uint16_t)cp->listen.port;
-
-    sp->family = cp->listen.info.family;
-    sp->addrlen = cp->listen.info.addrlen;
-    sp->addr = (struct sockaddr *)&cp->listen.info.addr;
-
-    sp->key_hash_type = cp->hash;
-    sp->key_hash = hash_algos[cp->hash];
-    sp->dist_type = cp->distribution;
-    sp->hash_tag = cp->hash_tag;
-
-    sp->redis = cp->redis ? 1 : 0;
-    sp->timeout = cp->timeout;
-    sp->backlog = cp->backlog;
-
-    sp->client_connections = (uint32_t)cp->client_connections;
+    conf_pool_apply(cp, sp);
 
-    sp->server_connections = (uint32_t)cp->server_connections;
-    sp->server_retry_timeout = (int64_t)cp->server_retry_timeout * 1000LL;
-    sp->server_failure_limit = (uint32_t)cp->server_failure_limit;
-    sp->auto_eject_hosts = cp->auto_eject_hosts ? 1 : 0;
-    sp->preconnect = cp->preconnect ? 1 : 0;
+    bucket_init(&sp->rate_tokens);
+    bucket_init(&sp->rate_bytes_tokens);
+    sp->next_latency_decay = 0LL;
+    sp->retry_tokens = SERVER_BUDGET_MAX_TOKENS;
+    sp->hedge_tokens = SERVER_BUDGET_MAX_TOKENS;
+    sp->stage_count = 0;
+    sp->reload_ts = 0LL;
 
     status = server_init(&sp->server, &cp->server, sp);
     if (status != NC_OK) {
         return status;
     }
 
+    status = server_init_read_replicas(sp, &cp->read_replica);
+    if (status != NC_OK) {
+        return status;
+    }
+
     log_debug(LOG_VERB, "transform to pool %"PRIu32" '%.*s'", sp->idx,
               sp->name.len, sp->name.data);
 
@@ -312,6 +624,13 @@ conf_dump(struct conf *cf)
         log_debug(LOG_VVERB, "  listen: %.*s",
                   cp->listen.pname.len, cp->listen.pname.data);
         log_debug(LOG_VVERB, "  timeout: %d", cp->timeout);
+        log_debug(LOG_VVERB, "  timeout_limit: %d", cp->timeout_limit);
+        log_debug(LOG_VVERB, "  timeout_factor: %d", cp->timeout_factor);
+        log_debug(LOG_VVERB, "  timeout_min: %d", cp->timeout_min);
+        log_debug(LOG_VVERB, "  timeout_max: %d", cp->timeout_max);
+        log_debug(LOG_VVERB, "  timeout_per_kb: %d", cp->timeout_per_kb);
+        log_debug(LOG_VVERB, "  queue_timeout: %d", cp->queue_timeout);
+        log_debug(LOG_VVERB, "  connect_timeout: %d", cp->connect_timeout);
         log_debug(LOG_VVERB, "  backlog: %d", cp->backlog);
         log_debug(LOG_VVERB, "  hash: %d", cp->hash);
         log_debug(LOG_VVERB, "  hash_tag: \"%.*s\"", cp->hash_tag.len,
@@ -322,12 +641,58 @@ conf_dump(struct conf *cf)
         log_debug(LOG_VVERB, "  redis: %d", cp->redis);
         log_debug(LOG_VVERB, "  preconnect: %d", cp->preconnect);
         log_debug(LOG_VVERB, "  auto_eject_hosts: %d", cp->auto_eject_hosts);
+        log_debug(LOG_VVERB, "  retry_reads: %d", cp->retry_reads);
+        log_debug(LOG_VVERB, "  retry_budget: %d", cp->retry_budget);
+        log_debug(LOG_VVERB, "  replicas: %d", cp->replicas);
+        log_debug(LOG_VVERB, "  write_ack: %d", cp->write_ack);
+        log_debug(LOG_VVERB, "  hedge_reads: %d", cp->hedge_reads);
+        log_debug(LOG_VVERB, "  hedge_budget: %d", cp->hedge_budget);
         log_debug(LOG_VVERB, "  server_connections: %d",
                   cp->server_connections);
+        log_debug(LOG_VVERB, "  server_connections_min: %d",
+                  cp->server_connections_min);
+        log_debug(LOG_VVERB, "  server_connections_max: %d",
+                  cp->server_connections_max);
+        log_debug(LOG_VVERB, "  server_connections_depth: %d",
+                  cp->server_connections_depth);
+        log_debug(LOG_VVERB, "  server_connections_shared: %d",
+                  cp->server_connections_shared);
+        log_debug(LOG_VVERB, "  server_pipeline: %d", cp->server_pipeline);
+        log_debug(LOG_VVERB, "  server_pipeline_latency: %d",
+                  cp->server_pipeline_latency);
+        log_debug(LOG_VVERB, "  server_flush_delay: %d",
+                  cp->server_flush_delay);
+        log_debug(LOG_VVERB, "  server_flush_requests: %d",
+                  cp->server_flush_requests);
+        log_debug(LOG_VVERB, "  server_flush_bytes: %d",
+                  cp->server_flush_bytes);
+        log_debug(LOG_VVERB, "  max_server_queue: %d", cp->max_server_queue);
+        log_debug(LOG_VVERB, "  max_server_queue_bytes: %d",
+                  cp->max_server_queue_bytes);
+        log_debug(LOG_VVERB, "  rate_limit: %d", cp->rate_limit);
+        log_debug(LOG_VVERB, "  rate_limit_bytes: %d", cp->rate_limit_bytes);
+        log_debug(LOG_VVERB, "  client_rate_limit: %d",
+                  cp->client_rate_limit);
+        log_debug(LOG_VVERB, "  client_rate_limit_bytes: %d",
+                  cp->client_rate_limit_bytes);
+        log_debug(LOG_VVERB, "  rate_limit_action: %d",
+                  cp->rate_limit_action);
+        log_debug(LOG_VVERB, "  batch_keys: %d", cp->batch_keys);
+        log_debug(LOG_VVERB, "  batch_weight: %d", cp->batch_weight);
         log_debug(LOG_VVERB, "  server_retry_timeout: %d",
                   cp->server_retry_timeout);
         log_debug(LOG_VVERB, "  server_failure_limit: %d",
                   cp->server_failure_limit);
+        log_debug(LOG_VVERB, "  health_check_interval: %d",
+                  cp->health_check_interval);
+        log_debug(LOG_VVERB, "  outlier_interval: %d", cp->outlier_interval);
+        log_debug(LOG_VVERB, "  outlier_factor: %d", cp->outlier_factor);
+        log_debug(LOG_VVERB, "  outlier_max_ejection: %d",
+                  cp->outlier_max_ejection);
+        log_debug(LOG_VVERB, "  stage_sampling: %d", cp->stage_sampling);
+        log_debug(LOG_VVERB, "  slowlog_slower_than: %d",
+                  cp->slowlog_slower_than);
+        log_debug(LOG_VVERB, "  slowlog_max_len: %d", cp->slowlog_max_len);
 
         nserver = array_n(&cp->server);
         log_debug(LOG_VVERB, "  servers: %"PRIu32"", nserver);
@@ -336,6 +701,14 @@ conf_dump(struct conf *cf)
             s = array_get(&cp->server, j);
             log_debug(LOG_VVERB, "    %.*s", s->len, s->data);
         }
+
+        nserver = array_n(&cp->read_replica);
+        log_debug(LOG_VVERB, "  read_replicas: %"PRIu32"", nserver);
+
+        for (j = 0; j < nserver; j++) {
+            s = array_get(&cp->read_replica, j);
+            log_debug(LOG_VVERB, "    %.*s", s->len, s->data);
+        }
     }
 }
 
@@ -975,6 +1348,8 @@ conf_validate_structure(struct conf *cf)
      *     - elem2
      *     - elem3
      *   key3: value3
+     *   seq2:
+     *     - elem4
      *
      * keyy:
      *   key1: value1
@@ -1035,11 +1410,7 @@ conf_validate_structure(struct conf *cf)
             break;
 
         case YAML_SEQUENCE_START_EVENT:
-            if (seq) {
-                error = true;
-                log_error("conf: '%s' has more than one sequence directive",
-                          cf->fname);
-            } else if (depth != CONF_MAX_DEPTH) {
+            if (depth != CONF_MAX_DEPTH) {
                 error = true;
                 log_error("conf: '%s' has sequence at depth %d instead of %d",
                           cf->fname, depth, CONF_MAX_DEPTH);
@@ -1133,6 +1504,22 @@ conf_pool_listen_cmp(const void *t1, const void *t2)
     return string_compare(&p1->listen.pname, &p2->listen.pname);
 }
 
+static struct conf_server *
+conf_server_lookup(struct conf_pool *cp, struct string *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < array_n(&cp->server); i++) {
+        struct conf_server *cs = array_get(&cp->server, i);
+
+        if (string_compare(&cs->name, name) == 0) {
+            return cs;
+        }
+    }
+
+    return NULL;
+}
+
 static rstatus_t
 conf_validate_server(struct conf *cf, struct conf_pool *cp)
 {
@@ -1171,6 +1558,24 @@ conf_validate_server(struct conf *cf, struct conf_pool *cp)
         return NC_ERROR;
     }
 
+    /*
+     * Read replicas are named after the server they replicate. Sorting them
+     * by name lays out the replicas of each server next to each other
+     */
+    if (array_n(&cp->read_replica) != 0) {
+        array_sort(&cp->read_replica, conf_server_name_cmp);
+    }
+    for (i = 0; i < array_n(&cp->read_replica); i++) {
+        struct conf_server *cs = array_get(&cp->read_replica, i);
+
+        if (conf_server_lookup(cp, &cs->name) == NULL) {
+            log_error("conf: pool '%.*s' has read replica '%.*s' not named "
+                      "after any of its servers", cp->name.len, cp->name.data,
+                      cs->pname.len, cs->pname.data);
+            return NC_ERROR;
+        }
+    }
+
     return NC_OK;
 }
 
@@ -1201,6 +1606,44 @@ conf_validate_pool(struct conf *cf, struct conf_pool *cp)
         cp->timeout = CONF_DEFAULT_TIMEOUT;
     }
 
+    if (cp->timeout_limit == CONF_UNSET_NUM) {
+        cp->timeout_limit = CONF_DEFAULT_TIMEOUT_LIMIT;
+    }
+
+    if (cp->timeout_factor == CONF_UNSET_NUM) {
+        cp->timeout_factor = CONF_DEFAULT_TIMEOUT_FACTOR;
+    }
+
+    /* timeout_min and timeout_max only bound adaptive timeouts */
+    if (cp->timeout_factor > 0) {
+        if (cp->timeout_max == CONF_UNSET_NUM) {
+            cp->timeout_max = cp->timeout > 0 ? cp->timeout :
+                              CONF_DEFAULT_TIMEOUT_MAX;
+        }
+
+        if (cp->timeout_min == CONF_UNSET_NUM) {
+            cp->timeout_min = MIN(CONF_DEFAULT_TIMEOUT_MIN, cp->timeout_max);
+        }
+
+        if (cp->timeout_min == 0 || cp->timeout_min > cp->timeout_max) {
+            log_error("conf: directive \"timeout_min:\" must be between 1 "
+                      "and \"timeout_max:\"");
+            return NC_ERROR;
+        }
+    }
+
+    if (cp->timeout_per_kb == CONF_UNSET_NUM) {
+        cp->timeout_per_kb = CONF_DEFAULT_TIMEOUT_PER_KB;
+    }
+
+    if (cp->queue_timeout == CONF_UNSET_NUM) {
+        cp->queue_timeout = CONF_DEFAULT_QUEUE_TIMEOUT;
+    }
+
+    if (cp->connect_timeout == CONF_UNSET_NUM) {
+        cp->connect_timeout = CONF_DEFAULT_CONNECT_TIMEOUT;
+    }
+
     if (cp->backlog == CONF_UNSET_NUM) {
         cp->backlog = CONF_DEFAULT_LISTEN_BACKLOG;
     }
@@ -1219,6 +1662,47 @@ conf_validate_pool(struct conf *cf, struct conf_pool *cp)
         cp->auto_eject_hosts = CONF_DEFAULT_AUTO_EJECT_HOSTS;
     }
 
+    if (cp->retry_reads == CONF_UNSET_NUM) {
+        cp->retry_reads = CONF_DEFAULT_RETRY_READS;
+    }
+
+    if (cp->retry_budget == CONF_UNSET_NUM) {
+        cp->retry_budget = CONF_DEFAULT_RETRY_BUDGET;
+    } else if (cp->retry_budget > 100) {
+        log_error("conf: directive \"retry_budget:\" cannot be more than 100");
+        return NC_ERROR;
+    }
+
+    if (cp->replicas == CONF_UNSET_NUM) {
+        cp->replicas = CONF_DEFAULT_REPLICAS;
+    } else if (cp->replicas == 0) {
+        log_error("conf: directive \"replicas:\" cannot be 0");
+        return NC_ERROR;
+    } else if (cp->replicas > SERVER_MAX_REPLICAS) {
+        log_error("conf: directive \"replicas:\" cannot be more than %d",
+                  SERVER_MAX_REPLICAS);
+        return NC_ERROR;
+    }
+
+    if (cp->write_ack == CONF_UNSET_ACK) {
+        cp->write_ack = CONF_DEFAULT_WRITE_ACK;
+    }
+
+    if (cp->hedge_reads == CONF_UNSET_NUM) {
+        cp->hedge_reads = CONF_DEFAULT_HEDGE_READS;
+    } else if (cp->hedge_reads && cp->replicas < 2) {
+        log_error("conf: directive \"hedge_reads:\" requires \"replicas:\" "
+                  "of at least 2");
+        return NC_ERROR;
+    }
+
+    if (cp->hedge_budget == CONF_UNSET_NUM) {
+        cp->hedge_budget = CONF_DEFAULT_HEDGE_BUDGET;
+    } else if (cp->hedge_budget > 100) {
+        log_error("conf: directive \"hedge_budget:\" cannot be more than 100");
+        return NC_ERROR;
+    }
+
     if (cp->server_connections == CONF_UNSET_NUM) {
         cp->server_connections = CONF_DEFAULT_SERVER_CONNECTIONS;
     } else if (cp->server_connections == 0) {
@@ -1226,6 +1710,106 @@ conf_validate_pool(struct conf *cf, struct conf_pool *cp)
         return NC_ERROR;
     }
 
+    if (cp->server_connections_max == CONF_UNSET_NUM) {
+        cp->server_connections_max = cp->server_connections;
+    } else if (cp->server_connections_max == 0) {
+        log_error("conf: directive \"server_connections_max:\" cannot be 0");
+        return NC_ERROR;
+    }
+
+    if (cp->server_connections_min == CONF_UNSET_NUM) {
+        cp->server_connections_min = cp->server_connections_max;
+    } else if (cp->server_connections_min == 0) {
+        log_error("conf: directive \"server_connections_min:\" cannot be 0");
+        return NC_ERROR;
+    } else if (cp->server_connections_min > cp->server_connections_max) {
+        log_error("conf: directive \"server_connections_min:\" cannot be "
+                  "more than \"server_connections_max:\"");
+        return NC_ERROR;
+    }
+
+    if (cp->server_connections_depth == CONF_UNSET_NUM) {
+        cp->server_connections_depth = CONF_DEFAULT_SERVER_CONNECTIONS_DEPTH;
+    } else if (cp->server_connections_depth == 0) {
+        log_error("conf: directive \"server_connections_depth:\" cannot be 0");
+        return NC_ERROR;
+    }
+
+    if (cp->server_connections_shared == CONF_UNSET_NUM) {
+        cp->server_connections_shared = CONF_DEFAULT_SERVER_CONNECTIONS_SHARED;
+    }
+
+    if (cp->server_pipeline == CONF_UNSET_NUM) {
+        cp->server_pipeline = CONF_DEFAULT_SERVER_PIPELINE;
+    }
+
+    if (cp->server_pipeline_latency == CONF_UNSET_NUM) {
+        cp->server_pipeline_latency = CONF_DEFAULT_SERVER_PIPELINE_LATENCY;
+    } else if (cp->server_pipeline_latency != 0 && cp->server_pipeline == 0) {
+        log_error("conf: directive \"server_pipeline_latency:\" requires "
+                  "\"server_pipeline:\"");
+        return NC_ERROR;
+    }
+
+    if (cp->server_flush_delay == CONF_UNSET_NUM) {
+        cp->server_flush_delay = CONF_DEFAULT_SERVER_FLUSH_DELAY;
+    }
+
+    if (cp->server_flush_requests == CONF_UNSET_NUM) {
+        cp->server_flush_requests = CONF_DEFAULT_SERVER_FLUSH_REQUESTS;
+    } else if (cp->server_flush_requests < 2) {
+        log_error("conf: directive \"server_flush_requests:\" cannot be less "
+                  "than 2");
+        return NC_ERROR;
+    }
+
+    if (cp->server_flush_bytes == CONF_UNSET_NUM) {
+        cp->server_flush_bytes = CONF_DEFAULT_SERVER_FLUSH_BYTES;
+    } else if (cp->server_flush_bytes == 0) {
+        log_error("conf: directive \"server_flush_bytes:\" cannot be 0");
+        return NC_ERROR;
+    }
+
+    if (cp->max_server_queue == CONF_UNSET_NUM) {
+        cp->max_server_queue = CONF_DEFAULT_MAX_SERVER_QUEUE;
+    }
+
+    if (cp->max_server_queue_bytes == CONF_UNSET_NUM) {
+        cp->max_server_queue_bytes = CONF_DEFAULT_MAX_SERVER_QUEUE_BYTES;
+    }
+
+    if (cp->rate_limit == CONF_UNSET_NUM) {
+        cp->rate_limit = CONF_DEFAULT_RATE_LIMIT;
+    }
+
+    if (cp->rate_limit_bytes == CONF_UNSET_NUM) {
+        cp->rate_limit_bytes = CONF_DEFAULT_RATE_LIMIT_BYTES;
+    }
+
+    if (cp->client_rate_limit == CONF_UNSET_NUM) {
+        cp->client_rate_limit = CONF_DEFAULT_CLIENT_RATE_LIMIT;
+    }
+
+    if (cp->client_rate_limit_bytes == CONF_UNSET_NUM) {
+        cp->client_rate_limit_bytes = CONF_DEFAULT_CLIENT_RATE_LIMIT_BYTES;
+    }
+
+    if (cp->rate_limit_action == CONF_UNSET_THROTTLE) {
+        cp->rate_limit_action = CONF_DEFAULT_RATE_LIMIT_ACTION;
+    }
+
+    if (cp->batch_keys == CONF_UNSET_NUM) {
+        cp->batch_keys = CONF_DEFAULT_BATCH_KEYS;
+    }
+
+    if (cp->batch_weight == CONF_UNSET_NUM) {
+        cp->batch_weight = CONF_DEFAULT_BATCH_WEIGHT;
+    } else if (cp->batch_weight == 0 || cp->batch_weight >= 100) {
+        log_error("conf: directive \"batch_weight:\" must be between 1 and "
+                  "99");
+        return NC_ERROR;
+    }
+
     if (cp->server_retry_timeout == CONF_UNSET_NUM) {
         cp->server_retry_timeout = CONF_DEFAULT_SERVER_RETRY_TIMEOUT;
     }
@@ -1234,6 +1818,41 @@ conf_validate_pool(struct conf *cf, struct conf_pool *cp)
         cp->server_failure_limit = CONF_DEFAULT_SERVER_FAILURE_LIMIT;
     }
 
+    if (cp->health_check_interval == CONF_UNSET_NUM) {
+        cp->health_check_interval = CONF_DEFAULT_HEALTH_CHECK_INTERVAL;
+    }
+
+    if (cp->outlier_interval == CONF_UNSET_NUM) {
+        cp->outlier_interval = CONF_DEFAULT_OUTLIER_INTERVAL;
+    }
+
+    if (cp->outlier_factor == CONF_UNSET_NUM) {
+        cp->outlier_factor = CONF_DEFAULT_OUTLIER_FACTOR;
+    } else if (cp->outlier_factor < 2) {
+        log_error("conf: directive \"outlier_factor:\" must be at least 2");
+        return NC_ERROR;
+    }
+
+    if (cp->outlier_max_ejection == CONF_UNSET_NUM) {
+        cp->outlier_max_ejection = CONF_DEFAULT_OUTLIER_MAX_EJECTION;
+    } else if (cp->outlier_max_ejection > 100) {
+        log_error("conf: directive \"outlier_max_ejection:\" cannot be "
+                  "more than 100");
+        return NC_ERROR;
+    }
+
+    if (cp->stage_sampling == CONF_UNSET_NUM) {
+        cp->stage_sampling = CONF_DEFAULT_STAGE_SAMPLING;
+    }
+
+    if (cp->slowlog_slower_than == CONF_UNSET_NUM) {
+        cp->slowlog_slower_than = CONF_DEFAULT_SLOWLOG_SLOWER_THAN;
+    }
+
+    if (cp->slowlog_max_len == CONF_UNSET_NUM) {
+        cp->slowlog_max_len = CONF_DEFAULT_SLOWLOG_MAX_LEN;
+    }
+
     status = conf_validate_server(cf, cp);
     if (status != NC_OK) {
         return status;
@@ -1313,6 +1932,60 @@ conf_post_validate(struct conf *cf)
     return NC_OK;
 }
 
+static rstatus_t
+conf_resolve_server(struct conf_pool *cp, struct array *server)
+{
+    rstatus_t status;
+    uint32_t i;
+
+    for (i = 0; i < array_n(server); i++) {
+        struct conf_server *cs = array_get(server, i);
+
+        if (cs->valid) {
+            continue;
+        }
+
+        status = dns_get(cs->dns_idx, cs->port, &cs->info);
+        if (status != NC_OK) {
+            log_error("conf: server '%.*s' in pool '%.*s' could not be "
+                      "resolved", cs->pname.len, cs->pname.data,
+                      cp->name.len, cp->name.data);
+            return NC_ERROR;
+        }
+        cs->valid = 1;
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+conf_resolve(struct conf *cf)
+{
+    rstatus_t status;
+    uint32_t i;
+
+    status = dns_resolve();
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < array_n(&cf->pool); i++) {
+        struct conf_pool *cp = array_get(&cf->pool, i);
+
+        status = conf_resolve_server(cp, &cp->server);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = conf_resolve_server(cp, &cp->read_replica);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return NC_OK;
+}
+
 struct conf *
 conf_create(char *filename)
 {
@@ -1342,6 +2015,12 @@ conf_create(char *filename)
         goto error;
     }
 
+    /* resolve server hostnames */
+    status = conf_resolve(cf);
+    if (status != NC_OK) {
+        goto error;
+    }
+
     conf_dump(cf);
 
     fclose(cf->fh);
@@ -1591,14 +2270,26 @@ conf_add_server(struct conf *cf, struct command *cmd, void *conf)
         return CONF_ERROR;
     }
 
-    status = nc_resolve(&address, field->port, &field->info);
-    if (status != NC_OK) {
-        string_deinit(&address);
-        return CONF_ERROR;
+    /*
+     * Hostnames are resolved in one go once the whole configuration is
+     * parsed, in conf_resolve
+     */
+    if (value->data[0] == '/') {
+        status = nc_resolve(&address, field->port, &field->info);
+        if (status != NC_OK) {
+            string_deinit(&address);
+            return CONF_ERROR;
+        }
+        field->valid = 1;
+    } else {
+        field->dns_idx = dns_lookup(&address, field->port);
+        if (field->dns_idx == UINT32_MAX) {
+            string_deinit(&address);
+            return CONF_ERROR;
+        }
     }
 
     string_deinit(&address);
-    field->valid = 1;
 
     return CONF_OK;
 }
@@ -1716,6 +2407,64 @@ conf_set_distribution(struct conf *cf, struct command *cmd, void *conf)
     return "is not a valid distribution";
 }
 
+char *
+conf_set_ack(struct conf *cf, struct command *cmd, void *conf)
+{
+    uint8_t *p;
+    ack_type_t *ap;
+    struct string *value, *ack;
+
+    p = conf;
+    ap = (ack_type_t *)(p + cmd->offset);
+
+    if (*ap != CONF_UNSET_ACK) {
+        return "is a duplicate";
+    }
+
+    value = array_top(&cf->arg);
+
+    for (ack = ack_strings; ack->len != 0; ack++) {
+        if (string_compare(value, ack) != 0) {
+            continue;
+        }
+
+        *ap = ack - ack_strings;
+
+        return CONF_OK;
+    }
+
+    return "is not a valid write ack";
+}
+
+char *
+conf_set_throttle(struct conf *cf, struct command *cmd, void *conf)
+{
+    uint8_t *p;
+    throttle_type_t *tp;
+    struct string *value, *throttle;
+
+    p = conf;
+    tp = (throttle_type_t *)(p + cmd->offset);
+
+    if (*tp != CONF_UNSET_THROTTLE) {
+        return "is a duplicate";
+    }
+
+    value = array_top(&cf->arg);
+
+    for (throttle = throttle_strings; throttle->len != 0; throttle++) {
+        if (string_compare(value, throttle) != 0) {
+            continue;
+        }
+
+        *tp = throttle - throttle_strings;
+
+        return CONF_OK;
+    }
+
+    return "is not a valid rate limit action";
+}
+
 char *
 conf_set_hashtag(struct conf *cf, struct command *cmd, void *conf)
 {
@@ -40,18 +40,56 @@
 #define CONF_UNSET_PTR  NULL
 #define CONF_UNSET_HASH (hash_type_t) -1
 #define CONF_UNSET_DIST (dist_type_t) -1
+#define CONF_UNSET_ACK  (ack_type_t) -1
+#define CONF_UNSET_THROTTLE (throttle_type_t) -1
 
 #define CONF_DEFAULT_HASH                    HASH_FNV1A_64
 #define CONF_DEFAULT_DIST                    DIST_KETAMA
 #define CONF_DEFAULT_TIMEOUT                 -1
+#define CONF_DEFAULT_TIMEOUT_LIMIT           0
+#define CONF_DEFAULT_TIMEOUT_FACTOR          0
+#define CONF_DEFAULT_TIMEOUT_MIN             10             /* in msec */
+#define CONF_DEFAULT_TIMEOUT_MAX             1000           /* in msec */
+#define CONF_DEFAULT_TIMEOUT_PER_KB          0              /* in msec */
+#define CONF_DEFAULT_QUEUE_TIMEOUT           0              /* in msec */
+#define CONF_DEFAULT_CONNECT_TIMEOUT         -1
 #define CONF_DEFAULT_LISTEN_BACKLOG          512
 #define CONF_DEFAULT_CLIENT_CONNECTIONS      0
 #define CONF_DEFAULT_REDIS                   false
 #define CONF_DEFAULT_PRECONNECT              false
 #define CONF_DEFAULT_AUTO_EJECT_HOSTS        false
+#define CONF_DEFAULT_RETRY_READS             false
+#define CONF_DEFAULT_RETRY_BUDGET            10             /* in % */
+#define CONF_DEFAULT_REPLICAS                1
+#define CONF_DEFAULT_WRITE_ACK               ACK_QUORUM
+#define CONF_DEFAULT_HEDGE_READS             false
+#define CONF_DEFAULT_HEDGE_BUDGET            5              /* in % */
 #define CONF_DEFAULT_SERVER_RETRY_TIMEOUT    30 * 1000      /* in msec */
 #define CONF_DEFAULT_SERVER_FAILURE_LIMIT    2
+#define CONF_DEFAULT_HEALTH_CHECK_INTERVAL   0              /* in msec */
+#define CONF_DEFAULT_OUTLIER_INTERVAL        0              /* in msec */
+#define CONF_DEFAULT_OUTLIER_FACTOR          3
+#define CONF_DEFAULT_OUTLIER_MAX_EJECTION    10             /* in % */
+#define CONF_DEFAULT_STAGE_SAMPLING          0              /* 1 in n */
+#define CONF_DEFAULT_SLOWLOG_SLOWER_THAN     0              /* in usec */
+#define CONF_DEFAULT_SLOWLOG_MAX_LEN         128
 #define CONF_DEFAULT_SERVER_CONNECTIONS      1
+#define CONF_DEFAULT_SERVER_CONNECTIONS_DEPTH 16
+#define CONF_DEFAULT_SERVER_CONNECTIONS_SHARED false
+#define CONF_DEFAULT_SERVER_PIPELINE         0
+#define CONF_DEFAULT_SERVER_PIPELINE_LATENCY 0              /* in msec */
+#define CONF_DEFAULT_SERVER_FLUSH_DELAY      0              /* in usec */
+#define CONF_DEFAULT_SERVER_FLUSH_REQUESTS   16
+#define CONF_DEFAULT_SERVER_FLUSH_BYTES      16384
+#define CONF_DEFAULT_MAX_SERVER_QUEUE        0
+#define CONF_DEFAULT_MAX_SERVER_QUEUE_BYTES  0
+#define CONF_DEFAULT_RATE_LIMIT              0              /* per sec */
+#define CONF_DEFAULT_RATE_LIMIT_BYTES        0              /* per sec */
+#define CONF_DEFAULT_CLIENT_RATE_LIMIT       0              /* per sec */
+#define CONF_DEFAULT_CLIENT_RATE_LIMIT_BYTES 0              /* per sec */
+#define CONF_DEFAULT_RATE_LIMIT_ACTION       THROTTLE_PAUSE
+#define CONF_DEFAULT_BATCH_KEYS              0
+#define CONF_DEFAULT_BATCH_WEIGHT            10             /* in % */
 #define CONF_DEFAULT_KETAMA_PORT             11211
 
 struct conf_listen {
@@ -68,6 +106,7 @@ struct conf_server {
     int             port;       /* port */
     int             weight;     /* weight */
     struct sockinfo info;       /* connect socket info */
+    uint32_t        dns_idx;    /* dns cache index, UINT32_MAX if none */
     unsigned        valid:1;    /* valid? */
 };
 
@@ -78,15 +117,54 @@ struct conf_pool {
     struct string      hash_tag;              /* hash_tag: */
     dist_type_t        distribution;          /* distribution: */
     int                timeout;               /* timeout: */
+    int                timeout_limit;         /* timeout_limit: */
+    int                timeout_factor;        /* timeout_factor: */
+    int                timeout_min;           /* timeout_min: in msec */
+    int                timeout_max;           /* timeout_max: in msec */
+    int                timeout_per_kb;        /* timeout_per_kb: in msec */
+    int                queue_timeout;         /* queue_timeout: in msec */
+    int                connect_timeout;       /* connect_timeout: */
     int                backlog;               /* backlog: */
     int                client_connections;    /* client_connections: */
     int                redis;                 /* redis: */
     int                preconnect;            /* preconnect: */
     int                auto_eject_hosts;      /* auto_eject_hosts: */
+    int                retry_reads;           /* retry_reads: */
+    int                retry_budget;          /* retry_budget: in % */
+    int                replicas;              /* replicas: */
+    ack_type_t         write_ack;             /* write_ack: */
+    int                hedge_reads;           /* hedge_reads: */
+    int                hedge_budget;          /* hedge_budget: in % */
     int                server_connections;    /* server_connections: */
+    int                server_connections_min; /* server_connections_min: */
+    int                server_connections_max; /* server_connections_max: */
+    int                server_connections_depth; /* server_connections_depth: */
+    int                server_connections_shared; /* server_connections_shared: */
+    int                server_pipeline;       /* server_pipeline: */
+    int                server_pipeline_latency; /* server_pipeline_latency: in msec */
+    int                server_flush_delay;    /* server_flush_delay: in usec */
+    int                server_flush_requests; /* server_flush_requests: */
+    int                server_flush_bytes;    /* server_flush_bytes: */
+    int                max_server_queue;      /* max_server_queue: */
+    int                max_server_queue_bytes; /* max_server_queue_bytes: */
+    int                rate_limit;            /* rate_limit: per sec */
+    int                rate_limit_bytes;      /* rate_limit_bytes: per sec */
+    int                client_rate_limit;     /* client_rate_limit: per sec */
+    int                client_rate_limit_bytes; /* client_rate_limit_bytes: per sec */
+    throttle_type_t    rate_limit_action;     /* rate_limit_action: */
+    int                batch_keys;            /* batch_keys: */
+    int                batch_weight;          /* batch_weight: in % */
     int                server_retry_timeout;  /* server_retry_timeout: in msec */
     int                server_failure_limit;  /* server_failure_limit: */
+    int                health_check_interval; /* health_check_interval: in msec */
+    int                outlier_interval;      /* outlier_interval: in msec */
+    int                outlier_factor;        /* outlier_factor: */
+    int                outlier_max_ejection;  /* outlier_max_ejection: in % */
+    int                stage_sampling;        /* stage_sampling: 1 in n */
+    int                slowlog_slower_than;   /* slowlog_slower_than: in usec */
+    int                slowlog_max_len;       /* slowlog_max_len: */
     struct array       server;                /* servers: conf_server[] */
+    struct array       read_replica;          /* read_replicas: conf_server[] */
     unsigned           valid:1;               /* valid? */
 };
 
@@ -123,10 +201,13 @@ char *conf_set_num(struct conf *cf, struct command *cmd, void *conf);
 char *conf_set_bool(struct conf *cf, struct command *cmd, void *conf);
 char *conf_set_hash(struct conf *cf, struct command *cmd, void *conf);
 char *conf_set_distribution(struct conf *cf, struct command *cmd, void *conf);
+char *conf_set_ack(struct conf *cf, struct command *cmd, void *conf);
+char *conf_set_throttle(struct conf *cf, struct command *cmd, void *conf);
 char *conf_set_hashtag(struct conf *cf, struct command *cmd, void *conf);
 
 rstatus_t conf_server_each_transform(void *elem, void *data);
 rstatus_t conf_pool_each_transform(void *elem, void *data);
+void conf_pool_apply(struct conf_pool *cp, struct server_pool *sp);
 
 struct conf *conf_create(char *filename);
 void conf_destroy(struct conf *cf);
@@ -21,6 +21,8 @@
 #include <nc_server.h>
 #include <nc_client.h>
 #include <nc_proxy.h>
+#include <nc_health.h>
+#include <nc_upgrade.h>
 #include <proto/nc_proto.h>
 
 /*
@@ -83,6 +85,216 @@
 
 static uint32_t nfree_connq;       /* # free conn q */
 static struct conn_tqh free_connq; /* free conn q */
+static struct rbtree tmo_rbt;      /* timeout rbtree */
+static struct rbnode tmo_rbs;      /* timeout rbtree sentinel */
+static struct rbtree flush_rbt;    /* flush rbtree */
+static struct rbnode flush_rbs;    /* flush rbtree sentinel */
+static struct rbtree queue_rbt;    /* queue timeout rbtree */
+static struct rbnode queue_rbs;    /* queue timeout rbtree sentinel */
+
+static struct conn *
+conn_from_rbe(struct rbnode *node)
+{
+    struct conn *conn;
+    int offset;
+
+    offset = offsetof(struct conn, tmo_rbe);
+    conn = (struct conn *)((char *)node - offset);
+
+    return conn;
+}
+
+struct conn *
+conn_tmo_min(void)
+{
+    struct rbnode *node;
+
+    node = rbtree_min(&tmo_rbt);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    return conn_from_rbe(node);
+}
+
+static struct conn *
+conn_from_flush_rbe(struct rbnode *node)
+{
+    struct conn *conn;
+    int offset;
+
+    offset = offsetof(struct conn, flush_rbe);
+    conn = (struct conn *)((char *)node - offset);
+
+    return conn;
+}
+
+struct conn *
+conn_flush_min(void)
+{
+    struct rbnode *node;
+
+    node = rbtree_min(&flush_rbt);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    return conn_from_flush_rbe(node);
+}
+
+/*
+ * Arm the deadline, delay usec from now, by which the requests held back on
+ * server connection conn are to be flushed
+ */
+void
+conn_flush_insert(struct conn *conn, int64_t delay)
+{
+    struct rbnode *node;
+
+    ASSERT(!conn->client && !conn->proxy);
+    ASSERT(delay > 0);
+
+    conn_flush_delete(conn);
+
+    node = &conn->flush_rbe;
+    node->key = nc_usec_now() + delay;
+    node->data = conn;
+
+    rbtree_insert(&flush_rbt, node);
+
+    log_debug(LOG_VERB, "insert conn %d into flush rbt with delay of "
+              "%"PRId64" usec", conn->sd, delay);
+}
+
+void
+conn_flush_delete(struct conn *conn)
+{
+    struct rbnode *node;
+
+    node = &conn->flush_rbe;
+
+    /* already deleted */
+
+    if (node->data == NULL) {
+        return;
+    }
+
+    rbtree_delete(&flush_rbt, node);
+
+    log_debug(LOG_VERB, "delete conn %d from flush rbt", conn->sd);
+}
+
+static struct conn *
+conn_from_queue_rbe(struct rbnode *node)
+{
+    struct conn *conn;
+    int offset;
+
+    offset = offsetof(struct conn, queue_rbe);
+    conn = (struct conn *)((char *)node - offset);
+
+    return conn;
+}
+
+struct conn *
+conn_queue_min(void)
+{
+    struct rbnode *node;
+
+    node = rbtree_min(&queue_rbt);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    return conn_from_queue_rbe(node);
+}
+
+/*
+ * Arm the deadline, at time then in usec, by which the oldest request
+ * waiting unsent in the inq of server connection conn times out
+ */
+void
+conn_queue_insert(struct conn *conn, int64_t then)
+{
+    struct rbnode *node;
+
+    ASSERT(!conn->client && !conn->proxy);
+
+    conn_queue_delete(conn);
+
+    node = &conn->queue_rbe;
+    node->key = then;
+    node->data = conn;
+
+    rbtree_insert(&queue_rbt, node);
+
+    log_debug(LOG_VERB, "insert conn %d into queue rbt at %"PRId64" usec",
+              conn->sd, then);
+}
+
+void
+conn_queue_delete(struct conn *conn)
+{
+    struct rbnode *node;
+
+    node = &conn->queue_rbe;
+
+    /* already deleted */
+
+    if (node->data == NULL) {
+        return;
+    }
+
+    rbtree_delete(&queue_rbt, node);
+
+    log_debug(LOG_VERB, "delete conn %d from queue rbt", conn->sd);
+}
+
+/*
+ * Arm a timer that expires timeout msec from now on connection conn. Unlike
+ * the request timers, there is at most one timer per connection, which is
+ * used to bound the time a server connection spends in connecting state,
+ * to close a server connection left idle, or to pause reading from a rate
+ * limited client connection.
+ */
+void
+conn_tmo_insert(struct conn *conn, int timeout)
+{
+    struct rbnode *node;
+
+    if (timeout <= 0) {
+        return;
+    }
+
+    conn_tmo_delete(conn);
+
+    node = &conn->tmo_rbe;
+    node->key = nc_msec_now() + timeout;
+    node->data = conn;
+
+    rbtree_insert(&tmo_rbt, node);
+
+    log_debug(LOG_VERB, "insert conn %d into tmo rbt with expiry of %d msec",
+              conn->sd, timeout);
+}
+
+void
+conn_tmo_delete(struct conn *conn)
+{
+    struct rbnode *node;
+
+    node = &conn->tmo_rbe;
+
+    /* already deleted */
+
+    if (node->data == NULL) {
+        return;
+    }
+
+    rbtree_delete(&tmo_rbt, node);
+
+    log_debug(LOG_VERB, "delete conn %d from tmo rbt", conn->sd);
+}
 
 /*
  * Return the context associated with this connection.
@@ -92,6 +304,10 @@ conn_to_ctx(struct conn *conn)
 {
     struct server_pool *pool;
 
+    if (conn->upgrade) {
+        return conn->owner;
+    }
+
     if (conn->proxy || conn->client) {
         pool = conn->owner;
     } else {
@@ -125,8 +341,16 @@ _conn_get(void)
     conn->sd = -1;
     /* {family, addrlen, addr} are initialized in enqueue handler */
 
+    rbtree_node_init(&conn->tmo_rbe);
+    rbtree_node_init(&conn->flush_rbe);
+    rbtree_node_init(&conn->queue_rbe);
+
     TAILQ_INIT(&conn->imsg_q);
     TAILQ_INIT(&conn->omsg_q);
+    TAILQ_INIT(&conn->wmsg_q[MSG_CLASS_INTERACTIVE]);
+    TAILQ_INIT(&conn->wmsg_q[MSG_CLASS_BATCH]);
+    conn->vtime[MSG_CLASS_INTERACTIVE] = 0;
+    conn->vtime[MSG_CLASS_BATCH] = 0;
     conn->rmsg = NULL;
     conn->smsg = NULL;
 
@@ -139,6 +363,21 @@ _conn_get(void)
     conn->send_bytes = 0;
     conn->recv_bytes = 0;
 
+    conn->ntimedout = 0;
+    conn->nrequest = 0;
+    conn->nsent = 0;
+    conn->nsend = 0;
+    conn->window = 0;
+    conn->nwindow = 0;
+    conn->window_recover = 0;
+    conn->nflush = 0;
+    conn->nflush_bytes = 0;
+    conn->flush_gap = 0;
+    conn->flush_last = 0;
+
+    bucket_init(&conn->rate_tokens);
+    bucket_init(&conn->rate_bytes_tokens);
+
     conn->events = 0;
     conn->err = 0;
     conn->recv_active = 0;
@@ -148,10 +387,14 @@ _conn_get(void)
 
     conn->client = 0;
     conn->proxy = 0;
+    conn->health = 0;
+    conn->upgrade = 0;
+    conn->batch = 0;
     conn->connecting = 0;
     conn->connected = 0;
     conn->eof = 0;
     conn->done = 0;
+    conn->drained = 0;
     conn->redis = 0;
 
     return conn;
@@ -268,6 +511,95 @@ conn_get_proxy(void *owner)
     return conn;
 }
 
+struct conn *
+conn_get_health(void *owner)
+{
+    struct server *server = owner;
+    struct server_pool *pool = server->owner;
+    struct conn *conn;
+
+    conn = _conn_get();
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    conn->redis = pool->redis;
+
+    conn->health = 1;
+
+    /*
+     * health check connection sends probes upstream and receives their
+     * responses, without ever being handed out to forward requests.
+     */
+    conn->recv = msg_recv;
+    conn->recv_next = health_recv_next;
+    conn->recv_done = health_recv_done;
+
+    conn->send = msg_send;
+    conn->send_next = health_send_next;
+    conn->send_done = health_send_done;
+
+    conn->close = health_close;
+    conn->active = health_active;
+
+    conn->ref = health_ref;
+    conn->unref = health_unref;
+
+    conn->enqueue_inq = NULL;
+    conn->dequeue_inq = NULL;
+    conn->enqueue_outq = NULL;
+    conn->dequeue_outq = NULL;
+
+    conn->ref(conn, owner);
+
+    log_debug(LOG_VVERB, "get conn %p health %d", conn, conn->health);
+
+    return conn;
+}
+
+struct conn *
+conn_get_upgrade(void *owner)
+{
+    struct conn *conn;
+
+    conn = _conn_get();
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    conn->upgrade = 1;
+
+    /*
+     * upgrade socket listener accepts the process that takes over from
+     * this one, and hands off the listening sockets to it on the accepted
+     * handoff connection.
+     */
+    conn->recv = upgrade_recv;
+    conn->recv_next = NULL;
+    conn->recv_done = NULL;
+
+    conn->send = upgrade_send;
+    conn->send_next = NULL;
+    conn->send_done = NULL;
+
+    conn->close = upgrade_close;
+    conn->active = NULL;
+
+    conn->ref = upgrade_ref;
+    conn->unref = upgrade_unref;
+
+    conn->enqueue_inq = NULL;
+    conn->dequeue_inq = NULL;
+    conn->enqueue_outq = NULL;
+    conn->dequeue_outq = NULL;
+
+    conn->ref(conn, owner);
+
+    log_debug(LOG_VVERB, "get conn %p upgrade %d", conn, conn->upgrade);
+
+    return conn;
+}
+
 static void
 conn_free(struct conn *conn)
 {
@@ -280,6 +612,9 @@ conn_put(struct conn *conn)
 {
     ASSERT(conn->sd < 0);
     ASSERT(conn->owner == NULL);
+    ASSERT(conn->tmo_rbe.data == NULL);
+    ASSERT(conn->flush_rbe.data == NULL);
+    ASSERT(conn->queue_rbe.data == NULL);
 
     log_debug(LOG_VVERB, "put conn %p", conn);
 
@@ -293,6 +628,9 @@ conn_init(void)
     log_debug(LOG_DEBUG, "conn size %d", sizeof(struct conn));
     nfree_connq = 0;
     TAILQ_INIT(&free_connq);
+    rbtree_init(&tmo_rbt, &tmo_rbs);
+    rbtree_init(&flush_rbt, &flush_rbs);
+    rbtree_init(&queue_rbt, &queue_rbs);
 }
 
 void
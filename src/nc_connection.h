@@ -43,10 +43,17 @@ struct conn {
     int                sd;            /* socket descriptor */
     int                family;        /* socket address family */
     socklen_t          addrlen;       /* socket length */
-    struct sockaddr    *addr;         /* socket address (ref in server or server_pool) */
+    struct sockaddr    *addr;         /* socket address (ref in info or server_pool) */
+    struct sockinfo    info;          /* server address connected to */
+
+    struct rbnode      tmo_rbe;       /* entry in rbtree */
+    struct rbnode      flush_rbe;     /* entry in flush rbtree */
+    struct rbnode      queue_rbe;     /* entry in queue timeout rbtree */
 
     struct msg_tqh     imsg_q;        /* incoming request Q */
     struct msg_tqh     omsg_q;        /* outstanding request Q */
+    struct msg_tqh     wmsg_q[MSG_NCLASS]; /* unscheduled request Q per class */
+    uint64_t           vtime[MSG_NCLASS];  /* virtual send time per class */
     struct msg         *rmsg;         /* current message being rcvd */
     struct msg         *smsg;         /* current message being sent */
 
@@ -70,6 +77,22 @@ struct conn {
     size_t             recv_bytes;    /* received (read) bytes */
     size_t             send_bytes;    /* sent (written) bytes */
 
+    uint32_t           ntimedout;     /* # outstanding timed out requests */
+    uint32_t           nrequest;      /* # outstanding requests */
+    uint32_t           nsent;         /* # requests sent and awaiting response */
+    uint32_t           nsend;         /* # requests picked for the current send */
+    uint32_t           window;        /* max # requests in flight */
+    uint32_t           nwindow;       /* # fast responses at this window */
+    uint64_t           window_recover; /* last request sent when window shrank */
+
+    uint32_t           nflush;        /* # requests held back to flush */
+    uint32_t           nflush_bytes;  /* # request bytes held back to flush */
+    int64_t            flush_gap;     /* avg request interarrival time in usec */
+    int64_t            flush_last;    /* last request arrival timestamp in usec */
+
+    struct bucket      rate_tokens;       /* client request rate bucket */
+    struct bucket      rate_bytes_tokens; /* client request bytes rate bucket */
+
     uint32_t           events;        /* connection io events */
     err_t              err;           /* connection errno */
     unsigned           recv_active:1; /* recv active? */
@@ -79,18 +102,34 @@ struct conn {
 
     unsigned           client:1;      /* client? or server? */
     unsigned           proxy:1;       /* proxy? */
+    unsigned           health:1;      /* health check? */
+    unsigned           upgrade:1;     /* upgrade socket listener? */
+    unsigned           batch:1;       /* batch client? */
     unsigned           connecting:1;  /* connecting? */
     unsigned           connected:1;   /* connected? */
     unsigned           eof:1;         /* eof? aka passive close? */
     unsigned           done:1;        /* done? aka close? */
+    unsigned           drained:1;     /* drained? aka closed when idle? */
     unsigned           redis:1;       /* redis? */
 };
 
 TAILQ_HEAD(conn_tqh, conn);
 
+struct conn *conn_tmo_min(void);
+void conn_tmo_insert(struct conn *conn, int timeout);
+void conn_tmo_delete(struct conn *conn);
+struct conn *conn_flush_min(void);
+void conn_flush_insert(struct conn *conn, int64_t delay);
+void conn_flush_delete(struct conn *conn);
+struct conn *conn_queue_min(void);
+void conn_queue_insert(struct conn *conn, int64_t then);
+void conn_queue_delete(struct conn *conn);
+
 struct context *conn_to_ctx(struct conn *conn);
 struct conn *conn_get(void *owner, bool client, bool redis);
 struct conn *conn_get_proxy(void *owner);
+struct conn *conn_get_health(void *owner);
+struct conn *conn_get_upgrade(void *owner);
 void conn_put(struct conn *conn);
 ssize_t conn_recv(struct conn *conn, void *buf, size_t size);
 ssize_t conn_sendv(struct conn *conn, struct array *sendv, size_t nsend);
@@ -17,12 +17,17 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
 #include <nc_core.h>
 #include <nc_conf.h>
 #include <nc_server.h>
 #include <nc_proxy.h>
+#include <nc_health.h>
+#include <nc_upgrade.h>
+#include <nc_dns.h>
 
 static uint32_t ctx_id; /* context generation */
+static volatile sig_atomic_t ctx_reload; /* reload requested? */
 
 static struct context *
 core_ctx_create(struct instance *nci)
@@ -36,11 +41,14 @@ core_ctx_create(struct instance *nci)
     }
     ctx->id = ++ctx_id;
     ctx->cf = NULL;
+    ctx->old_cf = NULL;
     ctx->stats = NULL;
     ctx->evb = NULL;
+    ctx->upgrade = NULL;
     array_null(&ctx->pool);
     ctx->max_timeout = nci->stats_interval;
     ctx->timeout = ctx->max_timeout;
+    ctx->handled = 0;
 
     /* parse and create configuration */
     ctx->cf = conf_create(nci->conf_filename);
@@ -57,10 +65,22 @@ core_ctx_create(struct instance *nci)
         return NULL;
     }
 
+    /* take over listening sockets of the process we are upgrading from */
+    status = upgrade_init(ctx, nci->upgrade_filename, nci->drain_timeout);
+    if (status != NC_OK) {
+        server_pool_deinit(&ctx->pool);
+        conf_destroy(ctx->cf);
+        nc_free(ctx);
+        return NULL;
+    }
+
     /* create stats per server pool */
     ctx->stats = stats_create(nci->stats_port, nci->stats_addr, nci->stats_interval,
-                              nci->hostname, &ctx->pool);
+                              nci->hostname, &ctx->pool,
+                              upgrade_take_stats(ctx, nci->stats_addr,
+                                                 nci->stats_port));
     if (ctx->stats == NULL) {
+        upgrade_deinit(ctx);
         server_pool_deinit(&ctx->pool);
         conf_destroy(ctx->cf);
         nc_free(ctx);
@@ -71,6 +91,7 @@ core_ctx_create(struct instance *nci)
     ctx->evb = event_base_create(EVENT_SIZE, &core_core);
     if (ctx->evb == NULL) {
         stats_destroy(ctx->stats);
+        upgrade_deinit(ctx);
         server_pool_deinit(&ctx->pool);
         conf_destroy(ctx->cf);
         nc_free(ctx);
@@ -83,6 +104,20 @@ core_ctx_create(struct instance *nci)
         server_pool_disconnect(ctx);
         event_base_destroy(ctx->evb);
         stats_destroy(ctx->stats);
+        upgrade_deinit(ctx);
+        server_pool_deinit(&ctx->pool);
+        conf_destroy(ctx->cf);
+        nc_free(ctx);
+        return NULL;
+    }
+
+    /* initialize health checks per server pool */
+    status = health_init(ctx);
+    if (status != NC_OK) {
+        server_pool_disconnect(ctx);
+        event_base_destroy(ctx->evb);
+        stats_destroy(ctx->stats);
+        upgrade_deinit(ctx);
         server_pool_deinit(&ctx->pool);
         conf_destroy(ctx->cf);
         nc_free(ctx);
@@ -92,15 +127,39 @@ core_ctx_create(struct instance *nci)
     /* initialize proxy per server pool */
     status = proxy_init(ctx);
     if (status != NC_OK) {
+        health_deinit(ctx);
+        server_pool_disconnect(ctx);
+        event_base_destroy(ctx->evb);
+        stats_destroy(ctx->stats);
+        upgrade_deinit(ctx);
+        server_pool_deinit(&ctx->pool);
+        conf_destroy(ctx->cf);
+        nc_free(ctx);
+        return NULL;
+    }
+
+    /* confirm the handoff from the process we upgraded from */
+    status = upgrade_ack(ctx);
+    if (status != NC_OK) {
+        proxy_deinit(ctx);
+        health_deinit(ctx);
         server_pool_disconnect(ctx);
         event_base_destroy(ctx->evb);
         stats_destroy(ctx->stats);
+        upgrade_deinit(ctx);
         server_pool_deinit(&ctx->pool);
         conf_destroy(ctx->cf);
         nc_free(ctx);
         return NULL;
     }
 
+    /* listen for upgrades */
+    status = upgrade_listen(ctx);
+    if (status != NC_OK) {
+        log_warn("listen on upgrade socket '%s' failed, ignored",
+                 nci->upgrade_filename);
+    }
+
     log_debug(LOG_VVERB, "created ctx %p id %"PRIu32"", ctx, ctx->id);
 
     return ctx;
@@ -111,10 +170,15 @@ core_ctx_destroy(struct context *ctx)
 {
     log_debug(LOG_VVERB, "destroy ctx %p id %"PRIu32"", ctx, ctx->id);
     proxy_deinit(ctx);
+    upgrade_deinit(ctx);
+    health_deinit(ctx);
     server_pool_disconnect(ctx);
     event_base_destroy(ctx->evb);
     stats_destroy(ctx->stats);
     server_pool_deinit(&ctx->pool);
+    if (ctx->old_cf != NULL) {
+        conf_destroy(ctx->old_cf);
+    }
     conf_destroy(ctx->cf);
     nc_free(ctx);
 }
@@ -144,10 +208,10 @@ core_start(struct instance *nci)
 void
 core_stop(struct context *ctx)
 {
+    core_ctx_destroy(ctx);
     conn_deinit();
     msg_deinit();
     mbuf_deinit();
-    core_ctx_destroy(ctx);
 }
 
 static rstatus_t
@@ -192,7 +256,7 @@ core_close(struct context *ctx, struct conn *conn)
         type = 'c';
         addrstr = nc_unresolve_peer_desc(conn->sd);
     } else {
-        type = conn->proxy ? 'p' : 's';
+        type = conn->proxy ? 'p' : (conn->upgrade ? 'u' : 's');
         addrstr = nc_unresolve_addr(conn->addr, conn->addrlen);
     }
     log_debug(LOG_NOTICE, "close %c %d '%s' on event %04"PRIX32" eof %d done "
@@ -225,8 +289,12 @@ core_error(struct context *ctx, struct conn *conn)
     core_close(ctx, conn);
 }
 
-static void
-core_timeout(struct context *ctx)
+/*
+ * Expire timed out requests and return the time in msec till the next
+ * request timeout
+ */
+static int
+core_msg_timeout(struct context *ctx)
 {
     for (;;) {
         struct msg *msg;
@@ -235,8 +303,7 @@ core_timeout(struct context *ctx)
 
         msg = msg_tmo_min();
         if (msg == NULL) {
-            ctx->timeout = ctx->max_timeout;
-            return;
+            return ctx->max_timeout;
         }
 
         /* skip over req that are in-error or done */
@@ -257,25 +324,209 @@ core_timeout(struct context *ctx)
         now = nc_msec_now();
         if (now < then) {
             int delta = (int)(then - now);
-            ctx->timeout = MIN(delta, ctx->max_timeout);
-            return;
+            return MIN(delta, ctx->max_timeout);
         }
 
         log_debug(LOG_INFO, "req %"PRIu64" on s %d timedout", msg->id, conn->sd);
 
         msg_tmo_delete(msg);
+
+        if (server_timedout(ctx, conn, msg)) {
+            continue;
+        }
+
         conn->err = ETIMEDOUT;
 
         core_close(ctx, conn);
     }
 }
 
-rstatus_t
-core_core(void *arg, uint32_t events)
+/*
+ * Close server connections that failed to connect in time, run the due
+ * health checks, resume reading from rate limited client connections and
+ * return the time in msec till the next connection timer
+ */
+static int
+core_conn_timeout(struct context *ctx)
+{
+    for (;;) {
+        struct conn *conn;
+        int64_t now, then;
+
+        conn = conn_tmo_min();
+        if (conn == NULL) {
+            return ctx->max_timeout;
+        }
+
+        then = conn->tmo_rbe.key;
+
+        now = nc_msec_now();
+        if (now < then) {
+            int delta = (int)(then - now);
+            return MIN(delta, ctx->max_timeout);
+        }
+
+        conn_tmo_delete(conn);
+
+        if (conn->health) {
+            /* timer on health check connection drives its next probe */
+            if (health_probe(ctx, conn) == NC_OK) {
+                continue;
+            }
+        } else if (conn->client) {
+            /* timer on rate limited client connection resumes reading */
+            if (core_recv(ctx, conn) == NC_OK && !conn->done && !conn->err) {
+                continue;
+            }
+        } else if (conn->upgrade) {
+            /* timer on upgrade handoff connection gives up on the handoff */
+            log_warn("upgrade handoff on u %d timedout, keep running",
+                     conn->sd);
+
+            conn->err = ETIMEDOUT;
+        } else if (!conn->connecting) {
+            /* timer on idle server connection drains it */
+            if (!server_idle_timedout(conn)) {
+                continue;
+            }
+        } else {
+            ASSERT(!conn->client && !conn->proxy);
+
+            log_debug(LOG_INFO, "connect on s %d timedout", conn->sd);
+
+            conn->err = ETIMEDOUT;
+        }
+
+        core_close(ctx, conn);
+    }
+}
+
+/*
+ * Flush the requests held back on server connections whose flush deadline
+ * is due, closing the ones that fail to flush, and return the time in msec
+ * till the next flush deadline
+ */
+static int
+core_flush_timeout(struct context *ctx)
+{
+    for (;;) {
+        struct conn *conn;
+        int64_t now, then;
+
+        conn = conn_flush_min();
+        if (conn == NULL) {
+            return ctx->max_timeout;
+        }
+
+        then = conn->flush_rbe.key;
+
+        now = nc_usec_now();
+        if (now < then) {
+            int delta = (int)((then - now + 999) / 1000);
+            return MIN(delta, ctx->max_timeout);
+        }
+
+        /* conn in error failed to flush on the arrival of a request */
+        if (!conn->err) {
+            stats_server_incr(ctx, conn->owner, flush_timedout);
+
+            if (req_flush(ctx, conn) == NC_OK) {
+                continue;
+            }
+        }
+
+        core_close(ctx, conn);
+    }
+}
+
+/*
+ * Expire the requests that waited too long unsent on server connections
+ * whose queue deadline is due and return the time in msec till the next
+ * queue deadline
+ */
+static int
+core_queue_timeout(struct context *ctx)
+{
+    for (;;) {
+        struct conn *conn;
+        int64_t now, then;
+
+        conn = conn_queue_min();
+        if (conn == NULL) {
+            return ctx->max_timeout;
+        }
+
+        then = conn->queue_rbe.key;
+
+        now = nc_usec_now();
+        if (now < then) {
+            int delta = (int)((then - now + 999) / 1000);
+            return MIN(delta, ctx->max_timeout);
+        }
+
+        req_queue_timeout(ctx, conn);
+    }
+}
+
+/*
+ * Hedge the read requests whose hedge timer is due and return the time in
+ * msec till the next hedge timer
+ */
+static int
+core_hedge_timeout(struct context *ctx)
+{
+    for (;;) {
+        struct msg *msg;
+        struct conn *conn;
+        int64_t now, then;
+
+        msg = msg_hedge_min();
+        if (msg == NULL) {
+            return ctx->max_timeout;
+        }
+
+        /* skip over req that are in-error or done */
+
+        if (msg->error || msg->done) {
+            msg_hedge_delete(msg);
+            continue;
+        }
+
+        conn = msg->hedge_rbe.data;
+        then = msg->hedge_rbe.key;
+
+        now = nc_msec_now();
+        if (now < then) {
+            int delta = (int)(then - now);
+            return MIN(delta, ctx->max_timeout);
+        }
+
+        msg_hedge_delete(msg);
+
+        req_hedge(ctx, conn, msg);
+    }
+}
+
+static void
+core_timeout(struct context *ctx)
+{
+    int msg_timeout, conn_timeout, hedge_timeout, flush_timeout;
+    int queue_timeout;
+
+    msg_timeout = core_msg_timeout(ctx);
+    conn_timeout = core_conn_timeout(ctx);
+    hedge_timeout = core_hedge_timeout(ctx);
+    flush_timeout = core_flush_timeout(ctx);
+    queue_timeout = core_queue_timeout(ctx);
+
+    ctx->timeout = MIN(MIN(msg_timeout, conn_timeout),
+                       MIN(MIN(hedge_timeout, flush_timeout), queue_timeout));
+}
+
+static rstatus_t
+core_event(struct context *ctx, struct conn *conn, uint32_t events)
 {
     rstatus_t status;
-    struct conn *conn = arg;
-    struct context *ctx = conn_to_ctx(conn);
 
     log_debug(LOG_VVERB, "event %04"PRIX32" on %c %d", events,
               conn->client ? 'c' : (conn->proxy ? 'p' : 's'), conn->sd);
@@ -308,19 +559,204 @@ core_core(void *arg, uint32_t events)
     return NC_OK;
 }
 
+rstatus_t
+core_core(void *arg, uint32_t events)
+{
+    rstatus_t status;
+    struct conn *conn = arg;
+    struct context *ctx = conn_to_ctx(conn);
+    stats_loop_field_t fidx;
+    int64_t start, usec;
+
+    /* conn may be closed by the time the event has been handled */
+    fidx = conn->client ? STATS_LOOP_client :
+           (conn->proxy ? STATS_LOOP_proxy : STATS_LOOP_server);
+
+    start = nc_usec_mono();
+
+    status = core_event(ctx, conn, events);
+
+    usec = nc_usec_mono() - start;
+    ctx->handled += usec;
+    stats_loop_time(ctx, fidx, usec);
+
+    return status;
+}
+
+/*
+ * Request a reload of the configuration on the next run of the event loop.
+ * This is called from the signal handler.
+ */
+void
+core_reload_request(void)
+{
+    ctx_reload = 1;
+}
+
+/*
+ * Reload the configuration on request, and release the configuration it
+ * replaced once the servers retired by the reload are drained. A reload
+ * waits for the stats aggregator to be done with the shadow stats, and for
+ * the previous reload to complete.
+ */
+static void
+core_reload(struct context *ctx)
+{
+    rstatus_t status;
+    struct conf *cf;
+
+    if (ctx->old_cf != NULL && stats_remapped(ctx->stats) &&
+        server_pool_drained(ctx)) {
+        log_debug(LOG_NOTICE, "reload of conf '%s' completed", ctx->cf->fname);
+
+        conf_destroy(ctx->old_cf);
+        ctx->old_cf = NULL;
+    }
+
+    if (!ctx_reload) {
+        return;
+    }
+
+    if (ctx->stats->aggregate || ctx->old_cf != NULL) {
+        log_debug(LOG_VERB, "reload conf '%s' deferred", ctx->cf->fname);
+
+        /* check back soon instead of on the next event */
+        ctx->timeout = MIN(ctx->timeout, 10);
+        return;
+    }
+
+    ctx_reload = 0;
+
+    log_debug(LOG_NOTICE, "reload conf '%s'", ctx->cf->fname);
+
+    cf = conf_create(ctx->cf->fname);
+    if (cf == NULL) {
+        log_error("reload conf '%s' failed, keeping the current conf",
+                  ctx->cf->fname);
+        return;
+    }
+
+    status = server_pool_reload(ctx, cf);
+    if (status != NC_OK) {
+        conf_destroy(cf);
+        return;
+    }
+
+    ctx->old_cf = ctx->cf;
+    ctx->cf = cf;
+}
+
+/*
+ * Drain the clients once the listening sockets are handed off on upgrade:
+ * stop accepting, close each client as soon as it has no requests
+ * outstanding, and close all of them on the drain timeout. Returns NC_ERROR
+ * to stop the event loop once no client is left.
+ */
+static rstatus_t
+core_drain(struct context *ctx)
+{
+    struct upgrade *up = ctx->upgrade;
+    uint32_t i, npool, nclient;
+    bool expired;
+
+    if (!upgrade_handed_off(ctx)) {
+        return NC_OK;
+    }
+
+    if (up->drain_deadline == 0) {
+        log_debug(LOG_NOTICE, "draining clients for upto %d msec on upgrade",
+                  up->drain_timeout);
+
+        for (i = 0, npool = array_n(&ctx->pool); i < npool; i++) {
+            struct server_pool *sp = array_get(&ctx->pool, i);
+
+            if (sp->p_conn != NULL) {
+                core_close(ctx, sp->p_conn);
+            }
+        }
+
+        if (up->l_conn != NULL) {
+            core_close(ctx, up->l_conn);
+        }
+
+        stats_handoff(ctx->stats);
+
+        up->drain_deadline = nc_msec_now() + up->drain_timeout;
+    }
+
+    expired = nc_msec_now() >= up->drain_deadline;
+
+    nclient = 0;
+    for (i = 0, npool = array_n(&ctx->pool); i < npool; i++) {
+        struct server_pool *sp = array_get(&ctx->pool, i);
+        struct conn *conn, *nconn;
+
+        for (conn = TAILQ_FIRST(&sp->c_conn_q); conn != NULL; conn = nconn) {
+            nconn = TAILQ_NEXT(conn, conn_tqe);
+
+            if (!expired && conn->active(conn)) {
+                nclient++;
+                continue;
+            }
+
+            core_close(ctx, conn);
+        }
+    }
+
+    if (nclient == 0) {
+        loga("drained clients on upgrade, exiting");
+        return NC_ERROR;
+    }
+
+    /* check back soon instead of on the next event */
+    ctx->timeout = MIN(ctx->timeout, 100);
+
+    return NC_OK;
+}
+
 rstatus_t
 core_loop(struct context *ctx)
 {
+    rstatus_t status;
     int nsd;
+    int64_t start, wait, now;
+
+    start = nc_usec_mono();
+    ctx->handled = 0;
 
     nsd = event_wait(ctx->evb, ctx->timeout);
     if (nsd < 0) {
         return nsd;
     }
 
+    /*
+     * event_wait handles the events it waited for before returning, so
+     * the time blocked is what is left after handling them
+     */
+    now = nc_usec_mono();
+    wait = now - start - ctx->handled;
+    stats_loop_time(ctx, STATS_LOOP_wait, wait);
+    stats_loop_events(ctx, nsd);
+
     core_timeout(ctx);
 
+    stats_loop_time(ctx, STATS_LOOP_timer, nc_usec_mono() - now);
+
+    core_reload(ctx);
+
+    dns_update(ctx);
+
+    status = core_drain(ctx);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    now = nc_usec_mono();
+
     stats_swap(ctx->stats);
 
+    stats_loop_time(ctx, STATS_LOOP_stats, nc_usec_mono() - now);
+    stats_loop_time(ctx, STATS_LOOP_busy, nc_usec_mono() - start - wait);
+
     return NC_OK;
 }
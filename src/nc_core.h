@@ -81,6 +81,7 @@ struct conf;
 struct stats;
 struct instance;
 struct event_base;
+struct upgrade;
 
 #include <stddef.h>
 #include <stdint.h>
@@ -114,12 +115,15 @@ struct event_base;
 struct context {
     uint32_t           id;          /* unique context id */
     struct conf        *cf;         /* configuration */
+    struct conf        *old_cf;     /* configuration replaced on reload */
     struct stats       *stats;      /* stats */
 
     struct array       pool;        /* server_pool[] */
     struct event_base  *evb;        /* event base */
+    struct upgrade     *upgrade;    /* hot upgrade */
     int                max_timeout; /* max timeout in msec */
     int                timeout;     /* timeout in msec */
+    int64_t            handled;     /* usec spent on events of this wakeup */
 };
 
 
@@ -135,6 +139,9 @@ struct instance {
     size_t          mbuf_chunk_size;             /* mbuf chunk size */
     pid_t           pid;                         /* process id */
     char            *pid_filename;               /* pid filename */
+    char            *upgrade_filename;           /* upgrade socket filename */
+    int             drain_timeout;               /* drain timeout on upgrade in msec */
+    int             resolve_interval;            /* re-resolve interval in msec */
     unsigned        pidfile:1;                   /* pid file created? */
 };
 
@@ -142,5 +149,6 @@ struct context *core_start(struct instance *nci);
 void core_stop(struct context *ctx);
 rstatus_t core_core(void *arg, uint32_t events);
 rstatus_t core_loop(struct context *ctx);
+void core_reload_request(void);
 
 #endif
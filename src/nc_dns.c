@@ -0,0 +1,504 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <nc_core.h>
+#include <nc_server.h>
+#include <nc_dns.h>
+#include <hashkit/nc_hashkit.h>
+
+/*
+ * Resolution of server hostnames.
+ *
+ * Hostnames are resolved once per configuration load, no matter how many
+ * servers (or pools) refer to them, and on a pool of resolver threads, so
+ * that a configuration with thousands of hostnames does not take a round
+ * trip to the resolver per server. Every distinct hostname gets an entry
+ * in a cache keyed by name, and a server only keeps the index of its entry.
+ *
+ * With a re-resolve interval (-r), a background thread resolves all the
+ * cached hostnames again every interval. It never touches a server; an
+ * address that changed is left in the cache and installed by the event loop
+ * on its next iteration, which only copies it into the servers that refer
+ * to the hostname. Connections that are already established are left alone
+ * and new connections go to the new address.
+ */
+
+#define DNS_NBUCKET     1024    /* # hash buckets of the cache */
+
+struct dns_batch {
+    uint32_t *idx;              /* cache entries to resolve */
+    uint32_t n;                 /* # cache entries to resolve */
+    uint32_t next;              /* next cache entry to resolve */
+};
+
+static struct array dns_cache;              /* dns_name[] */
+static uint32_t dns_bucket[DNS_NBUCKET];    /* first entry + 1, by hash */
+static uint32_t *dns_chain;                 /* next entry + 1, by entry */
+static uint32_t dns_nchain;                 /* # allocated chain links */
+
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t dns_tid;                   /* re-resolve thread */
+static int dns_interval;                    /* re-resolve interval in msec */
+static bool dns_running;                    /* re-resolve thread started? */
+static bool dns_stop;                       /* re-resolve thread to stop? */
+static volatile bool dns_changed;           /* re-resolved address pending? */
+static int64_t dns_time;                    /* last conf load resolve time in msec */
+
+static bool
+dns_same(struct sockinfo *a, struct sockinfo *b)
+{
+    return a->family == b->family && a->addrlen == b->addrlen &&
+           memcmp(&a->addr, &b->addr, a->addrlen) == 0;
+}
+
+static void
+dns_set_port(struct sockinfo *si, int port)
+{
+    switch (si->family) {
+    case AF_INET:
+        si->addr.in.sin_port = htons((uint16_t)port);
+        break;
+
+    case AF_INET6:
+        si->addr.in6.sin6_port = htons((uint16_t)port);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/*
+ * Return the index of the cache entry for hostname name, adding it to the
+ * cache if it is not there, or UINT32_MAX on failure. The entry is marked to
+ * be resolved by the next dns_resolve, unless it is kept fresh by the
+ * re-resolve thread.
+ */
+uint32_t
+dns_lookup(struct string *name, int port)
+{
+    struct dns_name *dn;
+    uint32_t idx, bucket, *chain;
+    rstatus_t status;
+
+    bucket = hash_fnv1a_32((char *)name->data, name->len) % DNS_NBUCKET;
+
+    pthread_mutex_lock(&dns_lock);
+
+    for (idx = dns_bucket[bucket]; idx != 0; idx = dns_chain[idx - 1]) {
+        dn = array_get(&dns_cache, idx - 1);
+        if (string_compare(&dn->name, name) == 0) {
+            if (!dn->resolved || dns_interval == 0) {
+                dn->wanted = 1;
+            }
+            pthread_mutex_unlock(&dns_lock);
+            return idx - 1;
+        }
+    }
+
+    if (array_n(&dns_cache) == dns_nchain) {
+        chain = nc_realloc(dns_chain, 2 * (dns_nchain + 1) * sizeof(*chain));
+        if (chain == NULL) {
+            pthread_mutex_unlock(&dns_lock);
+            return UINT32_MAX;
+        }
+        dns_chain = chain;
+        dns_nchain = 2 * (dns_nchain + 1);
+    }
+
+    dn = array_push(&dns_cache);
+    if (dn == NULL) {
+        pthread_mutex_unlock(&dns_lock);
+        return UINT32_MAX;
+    }
+
+    status = string_duplicate(&dn->name, name);
+    if (status != NC_OK) {
+        array_pop(&dns_cache);
+        pthread_mutex_unlock(&dns_lock);
+        return UINT32_MAX;
+    }
+    dn->port = port;
+    memset(&dn->info, 0, sizeof(dn->info));
+    memset(&dn->next, 0, sizeof(dn->next));
+    dn->wanted = 1;
+    dn->resolved = 0;
+    dn->changed = 0;
+
+    idx = array_idx(&dns_cache, dn);
+    dns_chain[idx] = dns_bucket[bucket];
+    dns_bucket[bucket] = idx + 1;
+
+    pthread_mutex_unlock(&dns_lock);
+
+    log_debug(LOG_VERB, "dns cache adds '%.*s' as %"PRIu32"", name->len,
+              name->data, idx);
+
+    return idx;
+}
+
+static void *
+dns_worker(void *arg)
+{
+    struct dns_batch *batch = arg;
+    struct dns_name *dn;
+    struct string name;
+    struct sockinfo si;
+    uint32_t idx;
+    int port, status;
+
+    pthread_mutex_lock(&dns_lock);
+
+    while (batch->next < batch->n) {
+        idx = batch->idx[batch->next++];
+        dn = array_get(&dns_cache, idx);
+        name = dn->name;
+        port = dn->port;
+
+        pthread_mutex_unlock(&dns_lock);
+        status = nc_resolve(&name, port, &si);
+        pthread_mutex_lock(&dns_lock);
+
+        dn = array_get(&dns_cache, idx);
+        if (status == 0) {
+            dn->info = si;
+            dn->resolved = 1;
+            dn->changed = 0;
+        } else if (dn->resolved) {
+            log_warn("dns resolution of '%.*s' failed, keeping its last "
+                     "address", name.len, name.data);
+        }
+    }
+
+    pthread_mutex_unlock(&dns_lock);
+
+    return NULL;
+}
+
+/*
+ * Resolve all cache entries marked by dns_lookup on up to DNS_MAX_THREADS
+ * threads, the calling thread being one of them. An entry that fails to
+ * resolve keeps its last address, or is left unresolved for dns_get to
+ * report if it never had one.
+ */
+rstatus_t
+dns_resolve(void)
+{
+    struct dns_batch batch;
+    pthread_t tid[DNS_MAX_THREADS - 1];
+    uint32_t i, n, nthread;
+    int64_t start;
+    int status;
+
+    pthread_mutex_lock(&dns_lock);
+
+    batch.idx = nc_alloc(MAX(array_n(&dns_cache), 1) * sizeof(*batch.idx));
+    if (batch.idx == NULL) {
+        pthread_mutex_unlock(&dns_lock);
+        return NC_ENOMEM;
+    }
+    batch.n = 0;
+    batch.next = 0;
+
+    for (i = 0; i < array_n(&dns_cache); i++) {
+        struct dns_name *dn = array_get(&dns_cache, i);
+
+        if (dn->wanted) {
+            dn->wanted = 0;
+            batch.idx[batch.n++] = i;
+        }
+    }
+
+    pthread_mutex_unlock(&dns_lock);
+
+    start = nc_msec_now();
+
+    nthread = 0;
+    n = MIN(batch.n, DNS_MAX_THREADS) - (batch.n != 0 ? 1 : 0);
+    for (i = 0; i < n; i++) {
+        status = pthread_create(&tid[nthread], NULL, dns_worker, &batch);
+        if (status != 0) {
+            log_warn("dns resolver thread create failed, ignored: %s",
+                     strerror(status));
+            break;
+        }
+        nthread++;
+    }
+
+    dns_worker(&batch);
+
+    for (i = 0; i < nthread; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    pthread_mutex_lock(&dns_lock);
+    dns_time = nc_msec_now() - start;
+    pthread_mutex_unlock(&dns_lock);
+
+    log_debug(LOG_NOTICE, "dns looked up %"PRIu32" of %"PRIu32" names on %"PRIu32" "
+              "threads in %"PRId64" msec", batch.n, array_n(&dns_cache),
+              nthread + 1, dns_time);
+
+    nc_free(batch.idx);
+
+    return NC_OK;
+}
+
+/*
+ * Copy the address of cache entry idx with the given port into si. Fails if
+ * the hostname of the entry could not be resolved.
+ */
+rstatus_t
+dns_get(uint32_t idx, int port, struct sockinfo *si)
+{
+    struct dns_name *dn;
+
+    pthread_mutex_lock(&dns_lock);
+
+    dn = array_get(&dns_cache, idx);
+    if (!dn->resolved) {
+        pthread_mutex_unlock(&dns_lock);
+        return NC_ERROR;
+    }
+
+    *si = dn->changed ? dn->next : dn->info;
+    dns_set_port(si, port);
+
+    pthread_mutex_unlock(&dns_lock);
+
+    return NC_OK;
+}
+
+/*
+ * Return the time in msec taken to resolve the hostnames on the last
+ * configuration load.
+ */
+int64_t
+dns_resolve_time(void)
+{
+    int64_t t;
+
+    pthread_mutex_lock(&dns_lock);
+    t = dns_time;
+    pthread_mutex_unlock(&dns_lock);
+
+    return t;
+}
+
+static void
+dns_update_server(struct array *server)
+{
+    uint32_t i;
+
+    for (i = 0; i < array_n(server); i++) {
+        struct server *s = array_get(server, i);
+        struct dns_name *dn;
+
+        if (s->dns_idx == UINT32_MAX) {
+            continue;
+        }
+
+        dn = array_get(&dns_cache, s->dns_idx);
+        if (!dn->changed) {
+            continue;
+        }
+
+        /* connections pick up the new address on their next connect */
+        s->info = dn->next;
+        dns_set_port(&s->info, s->port);
+
+        s->family = s->info.family;
+        s->addrlen = s->info.addrlen;
+        s->addr = (struct sockaddr *)&s->info.addr;
+
+        log_debug(LOG_NOTICE, "server '%.*s' in pool %"PRIu32" '%.*s' moves "
+                  "to '%s'", s->pname.len, s->pname.data, s->owner->idx,
+                  s->owner->name.len, s->owner->name.data,
+                  nc_unresolve_addr(s->addr, s->addrlen));
+    }
+}
+
+/*
+ * Install the addresses that changed on re-resolution into the servers of
+ * all pools. Called from the event loop on every iteration, and cheap unless
+ * an address changed.
+ */
+void
+dns_update(struct context *ctx)
+{
+    uint32_t i;
+
+    if (!dns_changed) {
+        return;
+    }
+
+    pthread_mutex_lock(&dns_lock);
+
+    for (i = 0; i < array_n(&ctx->pool); i++) {
+        struct server_pool *sp = array_get(&ctx->pool, i);
+
+        dns_update_server(&sp->server);
+        dns_update_server(&sp->read_replica);
+    }
+
+    for (i = 0; i < array_n(&dns_cache); i++) {
+        struct dns_name *dn = array_get(&dns_cache, i);
+
+        if (dn->changed) {
+            dn->info = dn->next;
+            dn->changed = 0;
+        }
+    }
+
+    dns_changed = false;
+
+    pthread_mutex_unlock(&dns_lock);
+}
+
+static void *
+dns_loop(void *arg)
+{
+    struct dns_name *dn;
+    struct string name;
+    struct sockinfo si;
+    struct timespec ts;
+    uint32_t i;
+    int port, status;
+
+    pthread_mutex_lock(&dns_lock);
+
+    for (;;) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += dns_interval / 1000;
+        ts.tv_nsec += (long)(dns_interval % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        while (!dns_stop) {
+            status = pthread_cond_timedwait(&dns_cond, &dns_lock, &ts);
+            if (status == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        for (i = 0; i < array_n(&dns_cache) && !dns_stop; i++) {
+            dn = array_get(&dns_cache, i);
+            if (!dn->resolved) {
+                continue;
+            }
+            name = dn->name;
+            port = dn->port;
+
+            pthread_mutex_unlock(&dns_lock);
+            status = nc_resolve(&name, port, &si);
+            pthread_mutex_lock(&dns_lock);
+
+            if (status != 0) {
+                log_warn("dns re-resolution of '%.*s' failed, keeping its "
+                         "address", name.len, name.data);
+                continue;
+            }
+
+            dn = array_get(&dns_cache, i);
+            if (dns_same(&si, &dn->info)) {
+                dn->changed = 0;
+                continue;
+            }
+
+            log_debug(LOG_INFO, "dns re-resolved '%.*s' to a new address",
+                      name.len, name.data);
+
+            dn->next = si;
+            dn->changed = 1;
+            dns_changed = true;
+        }
+
+        if (dns_stop) {
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&dns_lock);
+
+    return NULL;
+}
+
+rstatus_t
+dns_init(int interval)
+{
+    rstatus_t status;
+    int err;
+
+    status = array_init(&dns_cache, DNS_NBUCKET, sizeof(struct dns_name));
+    if (status != NC_OK) {
+        return status;
+    }
+
+    dns_interval = interval;
+    dns_running = false;
+    dns_stop = false;
+    dns_changed = false;
+    dns_time = 0;
+
+    if (interval == 0) {
+        return NC_OK;
+    }
+
+    err = pthread_create(&dns_tid, NULL, dns_loop, NULL);
+    if (err != 0) {
+        log_error("dns re-resolve thread create failed: %s", strerror(err));
+        array_deinit(&dns_cache);
+        return NC_ERROR;
+    }
+    dns_running = true;
+
+    log_debug(LOG_NOTICE, "dns re-resolves names every %d msec", interval);
+
+    return NC_OK;
+}
+
+void
+dns_deinit(void)
+{
+    if (dns_running) {
+        pthread_mutex_lock(&dns_lock);
+        dns_stop = true;
+        pthread_cond_signal(&dns_cond);
+        pthread_mutex_unlock(&dns_lock);
+
+        pthread_join(dns_tid, NULL);
+        dns_running = false;
+    }
+
+    while (array_n(&dns_cache) != 0) {
+        struct dns_name *dn = array_pop(&dns_cache);
+
+        string_deinit(&dn->name);
+    }
+    array_deinit(&dns_cache);
+    array_null(&dns_cache);
+
+    memset(dns_bucket, 0, sizeof(dns_bucket));
+    nc_free(dns_chain);
+    dns_nchain = 0;
+}
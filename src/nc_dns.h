@@ -0,0 +1,45 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_DNS_H_
+#define _NC_DNS_H_
+
+#include <nc_core.h>
+
+#define DNS_RESOLVE_INTERVAL    0       /* default re-resolve interval in msec (off) */
+#define DNS_MAX_THREADS         16      /* max # resolver threads on conf load */
+
+struct dns_name {
+    struct string   name;       /* hostname */
+    int             port;       /* port it was first resolved with */
+    struct sockinfo info;       /* resolved address */
+    struct sockinfo next;       /* re-resolved address, not yet installed */
+    unsigned        wanted:1;   /* to be resolved on conf load? */
+    unsigned        resolved:1; /* resolved? */
+    unsigned        changed:1;  /* next differs from info? */
+};
+
+uint32_t dns_lookup(struct string *name, int port);
+rstatus_t dns_resolve(void);
+rstatus_t dns_get(uint32_t idx, int port, struct sockinfo *si);
+int64_t dns_resolve_time(void);
+void dns_update(struct context *ctx);
+
+rstatus_t dns_init(int interval);
+void dns_deinit(void);
+
+#endif
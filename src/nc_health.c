@@ -0,0 +1,614 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <nc_core.h>
+#include <nc_server.h>
+#include <nc_health.h>
+
+/*
+ * Active health checking of servers in a pool.
+ *
+ * Every server in a pool with a non-zero 'health_check_interval:' owns a
+ * dedicated health check connection, that is never used to forward client
+ * requests. The connection timer (see conn_tmo_insert) drives the health
+ * check schedule of the server:
+ *
+ * 1). When the timer fires on an idle connection, a probe ('version' for
+ *     memcache and 'PING' for redis) is sent on it, reconnecting first if
+ *     needed. The timer is then re-armed to bound the wait for a reply.
+ * 2). A valid reply to the probe re-arms the timer for the next check.
+ * 3). An invalid reply, an error on the connection or the timer firing
+ *     with the probe still outstanding closes the connection and counts as
+ *     a failed check. The next check is then delayed by an exponentially
+ *     increasing backoff, capped at the 'server_retry_timeout:'.
+ *
+ * All delays are jittered, so that checks on different servers spread out
+ * over time instead of being sent in lockstep.
+ *
+ * With 'auto_eject_hosts:' enabled, a server that fails its health checks
+ * 'server_failure_limit:' consecutive times is ejected from the pool and
+ * stays ejected till a health check succeeds again. The distribution is
+ * only rebuilt on these state changes.
+ */
+
+void
+health_ref(struct conn *conn, void *owner)
+{
+    struct server *server = owner;
+
+    ASSERT(conn->health);
+    ASSERT(conn->owner == NULL);
+    ASSERT(server->health_conn == NULL);
+
+    server_conn_addr(conn, server);
+
+    server->health_conn = conn;
+
+    conn->owner = owner;
+
+    log_debug(LOG_VVERB, "ref conn %p owner %p into '%.*s'", conn, server,
+              server->pname.len, server->pname.data);
+}
+
+void
+health_unref(struct conn *conn)
+{
+    struct server *server;
+
+    ASSERT(conn->health);
+    ASSERT(conn->owner != NULL);
+
+    server = conn->owner;
+    conn->owner = NULL;
+
+    ASSERT(server->health_conn == conn);
+    server->health_conn = NULL;
+
+    log_debug(LOG_VVERB, "unref conn %p owner %p from '%.*s'", conn, server,
+              server->pname.len, server->pname.data);
+}
+
+bool
+health_active(struct conn *conn)
+{
+    ASSERT(conn->health);
+
+    if (!TAILQ_EMPTY(&conn->imsg_q) || !TAILQ_EMPTY(&conn->omsg_q)) {
+        return true;
+    }
+
+    if (conn->rmsg != NULL || conn->smsg != NULL) {
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Return the delay in msec before the next health check of a server that
+ * has failed its last nfailure checks
+ */
+static int
+health_delay(struct server_pool *pool, uint32_t nfailure)
+{
+    int64_t delay, max_delay;
+
+    delay = pool->health_check_interval;
+    max_delay = MAX(delay, pool->server_retry_timeout / 1000LL);
+
+    delay <<= MIN(nfailure, HEALTH_MAX_BACKOFF);
+    if (delay > max_delay) {
+        delay = max_delay;
+    }
+
+    /* jitter by upto a quarter of the delay */
+    delay -= random() % (delay / 4 + 1);
+
+    return (int)delay;
+}
+
+static void
+health_reset(struct conn *conn)
+{
+    struct msg *msg;
+    rstatus_t status;
+
+    while (!TAILQ_EMPTY(&conn->imsg_q)) {
+        msg = TAILQ_FIRST(&conn->imsg_q);
+        TAILQ_REMOVE(&conn->imsg_q, msg, s_tqe);
+        msg_put(msg);
+    }
+
+    while (!TAILQ_EMPTY(&conn->omsg_q)) {
+        msg = TAILQ_FIRST(&conn->omsg_q);
+        TAILQ_REMOVE(&conn->omsg_q, msg, s_tqe);
+        msg_put(msg);
+    }
+
+    if (conn->rmsg != NULL) {
+        msg_put(conn->rmsg);
+        conn->rmsg = NULL;
+    }
+    conn->smsg = NULL;
+
+    if (conn->sd > 0) {
+        status = close(conn->sd);
+        if (status < 0) {
+            log_error("close s %d failed, ignored: %s", conn->sd,
+                      strerror(errno));
+        }
+    }
+    conn->sd = -1;
+
+    conn->recv_active = 0;
+    conn->recv_ready = 0;
+    conn->send_active = 0;
+    conn->send_ready = 0;
+
+    conn->connecting = 0;
+    conn->connected = 0;
+    conn->eof = 0;
+    conn->done = 0;
+    conn->err = 0;
+}
+
+static void
+health_success(struct context *ctx, struct conn *conn)
+{
+    rstatus_t status;
+    struct server *server = conn->owner;
+    struct server_pool *pool = server->owner;
+
+    server->health_failures = 0;
+
+    /* restore server ejected on failed health checks or on failed traffic */
+    if (server->unhealthy || server->next_retry != 0LL) {
+        server->unhealthy = 0;
+        server->failure_count = 0;
+        server->next_retry = 0LL;
+
+        log_debug(LOG_NOTICE, "update pool %"PRIu32" '%.*s' to restore "
+                  "healthy server '%.*s'", pool->idx, pool->name.len,
+                  pool->name.data, server->pname.len, server->pname.data);
+
+        status = server_pool_run(pool);
+        if (status != NC_OK) {
+            log_error("updating pool %"PRIu32" '%.*s' failed: %s", pool->idx,
+                      pool->name.len, pool->name.data, strerror(errno));
+        }
+    }
+
+    conn_tmo_insert(conn, health_delay(pool, 0));
+}
+
+static void
+health_failure(struct context *ctx, struct conn *conn)
+{
+    rstatus_t status;
+    struct server *server = conn->owner;
+    struct server_pool *pool = server->owner;
+    int64_t now;
+
+    server->health_failures++;
+
+    stats_server_incr(ctx, server, health_failures);
+
+    log_debug(LOG_VERB, "server '%.*s' health check failure count %"PRIu32
+              " limit %"PRIu32, server->pname.len, server->pname.data,
+              server->health_failures, pool->server_failure_limit);
+
+    if (pool->auto_eject_hosts && !server->unhealthy &&
+        server->health_failures >= pool->server_failure_limit) {
+
+        now = nc_usec_now();
+        if (now > 0) {
+            stats_server_set_ts(ctx, server, server_ejected_at, now);
+        }
+
+        log_debug(LOG_NOTICE, "update pool %"PRIu32" '%.*s' to delete "
+                  "unhealthy server '%.*s'", pool->idx, pool->name.len,
+                  pool->name.data, server->pname.len, server->pname.data);
+
+        stats_pool_incr(ctx, pool, server_ejects);
+
+        /* unhealthy server stays ejected till it passes a health check */
+        server->unhealthy = 1;
+        server->failure_count = 0;
+        server->next_retry = INT64_MAX;
+
+        status = server_pool_run(pool);
+        if (status != NC_OK) {
+            log_error("updating pool %"PRIu32" '%.*s' failed: %s", pool->idx,
+                      pool->name.len, pool->name.data, strerror(errno));
+        }
+    }
+
+    conn_tmo_insert(conn, health_delay(pool, server->health_failures));
+}
+
+struct msg *
+health_recv_next(struct context *ctx, struct conn *conn, bool alloc)
+{
+    struct msg *msg;
+
+    ASSERT(conn->health);
+
+    if (conn->eof) {
+        msg = conn->rmsg;
+        if (msg != NULL) {
+            conn->rmsg = NULL;
+            msg_put(msg);
+        }
+
+        conn->done = 1;
+
+        return NULL;
+    }
+
+    msg = conn->rmsg;
+    if (msg != NULL) {
+        return msg;
+    }
+
+    if (!alloc) {
+        return NULL;
+    }
+
+    msg = msg_get(conn, false, conn->redis);
+    if (msg == NULL) {
+        conn->err = errno;
+        return NULL;
+    }
+    conn->rmsg = msg;
+
+    return msg;
+}
+
+void
+health_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
+                 struct msg *nmsg)
+{
+    struct msg *pmsg; /* probe message (request) */
+    bool ok;
+
+    ASSERT(conn->health);
+    ASSERT(msg != NULL && conn->rmsg == msg);
+
+    conn->rmsg = nmsg;
+
+    if (msg_empty(msg)) {
+        msg_put(msg);
+        return;
+    }
+
+    pmsg = TAILQ_FIRST(&conn->omsg_q);
+    if (pmsg == NULL) {
+        log_debug(LOG_ERR, "health check stray rsp %"PRIu64" len %"PRIu32
+                  " on s %d", msg->id, msg->mlen, conn->sd);
+        msg_put(msg);
+        conn->err = EINVAL;
+        conn->done = 1;
+        return;
+    }
+    TAILQ_REMOVE(&conn->omsg_q, pmsg, s_tqe);
+    msg_put(pmsg);
+
+    if (conn->redis) {
+        ok = msg->type == MSG_RSP_REDIS_STATUS ? true : false;
+    } else {
+        ok = msg->type == MSG_RSP_MC_VERSION ? true : false;
+    }
+
+    log_debug(LOG_VERB, "health check rsp %"PRIu64" type %d on s %d is %s",
+              msg->id, msg->type, conn->sd, ok ? "ok" : "invalid");
+
+    msg_put(msg);
+
+    if (!ok) {
+        conn->err = EINVAL;
+        conn->done = 1;
+        return;
+    }
+
+    health_success(ctx, conn);
+}
+
+struct msg *
+health_send_next(struct context *ctx, struct conn *conn)
+{
+    rstatus_t status;
+    struct msg *msg, *nmsg; /* current and next message */
+
+    ASSERT(conn->health);
+
+    if (conn->connecting) {
+        conn->connecting = 0;
+        conn->connected = 1;
+    }
+
+    nmsg = TAILQ_FIRST(&conn->imsg_q);
+    if (nmsg == NULL) {
+        status = event_del_out(ctx->evb, conn);
+        if (status != NC_OK) {
+            conn->err = errno;
+        }
+
+        return NULL;
+    }
+
+    msg = conn->smsg;
+    if (msg != NULL) {
+        nmsg = TAILQ_NEXT(msg, s_tqe);
+    }
+
+    conn->smsg = nmsg;
+
+    return nmsg;
+}
+
+void
+health_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    ASSERT(conn->health);
+    ASSERT(msg != NULL && conn->smsg == NULL);
+
+    TAILQ_REMOVE(&conn->imsg_q, msg, s_tqe);
+    TAILQ_INSERT_TAIL(&conn->omsg_q, msg, s_tqe);
+}
+
+void
+health_close(struct context *ctx, struct conn *conn)
+{
+    ASSERT(conn->health);
+
+    log_debug(LOG_INFO, "health check on s %d failed: %s", conn->sd,
+              conn->err ? strerror(conn->err) : "eof");
+
+    conn_tmo_delete(conn);
+
+    health_reset(conn);
+
+    health_failure(ctx, conn);
+}
+
+/*
+ * Send a probe on the health check connection, when its timer fires. Return
+ * NC_ERROR, if the connection should be closed instead, either because the
+ * previous probe is still outstanding or because the probe could not be
+ * sent.
+ */
+rstatus_t
+health_probe(struct context *ctx, struct conn *conn)
+{
+    rstatus_t status;
+    struct server *server = conn->owner;
+    struct server_pool *pool = server->owner;
+    struct msg *msg;
+    struct mbuf *mbuf;
+    char *probe;
+    size_t len;
+    int timeout;
+
+    ASSERT(conn->health);
+
+    if (health_active(conn)) {
+        log_debug(LOG_INFO, "health check on s %d to server '%.*s' timedout",
+                  conn->sd, server->pname.len, server->pname.data);
+        conn->err = ETIMEDOUT;
+        return NC_ERROR;
+    }
+
+    if (conn->sd < 0) {
+        status = server_connect(ctx, server, conn);
+        if (status != NC_OK) {
+            if (conn->sd < 0) {
+                health_close(ctx, conn);
+                return NC_OK;
+            }
+            return status;
+        }
+    }
+
+    msg = msg_get(conn, true, conn->redis);
+    if (msg == NULL) {
+        conn->err = errno;
+        return NC_ENOMEM;
+    }
+
+    mbuf = mbuf_get();
+    if (mbuf == NULL) {
+        msg_put(msg);
+        conn->err = errno;
+        return NC_ENOMEM;
+    }
+    mbuf_insert(&msg->mhdr, mbuf);
+
+    if (conn->redis) {
+        probe = HEALTH_PROBE_REDIS;
+        len = sizeof(HEALTH_PROBE_REDIS) - 1;
+    } else {
+        probe = HEALTH_PROBE_MC;
+        len = sizeof(HEALTH_PROBE_MC) - 1;
+    }
+    mbuf_copy(mbuf, (uint8_t *)probe, len);
+    msg->mlen = (uint32_t)len;
+
+    status = event_add_out(ctx->evb, conn);
+    if (status != NC_OK) {
+        msg_put(msg);
+        conn->err = errno;
+        return status;
+    }
+    TAILQ_INSERT_TAIL(&conn->imsg_q, msg, s_tqe);
+
+    /* reply to the probe is due before the next check */
+    timeout = pool->timeout > 0 ? MIN(pool->timeout, pool->health_check_interval) :
+              pool->health_check_interval;
+    conn_tmo_insert(conn, timeout);
+
+    stats_server_incr(ctx, server, health_checks);
+
+    log_debug(LOG_VERB, "health check req %"PRIu64" on s %d to server '%.*s'",
+              msg->id, conn->sd, server->pname.len, server->pname.data);
+
+    return NC_OK;
+}
+
+static rstatus_t
+health_each_init(void *elem, void *data)
+{
+    struct server *server = elem;
+    struct server_pool *pool = server->owner;
+    struct context *ctx = data;
+    struct conn *conn;
+    int delay;
+
+    conn = conn_get_health(server);
+    if (conn == NULL) {
+        return NC_ENOMEM;
+    }
+
+    delay = health_delay(pool, 0);
+    conn_tmo_insert(conn, delay);
+
+    /* wake up the event loop in time for the first check */
+    ctx->timeout = MIN(ctx->timeout, delay);
+
+    return NC_OK;
+}
+
+static rstatus_t
+health_pool_each_init(void *elem, void *data)
+{
+    struct server_pool *sp = elem;
+
+    if (sp->health_check_interval <= 0) {
+        return NC_OK;
+    }
+
+    return array_each(&sp->server, health_each_init, data);
+}
+
+rstatus_t
+health_init(struct context *ctx)
+{
+    rstatus_t status;
+
+    status = array_each(&ctx->pool, health_pool_each_init, ctx);
+    if (status != NC_OK) {
+        health_deinit(ctx);
+        return status;
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+health_each_deinit(void *elem, void *data)
+{
+    struct server *server = elem;
+    struct context *ctx = data;
+    struct conn *conn;
+    rstatus_t status;
+
+    conn = server->health_conn;
+    if (conn == NULL) {
+        return NC_OK;
+    }
+
+    if (conn->sd > 0) {
+        status = event_del_conn(ctx->evb, conn);
+        if (status < 0) {
+            log_warn("event del conn s %d failed, ignored: %s", conn->sd,
+                     strerror(errno));
+        }
+    }
+
+    conn_tmo_delete(conn);
+    health_reset(conn);
+
+    conn->unref(conn);
+    conn_put(conn);
+
+    return NC_OK;
+}
+
+/*
+ * Stop the health checks of server, which a reload retired
+ */
+void
+health_server_deinit(struct context *ctx, struct server *server)
+{
+    health_each_deinit(server, ctx);
+}
+
+/*
+ * Bring the health checks of pool sp in line with its reloaded
+ * 'health_check_interval:'. Servers that have no health check connection
+ * get one, or, with health checks turned off, the connections are closed
+ * and servers that were ejected as unhealthy are restored.
+ */
+rstatus_t
+health_pool_reload(struct context *ctx, struct server_pool *sp)
+{
+    rstatus_t status;
+    uint32_t i, nserver;
+
+    for (i = 0, nserver = array_n(&sp->server); i < nserver; i++) {
+        struct server *server = array_get(&sp->server, i);
+
+        if (sp->health_check_interval > 0) {
+            if (server->health_conn != NULL) {
+                continue;
+            }
+
+            status = health_each_init(server, ctx);
+            if (status != NC_OK) {
+                return status;
+            }
+            continue;
+        }
+
+        health_each_deinit(server, ctx);
+
+        server->health_failures = 0;
+        if (server->unhealthy) {
+            server->unhealthy = 0;
+            server->failure_count = 0;
+            server->next_retry = 0LL;
+        }
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+health_pool_each_deinit(void *elem, void *data)
+{
+    struct server_pool *sp = elem;
+
+    return array_each(&sp->server, health_each_deinit, data);
+}
+
+void
+health_deinit(struct context *ctx)
+{
+    array_each(&ctx->pool, health_pool_each_deinit, ctx);
+}
@@ -0,0 +1,43 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_HEALTH_H_
+#define _NC_HEALTH_H_
+
+#include <nc_core.h>
+
+#define HEALTH_MAX_BACKOFF  10  /* max # times the check interval is doubled */
+
+#define HEALTH_PROBE_MC     "version\r\n"
+#define HEALTH_PROBE_REDIS  "*1\r\n$4\r\nPING\r\n"
+
+void health_ref(struct conn *conn, void *owner);
+void health_unref(struct conn *conn);
+bool health_active(struct conn *conn);
+struct msg *health_recv_next(struct context *ctx, struct conn *conn, bool alloc);
+void health_recv_done(struct context *ctx, struct conn *conn, struct msg *msg, struct msg *nmsg);
+struct msg *health_send_next(struct context *ctx, struct conn *conn);
+void health_send_done(struct context *ctx, struct conn *conn, struct msg *msg);
+void health_close(struct context *ctx, struct conn *conn);
+rstatus_t health_probe(struct context *ctx, struct conn *conn);
+
+rstatus_t health_init(struct context *ctx);
+void health_deinit(struct context *ctx);
+rstatus_t health_pool_reload(struct context *ctx, struct server_pool *sp);
+void health_server_deinit(struct context *ctx, struct server *server);
+
+#endif
@@ -109,12 +109,21 @@
  * server.
  */
 
+#define DEFINE_ACTION(_type, _name) string(_name),
+static struct string msg_type_strings[] = {
+    MSG_TYPE_CODEC( DEFINE_ACTION )
+    null_string
+};
+#undef DEFINE_ACTION
+
 static uint64_t msg_id;          /* message id counter */
 static uint64_t frag_id;         /* fragment id counter */
 static uint32_t nfree_msgq;      /* # free msg q */
 static struct msg_tqh free_msgq; /* free msg q */
 static struct rbtree tmo_rbt;    /* timeout rbtree */
 static struct rbnode tmo_rbs;    /* timeout rbtree sentinel */
+static struct rbtree hedge_rbt;  /* hedge rbtree */
+static struct rbnode hedge_rbs;  /* hedge rbtree sentinel */
 
 static struct msg *
 msg_from_rbe(struct rbnode *node)
@@ -150,7 +159,7 @@ msg_tmo_insert(struct msg *msg, struct conn *conn)
     ASSERT(msg->request);
     ASSERT(!msg->quit && !msg->noreply);
 
-    timeout = server_timeout(conn);
+    timeout = server_timeout(conn, msg);
     if (timeout <= 0) {
         return;
     }
@@ -183,6 +192,67 @@ msg_tmo_delete(struct msg *msg)
     log_debug(LOG_VERB, "delete msg %"PRIu64" from tmo rbt", msg->id);
 }
 
+static struct msg *
+msg_from_hedge_rbe(struct rbnode *node)
+{
+    struct msg *msg;
+    int offset;
+
+    offset = offsetof(struct msg, hedge_rbe);
+    msg = (struct msg *)((char *)node - offset);
+
+    return msg;
+}
+
+struct msg *
+msg_hedge_min(void)
+{
+    struct rbnode *node;
+
+    node = rbtree_min(&hedge_rbt);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    return msg_from_hedge_rbe(node);
+}
+
+void
+msg_hedge_insert(struct msg *msg, struct conn *conn, int delay)
+{
+    struct rbnode *node;
+
+    ASSERT(msg->request);
+    ASSERT(delay > 0);
+
+    node = &msg->hedge_rbe;
+    node->key = nc_msec_now() + delay;
+    node->data = conn;
+
+    rbtree_insert(&hedge_rbt, node);
+
+    log_debug(LOG_VERB, "insert msg %"PRIu64" into hedge rbt with delay of "
+              "%d msec", msg->id, delay);
+}
+
+void
+msg_hedge_delete(struct msg *msg)
+{
+    struct rbnode *node;
+
+    node = &msg->hedge_rbe;
+
+    /* already deleted */
+
+    if (node->data == NULL) {
+        return;
+    }
+
+    rbtree_delete(&hedge_rbt, node);
+
+    log_debug(LOG_VERB, "delete msg %"PRIu64" from hedge rbt", msg->id);
+}
+
 static struct msg *
 _msg_get(void)
 {
@@ -207,8 +277,14 @@ done:
     msg->id = ++msg_id;
     msg->peer = NULL;
     msg->owner = NULL;
+    msg->server = NULL;
 
     rbtree_node_init(&msg->tmo_rbe);
+    msg->start_ts = 0LL;
+    msg->send_ts = 0LL;
+    rbtree_node_init(&msg->hedge_rbe);
+    msg->hedge = NULL;
+    msg->hedge_conn = NULL;
 
     STAILQ_INIT(&msg->mhdr);
     msg->mlen = 0;
@@ -237,6 +313,13 @@ done:
     msg->nfrag = 0;
     msg->frag_id = 0;
 
+    msg->replica_owner = NULL;
+    msg->nreplica = 0;
+    msg->nreplica_out = 0;
+    msg->nreplica_ack = 0;
+    msg->nreplica_ok = 0;
+    msg->nreplica_err = 0;
+
     msg->narg_start = NULL;
     msg->narg_end = NULL;
     msg->narg = 0;
@@ -255,7 +338,15 @@ done:
     msg->first_fragment = 0;
     msg->last_fragment = 0;
     msg->swallow = 0;
+    msg->expired = 0;
+    msg->retried = 0;
+    msg->hedge_copy = 0;
+    msg->batch = 0;
+    msg->scheduled = 0;
     msg->redis = 0;
+    msg->timed = 0;
+    msg->sampled = 0;
+    msg->replica_put = 0;
 
     return msg;
 }
@@ -390,6 +481,7 @@ msg_init(void)
     nfree_msgq = 0;
     TAILQ_INIT(&free_msgq);
     rbtree_init(&tmo_rbt, &tmo_rbs);
+    rbtree_init(&hedge_rbt, &hedge_rbs);
 }
 
 void
@@ -406,12 +498,51 @@ msg_deinit(void)
     ASSERT(nfree_msgq == 0);
 }
 
+/*
+ * Return the name of message type, the command name for requests
+ */
+struct string *
+msg_type_string(msg_type_t type)
+{
+    ASSERT(type >= MSG_UNKNOWN && type < MSG_SENTINEL);
+
+    return &msg_type_strings[type];
+}
+
 bool
 msg_empty(struct msg *msg)
 {
     return msg->mlen == 0 ? true : false;
 }
 
+/*
+ * Time the stages of request msg received on client connection conn,
+ * starting at its first byte read, when the pool keeps a slowlog or when
+ * it is one in every stage_sampling requests to be kept in stage stats
+ */
+static void
+msg_sample(struct conn *conn, struct msg *msg)
+{
+    struct server_pool *pool = conn->owner;
+
+    ASSERT(conn->client && !conn->proxy);
+    ASSERT(msg->request);
+
+    if (pool->stage_sampling != 0 &&
+        ++pool->stage_count >= pool->stage_sampling) {
+        pool->stage_count = 0;
+        msg->sampled = 1;
+    }
+
+    if (!msg->sampled && pool->slowlog_slower_than == 0) {
+        return;
+    }
+
+    msg->timed = 1;
+    memset(msg->stamp, 0, sizeof(msg->stamp));
+    msg->stamp[MSG_STAMP_RECV] = nc_usec_mono();
+}
+
 static rstatus_t
 msg_parsed(struct context *ctx, struct conn *conn, struct msg *msg)
 {
@@ -448,6 +579,10 @@ msg_parsed(struct context *ctx, struct conn *conn, struct msg *msg)
     nmsg->mlen = mbuf_length(nbuf);
     msg->mlen -= nmsg->mlen;
 
+    if (conn->client) {
+        msg_sample(conn, nmsg);
+    }
+
     conn->recv_done(ctx, conn, msg, nmsg);
 
     return NC_OK;
@@ -538,6 +673,12 @@ msg_fragment(struct context *ctx, struct conn *conn, struct msg *msg)
     nmsg->frag_owner = msg->frag_owner;
     msg->frag_owner->nfrag++;
 
+    if (msg->timed) {
+        nmsg->timed = 1;
+        nmsg->sampled = msg->sampled;
+        nc_memcpy(nmsg->stamp, msg->stamp, sizeof(nmsg->stamp));
+    }
+
     stats_pool_incr(ctx, conn->owner, fragments);
 
     log_debug(LOG_VERB, "fragment msg into %"PRIu64" and %"PRIu64" frag id "
@@ -636,6 +777,10 @@ msg_recv_chain(struct context *ctx, struct conn *conn, struct msg *msg)
     mbuf->last += n;
     msg->mlen += (uint32_t)n;
 
+    if (conn->client && msg->mlen == (uint32_t)n) {
+        msg_sample(conn, msg);
+    }
+
     for (;;) {
         status = msg_parse(ctx, conn, msg);
         if (status != NC_OK) {
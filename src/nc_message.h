@@ -32,139 +32,180 @@ typedef enum msg_parse_result {
     MSG_PARSE_AGAIN,                      /* incomplete -> parse again */
 } msg_parse_result_t;
 
+typedef enum msg_class {
+    MSG_CLASS_INTERACTIVE,                /* latency sensitive request */
+    MSG_CLASS_BATCH,                      /* bulk request */
+    MSG_NCLASS
+} msg_class_t;
+
+#define MSG_TYPE_CODEC(ACTION)                                                                            \
+    ACTION( UNKNOWN,                     "unknown" )                                                      \
+    ACTION( REQ_MC_GET,                  "get" )          /* memcache retrieval requests */               \
+    ACTION( REQ_MC_GETS,                 "gets" )                                                         \
+    ACTION( REQ_MC_DELETE,               "delete" )       /* memcache delete request */                   \
+    ACTION( REQ_MC_CAS,                  "cas" )          /* memcache cas request and storage request */  \
+    ACTION( REQ_MC_SET,                  "set" )          /* memcache storage request */                  \
+    ACTION( REQ_MC_ADD,                  "add" )                                                          \
+    ACTION( REQ_MC_REPLACE,              "replace" )                                                      \
+    ACTION( REQ_MC_APPEND,               "append" )                                                       \
+    ACTION( REQ_MC_PREPEND,              "prepend" )                                                      \
+    ACTION( REQ_MC_INCR,                 "incr" )         /* memcache arithmetic request */               \
+    ACTION( REQ_MC_DECR,                 "decr" )                                                         \
+    ACTION( REQ_MC_QUIT,                 "quit" )         /* memcache quit request */                     \
+    ACTION( RSP_MC_NUM,                  "num" )          /* memcache arithmetic response */              \
+    ACTION( RSP_MC_STORED,               "stored" )       /* memcache cas and storage response */         \
+    ACTION( RSP_MC_NOT_STORED,           "not_stored" )                                                   \
+    ACTION( RSP_MC_EXISTS,               "exists" )                                                       \
+    ACTION( RSP_MC_NOT_FOUND,            "not_found" )                                                    \
+    ACTION( RSP_MC_END,                  "end" )                                                          \
+    ACTION( RSP_MC_VALUE,                "value" )                                                        \
+    ACTION( RSP_MC_DELETED,              "deleted" )      /* memcache delete response */                  \
+    ACTION( RSP_MC_VERSION,              "version" )      /* memcache version response */                 \
+    ACTION( RSP_MC_ERROR,                "error" )        /* memcache error responses */                  \
+    ACTION( RSP_MC_CLIENT_ERROR,         "client_error" )                                                 \
+    ACTION( RSP_MC_SERVER_ERROR,         "server_error" )                                                 \
+    ACTION( REQ_REDIS_DEL,               "del" )          /* redis commands - keys */                     \
+    ACTION( REQ_REDIS_EXISTS,            "exists" )                                                       \
+    ACTION( REQ_REDIS_EXPIRE,            "expire" )                                                       \
+    ACTION( REQ_REDIS_EXPIREAT,          "expireat" )                                                     \
+    ACTION( REQ_REDIS_PEXPIRE,           "pexpire" )                                                      \
+    ACTION( REQ_REDIS_PEXPIREAT,         "pexpireat" )                                                    \
+    ACTION( REQ_REDIS_PERSIST,           "persist" )                                                      \
+    ACTION( REQ_REDIS_PTTL,              "pttl" )                                                         \
+    ACTION( REQ_REDIS_TTL,               "ttl" )                                                          \
+    ACTION( REQ_REDIS_TYPE,              "type" )                                                         \
+    ACTION( REQ_REDIS_APPEND,            "append" )       /* redis requests - string */                   \
+    ACTION( REQ_REDIS_BITCOUNT,          "bitcount" )                                                     \
+    ACTION( REQ_REDIS_DECR,              "decr" )                                                         \
+    ACTION( REQ_REDIS_DECRBY,            "decrby" )                                                       \
+    ACTION( REQ_REDIS_DUMP,              "dump" )                                                         \
+    ACTION( REQ_REDIS_GET,               "get" )                                                          \
+    ACTION( REQ_REDIS_GETBIT,            "getbit" )                                                       \
+    ACTION( REQ_REDIS_GETRANGE,          "getrange" )                                                     \
+    ACTION( REQ_REDIS_GETSET,            "getset" )                                                       \
+    ACTION( REQ_REDIS_INCR,              "incr" )                                                         \
+    ACTION( REQ_REDIS_INCRBY,            "incrby" )                                                       \
+    ACTION( REQ_REDIS_INCRBYFLOAT,       "incrbyfloat" )                                                  \
+    ACTION( REQ_REDIS_MGET,              "mget" )                                                         \
+    ACTION( REQ_REDIS_PSETEX,            "psetex" )                                                       \
+    ACTION( REQ_REDIS_RESTORE,           "restore" )                                                      \
+    ACTION( REQ_REDIS_SET,               "set" )                                                          \
+    ACTION( REQ_REDIS_SETBIT,            "setbit" )                                                       \
+    ACTION( REQ_REDIS_SETEX,             "setex" )                                                        \
+    ACTION( REQ_REDIS_SETNX,             "setnx" )                                                        \
+    ACTION( REQ_REDIS_SETRANGE,          "setrange" )                                                     \
+    ACTION( REQ_REDIS_STRLEN,            "strlen" )                                                       \
+    ACTION( REQ_REDIS_HDEL,              "hdel" )         /* redis requests - hashes */                   \
+    ACTION( REQ_REDIS_HEXISTS,           "hexists" )                                                      \
+    ACTION( REQ_REDIS_HGET,              "hget" )                                                         \
+    ACTION( REQ_REDIS_HGETALL,           "hgetall" )                                                      \
+    ACTION( REQ_REDIS_HINCRBY,           "hincrby" )                                                      \
+    ACTION( REQ_REDIS_HINCRBYFLOAT,      "hincrbyfloat" )                                                 \
+    ACTION( REQ_REDIS_HKEYS,             "hkeys" )                                                        \
+    ACTION( REQ_REDIS_HLEN,              "hlen" )                                                         \
+    ACTION( REQ_REDIS_HMGET,             "hmget" )                                                        \
+    ACTION( REQ_REDIS_HMSET,             "hmset" )                                                        \
+    ACTION( REQ_REDIS_HSET,              "hset" )                                                         \
+    ACTION( REQ_REDIS_HSETNX,            "hsetnx" )                                                       \
+    ACTION( REQ_REDIS_HVALS,             "hvals" )                                                        \
+    ACTION( REQ_REDIS_LINDEX,            "lindex" )       /* redis requests - lists */                    \
+    ACTION( REQ_REDIS_LINSERT,           "linsert" )                                                      \
+    ACTION( REQ_REDIS_LLEN,              "llen" )                                                         \
+    ACTION( REQ_REDIS_LPOP,              "lpop" )                                                         \
+    ACTION( REQ_REDIS_LPUSH,             "lpush" )                                                        \
+    ACTION( REQ_REDIS_LPUSHX,            "lpushx" )                                                       \
+    ACTION( REQ_REDIS_LRANGE,            "lrange" )                                                       \
+    ACTION( REQ_REDIS_LREM,              "lrem" )                                                         \
+    ACTION( REQ_REDIS_LSET,              "lset" )                                                         \
+    ACTION( REQ_REDIS_LTRIM,             "ltrim" )                                                        \
+    ACTION( REQ_REDIS_RPOP,              "rpop" )                                                         \
+    ACTION( REQ_REDIS_RPOPLPUSH,         "rpoplpush" )                                                    \
+    ACTION( REQ_REDIS_RPUSH,             "rpush" )                                                        \
+    ACTION( REQ_REDIS_RPUSHX,            "rpushx" )                                                       \
+    ACTION( REQ_REDIS_SADD,              "sadd" )         /* redis requests - sets */                     \
+    ACTION( REQ_REDIS_SCARD,             "scard" )                                                        \
+    ACTION( REQ_REDIS_SDIFF,             "sdiff" )                                                        \
+    ACTION( REQ_REDIS_SDIFFSTORE,        "sdiffstore" )                                                   \
+    ACTION( REQ_REDIS_SINTER,            "sinter" )                                                       \
+    ACTION( REQ_REDIS_SINTERSTORE,       "sinterstore" )                                                  \
+    ACTION( REQ_REDIS_SISMEMBER,         "sismember" )                                                    \
+    ACTION( REQ_REDIS_SMEMBERS,          "smembers" )                                                     \
+    ACTION( REQ_REDIS_SMOVE,             "smove" )                                                        \
+    ACTION( REQ_REDIS_SPOP,              "spop" )                                                         \
+    ACTION( REQ_REDIS_SRANDMEMBER,       "srandmember" )                                                  \
+    ACTION( REQ_REDIS_SREM,              "srem" )                                                         \
+    ACTION( REQ_REDIS_SUNION,            "sunion" )                                                       \
+    ACTION( REQ_REDIS_SUNIONSTORE,       "sunionstore" )                                                  \
+    ACTION( REQ_REDIS_ZADD,              "zadd" )         /* redis requests - sorted sets */              \
+    ACTION( REQ_REDIS_ZCARD,             "zcard" )                                                        \
+    ACTION( REQ_REDIS_ZCOUNT,            "zcount" )                                                       \
+    ACTION( REQ_REDIS_ZINCRBY,           "zincrby" )                                                      \
+    ACTION( REQ_REDIS_ZINTERSTORE,       "zinterstore" )                                                  \
+    ACTION( REQ_REDIS_ZRANGE,            "zrange" )                                                       \
+    ACTION( REQ_REDIS_ZRANGEBYSCORE,     "zrangebyscore" )                                                \
+    ACTION( REQ_REDIS_ZRANK,             "zrank" )                                                        \
+    ACTION( REQ_REDIS_ZREM,              "zrem" )                                                         \
+    ACTION( REQ_REDIS_ZREMRANGEBYRANK,   "zremrangebyrank" )                                              \
+    ACTION( REQ_REDIS_ZREMRANGEBYSCORE,  "zremrangebyscore" )                                             \
+    ACTION( REQ_REDIS_ZREVRANGE,         "zrevrange" )                                                    \
+    ACTION( REQ_REDIS_ZREVRANGEBYSCORE,  "zrevrangebyscore" )                                             \
+    ACTION( REQ_REDIS_ZREVRANK,          "zrevrank" )                                                     \
+    ACTION( REQ_REDIS_ZSCORE,            "zscore" )                                                       \
+    ACTION( REQ_REDIS_ZUNIONSTORE,       "zunionstore" )                                                  \
+    ACTION( REQ_REDIS_EVAL,              "eval" )         /* redis requests - eval */                     \
+    ACTION( REQ_REDIS_EVALSHA,           "evalsha" )                                                      \
+    ACTION( RSP_REDIS_STATUS,            "status" )       /* redis response */                            \
+    ACTION( RSP_REDIS_ERROR,             "error" )                                                        \
+    ACTION( RSP_REDIS_INTEGER,           "integer" )                                                      \
+    ACTION( RSP_REDIS_BULK,              "bulk" )                                                         \
+    ACTION( RSP_REDIS_MULTIBULK,         "multibulk" )                                                    \
+
+#define DEFINE_ACTION(_type, _name) MSG_##_type,
 typedef enum msg_type {
-    MSG_UNKNOWN,
-    MSG_REQ_MC_GET,                       /* memcache retrieval requests */
-    MSG_REQ_MC_GETS,
-    MSG_REQ_MC_DELETE,                    /* memcache delete request */
-    MSG_REQ_MC_CAS,                       /* memcache cas request and storage request */
-    MSG_REQ_MC_SET,                       /* memcache storage request */
-    MSG_REQ_MC_ADD,
-    MSG_REQ_MC_REPLACE,
-    MSG_REQ_MC_APPEND,
-    MSG_REQ_MC_PREPEND,
-    MSG_REQ_MC_INCR,                      /* memcache arithmetic request */
-    MSG_REQ_MC_DECR,
-    MSG_REQ_MC_QUIT,                      /* memcache quit request */
-    MSG_RSP_MC_NUM,                       /* memcache arithmetic response */
-    MSG_RSP_MC_STORED,                    /* memcache cas and storage response */
-    MSG_RSP_MC_NOT_STORED,
-    MSG_RSP_MC_EXISTS,
-    MSG_RSP_MC_NOT_FOUND,
-    MSG_RSP_MC_END,
-    MSG_RSP_MC_VALUE,
-    MSG_RSP_MC_DELETED,                   /* memcache delete response */
-    MSG_RSP_MC_ERROR,                     /* memcache error responses */
-    MSG_RSP_MC_CLIENT_ERROR,
-    MSG_RSP_MC_SERVER_ERROR,
-    MSG_REQ_REDIS_DEL,                    /* redis commands - keys */
-    MSG_REQ_REDIS_EXISTS,
-    MSG_REQ_REDIS_EXPIRE,
-    MSG_REQ_REDIS_EXPIREAT,
-    MSG_REQ_REDIS_PEXPIRE,
-    MSG_REQ_REDIS_PEXPIREAT,
-    MSG_REQ_REDIS_PERSIST,
-    MSG_REQ_REDIS_PTTL,
-    MSG_REQ_REDIS_TTL,
-    MSG_REQ_REDIS_TYPE,
-    MSG_REQ_REDIS_APPEND,                 /* redis requests - string */
-    MSG_REQ_REDIS_BITCOUNT,
-    MSG_REQ_REDIS_DECR,
-    MSG_REQ_REDIS_DECRBY,
-    MSG_REQ_REDIS_DUMP,
-    MSG_REQ_REDIS_GET,
-    MSG_REQ_REDIS_GETBIT,
-    MSG_REQ_REDIS_GETRANGE,
-    MSG_REQ_REDIS_GETSET,
-    MSG_REQ_REDIS_INCR,
-    MSG_REQ_REDIS_INCRBY,
-    MSG_REQ_REDIS_INCRBYFLOAT,
-    MSG_REQ_REDIS_MGET,
-    MSG_REQ_REDIS_PSETEX,
-    MSG_REQ_REDIS_RESTORE,
-    MSG_REQ_REDIS_SET,
-    MSG_REQ_REDIS_SETBIT,
-    MSG_REQ_REDIS_SETEX,
-    MSG_REQ_REDIS_SETNX,
-    MSG_REQ_REDIS_SETRANGE,
-    MSG_REQ_REDIS_STRLEN,
-    MSG_REQ_REDIS_HDEL,                   /* redis requests - hashes */
-    MSG_REQ_REDIS_HEXISTS,
-    MSG_REQ_REDIS_HGET,
-    MSG_REQ_REDIS_HGETALL,
-    MSG_REQ_REDIS_HINCRBY,
-    MSG_REQ_REDIS_HINCRBYFLOAT,
-    MSG_REQ_REDIS_HKEYS,
-    MSG_REQ_REDIS_HLEN,
-    MSG_REQ_REDIS_HMGET,
-    MSG_REQ_REDIS_HMSET,
-    MSG_REQ_REDIS_HSET,
-    MSG_REQ_REDIS_HSETNX,
-    MSG_REQ_REDIS_HVALS,
-    MSG_REQ_REDIS_LINDEX,                 /* redis requests - lists */
-    MSG_REQ_REDIS_LINSERT,
-    MSG_REQ_REDIS_LLEN,
-    MSG_REQ_REDIS_LPOP,
-    MSG_REQ_REDIS_LPUSH,
-    MSG_REQ_REDIS_LPUSHX,
-    MSG_REQ_REDIS_LRANGE,
-    MSG_REQ_REDIS_LREM,
-    MSG_REQ_REDIS_LSET,
-    MSG_REQ_REDIS_LTRIM,
-    MSG_REQ_REDIS_RPOP,
-    MSG_REQ_REDIS_RPOPLPUSH,
-    MSG_REQ_REDIS_RPUSH,
-    MSG_REQ_REDIS_RPUSHX,
-    MSG_REQ_REDIS_SADD,                   /* redis requests - sets */
-    MSG_REQ_REDIS_SCARD,
-    MSG_REQ_REDIS_SDIFF,
-    MSG_REQ_REDIS_SDIFFSTORE,
-    MSG_REQ_REDIS_SINTER,
-    MSG_REQ_REDIS_SINTERSTORE,
-    MSG_REQ_REDIS_SISMEMBER,
-    MSG_REQ_REDIS_SMEMBERS,
-    MSG_REQ_REDIS_SMOVE,
-    MSG_REQ_REDIS_SPOP,
-    MSG_REQ_REDIS_SRANDMEMBER,
-    MSG_REQ_REDIS_SREM,
-    MSG_REQ_REDIS_SUNION,
-    MSG_REQ_REDIS_SUNIONSTORE,
-    MSG_REQ_REDIS_ZADD,                   /* redis requests - sorted sets */
-    MSG_REQ_REDIS_ZCARD,
-    MSG_REQ_REDIS_ZCOUNT,
-    MSG_REQ_REDIS_ZINCRBY,
-    MSG_REQ_REDIS_ZINTERSTORE,
-    MSG_REQ_REDIS_ZRANGE,
-    MSG_REQ_REDIS_ZRANGEBYSCORE,
-    MSG_REQ_REDIS_ZRANK,
-    MSG_REQ_REDIS_ZREM,
-    MSG_REQ_REDIS_ZREMRANGEBYRANK,
-    MSG_REQ_REDIS_ZREMRANGEBYSCORE,
-    MSG_REQ_REDIS_ZREVRANGE,
-    MSG_REQ_REDIS_ZREVRANGEBYSCORE,
-    MSG_REQ_REDIS_ZREVRANK,
-    MSG_REQ_REDIS_ZSCORE,
-    MSG_REQ_REDIS_ZUNIONSTORE,
-    MSG_REQ_REDIS_EVAL,                   /* redis requests - eval */
-    MSG_REQ_REDIS_EVALSHA,
-    MSG_RSP_REDIS_STATUS,                 /* redis response */
-    MSG_RSP_REDIS_ERROR,
-    MSG_RSP_REDIS_INTEGER,
-    MSG_RSP_REDIS_BULK,
-    MSG_RSP_REDIS_MULTIBULK,
+    MSG_TYPE_CODEC( DEFINE_ACTION )
     MSG_SENTINEL
 } msg_type_t;
+#undef DEFINE_ACTION
+
+/*
+ * Points in the life of a request that a timed request is timestamped at,
+ * in the order they are reached
+ */
+typedef enum msg_stamp {
+    MSG_STAMP_RECV,                       /* first byte read */
+    MSG_STAMP_PARSED,                     /* request parsed */
+    MSG_STAMP_ENQUEUED,                   /* enqueued to server */
+    MSG_STAMP_SENT,                       /* written to server */
+    MSG_STAMP_RSP_PARSED,                 /* response parsed */
+    MSG_STAMP_COALESCED,                  /* response coalesced */
+    MSG_STAMP_DONE,                       /* response written to client */
+    MSG_NSTAMP
+} msg_stamp_t;
+
+#define msg_stamp(_msg, _stamp) do {                            \
+    if ((_msg)->timed) {                                        \
+        (_msg)->stamp[MSG_STAMP_##_stamp] = nc_usec_mono();     \
+    }                                                           \
+} while (0)
 
 struct msg {
     TAILQ_ENTRY(msg)     c_tqe;           /* link in client q */
     TAILQ_ENTRY(msg)     s_tqe;           /* link in server q */
     TAILQ_ENTRY(msg)     m_tqe;           /* link in send q / free q */
+    TAILQ_ENTRY(msg)     w_tqe;           /* link in server class q */
 
     uint64_t             id;              /* message id */
     struct msg           *peer;           /* message peer */
     struct conn          *owner;          /* message owner - client | server */
+    struct server        *server;         /* server request is routed to */
 
     struct rbnode        tmo_rbe;         /* entry in rbtree */
+    int64_t              start_ts;        /* forward start timestamp in usec */
+    int64_t              send_ts;         /* send done timestamp in usec */
+    struct rbnode        hedge_rbe;       /* entry in hedge rbtree */
+    struct msg           *hedge;          /* hedged request peer */
+    struct conn          *hedge_conn;     /* server conn of hedged request (copy) */
+    int64_t              stamp[MSG_NSTAMP]; /* stage timestamps in usec (timed) */
 
     struct mhdr          mhdr;            /* message mbuf header */
     uint32_t             mlen;            /* message length */
@@ -200,6 +241,13 @@ struct msg {
     uint32_t             nfrag;           /* # fragment */
     uint64_t             frag_id;         /* id of fragmented message */
 
+    struct msg           *replica_owner;  /* owner of replica message */
+    uint32_t             nreplica;        /* # replica */
+    uint32_t             nreplica_out;    /* # replica outstanding */
+    uint32_t             nreplica_ack;    /* # replica acks needed */
+    uint32_t             nreplica_ok;     /* # replica succeeded */
+    uint32_t             nreplica_err;    /* # replica failed */
+
     err_t                err;             /* errno on error? */
     unsigned             error:1;         /* error? */
     unsigned             ferror:1;        /* one or more fragments are in error? */
@@ -211,7 +259,15 @@ struct msg {
     unsigned             first_fragment:1;/* first fragment? */
     unsigned             last_fragment:1; /* last fragment? */
     unsigned             swallow:1;       /* swallow response? */
+    unsigned             expired:1;       /* timed out in server q? */
+    unsigned             retried:1;       /* retried? */
+    unsigned             hedge_copy:1;    /* copy of hedged request? */
+    unsigned             batch:1;         /* batch class? */
+    unsigned             scheduled:1;     /* scheduled to be sent? */
     unsigned             redis:1;         /* redis? */
+    unsigned             timed:1;         /* stages timestamped? */
+    unsigned             sampled:1;       /* stages kept in stats? */
+    unsigned             replica_put:1;   /* put with replica outstanding? */
 };
 
 TAILQ_HEAD(msg_tqh, msg);
@@ -219,9 +275,13 @@ TAILQ_HEAD(msg_tqh, msg);
 struct msg *msg_tmo_min(void);
 void msg_tmo_insert(struct msg *msg, struct conn *conn);
 void msg_tmo_delete(struct msg *msg);
+struct msg *msg_hedge_min(void);
+void msg_hedge_insert(struct msg *msg, struct conn *conn, int delay);
+void msg_hedge_delete(struct msg *msg);
 
 void msg_init(void);
 void msg_deinit(void);
+struct string *msg_type_string(msg_type_t type);
 struct msg *msg_get(struct conn *conn, bool request, bool redis);
 void msg_put(struct msg *msg);
 struct msg *msg_get_error(bool redis, err_t err);
@@ -244,6 +304,16 @@ struct msg *req_recv_next(struct context *ctx, struct conn *conn, bool alloc);
 void req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg, struct msg *nmsg);
 struct msg *req_send_next(struct context *ctx, struct conn *conn);
 void req_send_done(struct context *ctx, struct conn *conn, struct msg *msg);
+bool req_read(struct msg *msg);
+void req_unhedge(struct msg *msg);
+bool req_retry(struct context *ctx, struct msg *msg);
+void req_reforward(struct context *ctx, struct msg *msg);
+rstatus_t req_flush(struct context *ctx, struct conn *conn);
+void req_queue_timeout(struct context *ctx, struct conn *conn);
+rstatus_t req_expire(struct context *ctx, struct conn *conn, struct msg *msg);
+void req_hedge(struct context *ctx, struct conn *conn, struct msg *msg);
+bool req_hedge_won(struct context *ctx, struct msg *hmsg, struct msg *rsp);
+bool req_replica_done(struct context *ctx, struct msg *rmsg, struct msg *rsp);
 
 struct msg *rsp_get(struct conn *conn);
 void rsp_put(struct msg *msg);
@@ -20,6 +20,7 @@
 #include <nc_core.h>
 #include <nc_server.h>
 #include <nc_proxy.h>
+#include <nc_upgrade.h>
 
 void
 proxy_ref(struct conn *conn, void *owner)
@@ -127,25 +128,29 @@ proxy_listen(struct context *ctx, struct conn *p)
 
     ASSERT(p->proxy);
 
-    p->sd = socket(p->family, SOCK_STREAM, 0);
+    /* listening socket handed off by the process we are upgrading from? */
+    p->sd = upgrade_take(ctx, &pool->addrstr);
     if (p->sd < 0) {
-        log_error("socket failed: %s", strerror(errno));
-        return NC_ERROR;
-    }
+        p->sd = socket(p->family, SOCK_STREAM, 0);
+        if (p->sd < 0) {
+            log_error("socket failed: %s", strerror(errno));
+            return NC_ERROR;
+        }
 
-    status = proxy_reuse(p);
-    if (status < 0) {
-        log_error("reuse of addr '%.*s' for listening on p %d failed: %s",
-                  pool->addrstr.len, pool->addrstr.data, p->sd,
-                  strerror(errno));
-        return NC_ERROR;
-    }
+        status = proxy_reuse(p);
+        if (status < 0) {
+            log_error("reuse of addr '%.*s' for listening on p %d failed: %s",
+                      pool->addrstr.len, pool->addrstr.data, p->sd,
+                      strerror(errno));
+            return NC_ERROR;
+        }
 
-    status = bind(p->sd, p->addr, p->addrlen);
-    if (status < 0) {
-        log_error("bind on p %d to addr '%.*s' failed: %s", p->sd,
-                  pool->addrstr.len, pool->addrstr.data, strerror(errno));
-        return NC_ERROR;
+        status = bind(p->sd, p->addr, p->addrlen);
+        if (status < 0) {
+            log_error("bind on p %d to addr '%.*s' failed: %s", p->sd,
+                      pool->addrstr.len, pool->addrstr.data, strerror(errno));
+            return NC_ERROR;
+        }
     }
 
     status = listen(p->sd, pool->backlog);
@@ -17,6 +17,7 @@
 
 #include <nc_core.h>
 #include <nc_server.h>
+#include <proto/nc_proto.h>
 
 struct msg *
 req_get(struct conn *conn)
@@ -33,12 +34,43 @@ req_get(struct conn *conn)
     return msg;
 }
 
+/*
+ * Break the link between a hedged request msg and its copy. The copy of a
+ * request that is still outstanding is left to be swallowed.
+ */
+void
+req_unhedge(struct msg *msg)
+{
+    struct msg *hmsg; /* hedged request peer */
+
+    ASSERT(msg->request);
+
+    hmsg = msg->hedge;
+    if (hmsg == NULL) {
+        return;
+    }
+    ASSERT(hmsg->hedge == msg);
+
+    msg->hedge = NULL;
+    hmsg->hedge = NULL;
+
+    if (msg->hedge_copy) {
+        msg->hedge_conn = NULL;
+        return;
+    }
+
+    hmsg->hedge_conn = NULL;
+    if (!hmsg->done) {
+        hmsg->swallow = 1;
+    }
+}
+
 void
 req_put(struct msg *msg)
 {
     struct msg *pmsg; /* peer message (response) */
 
-    ASSERT(msg->request);
+    ASSERT(msg->request && msg->replica_owner == NULL);
 
     pmsg = msg->peer;
     if (pmsg != NULL) {
@@ -49,6 +81,14 @@ req_put(struct msg *msg)
     }
 
     msg_tmo_delete(msg);
+    msg_hedge_delete(msg);
+    req_unhedge(msg);
+
+    /* replica copies still outstanding refer to msg; the last puts it */
+    if (msg->nreplica_out != 0) {
+        msg->replica_put = 1;
+        return;
+    }
 
     msg_put(msg);
 }
@@ -137,6 +177,17 @@ req_done(struct conn *conn, struct msg *msg)
 
     msg->post_coalesce(msg->frag_owner);
 
+    if (msg->timed) {
+        int64_t now = nc_usec_mono();
+
+        /* every fragment learns the count, for the slowlog of the last */
+        for (cmsg = msg->frag_owner; cmsg != NULL && cmsg->frag_id == id;
+             cmsg = TAILQ_NEXT(cmsg, c_tqe)) {
+            cmsg->stamp[MSG_STAMP_COALESCED] = now;
+            cmsg->nfrag = nfragment;
+        }
+    }
+
     log_debug(LOG_DEBUG, "req from c %d with fid %"PRIu64" and %"PRIu32" "
               "fragments is done", conn->sd, id, nfragment);
 
@@ -225,37 +276,142 @@ ferror:
     return true;
 }
 
+/*
+ * Flush the requests held back on server connection conn, by arming it to
+ * send them. On failure, conn is in error and is to be closed.
+ */
+rstatus_t
+req_flush(struct context *ctx, struct conn *conn)
+{
+    rstatus_t status;
+
+    ASSERT(!conn->client && !conn->proxy);
+
+    conn_flush_delete(conn);
+
+    log_debug(LOG_VERB, "flush %"PRIu32" req of %"PRIu32" bytes on s %d",
+              conn->nflush, conn->nflush_bytes, conn->sd);
+
+    status = event_add_out(ctx->evb, conn);
+    if (status != NC_OK) {
+        conn->err = errno;
+    }
+
+    return status;
+}
+
+/*
+ * Account the arrival of request msg on server connection conn, and flush
+ * the requests held back on it, once they make a batch
+ */
+static void
+req_flush_arrival(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    struct server_pool *pool = ((struct server *)conn->owner)->owner;
+    int64_t gap;
+
+    if (pool->server_flush_delay == 0 || msg->start_ts <= 0) {
+        return;
+    }
+
+    /* moving average of the interarrival time, capped at the delay */
+    if (conn->flush_last == 0) {
+        conn->flush_gap = pool->server_flush_delay;
+    } else {
+        gap = MIN(msg->start_ts - conn->flush_last, pool->server_flush_delay);
+        conn->flush_gap += (gap - conn->flush_gap) / 8;
+    }
+    conn->flush_last = msg->start_ts;
+
+    if (conn->flush_rbe.data == NULL) {
+        return;
+    }
+
+    conn->nflush++;
+    conn->nflush_bytes += msg->mlen;
+
+    if (conn->nflush >= pool->server_flush_requests ||
+        conn->nflush_bytes >= pool->server_flush_bytes) {
+        if (req_flush(ctx, conn) != NC_OK) {
+            /* conn is being queued on; close it on a flush deadline due now */
+            conn_flush_insert(conn, 1);
+        }
+    }
+}
+
 void
 req_server_enqueue_imsgq(struct context *ctx, struct conn *conn, struct msg *msg)
 {
+    struct server *server = conn->owner;
+
     ASSERT(msg->request);
     ASSERT(!conn->client && !conn->proxy);
 
+    msg->server = server_route(conn, msg);
+
     /*
      * timeout clock starts ticking the instant the message is enqueued into
      * the server in_q; the clock continues to tick until it either expires
      * or the message is dequeued from the server out_q
      *
      * noreply request are free from timeouts because client is not intrested
-     * in the reponse anyway!
+     * in the reponse anyway! Neither are copies of hedged requests, as they
+     * live only as long as the request they were copied from
      */
-    if (!msg->noreply) {
+    if (!msg->noreply && !msg->hedge_copy) {
         msg_tmo_insert(msg, conn);
     }
 
+    msg->start_ts = nc_usec_now();
+    msg_stamp(msg, ENQUEUED);
+
     TAILQ_INSERT_TAIL(&conn->imsg_q, msg, s_tqe);
+    server->nrequest++;
+    server->nrequest_bytes += msg->mlen;
+
+    /* deadline of the oldest request in the inq, if none is armed yet */
+    if (server->owner->queue_timeout > 0 && conn->queue_rbe.data == NULL) {
+        conn_queue_insert(conn, msg->start_ts + server->owner->queue_timeout);
+    }
+
+    if (conn->nrequest++ == 0 && !conn->connecting) {
+        /* connection is no longer idle */
+        conn_tmo_delete(conn);
+    }
+
+    /* a class that was idle gets no credit for the time it was idle */
+    if (TAILQ_EMPTY(&conn->wmsg_q[msg->batch])) {
+        conn->vtime[msg->batch] = MAX(conn->vtime[msg->batch],
+                                      conn->vtime[!msg->batch]);
+    }
+    TAILQ_INSERT_TAIL(&conn->wmsg_q[msg->batch], msg, w_tqe);
+    msg->scheduled = 0;
 
     stats_server_incr(ctx, conn->owner, in_queue);
     stats_server_incr_by(ctx, conn->owner, in_queue_bytes, msg->mlen);
+
+    req_flush_arrival(ctx, conn, msg);
 }
 
 void
 req_server_dequeue_imsgq(struct context *ctx, struct conn *conn, struct msg *msg)
 {
+    struct server *server = conn->owner;
+
     ASSERT(msg->request);
     ASSERT(!conn->client && !conn->proxy);
 
     TAILQ_REMOVE(&conn->imsg_q, msg, s_tqe);
+    server->nrequest--;
+    server->nrequest_bytes -= msg->mlen;
+
+    if (--conn->nrequest == 0) {
+        server_idle(conn);
+    }
+
+    if (!msg->scheduled) {
+        TAILQ_REMOVE(&conn->wmsg_q[msg->batch], msg, w_tqe);
+    }
 
     stats_server_decr(ctx, conn->owner, in_queue);
     stats_server_decr_by(ctx, conn->owner, in_queue_bytes, msg->mlen);
@@ -273,10 +429,20 @@ req_client_enqueue_omsgq(struct context *ctx, struct conn *conn, struct msg *msg
 void
 req_server_enqueue_omsgq(struct context *ctx, struct conn *conn, struct msg *msg)
 {
+    struct server *server = conn->owner;
+
     ASSERT(msg->request);
     ASSERT(!conn->client && !conn->proxy);
 
     TAILQ_INSERT_TAIL(&conn->omsg_q, msg, s_tqe);
+    server->nrequest++;
+    server->nrequest_bytes += msg->mlen;
+
+    if (conn->nrequest++ == 0) {
+        /* connection is no longer idle */
+        conn_tmo_delete(conn);
+    }
+    conn->nsent++;
 
     stats_server_incr(ctx, conn->owner, out_queue);
     stats_server_incr_by(ctx, conn->owner, out_queue_bytes, msg->mlen);
@@ -294,17 +460,110 @@ req_client_dequeue_omsgq(struct context *ctx, struct conn *conn, struct msg *msg
 void
 req_server_dequeue_omsgq(struct context *ctx, struct conn *conn, struct msg *msg)
 {
+    struct server *server = conn->owner;
+
     ASSERT(msg->request);
     ASSERT(!conn->client && !conn->proxy);
 
     msg_tmo_delete(msg);
+    msg_hedge_delete(msg);
 
     TAILQ_REMOVE(&conn->omsg_q, msg, s_tqe);
+    server->nrequest--;
+    server->nrequest_bytes -= msg->mlen;
+
+    if (--conn->nrequest == 0) {
+        server_idle(conn);
+    }
+    conn->nsent--;
 
     stats_server_decr(ctx, conn->owner, out_queue);
     stats_server_decr_by(ctx, conn->owner, out_queue_bytes, msg->mlen);
 }
 
+/*
+ * Return the time in msec till the rate limits of client connection conn
+ * and of its pool allow another request in, or 0 if they do right now
+ */
+static int
+req_rate_delay(struct conn *conn, int64_t now)
+{
+    struct server_pool *pool = conn->owner;
+    int delay;
+
+    delay = bucket_delay(&pool->rate_tokens, pool->rate_limit, now);
+    delay = MAX(delay, bucket_delay(&pool->rate_bytes_tokens,
+                                    pool->rate_limit_bytes, now));
+    delay = MAX(delay, bucket_delay(&conn->rate_tokens,
+                                    pool->client_rate_limit, now));
+    delay = MAX(delay, bucket_delay(&conn->rate_bytes_tokens,
+                                    pool->client_rate_limit_bytes, now));
+
+    return delay;
+}
+
+/*
+ * Return true, if reading from client connection conn is to be paused, as
+ * the client or its pool is over a rate limit and the pool is set to
+ * 'rate_limit_action: pause'. The connection timer resumes reading once
+ * the limits allow; the unread requests push back on the client meanwhile.
+ */
+static bool
+req_rate_pause(struct context *ctx, struct conn *conn)
+{
+    struct server_pool *pool = conn->owner;
+    int delay;
+
+    if (!pool->rate_limited || pool->rate_limit_action != THROTTLE_PAUSE) {
+        return false;
+    }
+
+    delay = req_rate_delay(conn, nc_usec_now());
+    if (delay == 0) {
+        return false;
+    }
+
+    conn_tmo_insert(conn, delay);
+
+    stats_pool_incr(ctx, pool, throttled);
+
+    log_debug(LOG_VERB, "pause c %d for %d msec over rate limit", conn->sd,
+              delay);
+
+    return true;
+}
+
+/*
+ * Charge request msg from client connection c_conn against the rate limits
+ * of the client and of its pool. Return true, if the request is to be
+ * rejected instead, as a limit is exceeded and the pool is set to
+ * 'rate_limit_action: reject'; errno is set to EAGAIN then.
+ */
+static bool
+req_rate_limit(struct context *ctx, struct conn *c_conn, struct msg *msg)
+{
+    struct server_pool *pool = c_conn->owner;
+
+    if (!pool->rate_limited) {
+        return false;
+    }
+
+    if (pool->rate_limit_action == THROTTLE_REJECT &&
+        req_rate_delay(c_conn, nc_usec_now()) != 0) {
+        stats_pool_incr(ctx, pool, rate_limited);
+        errno = EAGAIN;
+        return true;
+    }
+
+    bucket_take(&pool->rate_tokens, pool->rate_limit, 1);
+    bucket_take(&pool->rate_bytes_tokens, pool->rate_limit_bytes, msg->mlen);
+    bucket_take(&c_conn->rate_tokens, pool->client_rate_limit, 1);
+    bucket_take(&c_conn->rate_bytes_tokens, pool->client_rate_limit_bytes,
+                msg->mlen);
+
+    return false;
+}
+
 struct msg *
 req_recv_next(struct context *ctx, struct conn *conn, bool alloc)
 {
@@ -342,6 +601,10 @@ req_recv_next(struct context *ctx, struct conn *conn, bool alloc)
         return NULL;
     }
 
+    if (alloc && req_rate_pause(ctx, conn)) {
+        return NULL;
+    }
+
     msg = conn->rmsg;
     if (msg != NULL) {
         ASSERT(msg->request);
@@ -426,25 +689,71 @@ req_forward_stats(struct context *ctx, struct server *server, struct msg *msg)
 
     stats_server_incr(ctx, server, requests);
     stats_server_incr_by(ctx, server, request_bytes, msg->mlen);
+    stats_command_request(ctx, server->owner, msg->type, msg->mlen);
 }
 
-static void
-req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
+/*
+ * Return true, if request msg only reads data and can safely be sent to a
+ * server more than once, otherwise return false
+ */
+bool
+req_read(struct msg *msg)
 {
-    rstatus_t status;
-    struct conn *s_conn;
-    struct server_pool *pool;
-    uint8_t *key;
-    uint32_t keylen;
+    ASSERT(msg->request);
+
+    return msg->redis ? redis_read(msg) : memcache_read(msg);
+}
+
+/*
+ * Return true, if the failed request msg can be sent to a server once more,
+ * otherwise return false.
+ *
+ * Only idempotent reads of pools with 'retry_reads:' set are retried, and
+ * each at most once. Retries are paid for from a budget that every request
+ * forwarded on the pool adds 'retry_budget:' percent of a retry to, so that
+ * a failing server never triggers a retry storm.
+ */
+bool
+req_retry(struct context *ctx, struct msg *msg)
+{
+    struct conn *c_conn = msg->owner;
+    struct server_pool *pool = c_conn->owner;
 
+    ASSERT(msg->request);
     ASSERT(c_conn->client && !c_conn->proxy);
 
-    /* enqueue message (request) into client outq, if response is expected */
-    if (!msg->noreply) {
-        c_conn->enqueue_outq(ctx, c_conn, msg);
+    if (!pool->retry_reads || msg->retried || msg->hedge_copy ||
+        msg->swallow || msg->noreply) {
+        return false;
     }
 
-    pool = c_conn->owner;
+    if (!req_read(msg)) {
+        return false;
+    }
+
+    if (pool->retry_tokens < SERVER_BUDGET_COST) {
+        stats_pool_incr(ctx, pool, retries_denied);
+        return false;
+    }
+    pool->retry_tokens -= SERVER_BUDGET_COST;
+
+    msg->retried = 1;
+
+    stats_pool_incr(ctx, pool, retries);
+
+    log_debug(LOG_INFO, "retry req %"PRIu64" len %"PRIu32" type %d from c %d",
+              msg->id, msg->mlen, msg->type, c_conn->sd);
+
+    return true;
+}
+
+static void
+req_key(struct server_pool *pool, struct msg *msg, uint8_t **pkey,
+        uint32_t *pkeylen)
+{
+    uint8_t *key;
+    uint32_t keylen;
+
     key = NULL;
     keylen = 0;
 
@@ -472,99 +781,663 @@ req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
         keylen = (uint32_t)(msg->key_end - msg->key_start);
     }
 
-    s_conn = server_pool_conn(ctx, c_conn->owner, key, keylen);
-    if (s_conn == NULL) {
-        req_forward_error(ctx, c_conn, msg);
-        return;
+    *pkey = key;
+    *pkeylen = keylen;
+}
+
+/*
+ * Return a copy of request msg from client connection c_conn, to be sent
+ * to a server other than the one msg is sent to.
+ */
+static struct msg *
+req_copy(struct conn *c_conn, struct msg *msg)
+{
+    struct msg *nmsg;
+    struct mbuf *mbuf, *nbuf;
+
+    nmsg = msg_get(c_conn, true, c_conn->redis);
+    if (nmsg == NULL) {
+        return NULL;
     }
-    ASSERT(!s_conn->client && !s_conn->proxy);
 
-    /* enqueue the message (request) into server inq */
-    if (TAILQ_EMPTY(&s_conn->imsg_q)) {
-        status = event_add_out(ctx->evb, s_conn);
-        if (status != NC_OK) {
-            req_forward_error(ctx, c_conn, msg);
-            s_conn->err = errno;
-            return;
+    STAILQ_FOREACH(mbuf, &msg->mhdr, next) {
+        nbuf = mbuf_get();
+        if (nbuf == NULL) {
+            req_put(nmsg);
+            return NULL;
         }
+        mbuf_copy(nbuf, mbuf->start, (size_t)(mbuf->last - mbuf->start));
+        mbuf_insert(&nmsg->mhdr, nbuf);
     }
-    s_conn->enqueue_inq(ctx, s_conn, msg);
-
-    req_forward_stats(ctx, s_conn->owner, msg);
+    nmsg->mlen = msg->mlen;
+    nmsg->type = msg->type;
+    nmsg->noreply = msg->noreply;
+    nmsg->batch = msg->batch;
 
-    log_debug(LOG_VERB, "forward from c %d to s %d req %"PRIu64" len %"PRIu32
-              " type %d with key '%.*s'", c_conn->sd, s_conn->sd, msg->id,
-              msg->mlen, msg->type, keylen, key);
+    return nmsg;
 }
 
-void
-req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
-              struct msg *nmsg)
+/*
+ * Arm the hedge timer of read request msg, just forwarded on server
+ * connection s_conn, to fire after the recent p95 response latency of
+ * the server.
+ */
+static void
+req_hedge_arm(struct context *ctx, struct conn *s_conn, struct msg *msg)
 {
-    ASSERT(conn->client && !conn->proxy);
-    ASSERT(msg->request);
-    ASSERT(msg->owner == conn);
-    ASSERT(conn->rmsg == msg);
-    ASSERT(nmsg == NULL || nmsg->request);
+    struct server *server = s_conn->owner;
+    struct server_pool *pool = server->owner;
+    int64_t latency;
 
-    /* enqueue next message (request), if any */
-    conn->rmsg = nmsg;
+    msg_hedge_delete(msg);
 
-    if (req_filter(ctx, conn, msg)) {
+    if (!pool->hedge_reads || msg->hedge_copy || msg->noreply ||
+        !req_read(msg)) {
         return;
     }
 
-    req_forward(ctx, conn, msg);
+    if (server->latency.nsample < SERVER_HEDGE_MIN_SAMPLE) {
+        return;
+    }
+
+    latency = server_latency_percentile(server, SERVER_HEDGE_PERCENTILE);
+
+    msg_hedge_insert(msg, s_conn, (int)MAX((latency + 999) / 1000, 1));
 }
 
-struct msg *
-req_send_next(struct context *ctx, struct conn *conn)
+/*
+ * Return true if the requests about to be queued on the idle server
+ * connection s_conn are to be held back, so that they are flushed to the
+ * server in a batch. Requests are held back only while they arrive at least
+ * twice as often as 'server_flush_delay:', and only for as long as the
+ * 'server_flush_requests:' of a batch are expected to take to arrive
+ */
+static bool
+req_cork(struct context *ctx, struct conn *s_conn)
 {
-    rstatus_t status;
-    struct msg *msg, *nmsg; /* current and next message */
+    struct server_pool *pool = ((struct server *)s_conn->owner)->owner;
+    int64_t delay;
 
-    ASSERT(!conn->client && !conn->proxy);
+    if (pool->server_flush_delay == 0 || !s_conn->connected ||
+        s_conn->flush_last == 0 ||
+        s_conn->flush_gap * 2 > pool->server_flush_delay) {
+        return false;
+    }
 
-    if (conn->connecting) {
-        server_connected(ctx, conn);
+    delay = MIN(pool->server_flush_delay,
+                s_conn->flush_gap * (pool->server_flush_requests - 1));
+    if (delay <= 0) {
+        return false;
     }
 
-    nmsg = TAILQ_FIRST(&conn->imsg_q);
-    if (nmsg == NULL) {
-        /* nothing to send as the server inq is empty */
-        status = event_del_out(ctx->evb, conn);
-        if (status != NC_OK) {
-            conn->err = errno;
-        }
+    s_conn->nflush = 0;
+    s_conn->nflush_bytes = 0;
+    conn_flush_insert(s_conn, delay);
 
-        return NULL;
-    }
+    stats_server_incr(ctx, s_conn->owner, flush_batches);
 
-    msg = conn->smsg;
-    if (msg != NULL) {
-        ASSERT(msg->request && !msg->done);
-        nmsg = TAILQ_NEXT(msg, s_tqe);
+    return true;
+}
+
+/*
+ * Arm server connection s_conn to send the request about to be queued on
+ * it, unless requests are queued on it already or are to be held back
+ */
+static rstatus_t
+req_send_arm(struct context *ctx, struct conn *s_conn)
+{
+    if (!TAILQ_EMPTY(&s_conn->imsg_q) || req_cork(ctx, s_conn)) {
+        return NC_OK;
     }
 
-    conn->smsg = nmsg;
+    return event_add_out(ctx->evb, s_conn);
+}
 
-    if (nmsg == NULL) {
-        return NULL;
+/*
+ * Return true, if request msg is to be shed instead of being forwarded on
+ * server connection s_conn, because the requests outstanding on its server
+ * are at the 'max_server_queue:' or 'max_server_queue_bytes:' limit of
+ * the pool; errno is set to EAGAIN then. Otherwise return false.
+ */
+static bool
+req_shed(struct context *ctx, struct conn *s_conn, struct msg *msg)
+{
+    struct server *server = s_conn->owner;
+    struct server_pool *pool = server->owner;
+
+    if (pool->max_server_queue != 0 &&
+        server->nrequest >= pool->max_server_queue) {
+        goto shed;
     }
 
-    ASSERT(nmsg->request && !nmsg->done);
+    /* a lone request is never shed for its size */
+    if (pool->max_server_queue_bytes != 0 && server->nrequest != 0 &&
+        server->nrequest_bytes + msg->mlen > pool->max_server_queue_bytes) {
+        goto shed;
+    }
 
-    log_debug(LOG_VVERB, "send next req %"PRIu64" len %"PRIu32" type %d on "
-              "s %d", nmsg->id, nmsg->mlen, nmsg->type, conn->sd);
+    return false;
 
-    return nmsg;
+shed:
+    log_debug(LOG_VERB, "shed req %"PRIu64" len %"PRIu32" on s %d with %"PRIu32
+              " req %"PRIu64" bytes outstanding", msg->id, msg->mlen,
+              s_conn->sd, server->nrequest, server->nrequest_bytes);
+
+    stats_server_incr(ctx, server, requests_shed);
+    errno = EAGAIN;
+    return true;
 }
 
-void
-req_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
+/*
+ * Return true if request msg is a write to be fanned out to all the
+ * replicas of its key, otherwise return false
+ */
+static bool
+req_replicated(struct server_pool *pool, struct msg *msg)
 {
-    ASSERT(!conn->client && !conn->proxy);
-    ASSERT(msg != NULL && conn->smsg == NULL);
+    return pool->replicas > 1 && !pool->redis && memcache_write(msg);
+}
+
+/*
+ * Return a connection to the server that request msg with key {key, keylen}
+ * is to be forwarded to. Reads may go to a replica of the server that the
+ * key maps to, while writes always go to that server.
+ */
+static struct conn *
+req_server_conn(struct context *ctx, struct server_pool *pool, struct msg *msg,
+                uint8_t *key, uint32_t keylen)
+{
+    if (req_read(msg)) {
+        return server_pool_read_conn(ctx, pool, key, keylen);
+    }
+
+    return server_pool_conn(ctx, pool, key, keylen);
+}
+
+/*
+ * Fan out write request msg from client connection c_conn to all the
+ * replicas of its key {key, keylen}. A copy of msg is sent to every
+ * replica, while msg itself waits in the client outq for 'write_ack:'
+ * of its replicas to answer; see req_replica_done().
+ */
+static void
+req_replicate(struct context *ctx, struct conn *c_conn, struct msg *msg,
+              uint8_t *key, uint32_t keylen)
+{
+    rstatus_t status;
+    struct server_pool *pool;
+    struct conn *s_conn[SERVER_MAX_REPLICAS];
+    struct msg *rmsg;       /* replica message (request) */
+    uint32_t i, n;
+
+    ASSERT(c_conn->client && !c_conn->proxy);
+    ASSERT(msg->nreplica == 0);
+
+    pool = c_conn->owner;
+
+    n = server_pool_write_conns(ctx, pool, key, keylen, s_conn);
+    for (i = 0; i < n; i++) {
+        if (req_shed(ctx, s_conn[i], msg)) {
+            continue;
+        }
+
+        rmsg = req_copy(c_conn, msg);
+        if (rmsg == NULL) {
+            continue;
+        }
+
+        status = req_send_arm(ctx, s_conn[i]);
+        if (status != NC_OK) {
+            s_conn[i]->err = errno;
+            req_put(rmsg);
+            continue;
+        }
+
+        if (!msg->noreply) {
+            rmsg->replica_owner = msg;
+            msg->nreplica_out++;
+        }
+        msg->nreplica++;
+
+        s_conn[i]->enqueue_inq(ctx, s_conn[i], rmsg);
+
+        req_forward_stats(ctx, server_routed(s_conn[i], rmsg), rmsg);
+
+        log_debug(LOG_VERB, "replicate req %"PRIu64" from c %d to s %d as "
+                  "req %"PRIu64" with key '%.*s'", msg->id, c_conn->sd,
+                  s_conn[i]->sd, rmsg->id, keylen, key);
+    }
+
+    if (msg->nreplica == 0) {
+        req_forward_error(ctx, c_conn, msg);
+        return;
+    }
+
+    stats_pool_incr(ctx, pool, replicated);
+
+    /* noreply request don't wait for any response */
+    if (msg->noreply) {
+        req_put(msg);
+        return;
+    }
+
+    switch (pool->write_ack) {
+    case ACK_FIRST:
+        msg->nreplica_ack = 1;
+        break;
+
+    case ACK_QUORUM:
+        msg->nreplica_ack = msg->nreplica / 2 + 1;
+        break;
+
+    case ACK_ALL:
+        msg->nreplica_ack = msg->nreplica;
+        break;
+
+    default:
+        NOT_REACHED();
+    }
+}
+
+static void
+req_dispatch(struct context *ctx, struct conn *c_conn, struct msg *msg)
+{
+    rstatus_t status;
+    struct conn *s_conn;
+    struct server_pool *pool;
+    uint8_t *key;
+    uint32_t keylen;
+
+    ASSERT(c_conn->client && !c_conn->proxy);
+
+    pool = c_conn->owner;
+
+    req_key(pool, msg, &key, &keylen);
+
+    if (req_replicated(pool, msg)) {
+        req_replicate(ctx, c_conn, msg, key, keylen);
+        return;
+    }
+
+    s_conn = req_server_conn(ctx, pool, msg, key, keylen);
+    if (s_conn == NULL && req_retry(ctx, msg)) {
+        s_conn = req_server_conn(ctx, pool, msg, key, keylen);
+    }
+    if (s_conn == NULL) {
+        req_forward_error(ctx, c_conn, msg);
+        return;
+    }
+    ASSERT(!s_conn->client && !s_conn->proxy);
+
+    if (req_shed(ctx, s_conn, msg)) {
+        req_forward_error(ctx, c_conn, msg);
+        return;
+    }
+
+    /* enqueue the message (request) into server inq */
+    status = req_send_arm(ctx, s_conn);
+    if (status != NC_OK) {
+        req_forward_error(ctx, c_conn, msg);
+        s_conn->err = errno;
+        return;
+    }
+    s_conn->enqueue_inq(ctx, s_conn, msg);
+
+    req_forward_stats(ctx, server_routed(s_conn, msg), msg);
+
+    req_hedge_arm(ctx, s_conn, msg);
+
+    log_debug(LOG_VERB, "forward from c %d to s %d req %"PRIu64" len %"PRIu32
+              " type %d with key '%.*s'", c_conn->sd, s_conn->sd, msg->id,
+              msg->mlen, msg->type, keylen, key);
+}
+
+static void
+req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
+{
+    struct server_pool *pool;
+
+    ASSERT(c_conn->client && !c_conn->proxy);
+
+    /* enqueue message (request) into client outq, if response is expected */
+    if (!msg->noreply) {
+        c_conn->enqueue_outq(ctx, c_conn, msg);
+    }
+
+    if (req_rate_limit(ctx, c_conn, msg)) {
+        req_forward_error(ctx, c_conn, msg);
+        return;
+    }
+
+    pool = c_conn->owner;
+
+    /* a client is batch once any of its requests fans out to enough keys */
+    if (pool->batch_keys != 0 && !c_conn->batch && msg->frag_owner != NULL &&
+        msg->frag_owner->nfrag >= pool->batch_keys) {
+        c_conn->batch = 1;
+        stats_pool_incr(ctx, pool, batch_clients);
+        log_debug(LOG_INFO, "c %d classified as batch on req %"PRIu64" with "
+                  "%"PRIu32" keys", c_conn->sd, msg->id,
+                  msg->frag_owner->nfrag);
+    }
+    msg->batch = c_conn->batch;
+
+    if (pool->retry_reads) {
+        pool->retry_tokens = MIN(pool->retry_tokens + pool->retry_budget,
+                                 SERVER_BUDGET_MAX_TOKENS);
+    }
+    if (pool->hedge_reads) {
+        pool->hedge_tokens = MIN(pool->hedge_tokens + pool->hedge_budget,
+                                 SERVER_BUDGET_MAX_TOKENS);
+    }
+
+    req_dispatch(ctx, c_conn, msg);
+}
+
+/*
+ * Forward request msg, that failed on a server connection and was
+ * granted a retry by req_retry(), once again from its client connection.
+ * The key picks the next server on the continuum, if the failed server
+ * was ejected, or the same server over a new connection otherwise.
+ */
+void
+req_reforward(struct context *ctx, struct msg *msg)
+{
+    struct mbuf *mbuf;
+
+    ASSERT(msg->request && msg->retried);
+    ASSERT(!msg->done && msg->peer == NULL);
+
+    msg_tmo_delete(msg);
+    req_unhedge(msg);
+
+    /* rewind the request, as it might have been sent in part or in full */
+    STAILQ_FOREACH(mbuf, &msg->mhdr, next) {
+        mbuf->pos = mbuf->start;
+    }
+
+    req_dispatch(ctx, msg->owner, msg);
+}
+
+void
+req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
+              struct msg *nmsg)
+{
+    ASSERT(conn->client && !conn->proxy);
+    ASSERT(msg->request);
+    ASSERT(msg->owner == conn);
+    ASSERT(conn->rmsg == msg);
+    ASSERT(nmsg == NULL || nmsg->request);
+
+    msg_stamp(msg, PARSED);
+
+    /* enqueue next message (request), if any */
+    conn->rmsg = nmsg;
+
+    if (req_filter(ctx, conn, msg)) {
+        return;
+    }
+
+    req_forward(ctx, conn, msg);
+}
+
+/*
+ * Return true, if none of request msg has been written out yet
+ */
+static bool
+req_unsent(struct msg *msg)
+{
+    struct mbuf *mbuf;
+
+    for (mbuf = STAILQ_FIRST(&msg->mhdr); mbuf != NULL;
+         mbuf = STAILQ_NEXT(mbuf, next)) {
+        if (mbuf->pos != mbuf->start) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Drop request msg, that waited in the inq of server connection conn for
+ * longer than 'queue_timeout:' without any of it being written out. The
+ * request is failed with a timeout error, as if it was never forwarded.
+ */
+static void
+req_queue_expire(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    struct conn *c_conn;    /* peer client connection */
+
+    ASSERT(!conn->client && !conn->proxy);
+    ASSERT(msg->request && !msg->done);
+
+    conn->dequeue_inq(ctx, conn, msg);
+    msg_tmo_delete(msg);
+    msg_hedge_delete(msg);
+
+    stats_server_incr(ctx, conn->owner, queue_timedout);
+
+    log_debug(LOG_INFO, "expire queued req %"PRIu64" len %"PRIu32" type %d "
+              "on s %d after %"PRId64" usec", msg->id, msg->mlen, msg->type,
+              conn->sd, nc_usec_now() - msg->start_ts);
+
+    /* nobody is waiting for the response to any of these */
+    if (msg->swallow || msg->noreply || msg->hedge_copy) {
+        if (msg->expired) {
+            /* placeholder of an expired request that will get no response */
+            ASSERT(conn->ntimedout > 0);
+            conn->ntimedout--;
+        }
+        req_put(msg);
+        return;
+    }
+
+    msg->done = 1;
+    msg->error = 1;
+    msg->err = ETIMEDOUT;
+
+    if (msg->replica_owner != NULL) {
+        req_replica_done(ctx, msg, NULL);
+        req_put(msg);
+        return;
+    }
+
+    c_conn = msg->owner;
+    ASSERT(c_conn->client && !c_conn->proxy);
+
+    if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
+        if (event_add_out(ctx->evb, c_conn) != NC_OK) {
+            c_conn->err = errno;
+        }
+    }
+}
+
+/*
+ * Expire the requests that waited unsent in the inq of server connection
+ * conn for longer than 'queue_timeout:', whether or not the connection is
+ * writable, and arm the deadline of the first request left. The inq is in
+ * arrival order, but for the few requests the scheduler moved ahead to be
+ * sent next, so the walk stops there; the send path catches any older one
+ * behind it. The request being sent (conn->smsg) is left to the send path
+ */
+void
+req_queue_timeout(struct context *ctx, struct conn *conn)
+{
+    struct server_pool *pool;
+    struct msg *msg, *nmsg; /* current and next message */
+    int64_t now;
+
+    ASSERT(!conn->client && !conn->proxy);
+
+    conn_queue_delete(conn);
+
+    pool = ((struct server *)conn->owner)->owner;
+    if (pool->queue_timeout <= 0) {
+        return;
+    }
+
+    now = nc_usec_now();
+
+    for (msg = TAILQ_FIRST(&conn->imsg_q); msg != NULL; msg = nmsg) {
+        nmsg = TAILQ_NEXT(msg, s_tqe);
+
+        if (msg == conn->smsg || msg->done || !req_unsent(msg)) {
+            continue;
+        }
+
+        if (now - msg->start_ts > pool->queue_timeout) {
+            req_queue_expire(ctx, conn, msg);
+            continue;
+        }
+
+        conn_queue_insert(conn, msg->start_ts + pool->queue_timeout + 1);
+        break;
+    }
+}
+
+/*
+ * Return the next request to send on server connection conn, after the
+ * current one (conn->smsg), or NULL if there is none.
+ *
+ * Requests wait in the server inq for their turn in a queue per class,
+ * interactive and batch. The class that is behind in virtual time, which
+ * advances by the bytes sent over the weight of the class, goes next; so
+ * the classes share the connection in the ratio of their weights while
+ * both have requests waiting. Scheduled requests are moved ahead of the
+ * ones still waiting, so the inq always lists requests in send order.
+ */
+static struct msg *
+req_schedule(struct conn *conn)
+{
+    struct server_pool *pool;
+    struct msg *msg, *nmsg; /* scheduled and next message */
+    msg_class_t class;
+    uint32_t weight;
+
+    msg = conn->smsg;
+    if (msg != NULL) {
+        ASSERT(msg->request && !msg->done);
+        nmsg = TAILQ_NEXT(msg, s_tqe);
+    } else {
+        nmsg = TAILQ_FIRST(&conn->imsg_q);
+    }
+
+    /* requests scheduled already are sent first, in order */
+    if (nmsg == NULL || nmsg->scheduled) {
+        return nmsg;
+    }
+
+    if (TAILQ_EMPTY(&conn->wmsg_q[MSG_CLASS_BATCH])) {
+        class = MSG_CLASS_INTERACTIVE;
+    } else if (TAILQ_EMPTY(&conn->wmsg_q[MSG_CLASS_INTERACTIVE])) {
+        class = MSG_CLASS_BATCH;
+    } else if (conn->vtime[MSG_CLASS_BATCH] <
+               conn->vtime[MSG_CLASS_INTERACTIVE]) {
+        class = MSG_CLASS_BATCH;
+    } else {
+        class = MSG_CLASS_INTERACTIVE;
+    }
+
+    pool = ((struct server *)conn->owner)->owner;
+    weight = class == MSG_CLASS_BATCH ? pool->batch_weight :
+                                        100 - pool->batch_weight;
+
+    msg = TAILQ_FIRST(&conn->wmsg_q[class]);
+    ASSERT(msg != NULL && !msg->scheduled);
+
+    TAILQ_REMOVE(&conn->wmsg_q[class], msg, w_tqe);
+    msg->scheduled = 1;
+    conn->vtime[class] += (uint64_t)msg->mlen * 100 / weight;
+
+    if (msg != nmsg) {
+        TAILQ_REMOVE(&conn->imsg_q, msg, s_tqe);
+        TAILQ_INSERT_BEFORE(nmsg, msg, s_tqe);
+    }
+
+    return msg;
+}
+
+struct msg *
+req_send_next(struct context *ctx, struct conn *conn)
+{
+    rstatus_t status;
+    struct server_pool *pool;
+    struct msg *nmsg; /* next message */
+    int64_t now;
+
+    ASSERT(!conn->client && !conn->proxy);
+
+    if (conn->connecting) {
+        server_connected(ctx, conn);
+    }
+
+    pool = ((struct server *)conn->owner)->owner;
+    now = pool->queue_timeout > 0 ? nc_usec_now() : 0LL;
+
+    if (conn->smsg == NULL) {
+        conn->nsend = 0;
+    }
+
+    if (conn->window != 0 && conn->nsent + conn->nsend >= conn->window) {
+        /*
+         * pipeline window is full; the requests wait in the server inq
+         * until responses make room in the window again
+         */
+        if (conn->smsg == NULL) {
+            stats_server_incr(ctx, conn->owner, window_full);
+
+            status = event_del_out(ctx->evb, conn);
+            if (status != NC_OK) {
+                conn->err = errno;
+            }
+        }
+
+        conn->smsg = NULL;
+        return NULL;
+    }
+
+    for (;;) {
+        nmsg = req_schedule(conn);
+        if (nmsg == NULL || pool->queue_timeout <= 0 ||
+            now - nmsg->start_ts <= pool->queue_timeout || !req_unsent(nmsg)) {
+            break;
+        }
+
+        req_queue_expire(ctx, conn, nmsg);
+    }
+
+    if (TAILQ_EMPTY(&conn->imsg_q)) {
+        /* nothing to send as the server inq is empty */
+        status = event_del_out(ctx->evb, conn);
+        if (status != NC_OK) {
+            conn->err = errno;
+        }
+
+        return NULL;
+    }
+
+    conn->smsg = nmsg;
+
+    if (nmsg == NULL) {
+        return NULL;
+    }
+
+    ASSERT(nmsg->request && !nmsg->done);
+
+    conn->nsend++;
+
+    log_debug(LOG_VVERB, "send next req %"PRIu64" len %"PRIu32" type %d on "
+              "s %d", nmsg->id, nmsg->mlen, nmsg->type, conn->sd);
+
+    return nmsg;
+}
+
+void
+req_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    ASSERT(!conn->client && !conn->proxy);
+    ASSERT(msg != NULL && conn->smsg == NULL);
     ASSERT(msg->request && !msg->done);
     ASSERT(msg->owner != conn);
 
@@ -574,6 +1447,11 @@ req_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
     /* dequeue the message (request) from server inq */
     conn->dequeue_inq(ctx, conn, msg);
 
+    if (conn->window != 0) {
+        msg->send_ts = nc_usec_now();
+    }
+    msg_stamp(msg, SENT);
+
     /*
      * noreply request instructs the server not to send any response. So,
      * enqueue message (request) in server outq, if response is expected.
@@ -585,3 +1463,336 @@ req_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
         req_put(msg);
     }
 }
+
+/*
+ * Detach request msg from server connection conn, without closing the
+ * connection. If the request has been put on the wire (partially or
+ * completely), its slot in the server queue is taken over by a placeholder
+ * request, so that the late response is swallowed when it arrives. Requests
+ * that are yet to be sent are simply dropped from the server inq.
+ *
+ * Placeholders of expired requests are accounted for in conn->ntimedout
+ * until their late response is swallowed.
+ */
+static rstatus_t
+req_detach(struct context *ctx, struct conn *conn, struct msg *msg,
+           bool expired)
+{
+    struct msg *tmsg;       /* placeholder message (request) */
+    struct mbuf *mbuf;
+    bool sent;
+
+    ASSERT(!conn->client && !conn->proxy);
+    ASSERT(msg->request && !msg->done && !msg->noreply);
+
+    /* requests in server outq have been written out completely */
+    sent = true;
+    for (mbuf = STAILQ_FIRST(&msg->mhdr); mbuf != NULL;
+         mbuf = STAILQ_NEXT(mbuf, next)) {
+        if (!mbuf_empty(mbuf)) {
+            sent = false;
+            break;
+        }
+    }
+
+    if (!sent && (!msg->scheduled || msg != TAILQ_FIRST(&conn->imsg_q))) {
+        /* none of the request has been written; just drop it */
+        conn->dequeue_inq(ctx, conn, msg);
+        tmsg = NULL;
+    } else {
+        tmsg = msg_get(conn, true, conn->redis);
+        if (tmsg == NULL) {
+            return NC_ENOMEM;
+        }
+
+        /* placeholder takes over the unsent bytes, if any */
+        while (!STAILQ_EMPTY(&msg->mhdr)) {
+            mbuf = STAILQ_FIRST(&msg->mhdr);
+            mbuf_remove(&msg->mhdr, mbuf);
+            mbuf_insert(&tmsg->mhdr, mbuf);
+        }
+        tmsg->mlen = msg->mlen;
+        tmsg->type = msg->type;
+        tmsg->swallow = 1;
+        tmsg->scheduled = 1;
+        tmsg->expired = expired ? 1 : 0;
+
+        TAILQ_INSERT_BEFORE(msg, tmsg, s_tqe);
+        if (sent) {
+            TAILQ_REMOVE(&conn->omsg_q, msg, s_tqe);
+        } else {
+            TAILQ_REMOVE(&conn->imsg_q, msg, s_tqe);
+        }
+
+        if (expired) {
+            conn->ntimedout++;
+        }
+    }
+
+    msg_tmo_delete(msg);
+    msg_hedge_delete(msg);
+
+    log_debug(LOG_VERB, "detach req %"PRIu64" len %"PRIu32" type %d from s %d%s",
+              msg->id, msg->mlen, msg->type, conn->sd,
+              tmsg != NULL ? " swallowing late rsp" : "");
+
+    return NC_OK;
+}
+
+/*
+ * Expire request msg that timed out on server connection conn, without
+ * closing the connection. The request is detached from the connection and
+ * completed in error towards the client right away.
+ */
+rstatus_t
+req_expire(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    rstatus_t status;
+    struct conn *c_conn;    /* peer client connection */
+
+    ASSERT(!conn->client && !conn->proxy);
+    ASSERT(msg->request && !msg->done && !msg->noreply);
+
+    if (msg->swallow) {
+        /* client is gone; the response is going to be swallowed anyway */
+        msg->expired = 1;
+        conn->ntimedout++;
+        return NC_OK;
+    }
+
+    status = req_detach(ctx, conn, msg, true);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    msg->done = 1;
+    msg->error = 1;
+    msg->err = ETIMEDOUT;
+
+    if (msg->replica_owner != NULL) {
+        log_debug(LOG_INFO, "expire replica req %"PRIu64" len %"PRIu32" "
+                  "type %d on s %d", msg->id, msg->mlen, msg->type, conn->sd);
+
+        req_replica_done(ctx, msg, NULL);
+        req_put(msg);
+        return NC_OK;
+    }
+
+    c_conn = msg->owner;
+    ASSERT(c_conn->client && !c_conn->proxy);
+
+    if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
+        if (event_add_out(ctx->evb, c_conn) != NC_OK) {
+            c_conn->err = errno;
+        }
+    }
+
+    log_debug(LOG_INFO, "expire req %"PRIu64" len %"PRIu32" type %d from "
+              "c %d on s %d", msg->id, msg->mlen, msg->type, c_conn->sd,
+              conn->sd);
+
+    return NC_OK;
+}
+
+/*
+ * Hedge read request msg, that is still outstanding on server connection
+ * conn once its hedge timer fires, by sending a copy of it to the next
+ * replica of its key. Whichever of the two is answered first, answers the
+ * client; the response to the other one is swallowed. Hedges are paid for
+ * from a budget of 'hedge_budget:' percent of the requests of the pool.
+ */
+void
+req_hedge(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    rstatus_t status;
+    struct conn *c_conn, *s_conn;
+    struct server_pool *pool;
+    struct msg *hmsg;       /* copy of hedged request */
+    uint8_t *key;
+    uint32_t keylen;
+
+    ASSERT(!conn->client && !conn->proxy);
+    ASSERT(msg->request && !msg->hedge_copy);
+
+    if (msg->done || msg->swallow || msg->hedge != NULL) {
+        return;
+    }
+
+    c_conn = msg->owner;
+    ASSERT(c_conn->client && !c_conn->proxy);
+    pool = c_conn->owner;
+
+    if (pool->hedge_tokens < SERVER_BUDGET_COST) {
+        stats_pool_incr(ctx, pool, hedges_denied);
+        return;
+    }
+
+    req_key(pool, msg, &key, &keylen);
+
+    s_conn = server_pool_replica_conn(ctx, pool, key, keylen,
+                                      server_routed(conn, msg));
+    if (s_conn == NULL || req_shed(ctx, s_conn, msg)) {
+        return;
+    }
+
+    hmsg = req_copy(c_conn, msg);
+    if (hmsg == NULL) {
+        return;
+    }
+    hmsg->hedge_copy = 1;
+
+    status = req_send_arm(ctx, s_conn);
+    if (status != NC_OK) {
+        s_conn->err = errno;
+        req_put(hmsg);
+        return;
+    }
+    s_conn->enqueue_inq(ctx, s_conn, hmsg);
+
+    hmsg->hedge = msg;
+    hmsg->hedge_conn = conn;
+    msg->hedge = hmsg;
+
+    pool->hedge_tokens -= SERVER_BUDGET_COST;
+
+    req_forward_stats(ctx, server_routed(s_conn, hmsg), hmsg);
+    stats_pool_incr(ctx, pool, hedges);
+
+    log_debug(LOG_INFO, "hedge req %"PRIu64" len %"PRIu32" type %d from c %d "
+              "on s %d with req %"PRIu64" on s %d", msg->id, msg->mlen,
+              msg->type, c_conn->sd, conn->sd, hmsg->id, s_conn->sd);
+}
+
+/*
+ * Mark hedged request msg done, as its copy hmsg was answered first with
+ * response rsp. The request is detached from its own server connection,
+ * so that its response is swallowed when it arrives. Return false, if the
+ * request is done already and rsp has to be discarded.
+ */
+bool
+req_hedge_won(struct context *ctx, struct msg *hmsg, struct msg *rsp)
+{
+    rstatus_t status;
+    struct msg *msg;        /* hedged request */
+    struct conn *conn;      /* server connection of hedged request */
+
+    ASSERT(hmsg->request && hmsg->hedge_copy && hmsg->done);
+    ASSERT(!rsp->request);
+
+    msg = hmsg->hedge;
+    conn = hmsg->hedge_conn;
+    if (msg == NULL || msg->done || msg->swallow) {
+        return false;
+    }
+    ASSERT(conn != NULL);
+
+    status = req_detach(ctx, conn, msg, false);
+    if (status != NC_OK) {
+        return false;
+    }
+
+    req_unhedge(msg);
+
+    msg->done = 1;
+
+    stats_pool_incr(ctx, ((struct conn *)msg->owner)->owner, hedges_won);
+
+    log_debug(LOG_INFO, "hedge req %"PRIu64" answered by rsp %"PRIu64" to "
+              "req %"PRIu64"", msg->id, rsp->id, hmsg->id);
+
+    return true;
+}
+
+/*
+ * Account for the answer of replica request rmsg to its replicated write,
+ * which is either the response rsp, or an error if rsp is NULL. The write
+ * is answered once 'write_ack:' of its replicas succeeded, with the
+ * response that made it, or once too many failed for that to happen, with
+ * the failure. Return true, if rsp answers the write and is taken over by
+ * it, false otherwise.
+ */
+bool
+req_replica_done(struct context *ctx, struct msg *rmsg, struct msg *rsp)
+{
+    rstatus_t status;
+    struct msg *msg;        /* replicated message (request) */
+    struct conn *c_conn;
+    bool ok;
+
+    ASSERT(rmsg->request && rmsg->replica_owner != NULL);
+    ASSERT(rsp == NULL || !rsp->request);
+
+    msg = rmsg->replica_owner;
+    rmsg->replica_owner = NULL;
+
+    ASSERT(msg->nreplica_out > 0);
+    msg->nreplica_out--;
+
+    /*
+     * The write is answered as soon as enough replicas agree, while the
+     * rest of them are still outstanding. If it has been put since, the
+     * last of them puts it for good.
+     */
+    if (msg->replica_put) {
+        if (msg->nreplica_out == 0) {
+            req_put(msg);
+        }
+        return false;
+    }
+
+    if (msg->done) {
+        return false;
+    }
+    ASSERT(msg->nreplica_ok + msg->nreplica_err < msg->nreplica);
+
+    ok = rsp != NULL && !memcache_failure(rsp);
+    if (ok) {
+        msg->nreplica_ok++;
+    } else {
+        msg->nreplica_err++;
+    }
+
+    if (msg->nreplica_ok < msg->nreplica_ack &&
+        msg->nreplica_err <= msg->nreplica - msg->nreplica_ack) {
+        return false;
+    }
+
+    msg->done = 1;
+
+    c_conn = msg->owner;
+
+    if (msg->swallow) {
+        /* client is gone; no one is waiting for the write anymore */
+        req_put(msg);
+        return false;
+    }
+    ASSERT(c_conn->client && !c_conn->proxy);
+
+    if (!ok) {
+        stats_pool_incr(ctx, c_conn->owner, replica_failed);
+    }
+
+    if (rsp != NULL) {
+        /* establish msg <-> rsp (request <-> response) link */
+        msg->peer = rsp;
+        rsp->peer = msg;
+
+        rsp->pre_coalesce(rsp);
+    } else {
+        msg->error = 1;
+        msg->err = rmsg->err;
+    }
+
+    if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
+        status = event_add_out(ctx->evb, c_conn);
+        if (status != NC_OK) {
+            c_conn->err = errno;
+        }
+    }
+
+    log_debug(LOG_VERB, "replicated req %"PRIu64" done with %"PRIu32" of "
+              "%"PRIu32" replicas ok", msg->id, msg->nreplica_ok,
+              msg->nreplica);
+
+    return rsp != NULL;
+}
@@ -17,6 +17,7 @@
 
 #include <nc_core.h>
 #include <nc_server.h>
+#include <nc_slowlog.h>
 
 struct msg *
 rsp_get(struct conn *conn)
@@ -188,6 +189,13 @@ rsp_filter(struct context *ctx, struct conn *conn, struct msg *msg)
         conn->dequeue_outq(ctx, conn, pmsg);
         pmsg->done = 1;
 
+        if (pmsg->expired) {
+            ASSERT(conn->ntimedout > 0);
+            conn->ntimedout--;
+        }
+
+        server_window(ctx, conn, pmsg);
+
         log_debug(LOG_INFO, "swallow rsp %"PRIu64" len %"PRIu32" of req "
                   "%"PRIu64" on s %d", msg->id, msg->mlen, pmsg->id,
                   conn->sd);
@@ -201,20 +209,26 @@ rsp_filter(struct context *ctx, struct conn *conn, struct msg *msg)
 }
 
 static void
-rsp_forward_stats(struct context *ctx, struct server *server, struct msg *msg)
+rsp_forward_stats(struct context *ctx, struct server *server, struct msg *msg,
+                  struct msg *pmsg)
 {
     ASSERT(!msg->request);
+    ASSERT(pmsg->request);
 
     stats_server_incr(ctx, server, responses);
     stats_server_incr_by(ctx, server, response_bytes, msg->mlen);
+    stats_command_response(ctx, server->owner, pmsg->type, msg->mlen,
+                           pmsg->start_ts > 0 ?
+                           nc_usec_now() - pmsg->start_ts : 0);
 }
 
 static void
 rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
 {
     rstatus_t status;
-    struct msg *pmsg;
+    struct msg *pmsg, *hmsg;
     struct conn *c_conn;
+    struct server *server;
 
     ASSERT(!s_conn->client && !s_conn->proxy);
 
@@ -229,11 +243,44 @@ rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
     s_conn->dequeue_outq(ctx, s_conn, pmsg);
     pmsg->done = 1;
 
+    server = server_routed(s_conn, pmsg);
+
+    server_latency(ctx, s_conn, pmsg);
+    server_window(ctx, s_conn, pmsg);
+
+    if (pmsg->replica_owner != NULL) {
+        /* response to replica of replicated write answers to the write */
+        rsp_forward_stats(ctx, server, msg, pmsg);
+        if (!req_replica_done(ctx, pmsg, msg)) {
+            rsp_put(msg);
+        }
+        req_put(pmsg);
+        return;
+    }
+
+    if (pmsg->hedge_copy) {
+        /* response to copy of hedged request answers the hedged request */
+        hmsg = pmsg->hedge;
+        if (!req_hedge_won(ctx, pmsg, msg)) {
+            rsp_put(msg);
+            req_put(pmsg);
+            return;
+        }
+        req_put(pmsg);
+        pmsg = hmsg;
+    } else {
+        /* response to copy of this request, if any, is to be swallowed */
+        req_unhedge(pmsg);
+    }
+
+    msg_stamp(pmsg, RSP_PARSED);
+
     /* establish msg <-> pmsg (response <-> request) link */
     pmsg->peer = msg;
     msg->peer = pmsg;
 
     msg->pre_coalesce(msg);
+    msg_stamp(pmsg, COALESCED);
 
     c_conn = pmsg->owner;
     ASSERT(c_conn->client && !c_conn->proxy);
@@ -245,7 +292,7 @@ rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
         }
     }
 
-    rsp_forward_stats(ctx, s_conn->owner, msg);
+    rsp_forward_stats(ctx, server, msg, pmsg);
 }
 
 void
@@ -345,5 +392,14 @@ rsp_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
     /* dequeue request from client outq */
     conn->dequeue_outq(ctx, conn, pmsg);
 
+    /* the reply to a fragmented request is done with its last fragment */
+    if (pmsg->timed && (pmsg->frag_id == 0 || pmsg->last_fragment)) {
+        msg_stamp(pmsg, DONE);
+        if (pmsg->sampled) {
+            stats_pool_stage(ctx, conn->owner, pmsg);
+        }
+        slowlog_add(conn->owner, pmsg, msg);
+    }
+
     req_put(pmsg);
 }
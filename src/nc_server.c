@@ -21,24 +21,44 @@
 #include <nc_core.h>
 #include <nc_server.h>
 #include <nc_conf.h>
+#include <nc_health.h>
+#include <nc_slowlog.h>
+
+/*
+ * Take a copy of the address of server into its connection conn. The copy
+ * is what the connection connects to, while the server may move to another
+ * address on re-resolution; see dns_update().
+ */
+void
+server_conn_addr(struct conn *conn, struct server *server)
+{
+    conn->info.family = server->family;
+    conn->info.addrlen = server->addrlen;
+    nc_memcpy(&conn->info.addr, server->addr, server->addrlen);
+
+    conn->family = conn->info.family;
+    conn->addrlen = conn->info.addrlen;
+    conn->addr = (struct sockaddr *)&conn->info.addr;
+}
 
 void
 server_ref(struct conn *conn, void *owner)
 {
     struct server *server = owner;
+    struct server_pool *pool = server->owner;
 
     ASSERT(!conn->client && !conn->proxy);
     ASSERT(conn->owner == NULL);
 
-    conn->family = server->family;
-    conn->addrlen = server->addrlen;
-    conn->addr = server->addr;
+    server_conn_addr(conn, server);
 
     server->ns_conn_q++;
     TAILQ_INSERT_TAIL(&server->s_conn_q, conn, conn_tqe);
 
     conn->owner = owner;
 
+    conn->window = pool->server_pipeline;
+
     log_debug(LOG_VVERB, "ref conn %p owner %p into '%.*s", conn, server,
               server->pname.len, server->pname.data);
 }
@@ -62,8 +82,79 @@ server_unref(struct conn *conn)
               server->pname.len, server->pname.data);
 }
 
+/*
+ * Return the server that request msg, forwarded on server connection conn,
+ * is routed to by the pool of its client. This is the server owning conn,
+ * unless the pool shares the connections of that server with
+ * 'server_connections_shared:'.
+ */
+struct server *
+server_route(struct conn *conn, struct msg *msg)
+{
+    struct server *server = conn->owner;
+    struct server_pool *pool;
+    struct conn *c_conn = msg->owner;
+
+    ASSERT(!conn->client && !conn->proxy);
+    ASSERT(c_conn->client && !c_conn->proxy);
+
+    if (server->share == NULL) {
+        return server;
+    }
+
+    pool = c_conn->owner;
+    if (server->share[pool->idx] == NULL) {
+        return server;
+    }
+
+    return server->share[pool->idx];
+}
+
+/*
+ * Return the server that request msg on server connection conn was routed
+ * to when it was forwarded; requests forwarded before a reload are
+ * accounted to the server owning conn
+ */
+struct server *
+server_routed(struct conn *conn, struct msg *msg)
+{
+    ASSERT(msg->request);
+
+    return msg->server != NULL ? msg->server : conn->owner;
+}
+
+/*
+ * Return the timeout of request msg on server connection conn. With
+ * 'timeout_factor:' set, this is the timeout adapted to the recent response
+ * latencies of the server, extended by 'timeout_per_kb:' for every KB of
+ * the request and clamped to 'timeout_max:'.
+ */
+int
+server_timeout(struct conn *conn, struct msg *msg)
+{
+    struct server *server;
+    struct server_pool *pool;
+    int timeout;
+
+    ASSERT(!conn->client && !conn->proxy);
+
+    server = server_routed(conn, msg);
+    pool = server->owner;
+
+    if (pool->timeout_factor == 0) {
+        return pool->timeout;
+    }
+
+    timeout = server->timeout > 0 ? server->timeout : pool->timeout_max;
+    if (pool->timeout_per_kb > 0) {
+        timeout += (int)(msg->mlen / 1024) * pool->timeout_per_kb;
+    }
+
+    return MIN(timeout, pool->timeout_max);
+}
+
 int
-server_timeout(struct conn *conn)
+server_connect_timeout(struct conn *conn)
 {
     struct server *server;
     struct server_pool *pool;
@@ -73,7 +164,7 @@ server_timeout(struct conn *conn)
     server = conn->owner;
     pool = server->owner;
 
-    return pool->timeout;
+    return pool->connect_timeout;
 }
 
 bool
@@ -154,6 +245,57 @@ server_init(struct array *server, struct array *conf_server,
     return NC_OK;
 }
 
+/*
+ * Initialize the read replica servers of pool sp from conf_replica, sorted
+ * by name, and link every server to the range of its replicas. Replicas
+ * are indexed after the servers, so that they have stats of their own.
+ */
+rstatus_t
+server_init_read_replicas(struct server_pool *sp, struct array *conf_replica)
+{
+    rstatus_t status;
+    uint32_t i, j, nserver, nreplica;
+
+    nreplica = array_n(conf_replica);
+    if (nreplica == 0) {
+        return NC_OK;
+    }
+
+    status = server_init(&sp->read_replica, conf_replica, sp);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    nserver = array_n(&sp->server);
+    for (i = 0; i < nreplica; i++) {
+        struct server *r = array_get(&sp->read_replica, i);
+        struct server *s = NULL;
+
+        for (j = 0; j < nserver; j++) {
+            s = array_get(&sp->server, j);
+            if (string_compare(&s->name, &r->name) == 0) {
+                break;
+            }
+        }
+        ASSERT(j < nserver);
+
+        if (s->nreplica == 0) {
+            s->replica_idx = i;
+        }
+        s->nreplica++;
+
+        r->idx = nserver + i;
+        r->master = s;
+        /* replica goes by its address, as its name is taken by its master */
+        r->name = r->pname;
+    }
+
+    log_debug(LOG_DEBUG, "init %"PRIu32" read replicas in pool %"PRIu32" "
+              "'%.*s'", nreplica, sp->idx, sp->name.len, sp->name.data);
+
+    return NC_OK;
+}
+
 void
 server_deinit(struct array *server)
 {
@@ -164,40 +306,222 @@ server_deinit(struct array *server)
 
         s = array_pop(server);
         ASSERT(TAILQ_EMPTY(&s->s_conn_q) && s->ns_conn_q == 0);
+
+        if (s->share != NULL) {
+            nc_free(s->share);
+        }
     }
     array_deinit(server);
 }
 
+/*
+ * Return true if server connection conn has a pipeline window's worth of
+ * requests outstanding already
+ */
+static bool
+server_conn_full(struct conn *conn)
+{
+    return conn->window != 0 && conn->nrequest >= conn->window;
+}
+
 struct conn *
 server_conn(struct server *server)
 {
     struct server_pool *pool;
-    struct conn *conn;
+    struct conn *conn, *lconn;
 
     pool = server->owner;
 
+    if (server->ns_conn_q < pool->server_connections_min) {
+        return conn_get(server, false, pool->redis);
+    }
+
+    if (pool->server_connections_min == pool->server_connections) {
+        ASSERT(server->ns_conn_q >= pool->server_connections);
+
+        /*
+         * Pick a server connection from the head of the queue and insert
+         * it back into the tail of queue to maintain the lru order. When
+         * its pipeline window is full, the next connection in lru order
+         * with room is picked instead
+         */
+        TAILQ_FOREACH(conn, &server->s_conn_q, conn_tqe) {
+            if (!server_conn_full(conn)) {
+                break;
+            }
+        }
+        if (conn == NULL) {
+            conn = TAILQ_FIRST(&server->s_conn_q);
+        }
+        ASSERT(!conn->client && !conn->proxy);
+
+        TAILQ_REMOVE(&server->s_conn_q, conn, conn_tqe);
+        TAILQ_INSERT_TAIL(&server->s_conn_q, conn, conn_tqe);
+
+        return conn;
+    }
+
     /*
-     * FIXME: handle multiple server connections per server and do load
-     * balancing on it. Support multiple algorithms for
-     * 'server_connections:' > 0 key
+     * Pick the first server connection in the queue that has fewer than
+     * 'server_connections_depth:' requests outstanding, nor a full pipeline
+     * window, so that the load
+     * fills the connections at the head of the queue and the ones at the
+     * tail drain and get closed once they stay idle. Another connection is
+     * opened only when every connection is that deep, and up to
+     * 'server_connections_max:' connections; beyond that the least loaded
+     * connection is picked
      */
+    lconn = NULL;
+    TAILQ_FOREACH(conn, &server->s_conn_q, conn_tqe) {
+        ASSERT(!conn->client && !conn->proxy);
+
+        if (conn->nrequest < pool->server_connections_depth &&
+            !server_conn_full(conn)) {
+            return conn;
+        }
+
+        if (lconn == NULL || conn->nrequest < lconn->nrequest) {
+            lconn = conn;
+        }
+    }
 
     if (server->ns_conn_q < pool->server_connections) {
+        log_debug(LOG_INFO, "scale up server '%.*s' to %"PRIu32" connections",
+                  server->pname.len, server->pname.data, server->ns_conn_q + 1);
+
+        stats_server_incr(pool->ctx, server, server_scale_ups);
+
         return conn_get(server, false, pool->redis);
     }
-    ASSERT(server->ns_conn_q == pool->server_connections);
 
-    /*
-     * Pick a server connection from the head of the queue and insert
-     * it back into the tail of queue to maintain the lru order
-     */
-    conn = TAILQ_FIRST(&server->s_conn_q);
+    return lconn;
+}
+
+/*
+ * Arm the idle timer on server connection conn, when it has no requests
+ * outstanding and the pool may close the connections above its
+ * 'server_connections_min:'. The connections of a server retired by a
+ * reload are closed as soon as they are idle.
+ */
+void
+server_idle(struct conn *conn)
+{
+    struct server *server = conn->owner;
+    struct server_pool *pool = server->owner;
+
     ASSERT(!conn->client && !conn->proxy);
+    ASSERT(conn->nrequest == 0);
 
-    TAILQ_REMOVE(&server->s_conn_q, conn, conn_tqe);
-    TAILQ_INSERT_TAIL(&server->s_conn_q, conn, conn_tqe);
+    if (conn->connecting) {
+        return;
+    }
 
-    return conn;
+    if (server->retired) {
+        conn_tmo_insert(conn, 1);
+        return;
+    }
+
+    if (pool->server_connections_min == pool->server_connections) {
+        return;
+    }
+
+    conn_tmo_insert(conn, SERVER_IDLE_TIMEOUT);
+}
+
+/*
+ * Return true if the idle server connection conn, whose idle timer expired,
+ * is to be drained and closed because the server has more connections than
+ * the pool keeps open at a minimum, or was retired by a reload. Otherwise,
+ * the idle timer is armed again and false is returned.
+ */
+bool
+server_idle_timedout(struct conn *conn)
+{
+    struct server *server = conn->owner;
+    struct server_pool *pool = server->owner;
+
+    ASSERT(!conn->client && !conn->proxy);
+    ASSERT(conn->connected);
+
+    if (conn->nrequest != 0 || conn->rmsg != NULL) {
+        conn_tmo_insert(conn, SERVER_IDLE_TIMEOUT);
+        return false;
+    }
+
+    if (server->retired) {
+        log_debug(LOG_INFO, "drain retired server '%.*s', closing idle s %d",
+                  server->pname.len, server->pname.data, conn->sd);
+
+        conn->drained = 1;
+
+        return true;
+    }
+
+    if (server->ns_conn_q <= pool->server_connections_min) {
+        conn_tmo_insert(conn, SERVER_IDLE_TIMEOUT);
+        return false;
+    }
+
+    log_debug(LOG_INFO, "scale down server '%.*s' to %"PRIu32" connections, "
+              "closing idle s %d", server->pname.len, server->pname.data,
+              server->ns_conn_q - 1, conn->sd);
+
+    conn->drained = 1;
+
+    return true;
+}
+
+/*
+ * Update the pipeline window of server connection conn on the response to
+ * request msg. With 'server_pipeline_latency:', the window grows by one for
+ * every window of responses within the target latency and is halved on a
+ * response beyond it, at most once for the requests in flight at the time.
+ * Sending on the connection resumes when the window has room again
+ */
+void
+server_window(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    rstatus_t status;
+    struct server *server = conn->owner;
+    struct server_pool *pool = server->owner;
+    struct msg *lmsg;
+    int64_t now;
+
+    ASSERT(!conn->client && !conn->proxy);
+    ASSERT(msg->request);
+
+    if (conn->window == 0) {
+        return;
+    }
+
+    if (pool->server_pipeline_latency != 0 && msg->send_ts > 0 &&
+        (now = nc_usec_now()) > 0) {
+        if (now - msg->send_ts <= pool->server_pipeline_latency) {
+            if (conn->window < pool->server_pipeline &&
+                ++conn->nwindow >= conn->window) {
+                conn->window++;
+                conn->nwindow = 0;
+            }
+        } else if (msg->id > conn->window_recover) {
+            lmsg = TAILQ_LAST(&conn->omsg_q, msg_tqh);
+            conn->window_recover = lmsg != NULL ? lmsg->id : msg->id;
+            conn->window = MAX(conn->window / 2, 1);
+            conn->nwindow = 0;
+
+            stats_server_incr(ctx, server, window_shrinks);
+
+            log_debug(LOG_VERB, "shrink window on s %d to %"PRIu32" on req "
+                      "%"PRIu64" latency %"PRId64" usec", conn->sd,
+                      conn->window, msg->id, now - msg->send_ts);
+        }
+    }
+
+    if (conn->nsent < conn->window && !TAILQ_EMPTY(&conn->imsg_q)) {
+        status = event_add_out(ctx->evb, conn);
+        if (status != NC_OK) {
+            conn->err = errno;
+        }
+    }
 }
 
 static rstatus_t
@@ -211,6 +535,11 @@ server_each_preconnect(void *elem, void *data)
     server = elem;
     pool = server->owner;
 
+    /* connections of a shared server are those of the server it shares */
+    if (server->shared != NULL) {
+        return NC_OK;
+    }
+
     conn = server_conn(server);
     if (conn == NULL) {
         return NC_ENOMEM;
@@ -254,7 +583,23 @@ server_failure(struct context *ctx, struct server *server)
     int64_t now, next;
     rstatus_t status;
 
-    if (!pool->auto_eject_hosts) {
+    if (server->retired) {
+        return;
+    }
+
+    /* failure of a shared connection is a failure of every server sharing it */
+    if (server->share != NULL) {
+        uint32_t i, npool;
+
+        for (i = 0, npool = array_n(&pool->ctx->pool); i < npool; i++) {
+            if (server->share[i] != NULL) {
+                server_failure(ctx, server->share[i]);
+            }
+        }
+    }
+
+    /* unhealthy server stays ejected till it passes a health check */
+    if (!pool->auto_eject_hosts || server->unhealthy) {
         return;
     }
 
@@ -296,12 +641,17 @@ server_failure(struct context *ctx, struct server *server)
 
 static void
 server_close_stats(struct context *ctx, struct server *server, err_t err,
-                   unsigned eof, unsigned connected)
+                   unsigned eof, unsigned connected, unsigned drained)
 {
     if (connected) {
         stats_server_decr(ctx, server, server_connections);
     }
 
+    if (drained) {
+        stats_server_incr(ctx, server, server_scale_downs);
+        return;
+    }
+
     if (eof) {
         stats_server_incr(ctx, server, server_eof);
         return;
@@ -332,13 +682,20 @@ server_close(struct context *ctx, struct conn *conn)
     rstatus_t status;
     struct msg *msg, *nmsg; /* current and next message */
     struct conn *c_conn;    /* peer client connection */
+    struct msg_tqh retry_q; /* requests to retry */
 
     ASSERT(!conn->client && !conn->proxy);
 
+    TAILQ_INIT(&retry_q);
+
     server_close_stats(ctx, conn->owner, conn->err, conn->eof,
-                       conn->connected);
+                       conn->connected, conn->drained);
+
+    conn_flush_delete(conn);
+    conn_queue_delete(conn);
 
     if (conn->sd < 0) {
+        conn_tmo_delete(conn);
         server_failure(ctx, conn->owner);
         conn->unref(conn);
         conn_put(conn);
@@ -354,12 +711,22 @@ server_close(struct context *ctx, struct conn *conn)
         /*
          * Don't send any error response, if
          * 1. request is tagged as noreply or,
-         * 2. client has already closed its connection
+         * 2. client has already closed its connection or,
+         * 3. request is a copy of a hedged request
          */
-        if (msg->swallow || msg->noreply) {
+        if (msg->swallow || msg->noreply || msg->hedge_copy) {
             log_debug(LOG_INFO, "close s %d swallow req %"PRIu64" len %"PRIu32
                       " type %d", conn->sd, msg->id, msg->mlen, msg->type);
             req_put(msg);
+        } else if (msg->replica_owner != NULL) {
+            msg->done = 1;
+            msg->error = 1;
+            msg->err = conn->err;
+
+            req_replica_done(ctx, msg, NULL);
+            req_put(msg);
+        } else if (req_retry(ctx, msg)) {
+            TAILQ_INSERT_TAIL(&retry_q, msg, s_tqe);
         } else {
             c_conn = msg->owner;
             ASSERT(c_conn->client && !c_conn->proxy);
@@ -386,10 +753,19 @@ server_close(struct context *ctx, struct conn *conn)
         /* dequeue the message (request) from server outq */
         conn->dequeue_outq(ctx, conn, msg);
 
-        if (msg->swallow) {
+        if (msg->swallow || msg->hedge_copy) {
             log_debug(LOG_INFO, "close s %d swallow req %"PRIu64" len %"PRIu32
                       " type %d", conn->sd, msg->id, msg->mlen, msg->type);
             req_put(msg);
+        } else if (msg->replica_owner != NULL) {
+            msg->done = 1;
+            msg->error = 1;
+            msg->err = conn->err;
+
+            req_replica_done(ctx, msg, NULL);
+            req_put(msg);
+        } else if (req_retry(ctx, msg)) {
+            TAILQ_INSERT_TAIL(&retry_q, msg, s_tqe);
         } else {
             c_conn = msg->owner;
             ASSERT(c_conn->client && !c_conn->proxy);
@@ -425,7 +801,12 @@ server_close(struct context *ctx, struct conn *conn)
 
     ASSERT(conn->smsg == NULL);
 
-    server_failure(ctx, conn->owner);
+    /* dequeuing the requests above may have armed the idle timer */
+    conn_tmo_delete(conn);
+
+    if (!conn->drained) {
+        server_failure(ctx, conn->owner);
+    }
 
     conn->unref(conn);
 
@@ -436,6 +817,18 @@ server_close(struct context *ctx, struct conn *conn)
     conn->sd = -1;
 
     conn_put(conn);
+
+    /*
+     * Retried requests are forwarded only once the connection is gone, so
+     * that they are sent over a new connection or to the next server, if
+     * this server got ejected
+     */
+    while (!TAILQ_EMPTY(&retry_q)) {
+        msg = TAILQ_FIRST(&retry_q);
+        TAILQ_REMOVE(&retry_q, msg, s_tqe);
+
+        req_reforward(ctx, msg);
+    }
 }
 
 rstatus_t
@@ -453,6 +846,9 @@ server_connect(struct context *ctx, struct server *server, struct conn *conn)
     log_debug(LOG_VVERB, "connect to server '%.*s'", server->pname.len,
               server->pname.data);
 
+    /* pick up the address the server moved to since, if any */
+    server_conn_addr(conn, server);
+
     conn->sd = socket(conn->family, SOCK_STREAM, 0);
     if (conn->sd < 0) {
         log_error("socket for server '%.*s' failed: %s", server->pname.len,
@@ -492,6 +888,7 @@ server_connect(struct context *ctx, struct server *server, struct conn *conn)
     if (status != NC_OK) {
         if (errno == EINPROGRESS) {
             conn->connecting = 1;
+            conn_tmo_insert(conn, server_connect_timeout(conn));
             log_debug(LOG_DEBUG, "connecting on s %d to server '%.*s'",
                       conn->sd, server->pname.len, server->pname.data);
             return NC_OK;
@@ -525,9 +922,15 @@ server_connected(struct context *ctx, struct conn *conn)
 
     stats_server_incr(ctx, server, server_connections);
 
+    conn_tmo_delete(conn);
+
     conn->connecting = 0;
     conn->connected = 1;
 
+    if (conn->nrequest == 0) {
+        server_idle(conn);
+    }
+
     log_debug(LOG_INFO, "connected on s %d to server '%.*s'", conn->sd,
               server->pname.len, server->pname.data);
 }
@@ -540,66 +943,413 @@ server_ok(struct context *ctx, struct conn *conn)
     ASSERT(!conn->client && !conn->proxy);
     ASSERT(conn->connected);
 
-    if (server->failure_count != 0) {
+    /* unhealthy server stays ejected till it passes a health check */
+    if (server->failure_count != 0 && !server->unhealthy) {
         log_debug(LOG_VERB, "reset server '%.*s' failure count from %"PRIu32
                   " to 0", server->pname.len, server->pname.data,
                   server->failure_count);
         server->failure_count = 0;
         server->next_retry = 0LL;
     }
-}
 
-static rstatus_t
-server_pool_update(struct server_pool *pool)
-{
-    rstatus_t status;
-    int64_t now;
-    uint32_t pnlive_server; /* prev # live server */
+    if (server->share != NULL) {
+        struct server_pool *pool = server->owner;
+        uint32_t i, npool;
 
-    if (!pool->auto_eject_hosts) {
-        return NC_OK;
-    }
+        for (i = 0, npool = array_n(&pool->ctx->pool); i < npool; i++) {
+            struct server *s = server->share[i];
 
-    if (pool->next_rebuild == 0LL) {
-        return NC_OK;
+            if (s != NULL && s->failure_count != 0 && !s->unhealthy) {
+                s->failure_count = 0;
+                s->next_retry = 0LL;
+            }
+        }
     }
+}
 
-    now = nc_usec_now();
-    if (now < 0) {
-        return NC_ERROR;
-    }
+/*
+ * Return true, if the timed out request msg could be expired on its own,
+ * keeping server connection conn open. Otherwise, return false, so that the
+ * caller closes the connection failing all the outstanding requests on it.
+ *
+ * The connection is kept open as long as the number of timed out requests
+ * still outstanding on it stays within the 'timeout_limit:' of its pool.
+ */
+bool
+server_timedout(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    struct server *server = conn->owner;
+    struct server_pool *pool = server->owner;
 
-    if (now <= pool->next_rebuild) {
-        if (pool->nlive_server == 0) {
-            errno = ECONNREFUSED;
-            return NC_ERROR;
-        }
-        return NC_OK;
-    }
+    ASSERT(!conn->client && !conn->proxy);
 
-    pnlive_server = pool->nlive_server;
+    if (conn->ntimedout >= pool->timeout_limit) {
+        return false;
+    }
 
-    status = server_pool_run(pool);
-    if (status != NC_OK) {
-        log_error("updating pool %"PRIu32" with dist %d failed: %s", pool->idx,
-                  pool->dist_type, strerror(errno));
-        return status;
+    if (req_expire(ctx, conn, msg) != NC_OK) {
+        return false;
     }
 
-    log_debug(LOG_INFO, "update pool %"PRIu32" '%.*s' to add %"PRIu32" servers",
-              pool->idx, pool->name.len, pool->name.data,
-              pool->nlive_server - pnlive_server);
+    stats_server_incr(ctx, server, server_timedout);
 
+    log_debug(LOG_VERB, "s %d has %"PRIu32" of %"PRIu32" timed out req "
+              "outstanding", conn->sd, conn->ntimedout, pool->timeout_limit);
 
-    return NC_OK;
+    return true;
 }
 
 static uint32_t
-server_pool_hash(struct server_pool *pool, uint8_t *key, uint32_t keylen)
+server_latency_bucket(int64_t usec)
 {
-    ASSERT(array_n(&pool->server) != 0);
+    uint32_t msb, idx;
 
-    if (array_n(&pool->server) == 1) {
+    if (usec < 4) {
+        return usec < 0 ? 0 : (uint32_t)usec;
+    }
+
+    for (msb = 2; msb < 62 && (usec >> (msb + 1)) != 0; msb++) {
+        /* find the most significant bit */
+    }
+
+    idx = 4 * (msb - 1) + (uint32_t)((usec >> (msb - 2)) & 3);
+
+    return MIN(idx, SERVER_LATENCY_NBUCKET - 1);
+}
+
+static int64_t
+server_latency_value(uint32_t idx)
+{
+    uint32_t msb;
+
+    if (idx < 4) {
+        return idx;
+    }
+
+    /* upper bound of the latencies in bucket idx */
+    msb = idx / 4 + 1;
+
+    return ((int64_t)(4 + idx % 4 + 1) << (msb - 2)) - 1;
+}
+
+/*
+ * Return the given percentile, in permille, of the recent response latencies
+ * of server in usec, or 0 if no latency was recorded.
+ */
+int64_t
+server_latency_percentile(struct server *server, uint32_t permille)
+{
+    struct latency *latency = &server->latency;
+    uint32_t idx, rank, nsample;
+
+    ASSERT(permille <= 1000);
+
+    if (latency->nsample == 0) {
+        return 0;
+    }
+
+    rank = (uint32_t)(((uint64_t)latency->nsample * permille + 999) / 1000);
+    rank = MAX(rank, 1);
+
+    for (idx = 0, nsample = 0; idx < SERVER_LATENCY_NBUCKET; idx++) {
+        nsample += latency->bucket[idx];
+        if (nsample >= rank) {
+            break;
+        }
+    }
+
+    return server_latency_value(MIN(idx, SERVER_LATENCY_NBUCKET - 1));
+}
+
+/*
+ * Return the server with index idx in pool, where read replicas are
+ * indexed after the servers
+ */
+static struct server *
+server_pool_idx(struct server_pool *pool, uint32_t idx)
+{
+    if (idx < array_n(&pool->server)) {
+        return array_get(&pool->server, idx);
+    }
+
+    return array_get(&pool->read_replica, idx - array_n(&pool->server));
+}
+
+static void
+server_pool_latency_decay(struct server_pool *pool)
+{
+    uint32_t i, idx, nserver;
+
+    nserver = array_n(&pool->server) + array_n(&pool->read_replica);
+    for (i = 0; i < nserver; i++) {
+        struct server *server = server_pool_idx(pool, i);
+        struct latency *latency = &server->latency;
+
+        latency->nsample = 0;
+        for (idx = 0; idx < SERVER_LATENCY_NBUCKET; idx++) {
+            latency->bucket[idx] >>= 1;
+            latency->nsample += latency->bucket[idx];
+        }
+    }
+}
+
+/*
+ * Adapt the timeout of every server in the pool to 'timeout_factor:' times
+ * its recent p999 response latency, clamped between 'timeout_min:' and
+ * 'timeout_max:'. Servers with too few recent responses keep their current
+ * timeout, which starts off as the 'timeout:' of the pool.
+ */
+static void
+server_pool_timeout_update(struct context *ctx, struct server_pool *pool)
+{
+    uint32_t i, nserver;
+    int64_t latency;
+    int timeout;
+
+    if (pool->timeout_factor == 0) {
+        return;
+    }
+
+    nserver = array_n(&pool->server) + array_n(&pool->read_replica);
+    for (i = 0; i < nserver; i++) {
+        struct server *server = server_pool_idx(pool, i);
+
+        if (server->latency.nsample >= SERVER_TIMEOUT_MIN_SAMPLE) {
+            latency = server_latency_percentile(server, SERVER_TIMEOUT_PERCENTILE);
+            latency = (latency * pool->timeout_factor + 999) / 1000;
+            timeout = (int)MIN(latency, pool->timeout_max);
+        } else if (server->timeout > 0) {
+            timeout = server->timeout;
+        } else if (pool->timeout > 0) {
+            timeout = MIN(pool->timeout, pool->timeout_max);
+        } else {
+            timeout = pool->timeout_max;
+        }
+        timeout = MAX(timeout, pool->timeout_min);
+
+        if (timeout == server->timeout) {
+            continue;
+        }
+
+        log_debug(LOG_VERB, "adapt timeout of server '%.*s' from %d to %d msec",
+                  server->pname.len, server->pname.data, server->timeout,
+                  timeout);
+
+        if (timeout > server->timeout) {
+            stats_server_incr_by(ctx, server, request_timeout,
+                                 timeout - server->timeout);
+        } else {
+            stats_server_decr_by(ctx, server, request_timeout,
+                                 server->timeout - timeout);
+        }
+        server->timeout = timeout;
+    }
+}
+
+static int
+server_latency_cmp(const void *t1, const void *t2)
+{
+    const int64_t *l1 = t1, *l2 = t2;
+
+    if (*l1 < *l2) {
+        return -1;
+    }
+
+    return *l1 > *l2 ? 1 : 0;
+}
+
+/*
+ * Eject the servers whose recent response latency percentile is more than
+ * 'outlier_factor:' times the median of that percentile across the live
+ * servers of the pool. At most 'outlier_max_ejection:' percent of servers
+ * are ejected at any time, counting the ones ejected on failures. Ejected
+ * servers are reinstated after 'server_retry_timeout:', like servers
+ * ejected on failures.
+ */
+static void
+server_pool_outlier(struct context *ctx, struct server_pool *pool, int64_t now)
+{
+    rstatus_t status;
+    uint32_t i, nserver, ncompare, nejected, max_ejected;
+    int64_t *latency, median, threshold, pct;
+    bool update;
+
+    nserver = array_n(&pool->server);
+
+    latency = nc_alloc(nserver * sizeof(*latency));
+    if (latency == NULL) {
+        return;
+    }
+
+    ncompare = 0;
+    nejected = 0;
+    for (i = 0; i < nserver; i++) {
+        struct server *server = array_get(&pool->server, i);
+
+        if (server->next_retry > now) {
+            nejected++;
+            continue;
+        }
+
+        if (server->latency.nsample < SERVER_OUTLIER_MIN_SAMPLE) {
+            continue;
+        }
+
+        latency[ncompare++] = server_latency_percentile(server,
+                                                        SERVER_OUTLIER_PERCENTILE);
+    }
+
+    if (ncompare < SERVER_OUTLIER_MIN_SERVER) {
+        goto done;
+    }
+
+    qsort(latency, ncompare, sizeof(*latency), server_latency_cmp);
+    median = latency[ncompare / 2];
+    threshold = median * pool->outlier_factor;
+
+    max_ejected = (nserver * pool->outlier_max_ejection + 99) / 100;
+    update = false;
+
+    for (i = 0; i < nserver && nejected < max_ejected; i++) {
+        struct server *server = array_get(&pool->server, i);
+
+        if (server->next_retry > now ||
+            server->latency.nsample < SERVER_OUTLIER_MIN_SAMPLE) {
+            continue;
+        }
+
+        pct = server_latency_percentile(server, SERVER_OUTLIER_PERCENTILE);
+        if (pct <= threshold) {
+            continue;
+        }
+
+        log_debug(LOG_INFO, "update pool %"PRIu32" '%.*s' to delete outlier "
+                  "server '%.*s' with p99 latency %"PRId64" usec over median "
+                  "%"PRId64" usec", pool->idx, pool->name.len, pool->name.data,
+                  server->pname.len, server->pname.data, pct, median);
+
+        stats_server_set_ts(ctx, server, server_ejected_at, now);
+        stats_pool_incr(ctx, pool, server_ejects);
+        stats_pool_incr(ctx, pool, outlier_ejects);
+
+        server->failure_count = 0;
+        server->next_retry = now + pool->server_retry_timeout;
+        memset(&server->latency, 0, sizeof(server->latency));
+
+        nejected++;
+        update = true;
+    }
+
+    if (update) {
+        status = server_pool_run(pool);
+        if (status != NC_OK) {
+            log_error("updating pool %"PRIu32" '%.*s' failed: %s", pool->idx,
+                      pool->name.len, pool->name.data, strerror(errno));
+        }
+    }
+
+done:
+    nc_free(latency);
+}
+
+/*
+ * Record the response latency of request msg forwarded on server connection
+ * conn. Once every latency window, look for latency outliers in the pool,
+ * adapt the timeouts of its servers and decay their latency histograms.
+ */
+void
+server_latency(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    struct server *server = server_routed(conn, msg);
+    struct server_pool *pool = server->owner;
+    struct latency *latency = &server->latency;
+    int64_t now;
+
+    ASSERT(!conn->client && !conn->proxy);
+    ASSERT(msg->request);
+
+    if (msg->start_ts <= 0) {
+        return;
+    }
+
+    now = nc_usec_now();
+    if (now < 0) {
+        return;
+    }
+
+    latency->bucket[server_latency_bucket(now - msg->start_ts)]++;
+    latency->nsample++;
+
+    if (now < pool->next_latency_decay) {
+        return;
+    }
+
+    if (pool->next_latency_decay != 0LL && pool->outlier_interval != 0 &&
+        pool->auto_eject_hosts) {
+        server_pool_outlier(ctx, pool, now);
+    }
+
+    server_pool_timeout_update(ctx, pool);
+    server_pool_latency_decay(pool);
+
+    if (pool->outlier_interval != 0) {
+        pool->next_latency_decay = now + pool->outlier_interval;
+    } else {
+        pool->next_latency_decay = now + SERVER_LATENCY_WINDOW;
+    }
+}
+
+static rstatus_t
+server_pool_update(struct server_pool *pool)
+{
+    rstatus_t status;
+    int64_t now;
+    uint32_t pnlive_server; /* prev # live server */
+
+    if (!pool->auto_eject_hosts) {
+        return NC_OK;
+    }
+
+    if (pool->next_rebuild == 0LL) {
+        return NC_OK;
+    }
+
+    now = nc_usec_now();
+    if (now < 0) {
+        return NC_ERROR;
+    }
+
+    if (now <= pool->next_rebuild) {
+        if (pool->nlive_server == 0) {
+            errno = ECONNREFUSED;
+            return NC_ERROR;
+        }
+        return NC_OK;
+    }
+
+    pnlive_server = pool->nlive_server;
+
+    status = server_pool_run(pool);
+    if (status != NC_OK) {
+        log_error("updating pool %"PRIu32" with dist %d failed: %s", pool->idx,
+                  pool->dist_type, strerror(errno));
+        return status;
+    }
+
+    log_debug(LOG_INFO, "update pool %"PRIu32" '%.*s' to add %"PRIu32" servers",
+              pool->idx, pool->name.len, pool->name.data,
+              pool->nlive_server - pnlive_server);
+
+
+    return NC_OK;
+}
+
+static uint32_t
+server_pool_hash(struct server_pool *pool, uint8_t *key, uint32_t keylen)
+{
+    ASSERT(array_n(&pool->server) != 0);
+
+    if (array_n(&pool->server) == 1) {
         return 0;
     }
 
@@ -646,13 +1396,91 @@ server_pool_server(struct server_pool *pool, uint8_t *key, uint32_t keylen)
     return server;
 }
 
+/*
+ * Fill replica[] with up to nreplica distinct servers, following the
+ * continuum point that {key, keylen} maps to, and return their count. The
+ * first server is the one that the key is dispatched to.
+ */
+uint32_t
+server_pool_replicas(struct server_pool *pool, uint8_t *key, uint32_t keylen,
+                     struct server **replica, uint32_t nreplica)
+{
+    uint32_t i, j, n, point;
+
+    ASSERT(array_n(&pool->server) != 0);
+    ASSERT(nreplica != 0);
+
+    if (pool->ncontinuum == 0) {
+        return 0;
+    }
+
+    switch (pool->dist_type) {
+    case DIST_KETAMA:
+        point = ketama_point(pool->continuum, pool->ncontinuum,
+                             server_pool_hash(pool, key, keylen));
+        break;
+
+    case DIST_MODULA:
+        point = server_pool_hash(pool, key, keylen) % pool->ncontinuum;
+        break;
+
+    case DIST_RANDOM:
+        point = (uint32_t)random() % pool->ncontinuum;
+        break;
+
+    default:
+        NOT_REACHED();
+        return 0;
+    }
+
+    for (i = 0, n = 0; i < pool->ncontinuum && n < nreplica; i++) {
+        struct continuum *c = &pool->continuum[(point + i) % pool->ncontinuum];
+        struct server *server = array_get(&pool->server, c->index);
+
+        for (j = 0; j < n && replica[j] != server; j++) {
+            /* skip over servers picked already */
+        }
+
+        if (j == n) {
+            replica[n++] = server;
+        }
+    }
+
+    return n;
+}
+
+static struct conn *
+server_pool_server_conn(struct context *ctx, struct server *server)
+{
+    rstatus_t status;
+    struct conn *conn;
+
+    /* servers that share connections borrow those of the server they share */
+    if (server->shared != NULL) {
+        server = server->shared;
+    }
+
+    /* pick a connection to a given server */
+    conn = server_conn(server);
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    status = server_connect(ctx, server, conn);
+    if (status != NC_OK) {
+        server_close(ctx, conn);
+        return NULL;
+    }
+
+    return conn;
+}
+
 struct conn *
 server_pool_conn(struct context *ctx, struct server_pool *pool, uint8_t *key,
                  uint32_t keylen)
 {
     rstatus_t status;
     struct server *server;
-    struct conn *conn;
 
     status = server_pool_update(pool);
     if (status != NC_OK) {
@@ -665,19 +1493,196 @@ server_pool_conn(struct context *ctx, struct server_pool *pool, uint8_t *key,
         return NULL;
     }
 
-    /* pick a connection to a given server */
-    conn = server_conn(server);
-    if (conn == NULL) {
+    return server_pool_server_conn(ctx, server);
+}
+
+/*
+ * Return a connection to the first of the 'replicas:' servers that
+ * {key, keylen} maps to, other than server exclude.
+ */
+struct conn *
+server_pool_replica_conn(struct context *ctx, struct server_pool *pool,
+                         uint8_t *key, uint32_t keylen, struct server *exclude)
+{
+    rstatus_t status;
+    struct server *replica[SERVER_MAX_REPLICAS];
+    uint32_t i, n;
+
+    status = server_pool_update(pool);
+    if (status != NC_OK) {
         return NULL;
     }
 
-    status = server_connect(ctx, server, conn);
+    n = server_pool_replicas(pool, key, keylen, replica, pool->replicas);
+    for (i = 0; i < n; i++) {
+        if (replica[i] != exclude) {
+            return server_pool_server_conn(ctx, replica[i]);
+        }
+    }
+
+    errno = ENOENT;
+    return NULL;
+}
+
+/*
+ * Return the # requests outstanding on the connections of server, which
+ * are those of the server it shares, if any
+ */
+static uint32_t
+server_nrequest(struct server *server)
+{
+    if (server->shared != NULL) {
+        return server->shared->nrequest;
+    }
+
+    return server->nrequest;
+}
+
+/*
+ * Return the least loaded of the 'replicas:' servers that {key, keylen}
+ * maps to, counting the requests outstanding on each. Servers that failed
+ * since their last response are passed over, as they look idle for failing
+ * fast. Ties go to the server that comes first on the continuum.
+ */
+static struct server *
+server_pool_least_loaded(struct server_pool *pool, uint8_t *key,
+                         uint32_t keylen)
+{
+    struct server *replica[SERVER_MAX_REPLICAS], *server;
+    uint32_t i, n;
+
+    n = server_pool_replicas(pool, key, keylen, replica, pool->replicas);
+    if (n == 0) {
+        return NULL;
+    }
+
+    server = replica[0];
+    for (i = 1; i < n; i++) {
+        if (replica[i]->failure_count != 0) {
+            continue;
+        }
+
+        if (server->failure_count != 0 ||
+            server_nrequest(replica[i]) < server_nrequest(server)) {
+            server = replica[i];
+        }
+    }
+
+    return server;
+}
+
+/*
+ * Return one of the read replicas of server, picked by the power of two
+ * choices - the less loaded of two replicas picked at random. Ejected
+ * replicas are passed over, and server itself is returned when it has no
+ * live replica to offer.
+ */
+static struct server *
+server_read_replica(struct server *server)
+{
+    struct server_pool *pool = server->owner;
+    struct server *r1, *r2;
+    uint32_t i1, i2;
+    int64_t now;
+
+    ASSERT(server->nreplica != 0);
+
+    i1 = (uint32_t)random() % server->nreplica;
+    r1 = array_get(&pool->read_replica, server->replica_idx + i1);
+
+    if (server->nreplica == 1) {
+        r2 = r1;
+    } else {
+        i2 = (uint32_t)random() % (server->nreplica - 1);
+        if (i2 >= i1) {
+            i2++;
+        }
+        r2 = array_get(&pool->read_replica, server->replica_idx + i2);
+    }
+
+    now = nc_usec_now();
+    if (now < 0) {
+        return server;
+    }
+
+    if (r1->next_retry > now) {
+        r1 = r2;
+    } else if (r2->next_retry > now) {
+        r2 = r1;
+    }
+
+    if (r1->next_retry > now) {
+        return server;
+    }
+
+    return server_nrequest(r2) < server_nrequest(r1) ? r2 : r1;
+}
+
+/*
+ * Return a connection to the server that reads of {key, keylen} are sent
+ * to - the least loaded of its 'replicas:' when writes are replicated, or
+ * one of the read replicas of its server, if any.
+ */
+struct conn *
+server_pool_read_conn(struct context *ctx, struct server_pool *pool,
+                      uint8_t *key, uint32_t keylen)
+{
+    rstatus_t status;
+    struct server *server;
+
+    status = server_pool_update(pool);
     if (status != NC_OK) {
-        server_close(ctx, conn);
         return NULL;
     }
 
-    return conn;
+    if (pool->replicas > 1 && !pool->redis) {
+        server = server_pool_least_loaded(pool, key, keylen);
+    } else {
+        server = server_pool_server(pool, key, keylen);
+    }
+    if (server == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    if (server->nreplica != 0) {
+        server = server_read_replica(server);
+    }
+
+    return server_pool_server_conn(ctx, server);
+}
+
+/*
+ * Fill conn[] with a connection to each of the 'replicas:' servers that
+ * {key, keylen} maps to and return their count. Servers that cannot be
+ * connected to are left out.
+ */
+uint32_t
+server_pool_write_conns(struct context *ctx, struct server_pool *pool,
+                        uint8_t *key, uint32_t keylen, struct conn **conn)
+{
+    rstatus_t status;
+    struct server *replica[SERVER_MAX_REPLICAS];
+    uint32_t i, n, nconn;
+
+    status = server_pool_update(pool);
+    if (status != NC_OK) {
+        return 0;
+    }
+
+    n = server_pool_replicas(pool, key, keylen, replica, pool->replicas);
+    for (i = 0, nconn = 0; i < n; i++) {
+        conn[nconn] = server_pool_server_conn(ctx, replica[i]);
+        if (conn[nconn] != NULL) {
+            nconn++;
+        }
+    }
+
+    if (n == 0) {
+        errno = ENOENT;
+    }
+
+    return nconn;
 }
 
 static rstatus_t
@@ -695,6 +1700,13 @@ server_pool_each_preconnect(void *elem, void *data)
         return status;
     }
 
+    if (array_n(&sp->read_replica) != 0) {
+        status = array_each(&sp->read_replica, server_each_preconnect, NULL);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
     return NC_OK;
 }
 
@@ -722,6 +1734,27 @@ server_pool_each_disconnect(void *elem, void *data)
         return status;
     }
 
+    if (array_n(&sp->read_replica) != 0) {
+        status = array_each(&sp->read_replica, server_each_disconnect, NULL);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    if (array_n(&sp->retired) != 0) {
+        status = array_each(&sp->retired, server_each_disconnect, NULL);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    if (array_n(&sp->retired_replica) != 0) {
+        status = array_each(&sp->retired_replica, server_each_disconnect, NULL);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
     return NC_OK;
 }
 
@@ -771,6 +1804,485 @@ server_pool_each_run(void *elem, void *data)
     return server_pool_run(elem);
 }
 
+static bool
+server_same_addr(struct server *s1, struct server *s2)
+{
+    return s1->family == s2->family && s1->addrlen == s2->addrlen &&
+           memcmp(s1->addr, s2->addr, s1->addrlen) == 0;
+}
+
+/*
+ * Stop the servers in server[] from sharing connections, and forget the
+ * server that each request outstanding on their connections was routed to
+ */
+static void
+server_unshare(struct array *server)
+{
+    uint32_t i, nserver;
+
+    for (i = 0, nserver = array_n(server); i < nserver; i++) {
+        struct server *s = array_get(server, i);
+        struct conn *conn;
+        struct msg *msg;
+
+        if (s->share != NULL) {
+            nc_free(s->share);
+            s->share = NULL;
+        }
+        s->shared = NULL;
+
+        TAILQ_FOREACH(conn, &s->s_conn_q, conn_tqe) {
+            TAILQ_FOREACH(msg, &conn->imsg_q, s_tqe) {
+                msg->server = NULL;
+            }
+            TAILQ_FOREACH(msg, &conn->omsg_q, s_tqe) {
+                msg->server = NULL;
+            }
+        }
+    }
+}
+
+/*
+ * Let every server of the pools with 'server_connections_shared:' set share
+ * the connections of the server at the same address in an earlier pool of
+ * the same protocol, if any. Keys are still distributed over the servers
+ * of each pool, while the requests to servers that share connections are
+ * forwarded on those of the server they share.
+ */
+static rstatus_t
+server_pool_share(struct array *server_pool)
+{
+    uint32_t i, j, k, l, npool, nserver, nother;
+
+    npool = array_n(server_pool);
+
+    for (i = 0; i < npool; i++) {
+        struct server_pool *sp = array_get(server_pool, i);
+
+        server_unshare(&sp->server);
+        server_unshare(&sp->read_replica);
+        server_unshare(&sp->retired);
+        server_unshare(&sp->retired_replica);
+    }
+
+    for (i = 0; i < npool; i++) {
+        struct server_pool *sp = array_get(server_pool, i);
+
+        if (!sp->server_connections_shared) {
+            continue;
+        }
+
+        nserver = array_n(&sp->server) + array_n(&sp->read_replica);
+        for (k = 0; k < nserver; k++) {
+            struct server *s = server_pool_idx(sp, k);
+            struct server *os = NULL;
+
+            for (j = 0; j < i && os == NULL; j++) {
+                struct server_pool *osp = array_get(server_pool, j);
+
+                if (osp->redis != sp->redis) {
+                    continue;
+                }
+
+                nother = array_n(&osp->server) + array_n(&osp->read_replica);
+                for (l = 0; l < nother; l++) {
+                    os = server_pool_idx(osp, l);
+                    if (server_same_addr(os, s)) {
+                        break;
+                    }
+                    os = NULL;
+                }
+            }
+
+            if (os == NULL) {
+                continue;
+            }
+
+            if (os->shared != NULL) {
+                os = os->shared;
+            }
+
+            if (os->share == NULL) {
+                os->share = nc_zalloc(npool * sizeof(*os->share));
+                if (os->share == NULL) {
+                    return NC_ENOMEM;
+                }
+            }
+
+            /* a server listed twice in a pool shares connections just once */
+            if (os->share[i] != NULL) {
+                continue;
+            }
+
+            os->share[i] = s;
+            s->shared = os;
+
+            log_debug(LOG_VERB, "server '%.*s' in pool %"PRIu32" shares "
+                      "connections of pool %"PRIu32" '%.*s'", s->pname.len,
+                      s->pname.data, sp->idx, os->owner->idx,
+                      os->owner->name.len, os->owner->name.data);
+        }
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Hand the connections and the runtime state of server os over to server s,
+ * which replaces it on reload at the same address
+ */
+static void
+server_move(struct server *os, struct server *s)
+{
+    struct server_pool *pool = s->owner;
+    struct conn *conn;
+
+    while (!TAILQ_EMPTY(&os->s_conn_q)) {
+        conn = TAILQ_FIRST(&os->s_conn_q);
+        TAILQ_REMOVE(&os->s_conn_q, conn, conn_tqe);
+        TAILQ_INSERT_TAIL(&s->s_conn_q, conn, conn_tqe);
+
+        conn->owner = s;
+        conn->window = pool->server_pipeline;
+    }
+    s->ns_conn_q = os->ns_conn_q;
+    os->ns_conn_q = 0;
+
+    conn = os->health_conn;
+    if (conn != NULL) {
+        conn->owner = s;
+    }
+    s->health_conn = conn;
+    os->health_conn = NULL;
+
+    s->next_retry = os->next_retry;
+    s->failure_count = os->failure_count;
+    s->health_failures = os->health_failures;
+    s->unhealthy = os->unhealthy;
+
+    s->latency = os->latency;
+    s->timeout = os->timeout;
+    s->nrequest = os->nrequest;
+    s->nrequest_bytes = os->nrequest_bytes;
+}
+
+/*
+ * Retire server s, which is gone from the pool on reload. Its health checks
+ * stop and its connections are closed as soon as they are idle.
+ */
+static void
+server_retire(struct context *ctx, struct server *s)
+{
+    struct conn *conn;
+
+    health_server_deinit(ctx, s);
+
+    TAILQ_FOREACH(conn, &s->s_conn_q, conn_tqe) {
+        if (conn->nrequest == 0) {
+            server_idle(conn);
+        }
+    }
+
+    log_debug(LOG_NOTICE, "retire server '%.*s' with %"PRIu32" connections",
+              s->pname.len, s->pname.data, s->ns_conn_q);
+}
+
+/*
+ * Match the servers in array server with the servers in array old, which
+ * they replace on reload, by their address. The old servers that are left
+ * over are marked retired.
+ */
+static void
+server_pool_match(struct array *server, struct array *old)
+{
+    uint32_t i, j, nserver, nold;
+
+    nold = array_n(old);
+    for (j = 0; j < nold; j++) {
+        struct server *os = array_get(old, j);
+
+        os->retired = 1;
+    }
+
+    for (i = 0, nserver = array_n(server); i < nserver; i++) {
+        struct server *s = array_get(server, i);
+
+        for (j = 0; j < nold; j++) {
+            struct server *os = array_get(old, j);
+
+            if (os->retired && server_same_addr(os, s)) {
+                os->retired = 0;
+                s->prev_idx = os->idx;
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Hand every matched server in array old over to its replacement in array
+ * server and retire the others. Server indices in array old start at base.
+ */
+static void
+server_pool_handover(struct context *ctx, struct array *server,
+                     struct array *old, uint32_t base)
+{
+    uint32_t i, nserver;
+
+    for (i = 0, nserver = array_n(server); i < nserver; i++) {
+        struct server *s = array_get(server, i);
+
+        if (s->prev_idx != UINT32_MAX) {
+            server_move(array_get(old, s->prev_idx - base), s);
+        }
+    }
+
+    for (i = 0, nserver = array_n(old); i < nserver; i++) {
+        struct server *os = array_get(old, i);
+
+        if (os->retired) {
+            server_retire(ctx, os);
+        }
+    }
+}
+
+/*
+ * Swap the servers of pool sp for the servers of conf pool cp. The old
+ * servers are set aside, so that a failure can put them back.
+ */
+static rstatus_t
+server_pool_each_reload_servers(struct server_pool *sp, struct conf_pool *cp)
+{
+    rstatus_t status;
+
+    ASSERT(array_n(&sp->retired) == 0 && array_n(&sp->retired_replica) == 0);
+
+    sp->retired = sp->server;
+    sp->retired_replica = sp->read_replica;
+    array_null(&sp->server);
+    array_null(&sp->read_replica);
+
+    status = server_init(&sp->server, &cp->server, sp);
+    if (status != NC_OK) {
+        goto error;
+    }
+
+    status = server_init_read_replicas(sp, &cp->read_replica);
+    if (status != NC_OK) {
+        server_deinit(&sp->server);
+        goto error;
+    }
+
+    return NC_OK;
+
+error:
+    sp->server = sp->retired;
+    sp->read_replica = sp->retired_replica;
+    array_null(&sp->retired);
+    array_null(&sp->retired_replica);
+    return status;
+}
+
+/*
+ * Put the servers of pool sp, set aside on a failed reload, back in place
+ */
+static void
+server_pool_each_restore_servers(struct server_pool *sp)
+{
+    uint32_t i, nserver;
+
+    server_deinit(&sp->server);
+    server_deinit(&sp->read_replica);
+    sp->server = sp->retired;
+    sp->read_replica = sp->retired_replica;
+    array_null(&sp->retired);
+    array_null(&sp->retired_replica);
+
+    for (i = 0, nserver = array_n(&sp->server); i < nserver; i++) {
+        struct server *s = array_get(&sp->server, i);
+
+        s->retired = 0;
+    }
+
+    for (i = 0, nserver = array_n(&sp->read_replica); i < nserver; i++) {
+        struct server *s = array_get(&sp->read_replica, i);
+
+        s->retired = 0;
+    }
+}
+
+/*
+ * Apply the reloaded configuration cf to the running pools in place. The
+ * pools keep their listeners and client connections and take up the new
+ * directives and servers. A server that stays at the same address keeps
+ * its connections, health and latency state; the servers that are gone are
+ * retired and drained, and the new ones get connected on demand or, with
+ * 'preconnect:', right away. Adding or removing pools, or changing their
+ * name, listen address or protocol requires a restart.
+ */
+rstatus_t
+server_pool_reload(struct context *ctx, struct conf *cf)
+{
+    rstatus_t status;
+    uint32_t i, npool;
+
+    npool = array_n(&ctx->pool);
+    if (array_n(&cf->pool) != npool) {
+        log_error("reload conf '%s' failed: adding or removing pools requires "
+                  "a restart", cf->fname);
+        return NC_ERROR;
+    }
+
+    for (i = 0; i < npool; i++) {
+        struct server_pool *sp = array_get(&ctx->pool, i);
+        struct conf_pool *cp = array_get(&cf->pool, i);
+
+        if (string_compare(&sp->name, &cp->name) != 0 ||
+            string_compare(&sp->addrstr, &cp->listen.pname) != 0 ||
+            sp->redis != (cp->redis ? 1 : 0)) {
+            log_error("reload conf '%s' failed: changing the name, listen "
+                      "address or protocol of pool '%.*s' requires a restart",
+                      cf->fname, sp->name.len, sp->name.data);
+            return NC_ERROR;
+        }
+    }
+
+    for (i = 0; i < npool; i++) {
+        struct server_pool *sp = array_get(&ctx->pool, i);
+        struct conf_pool *cp = array_get(&cf->pool, i);
+
+        status = server_pool_each_reload_servers(sp, cp);
+        if (status != NC_OK) {
+            log_error("reload conf '%s' failed: %s", cf->fname,
+                      strerror(errno));
+            npool = i;
+            goto error;
+        }
+
+        server_pool_match(&sp->server, &sp->retired);
+        server_pool_match(&sp->read_replica, &sp->retired_replica);
+
+        conf_pool_apply(cp, sp);
+        sp->reload_ts = nc_usec_mono();
+    }
+
+    /* stats follow the servers to their new index */
+    status = stats_remap(ctx->stats, &ctx->pool);
+    if (status != NC_OK) {
+        log_error("reload conf '%s' failed: %s", cf->fname, strerror(errno));
+        goto error;
+    }
+
+    for (i = 0; i < npool; i++) {
+        struct server_pool *sp = array_get(&ctx->pool, i);
+
+        /* listener is closed once handed off on upgrade */
+        if (sp->p_conn != NULL) {
+            sp->p_conn->addr = sp->addr;
+        }
+
+        server_pool_handover(ctx, &sp->server, &sp->retired, 0);
+        server_pool_handover(ctx, &sp->read_replica, &sp->retired_replica,
+                             array_n(&sp->retired));
+    }
+
+    status = server_pool_share(&ctx->pool);
+    if (status != NC_OK) {
+        log_warn("sharing server connections failed, ignored: %s",
+                 strerror(errno));
+    }
+
+    status = slowlog_reload(&ctx->pool);
+    if (status != NC_OK) {
+        log_warn("resizing slowlog failed, ignored: %s", strerror(errno));
+    }
+
+    for (i = 0; i < npool; i++) {
+        struct server_pool *sp = array_get(&ctx->pool, i);
+
+        status = server_pool_run(sp);
+        if (status != NC_OK) {
+            log_error("updating pool %"PRIu32" '%.*s' failed: %s", sp->idx,
+                      sp->name.len, sp->name.data, strerror(errno));
+        }
+
+        status = health_pool_reload(ctx, sp);
+        if (status != NC_OK) {
+            log_warn("health checks of pool %"PRIu32" '%.*s' failed, "
+                     "ignored: %s", sp->idx, sp->name.len, sp->name.data,
+                     strerror(errno));
+        }
+
+        status = server_pool_each_preconnect(sp, NULL);
+        if (status != NC_OK) {
+            log_warn("preconnect pool %"PRIu32" '%.*s' failed, ignored: %s",
+                     sp->idx, sp->name.len, sp->name.data, strerror(errno));
+        }
+
+        log_debug(LOG_NOTICE, "reload pool %"PRIu32" '%.*s' with %"PRIu32" "
+                  "servers", sp->idx, sp->name.len, sp->name.data,
+                  array_n(&sp->server));
+    }
+
+    return NC_OK;
+
+error:
+    for (i = 0; i < npool; i++) {
+        struct server_pool *sp = array_get(&ctx->pool, i);
+
+        conf_pool_apply(array_get(&ctx->cf->pool, i), sp);
+        server_pool_each_restore_servers(sp);
+    }
+    return status;
+}
+
+static bool
+server_retired_drained(struct array *server)
+{
+    uint32_t i, nserver;
+
+    for (i = 0, nserver = array_n(server); i < nserver; i++) {
+        struct server *s = array_get(server, i);
+
+        if (s->ns_conn_q != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Return true once the servers retired on reload have closed all their
+ * connections, and release them
+ */
+bool
+server_pool_drained(struct context *ctx)
+{
+    uint32_t i, npool;
+
+    npool = array_n(&ctx->pool);
+    for (i = 0; i < npool; i++) {
+        struct server_pool *sp = array_get(&ctx->pool, i);
+
+        if (!server_retired_drained(&sp->retired) ||
+            !server_retired_drained(&sp->retired_replica)) {
+            return false;
+        }
+    }
+
+    for (i = 0; i < npool; i++) {
+        struct server_pool *sp = array_get(&ctx->pool, i);
+
+        server_deinit(&sp->retired);
+        array_null(&sp->retired);
+        server_deinit(&sp->retired_replica);
+        array_null(&sp->retired_replica);
+    }
+
+    return true;
+}
+
 rstatus_t
 server_pool_init(struct array *server_pool, struct array *conf_pool,
                  struct context *ctx)
@@ -809,6 +2321,19 @@ server_pool_init(struct array *server_pool, struct array *conf_pool,
         return status;
     }
 
+    /* share server connections across pools */
+    status = server_pool_share(server_pool);
+    if (status != NC_OK) {
+        server_pool_deinit(server_pool);
+        return status;
+    }
+
+    status = slowlog_init(server_pool);
+    if (status != NC_OK) {
+        server_pool_deinit(server_pool);
+        return status;
+    }
+
     log_debug(LOG_DEBUG, "init %"PRIu32" pools", npool);
 
     return NC_OK;
@@ -834,6 +2359,9 @@ server_pool_deinit(struct array *server_pool)
         }
 
         server_deinit(&sp->server);
+        server_deinit(&sp->read_replica);
+        server_deinit(&sp->retired);
+        server_deinit(&sp->retired_replica);
 
         log_debug(LOG_DEBUG, "deinit pool %"PRIu32" '%.*s'", sp->idx,
                   sp->name.len, sp->name.data);
@@ -841,5 +2369,7 @@ server_pool_deinit(struct array *server_pool)
 
     array_deinit(server_pool);
 
+    slowlog_deinit();
+
     log_debug(LOG_DEBUG, "deinit %"PRIu32" pools", npool);
 }
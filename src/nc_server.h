@@ -59,6 +59,43 @@
  *            //
  */
 
+#define SERVER_BUDGET_COST          100 /* # tokens a retry or hedge costs */
+#define SERVER_BUDGET_MAX_TOKENS    (10 * SERVER_BUDGET_COST) /* max # tokens */
+#define SERVER_MAX_REPLICAS         8   /* max # replicas of a key */
+#define SERVER_HEDGE_PERCENTILE     950 /* latency permille to hedge reads after */
+#define SERVER_HEDGE_MIN_SAMPLE     32  /* min # samples to hedge reads */
+#define SERVER_LATENCY_NBUCKET      128 /* # latency histogram buckets */
+#define SERVER_LATENCY_WINDOW       (1000 * 1000) /* latency decay interval in usec */
+#define SERVER_OUTLIER_PERCENTILE   990 /* latency permille compared for outliers */
+#define SERVER_TIMEOUT_PERCENTILE   999 /* latency permille scaled for timeouts */
+#define SERVER_TIMEOUT_MIN_SAMPLE   100 /* min # samples to adapt the timeout */
+#define SERVER_OUTLIER_MIN_SAMPLE   32  /* min # samples for a server to be compared */
+#define SERVER_OUTLIER_MIN_SERVER   3   /* min # servers compared to find outliers */
+#define SERVER_IDLE_TIMEOUT         (5 * 1000) /* msec an extra connection idles before close */
+
+#define ACK_CODEC(ACTION)                   \
+    ACTION( ACK_FIRST,          first       ) \
+    ACTION( ACK_QUORUM,         quorum      ) \
+    ACTION( ACK_ALL,            all         ) \
+
+#define DEFINE_ACTION(_ack, _name) _ack,
+typedef enum ack_type {
+    ACK_CODEC( DEFINE_ACTION )
+    ACK_SENTINEL
+} ack_type_t;
+#undef DEFINE_ACTION
+
+#define THROTTLE_CODEC(ACTION)                  \
+    ACTION( THROTTLE_PAUSE,     pause       ) \
+    ACTION( THROTTLE_REJECT,    reject      ) \
+
+#define DEFINE_ACTION(_throttle, _name) _throttle,
+typedef enum throttle_type {
+    THROTTLE_CODEC( DEFINE_ACTION )
+    THROTTLE_SENTINEL
+} throttle_type_t;
+#undef DEFINE_ACTION
+
 typedef uint32_t (*hash_t)(const char *, size_t);
 
 struct continuum {
@@ -66,6 +103,18 @@ struct continuum {
     uint32_t value;  /* hash value */
 };
 
+/*
+ * Response latency histogram of a server. Latencies in usec are put in
+ * log-linear buckets, with four buckets per power of two, so that any
+ * percentile is within ~25% of the actual value. Counts decay by half
+ * every outlier detection interval (or every second), biasing the
+ * histogram towards the recent latencies.
+ */
+struct latency {
+    uint32_t nsample;                        /* # samples */
+    uint32_t bucket[SERVER_LATENCY_NBUCKET]; /* # samples per bucket */
+};
+
 struct server {
     uint32_t           idx;           /* server index */
     struct server_pool *owner;        /* owner pool */
@@ -77,12 +126,32 @@ struct server {
     int                family;        /* socket family */
     socklen_t          addrlen;       /* socket length */
     struct sockaddr    *addr;         /* socket address (ref in conf_server) */
+    struct sockinfo    info;          /* re-resolved address, addr refs it */
+    uint32_t           dns_idx;       /* dns cache index, UINT32_MAX if none */
 
     uint32_t           ns_conn_q;     /* # server connection */
     struct conn_tqh    s_conn_q;      /* server connection q */
 
     int64_t            next_retry;    /* next retry time in usec */
     uint32_t           failure_count; /* # consecutive failures */
+
+    struct conn        *health_conn;    /* health check connection */
+    uint32_t           health_failures; /* # consecutive failed health checks */
+    unsigned           unhealthy:1;     /* ejected on failed health checks? */
+    unsigned           retired:1;       /* removed on reload and draining? */
+    uint32_t           prev_idx;        /* server index before reload */
+
+    struct server      *shared;       /* server whose connections are shared */
+    struct server      **share;       /* server[] sharing connections, by pool */
+
+    struct latency     latency;       /* response latency histogram */
+    int                timeout;       /* adaptive timeout in msec */
+    uint32_t           nrequest;      /* # requests outstanding */
+    uint64_t           nrequest_bytes; /* # bytes of requests outstanding */
+
+    struct server      *master;       /* master server of read replica */
+    uint32_t           replica_idx;   /* index of first read replica */
+    uint32_t           nreplica;      /* # read replica */
 };
 
 struct server_pool {
@@ -94,6 +163,9 @@ struct server_pool {
     struct conn_tqh    c_conn_q;             /* client connection q */
 
     struct array       server;               /* server[] */
+    struct array       read_replica;         /* read replica server[] */
+    struct array       retired;              /* server[] replaced on reload */
+    struct array       retired_replica;      /* read replica server[] replaced on reload */
     uint32_t           ncontinuum;           /* # continuum points */
     uint32_t           nserver_continuum;    /* # servers - live and dead on continuum (const) */
     struct continuum   *continuum;           /* continuum */
@@ -111,30 +183,92 @@ struct server_pool {
     hash_t             key_hash;             /* key hasher */
     struct string      hash_tag;             /* key hash tag (ref in conf_pool) */
     int                timeout;              /* timeout in msec */
+    uint32_t           timeout_limit;        /* # timed out requests tolerated per connection */
+    uint32_t           timeout_factor;       /* adaptive timeout factor over p999 latency */
+    int                timeout_min;          /* min adaptive timeout in msec */
+    int                timeout_max;          /* max adaptive timeout in msec */
+    int                timeout_per_kb;       /* adaptive timeout in msec per KB of request */
+    int64_t            queue_timeout;        /* server inq timeout in usec */
+    int                connect_timeout;      /* connect timeout in msec */
     int                backlog;              /* listen backlog */
     uint32_t           client_connections;   /* maximum # client connection */
     uint32_t           server_connections;   /* maximum # server connection */
+    uint32_t           server_connections_min; /* minimum # server connection */
+    uint32_t           server_connections_depth; /* # outstanding requests per server connection to open another */
+    uint32_t           server_pipeline;      /* max # requests in flight per server connection */
+    int64_t            server_pipeline_latency; /* target in flight latency in usec */
+    int64_t            server_flush_delay;   /* max delay of requests held back to flush in usec */
+    uint32_t           server_flush_requests; /* # requests held back to flush a batch */
+    uint32_t           server_flush_bytes;   /* # request bytes held back to flush a batch */
+    uint32_t           max_server_queue;     /* max # requests outstanding per server */
+    uint32_t           max_server_queue_bytes; /* max # bytes outstanding per server */
+    uint32_t           rate_limit;           /* max # requests per sec */
+    uint32_t           rate_limit_bytes;     /* max # request bytes per sec */
+    uint32_t           client_rate_limit;    /* max # requests per sec per client */
+    uint32_t           client_rate_limit_bytes; /* max # request bytes per sec per client */
+    int                rate_limit_action;    /* over rate limit action (throttle_type_t) */
+    uint32_t           batch_keys;           /* min # keys of a batch client request */
+    uint32_t           batch_weight;         /* batch share of server bandwidth in % */
+    struct bucket      rate_tokens;          /* request rate bucket */
+    struct bucket      rate_bytes_tokens;    /* request bytes rate bucket */
     int64_t            server_retry_timeout; /* server retry timeout in usec */
     uint32_t           server_failure_limit; /* server failure limit */
+    int                health_check_interval; /* health check interval in msec */
+    int64_t            outlier_interval;     /* outlier detection interval in usec */
+    uint32_t           outlier_factor;       /* outlier latency factor over median */
+    uint32_t           outlier_max_ejection; /* max % of servers ejected */
+    uint32_t           stage_sampling;       /* time stages of 1 in n requests */
+    uint32_t           stage_count;          /* requests since last sampled */
+    int64_t            slowlog_slower_than;  /* slowlog threshold in usec */
+    uint32_t           slowlog_max_len;      /* # slowlog entries kept */
+    int64_t            reload_ts;            /* last reload time in usec (monotonic) */
+    int64_t            next_latency_decay;   /* next latency histogram decay time in usec */
+    uint32_t           retry_budget;         /* retry budget in % of requests */
+    uint32_t           retry_tokens;         /* retry tokens available */
+    uint32_t           replicas;             /* # servers holding each key */
+    int                write_ack;            /* replicated write ack (ack_type_t) */
+    uint32_t           hedge_budget;         /* hedge budget in % of requests */
+    uint32_t           hedge_tokens;         /* hedge tokens available */
     unsigned           auto_eject_hosts:1;   /* auto_eject_hosts? */
+    unsigned           retry_reads:1;        /* retry_reads? */
+    unsigned           hedge_reads:1;        /* hedge_reads? */
+    unsigned           rate_limited:1;       /* rate limited? */
     unsigned           preconnect:1;         /* preconnect? */
+    unsigned           server_connections_shared:1; /* server connections shared? */
     unsigned           redis:1;              /* redis? */
 };
 
+void server_conn_addr(struct conn *conn, struct server *server);
 void server_ref(struct conn *conn, void *owner);
 void server_unref(struct conn *conn);
-int server_timeout(struct conn *conn);
+struct server *server_route(struct conn *conn, struct msg *msg);
+struct server *server_routed(struct conn *conn, struct msg *msg);
+int server_timeout(struct conn *conn, struct msg *msg);
+int server_connect_timeout(struct conn *conn);
 bool server_active(struct conn *conn);
 rstatus_t server_init(struct array *server, struct array *conf_server, struct server_pool *sp);
+rstatus_t server_init_read_replicas(struct server_pool *sp, struct array *conf_replica);
 void server_deinit(struct array *server);
 struct conn *server_conn(struct server *server);
 rstatus_t server_connect(struct context *ctx, struct server *server, struct conn *conn);
 void server_close(struct context *ctx, struct conn *conn);
 void server_connected(struct context *ctx, struct conn *conn);
+void server_idle(struct conn *conn);
+void server_window(struct context *ctx, struct conn *conn, struct msg *msg);
+bool server_idle_timedout(struct conn *conn);
 void server_ok(struct context *ctx, struct conn *conn);
+bool server_timedout(struct context *ctx, struct conn *conn, struct msg *msg);
+void server_latency(struct context *ctx, struct conn *conn, struct msg *msg);
+int64_t server_latency_percentile(struct server *server, uint32_t permille);
 
+uint32_t server_pool_replicas(struct server_pool *pool, uint8_t *key, uint32_t keylen, struct server **replica, uint32_t nreplica);
 struct conn *server_pool_conn(struct context *ctx, struct server_pool *pool, uint8_t *key, uint32_t keylen);
+struct conn *server_pool_replica_conn(struct context *ctx, struct server_pool *pool, uint8_t *key, uint32_t keylen, struct server *exclude);
+struct conn *server_pool_read_conn(struct context *ctx, struct server_pool *pool, uint8_t *key, uint32_t keylen);
+uint32_t server_pool_write_conns(struct context *ctx, struct server_pool *pool, uint8_t *key, uint32_t keylen, struct conn **conn);
 rstatus_t server_pool_run(struct server_pool *pool);
+rstatus_t server_pool_reload(struct context *ctx, struct conf *cf);
+bool server_pool_drained(struct context *ctx);
 rstatus_t server_pool_preconnect(struct context *ctx);
 void server_pool_disconnect(struct context *ctx);
 rstatus_t server_pool_init(struct array *server_pool, struct array *conf_pool, struct context *ctx);
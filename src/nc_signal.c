@@ -100,8 +100,9 @@ signal_handler(int signo)
         break;
 
     case SIGHUP:
-        actionstr = ", reopening log file";
+        actionstr = ", reopening log file and reloading conf";
         action = log_reopen;
+        core_reload_request();
         break;
 
     case SIGINT:
@@ -0,0 +1,414 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include <nc_core.h>
+#include <nc_server.h>
+#include <nc_slowlog.h>
+
+/*
+ * Log of slow requests.
+ *
+ * Each pool with 'slowlog_slower_than:' keeps a ring of the last
+ * 'slowlog_max_len:' requests that took at least that long, from the first
+ * byte read off the client to the last byte of the response written back
+ * to it. Requests of such a pool are timed through all their stages, and
+ * an entry keeps the command, the key and the server, the sizes and the
+ * time spent in each stage.
+ *
+ * The rings are allocated up front, so logging a request only copies into
+ * the oldest entry of the ring. The event loop logs entries and the stats
+ * aggregator thread dumps and resets them, under a lock that is only taken
+ * for slow requests.
+ */
+
+/* upper bound of an entry in json, with every key byte escaped */
+#define SLOWLOG_ENTRY_JSON  \
+    (512 + 6 * (SLOWLOG_KEY_LEN + SLOWLOG_SERVER_LEN) + 48 * STATS_NSTAGE)
+
+static struct slowlog *slowlog_pool;        /* slowlog[] by pool index */
+static uint32_t slowlog_npool;              /* # pools */
+static uint64_t slowlog_id;                 /* last entry id */
+static pthread_mutex_t slowlog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+slowlog_copy_str(uint8_t *dst, uint32_t *dstlen, uint32_t size,
+                 uint8_t *src, uint32_t srclen)
+{
+    *dstlen = MIN(srclen, size);
+    if (*dstlen != 0) {
+        nc_memcpy(dst, src, *dstlen);
+    }
+}
+
+/*
+ * Log request req of pool, answered with response rsp, if it was slower
+ * than the pool threshold
+ */
+void
+slowlog_add(struct server_pool *pool, struct msg *req, struct msg *rsp)
+{
+    struct slowlog *sl;
+    struct slowlog_entry *e;
+    struct server *server;
+    int64_t duration;
+    uint32_t i;
+
+    ASSERT(req->request && req->timed);
+    ASSERT(!rsp->request);
+
+    if (pool->slowlog_slower_than == 0) {
+        return;
+    }
+
+    duration = req->stamp[MSG_STAMP_DONE] - req->stamp[MSG_STAMP_RECV];
+    if (duration < pool->slowlog_slower_than) {
+        return;
+    }
+
+    /* a reload since the request was routed may have moved its server */
+    server = req->stamp[MSG_STAMP_ENQUEUED] > pool->reload_ts ?
+             req->server : NULL;
+
+    pthread_mutex_lock(&slowlog_lock);
+
+    sl = &slowlog_pool[pool->idx];
+    if (sl->size == 0) {
+        pthread_mutex_unlock(&slowlog_lock);
+        return;
+    }
+
+    e = &sl->ring[sl->head];
+    sl->head = (sl->head + 1) % sl->size;
+    if (sl->n < sl->size) {
+        sl->n++;
+    }
+
+    e->id = ++slowlog_id;
+    e->timestamp = (int64_t)time(NULL);
+    for (i = 0; i < STATS_NSTAGE; i++) {
+        e->stage[i] = stats_stage_usec(req, i);
+    }
+    e->type = req->type;
+    e->nfrag = req->nfrag;
+    e->request_bytes = req->mlen;
+    e->response_bytes = rsp->mlen;
+
+    if (req->key_start != NULL && req->key_end > req->key_start) {
+        slowlog_copy_str(e->key, &e->keylen, SLOWLOG_KEY_LEN, req->key_start,
+                         (uint32_t)(req->key_end - req->key_start));
+    } else {
+        e->keylen = 0;
+    }
+
+    if (server != NULL) {
+        slowlog_copy_str(e->server, &e->serverlen, SLOWLOG_SERVER_LEN,
+                         server->name.data, server->name.len);
+    } else {
+        e->serverlen = 0;
+    }
+
+    pthread_mutex_unlock(&slowlog_lock);
+
+    log_debug(LOG_VERB, "slowlog req %"PRIu64" type %d in pool %"PRIu32" "
+              "took %"PRId64" usec", req->id, req->type, pool->idx, duration);
+}
+
+/*
+ * Append src as a json string to buf, escaping what json requires
+ */
+static size_t
+slowlog_dump_str(uint8_t *buf, size_t size, uint8_t *src, uint32_t srclen)
+{
+    size_t len = 0;
+    uint32_t i;
+
+    len += (size_t)nc_scnprintf(buf + len, size - len, "\"");
+
+    for (i = 0; i < srclen; i++) {
+        uint8_t ch = src[i];
+
+        if (ch == '"' || ch == '\\') {
+            len += (size_t)nc_scnprintf(buf + len, size - len, "\\%c", ch);
+        } else if (ch < 0x20 || ch >= 0x7f) {
+            len += (size_t)nc_scnprintf(buf + len, size - len, "\\u%04x", ch);
+        } else {
+            len += (size_t)nc_scnprintf(buf + len, size - len, "%c", ch);
+        }
+    }
+
+    len += (size_t)nc_scnprintf(buf + len, size - len, "\"");
+
+    return len;
+}
+
+static size_t
+slowlog_dump_entry(uint8_t *buf, size_t size, struct slowlog_entry *e)
+{
+    struct string *command = msg_type_string(e->type);
+    const char *sep;
+    size_t len = 0;
+    uint32_t i;
+
+    len += (size_t)nc_scnprintf(buf + len, size - len,
+                                "{\"id\":%"PRIu64", \"timestamp\":%"PRId64", "
+                                "\"command\":\"%.*s\", \"key\":", e->id,
+                                e->timestamp, command->len, command->data);
+    len += slowlog_dump_str(buf + len, size - len, e->key, e->keylen);
+    len += (size_t)nc_scnprintf(buf + len, size - len, ", \"server\":");
+    len += slowlog_dump_str(buf + len, size - len, e->server, e->serverlen);
+    len += (size_t)nc_scnprintf(buf + len, size - len,
+                                ", \"fragments\":%"PRIu32", "
+                                "\"request_bytes\":%"PRIu32", "
+                                "\"response_bytes\":%"PRIu32", \"stages\":{",
+                                e->nfrag, e->request_bytes, e->response_bytes);
+
+    for (sep = "", i = 0; i < STATS_NSTAGE; i++) {
+        struct string *name = stats_stage_name(i);
+
+        if (e->stage[i] < 0) {
+            continue;
+        }
+
+        len += (size_t)nc_scnprintf(buf + len, size - len,
+                                    "%s\"%.*s\":%"PRId64"", sep, name->len,
+                                    name->data, e->stage[i]);
+        sep = ", ";
+    }
+
+    len += (size_t)nc_scnprintf(buf + len, size - len, "}}");
+
+    return len;
+}
+
+/*
+ * Return the last count entries (or all with count 0) of the slowlog of
+ * every pool, newest first, as a json object keyed by pool name. The
+ * buffer is allocated and is to be freed by the caller
+ */
+uint8_t *
+slowlog_dump(uint32_t count, size_t *len)
+{
+    uint8_t *buf;
+    size_t size;
+    uint32_t i, j, n;
+
+    pthread_mutex_lock(&slowlog_lock);
+
+    size = 4;
+    for (i = 0; i < slowlog_npool; i++) {
+        struct slowlog *sl = &slowlog_pool[i];
+
+        size += 6 * sl->name.len + 8;
+        size += (size_t)sl->n * SLOWLOG_ENTRY_JSON;
+    }
+
+    buf = nc_alloc(size);
+    if (buf == NULL) {
+        pthread_mutex_unlock(&slowlog_lock);
+        return NULL;
+    }
+
+    *len = 0;
+    *len += (size_t)nc_scnprintf(buf + *len, size - *len, "{");
+
+    for (i = 0; i < slowlog_npool; i++) {
+        struct slowlog *sl = &slowlog_pool[i];
+
+        n = (count == 0) ? sl->n : MIN(count, sl->n);
+
+        *len += slowlog_dump_str(buf + *len, size - *len, sl->name.data,
+                                 sl->name.len);
+        *len += (size_t)nc_scnprintf(buf + *len, size - *len, ":[");
+
+        for (j = 0; j < n; j++) {
+            uint32_t idx = (sl->head + sl->size - 1 - j) % sl->size;
+
+            if (j != 0) {
+                *len += (size_t)nc_scnprintf(buf + *len, size - *len, ", ");
+            }
+            *len += slowlog_dump_entry(buf + *len, size - *len, &sl->ring[idx]);
+        }
+
+        *len += (size_t)nc_scnprintf(buf + *len, size - *len, "]%s",
+                                     i + 1 < slowlog_npool ? ", " : "");
+    }
+
+    *len += (size_t)nc_scnprintf(buf + *len, size - *len, "}\n");
+
+    pthread_mutex_unlock(&slowlog_lock);
+
+    return buf;
+}
+
+/*
+ * Empty the slowlog of every pool, and return the # entries dropped
+ */
+uint32_t
+slowlog_reset(void)
+{
+    uint32_t i, n;
+
+    pthread_mutex_lock(&slowlog_lock);
+
+    for (n = 0, i = 0; i < slowlog_npool; i++) {
+        struct slowlog *sl = &slowlog_pool[i];
+
+        n += sl->n;
+        sl->head = 0;
+        sl->n = 0;
+    }
+
+    pthread_mutex_unlock(&slowlog_lock);
+
+    log_debug(LOG_NOTICE, "slowlog reset, dropped %"PRIu32" entries", n);
+
+    return n;
+}
+
+/*
+ * Resize the ring of slowlog sl to the size pool sp wants, keeping the
+ * newest entries that fit
+ */
+static rstatus_t
+slowlog_resize(struct slowlog *sl, struct server_pool *sp)
+{
+    struct slowlog_entry *ring;
+    uint32_t size, n, i;
+
+    size = sp->slowlog_slower_than == 0 ? 0 : sp->slowlog_max_len;
+    if (size == sl->size) {
+        return NC_OK;
+    }
+
+    ring = NULL;
+    n = MIN(size, sl->n);
+
+    if (size != 0) {
+        ring = nc_alloc(size * sizeof(*ring));
+        if (ring == NULL) {
+            return NC_ENOMEM;
+        }
+
+        for (i = 0; i < n; i++) {
+            uint32_t idx = (sl->head + sl->size - 1 - i) % sl->size;
+
+            ring[n - 1 - i] = sl->ring[idx];
+        }
+    }
+
+    if (sl->ring != NULL) {
+        nc_free(sl->ring);
+    }
+
+    sl->ring = ring;
+    sl->size = size;
+    sl->head = (size == 0) ? 0 : n % size;
+    sl->n = n;
+
+    return NC_OK;
+}
+
+rstatus_t
+slowlog_init(struct array *server_pool)
+{
+    rstatus_t status;
+    uint32_t i, npool;
+
+    ASSERT(slowlog_pool == NULL && slowlog_npool == 0);
+
+    npool = array_n(server_pool);
+
+    slowlog_pool = nc_zalloc(npool * sizeof(*slowlog_pool));
+    if (slowlog_pool == NULL) {
+        return NC_ENOMEM;
+    }
+    slowlog_npool = npool;
+
+    for (i = 0; i < npool; i++) {
+        struct server_pool *sp = array_get(server_pool, i);
+        struct slowlog *sl = &slowlog_pool[i];
+
+        status = string_duplicate(&sl->name, &sp->name);
+        if (status != NC_OK) {
+            slowlog_deinit();
+            return status;
+        }
+
+        status = slowlog_resize(sl, sp);
+        if (status != NC_OK) {
+            slowlog_deinit();
+            return status;
+        }
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Resize the slowlog of the pools, that keep their names and indexes on
+ * reload, to their reloaded 'slowlog_max_len:'
+ */
+rstatus_t
+slowlog_reload(struct array *server_pool)
+{
+    rstatus_t status;
+    uint32_t i;
+
+    ASSERT(array_n(server_pool) == slowlog_npool);
+
+    pthread_mutex_lock(&slowlog_lock);
+
+    for (i = 0; i < slowlog_npool; i++) {
+        status = slowlog_resize(&slowlog_pool[i], array_get(server_pool, i));
+        if (status != NC_OK) {
+            pthread_mutex_unlock(&slowlog_lock);
+            return status;
+        }
+    }
+
+    pthread_mutex_unlock(&slowlog_lock);
+
+    return NC_OK;
+}
+
+void
+slowlog_deinit(void)
+{
+    uint32_t i;
+
+    pthread_mutex_lock(&slowlog_lock);
+
+    for (i = 0; i < slowlog_npool; i++) {
+        struct slowlog *sl = &slowlog_pool[i];
+
+        string_deinit(&sl->name);
+        if (sl->ring != NULL) {
+            nc_free(sl->ring);
+        }
+    }
+
+    if (slowlog_pool != NULL) {
+        nc_free(slowlog_pool);
+    }
+    slowlog_pool = NULL;
+    slowlog_npool = 0;
+
+    pthread_mutex_unlock(&slowlog_lock);
+}
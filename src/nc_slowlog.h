@@ -0,0 +1,56 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_SLOWLOG_H_
+#define _NC_SLOWLOG_H_
+
+#include <nc_core.h>
+
+#define SLOWLOG_KEY_LEN         128     /* max key bytes kept per entry */
+#define SLOWLOG_SERVER_LEN      64      /* max server name bytes kept per entry */
+
+struct slowlog_entry {
+    uint64_t   id;                          /* entry id */
+    int64_t    timestamp;                   /* logged at, in sec since Epoch */
+    int64_t    stage[STATS_NSTAGE];         /* usec per stage, -1 if not reached */
+    msg_type_t type;                        /* request type */
+    uint32_t   nfrag;                       /* # fragments, 0 if not fragmented */
+    uint32_t   request_bytes;               /* request length */
+    uint32_t   response_bytes;              /* response length */
+    uint32_t   keylen;                      /* key length kept */
+    uint32_t   serverlen;                   /* server name length kept */
+    uint8_t    key[SLOWLOG_KEY_LEN];        /* key, truncated */
+    uint8_t    server[SLOWLOG_SERVER_LEN];  /* server name, truncated */
+};
+
+struct slowlog {
+    struct string        name;  /* pool name (copy) */
+    struct slowlog_entry *ring; /* ring of entries */
+    uint32_t             size;  /* # entries the ring holds */
+    uint32_t             head;  /* next entry to write */
+    uint32_t             n;     /* # entries in the ring */
+};
+
+void slowlog_add(struct server_pool *pool, struct msg *req, struct msg *rsp);
+uint8_t *slowlog_dump(uint32_t count, size_t *len);
+uint32_t slowlog_reset(void);
+
+rstatus_t slowlog_init(struct array *server_pool);
+rstatus_t slowlog_reload(struct array *server_pool);
+void slowlog_deinit(void);
+
+#endif
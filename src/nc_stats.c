@@ -25,6 +25,8 @@
 
 #include <nc_core.h>
 #include <nc_server.h>
+#include <nc_dns.h>
+#include <nc_slowlog.h>
 
 struct stats_desc {
     char *name; /* stats name */
@@ -51,6 +53,90 @@ static struct stats_desc stats_server_desc[] = {
 };
 #undef DEFINE_ACTION
 
+#define DEFINE_ACTION(_name, _usec, _desc) string(#_name),
+static struct string stats_latency_names[] = {
+    STATS_LATENCY_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _usec, _desc) _usec,
+static int64_t stats_latency_bounds[] = {
+    STATS_LATENCY_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _usec, _desc) { .name = #_name, .desc = _desc },
+static struct stats_desc stats_latency_desc[] = {
+    STATS_LATENCY_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _from, _to, _desc) string(#_name),
+static struct string stats_stage_names[] = {
+    STATS_STAGE_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _from, _to, _desc) _from,
+static msg_stamp_t stats_stage_from[] = {
+    STATS_STAGE_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _from, _to, _desc) _to,
+static msg_stamp_t stats_stage_to[] = {
+    STATS_STAGE_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _from, _to, _desc) { .name = #_name, .desc = _desc },
+static struct stats_desc stats_stage_desc[] = {
+    STATS_STAGE_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _desc) string(#_name),
+static struct string stats_loop_names[] = {
+    STATS_LOOP_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _desc) { .name = #_name, .desc = _desc },
+static struct stats_desc stats_loop_desc[] = {
+    STATS_LOOP_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _n, _desc) string(#_name),
+static struct string stats_events_names[] = {
+    STATS_EVENTS_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _n, _desc) _n,
+static int64_t stats_events_bounds[] = {
+    STATS_EVENTS_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _n, _desc) { .name = #_name, .desc = _desc },
+static struct stats_desc stats_events_desc[] = {
+    STATS_EVENTS_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+static struct stats_desc stats_command_desc[] = {
+    { .name = "command_requests", .desc = "# requests" },
+    { .name = "command_request_bytes", .desc = "total request bytes" },
+    { .name = "command_response_bytes", .desc = "total response bytes" },
+};
+
+static struct string stats_command_str = string("commands");
+static struct string stats_stage_str = string("stages");
+static struct string stats_requests_str = string("requests");
+static struct string stats_request_bytes_str = string("request_bytes");
+static struct string stats_response_bytes_str = string("response_bytes");
+
 void
 stats_describe(void)
 {
@@ -69,6 +155,38 @@ stats_describe(void)
         log_stderr("  %-20s\"%s\"", stats_server_desc[i].name,
                    stats_server_desc[i].desc);
     }
+
+    log_stderr("");
+
+    log_stderr("command stats:");
+    log_stderr("  %-20s\"%s\"", "requests", "# requests");
+    log_stderr("  %-20s\"%s\"", "request_bytes", "total request bytes");
+    log_stderr("  %-20s\"%s\"", "response_bytes", "total response bytes");
+    for (i = 0; i < NELEMS(stats_latency_desc); i++) {
+        log_stderr("  %-20s\"%s\"", stats_latency_desc[i].name,
+                   stats_latency_desc[i].desc);
+    }
+
+    log_stderr("");
+
+    log_stderr("stage stats:");
+    for (i = 0; i < NELEMS(stats_stage_desc); i++) {
+        log_stderr("  %-20s\"%s\"", stats_stage_desc[i].name,
+                   stats_stage_desc[i].desc);
+    }
+
+    log_stderr("");
+
+    log_stderr("loop stats:");
+    for (i = 0; i < NELEMS(stats_loop_desc); i++) {
+        log_stderr("  %-20s\"%s\"", stats_loop_desc[i].name,
+                   stats_loop_desc[i].desc);
+    }
+    log_stderr("  %-20s\"%s\"", "events", "# wakeups by events returned");
+    for (i = 0; i < NELEMS(stats_events_desc); i++) {
+        log_stderr("    %-18s\"%s\"", stats_events_desc[i].name,
+                   stats_events_desc[i].desc);
+    }
 }
 
 static void
@@ -187,13 +305,18 @@ stats_server_init(struct stats_server *sts, struct server *s)
 
 }
 
+/*
+ * Map stats of the servers in server[], followed by those of the read
+ * replicas in replica[], in the order of their server index
+ */
 static rstatus_t
-stats_server_map(struct array *stats_server, struct array *server)
+stats_server_map(struct array *stats_server, struct array *server,
+                 struct array *replica)
 {
     rstatus_t status;
     uint32_t i, nserver;
 
-    nserver = array_n(server);
+    nserver = array_n(server) + array_n(replica);
     ASSERT(nserver != 0);
 
     status = array_init(stats_server, nserver, sizeof(struct stats_server));
@@ -202,9 +325,13 @@ stats_server_map(struct array *stats_server, struct array *server)
     }
 
     for (i = 0; i < nserver; i++) {
-        struct server *s = array_get(server, i);
+        struct server *s = i < array_n(server) ?
+                           array_get(server, i) :
+                           array_get(replica, i - array_n(server));
         struct stats_server *sts = array_push(stats_server);
 
+        ASSERT(s->idx == i);
+
         status = stats_server_init(sts, s);
         if (status != NC_OK) {
             return status;
@@ -240,15 +367,24 @@ stats_pool_init(struct stats_pool *stp, struct server_pool *sp)
     stp->name = sp->name;
     array_null(&stp->metric);
     array_null(&stp->server);
+    stp->redis = sp->redis;
+    memset(stp->stage, 0, sizeof(stp->stage));
+
+    stp->command = nc_zalloc(MSG_SENTINEL * sizeof(*stp->command));
+    if (stp->command == NULL) {
+        return NC_ENOMEM;
+    }
 
     status = stats_pool_metric_init(&stp->metric);
     if (status != NC_OK) {
+        nc_free(stp->command);
         return status;
     }
 
-    status = stats_server_map(&stp->server, &sp->server);
+    status = stats_server_map(&stp->server, &sp->server, &sp->read_replica);
     if (status != NC_OK) {
         stats_metric_deinit(&stp->metric);
+        nc_free(stp->command);
         return status;
     }
 
@@ -271,6 +407,8 @@ stats_pool_reset(struct array *stats_pool)
         uint32_t j, nserver;
 
         stats_metric_reset(&stp->metric);
+        memset(stp->command, 0, MSG_SENTINEL * sizeof(*stp->command));
+        memset(stp->stage, 0, sizeof(stp->stage));
 
         nserver = array_n(&stp->server);
         for (j = 0; j < nserver; j++) {
@@ -320,12 +458,29 @@ stats_pool_unmap(struct array *stats_pool)
         struct stats_pool *stp = array_pop(stats_pool);
         stats_metric_deinit(&stp->metric);
         stats_server_unmap(&stp->server);
+        nc_free(stp->command);
     }
     array_deinit(stats_pool);
 
     log_debug(LOG_VVVERB, "unmap %"PRIu32" stats pool", npool);
 }
 
+/*
+ * Return the first and the last msg type of the requests of a pool, that
+ * stats are kept by
+ */
+static msg_type_t
+stats_command_first(struct stats_pool *stp)
+{
+    return stp->redis ? MSG_REQ_REDIS_DEL : MSG_REQ_MC_GET;
+}
+
+static msg_type_t
+stats_command_last(struct stats_pool *stp)
+{
+    return stp->redis ? MSG_REQ_REDIS_EVALSHA : MSG_REQ_MC_QUIT;
+}
+
 static rstatus_t
 stats_create_buf(struct stats *st)
 {
@@ -334,7 +489,7 @@ stats_create_buf(struct stats *st)
     uint32_t pool_extra = 8;        /* '"pool_name": { ' + ' }' */
     uint32_t server_extra = 8;      /* '"server_name": { ' + ' }' */
     size_t size = 0;
-    uint32_t i;
+    uint32_t i, j;
 
     ASSERT(st->buf.data == NULL && st->buf.size == 0);
 
@@ -361,10 +516,38 @@ stats_create_buf(struct stats *st)
     size += int64_max_digits;
     size += key_value_extra;
 
+    size += st->resolve_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    /* event loop */
+    size += st->loop_str.len;
+    size += pool_extra;
+
+    for (i = 0; i < STATS_LOOP_NFIELD; i++) {
+        size += stats_loop_names[i].len;
+        size += server_extra;
+
+        for (j = 0; j < STATS_LATENCY_NBUCKET; j++) {
+            size += stats_latency_names[j].len;
+            size += int64_max_digits;
+            size += key_value_extra;
+        }
+    }
+
+    size += st->events_str.len;
+    size += server_extra;
+
+    for (i = 0; i < STATS_EVENTS_NBUCKET; i++) {
+        size += stats_events_names[i].len;
+        size += int64_max_digits;
+        size += key_value_extra;
+    }
+
     /* server pools */
     for (i = 0; i < array_n(&st->sum); i++) {
         struct stats_pool *stp = array_get(&st->sum, i);
-        uint32_t j;
+        uint32_t k;
 
         size += stp->name.len;
         size += pool_extra;
@@ -377,10 +560,46 @@ stats_create_buf(struct stats *st)
             size += key_value_extra;
         }
 
+        /* commands per pool */
+        size += stats_command_str.len;
+        size += server_extra;
+
+        for (j = stats_command_first(stp); j <= stats_command_last(stp); j++) {
+            struct string *name = msg_type_string(j);
+
+            size += name->len;
+            size += server_extra;
+
+            size += stats_requests_str.len;
+            size += stats_request_bytes_str.len;
+            size += stats_response_bytes_str.len;
+            size += 3 * (int64_max_digits + key_value_extra);
+
+            for (k = 0; k < STATS_LATENCY_NBUCKET; k++) {
+                size += stats_latency_names[k].len;
+                size += int64_max_digits;
+                size += key_value_extra;
+            }
+        }
+
+        /* stages per pool */
+        size += stats_stage_str.len;
+        size += server_extra;
+
+        for (j = 0; j < STATS_NSTAGE; j++) {
+            size += stats_stage_names[j].len;
+            size += server_extra;
+
+            for (k = 0; k < STATS_LATENCY_NBUCKET; k++) {
+                size += stats_latency_names[k].len;
+                size += int64_max_digits;
+                size += key_value_extra;
+            }
+        }
+
         /* servers per pool */
         for (j = 0; j < array_n(&stp->server); j++) {
             struct stats_server *sts = array_get(&stp->server, j);
-            uint32_t k;
 
             size += sts->name.len;
             size += server_extra;
@@ -508,6 +727,11 @@ stats_add_header(struct stats *st)
         return status;
     }
 
+    status = stats_add_num(st, &st->resolve_str, dns_resolve_time());
+    if (status != NC_OK) {
+        return status;
+    }
+
     return NC_OK;
 }
 
@@ -609,115 +833,176 @@ stats_copy_metric(struct stats *st, struct array *metric)
     return NC_OK;
 }
 
-static void
-stats_aggregate_metric(struct array *dst, struct array *src)
+/*
+ * Copy the stats of the commands of pool stp that were seen at all, as
+ * a "commands" object keyed by command name
+ */
+static rstatus_t
+stats_copy_command(struct stats *st, struct stats_pool *stp)
 {
+    rstatus_t status;
+    msg_type_t type;
     uint32_t i;
+    bool nested;
 
-    for (i = 0; i < array_n(src); i++) {
-        struct stats_metric *stm1, *stm2;
-
-        stm1 = array_get(src, i);
-        stm2 = array_get(dst, i);
-
-        ASSERT(stm1->type == stm2->type);
+    nested = false;
 
-        switch (stm1->type) {
-        case STATS_COUNTER:
-            stm2->value.counter += stm1->value.counter;
-            break;
+    for (type = stats_command_first(stp); type <= stats_command_last(stp);
+         type++) {
+        struct stats_command *stc = &stp->command[type];
 
-        case STATS_GAUGE:
-            stm2->value.counter += stm1->value.counter;
-            break;
+        if (stc->requests == 0) {
+            continue;
+        }
 
-        case STATS_TIMESTAMP:
-            if (stm1->value.timestamp) {
-                stm2->value.timestamp = stm1->value.timestamp;
+        if (!nested) {
+            status = stats_begin_nesting(st, &stats_command_str);
+            if (status != NC_OK) {
+                return status;
             }
-            break;
-
-        default:
-            NOT_REACHED();
+            nested = true;
         }
-    }
-}
 
-static void
-stats_aggregate(struct stats *st)
-{
-    uint32_t i;
+        status = stats_begin_nesting(st, msg_type_string(type));
+        if (status != NC_OK) {
+            return status;
+        }
 
-    if (st->aggregate == 0) {
-        log_debug(LOG_PVERB, "skip aggregate of shadow %p to sum %p as "
-                  "generator is slow", st->shadow.elem, st->sum.elem);
-        return;
-    }
+        status = stats_add_num(st, &stats_requests_str, stc->requests);
+        if (status != NC_OK) {
+            return status;
+        }
 
-    log_debug(LOG_PVERB, "aggregate stats shadow %p to sum %p", st->shadow.elem,
-              st->sum.elem);
+        status = stats_add_num(st, &stats_request_bytes_str,
+                               stc->request_bytes);
+        if (status != NC_OK) {
+            return status;
+        }
 
-    for (i = 0; i < array_n(&st->shadow); i++) {
-        struct stats_pool *stp1, *stp2;
-        uint32_t j;
+        status = stats_add_num(st, &stats_response_bytes_str,
+                               stc->response_bytes);
+        if (status != NC_OK) {
+            return status;
+        }
 
-        stp1 = array_get(&st->shadow, i);
-        stp2 = array_get(&st->sum, i);
-        stats_aggregate_metric(&stp2->metric, &stp1->metric);
+        for (i = 0; i < STATS_LATENCY_NBUCKET; i++) {
+            status = stats_add_num(st, &stats_latency_names[i],
+                                   stc->latency[i]);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
 
-        for (j = 0; j < array_n(&stp1->server); j++) {
-            struct stats_server *sts1, *sts2;
+        status = stats_end_nesting(st);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
 
-            sts1 = array_get(&stp1->server, j);
-            sts2 = array_get(&stp2->server, j);
-            stats_aggregate_metric(&sts2->metric, &sts1->metric);
+    if (nested) {
+        status = stats_end_nesting(st);
+        if (status != NC_OK) {
+            return status;
         }
     }
 
-    st->aggregate = 0;
+    return NC_OK;
 }
 
+/*
+ * Copy the stats of the event loop as a "loop" object, with an object of
+ * time buckets for each part of the loop and one of events per wakeup
+ */
 static rstatus_t
-stats_make_rsp(struct stats *st)
+stats_copy_loop(struct stats *st)
 {
     rstatus_t status;
-    uint32_t i;
+    struct stats_loop *stl = &st->loop_sum;
+    uint32_t i, j;
 
-    status = stats_add_header(st);
+    status = stats_begin_nesting(st, &st->loop_str);
     if (status != NC_OK) {
         return status;
     }
 
-    for (i = 0; i < array_n(&st->sum); i++) {
-        struct stats_pool *stp = array_get(&st->sum, i);
-        uint32_t j;
+    for (i = 0; i < STATS_LOOP_NFIELD; i++) {
+        status = stats_begin_nesting(st, &stats_loop_names[i]);
+        if (status != NC_OK) {
+            return status;
+        }
 
-        status = stats_begin_nesting(st, &stp->name);
+        for (j = 0; j < STATS_LATENCY_NBUCKET; j++) {
+            status = stats_add_num(st, &stats_latency_names[j],
+                                   stl->time[i][j]);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        status = stats_end_nesting(st);
         if (status != NC_OK) {
             return status;
         }
+    }
 
-        /* copy pool metric from sum(c) to buffer */
-        status = stats_copy_metric(st, &stp->metric);
+    status = stats_begin_nesting(st, &st->events_str);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < STATS_EVENTS_NBUCKET; i++) {
+        status = stats_add_num(st, &stats_events_names[i], stl->events[i]);
         if (status != NC_OK) {
             return status;
         }
+    }
 
-        for (j = 0; j < array_n(&stp->server); j++) {
-            struct stats_server *sts = array_get(&stp->server, j);
+    status = stats_end_nesting(st);
+    if (status != NC_OK) {
+        return status;
+    }
 
-            status = stats_begin_nesting(st, &sts->name);
-            if (status != NC_OK) {
-                return status;
-            }
+    return stats_end_nesting(st);
+}
 
-            /* copy server metric from sum(c) to buffer */
-            status = stats_copy_metric(st, &sts->metric);
+/*
+ * Copy the latency buckets of the stages that sampled requests of pool stp
+ * went through, as a "stages" object keyed by stage name
+ */
+static rstatus_t
+stats_copy_stage(struct stats *st, struct stats_pool *stp)
+{
+    rstatus_t status;
+    uint32_t i, j;
+    int64_t n;
+    bool nested;
+
+    nested = false;
+
+    for (i = 0; i < STATS_NSTAGE; i++) {
+        for (n = 0, j = 0; j < STATS_LATENCY_NBUCKET; j++) {
+            n += stp->stage[i][j];
+        }
+        if (n == 0) {
+            continue;
+        }
+
+        if (!nested) {
+            status = stats_begin_nesting(st, &stats_stage_str);
             if (status != NC_OK) {
                 return status;
             }
+            nested = true;
+        }
 
-            status = stats_end_nesting(st);
+        status = stats_begin_nesting(st, &stats_stage_names[i]);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        for (j = 0; j < STATS_LATENCY_NBUCKET; j++) {
+            status = stats_add_num(st, &stats_latency_names[j],
+                                   stp->stage[i][j]);
             if (status != NC_OK) {
                 return status;
             }
@@ -729,25 +1014,997 @@ stats_make_rsp(struct stats *st)
         }
     }
 
-    status = stats_add_footer(st);
-    if (status != NC_OK) {
-        return status;
+    if (nested) {
+        status = stats_end_nesting(st);
+        if (status != NC_OK) {
+            return status;
+        }
     }
 
     return NC_OK;
 }
 
-static rstatus_t
-stats_send_rsp(struct stats *st)
+static void
+stats_aggregate_metric(struct array *dst, struct array *src)
 {
-    rstatus_t status;
-    ssize_t n;
-    int sd;
+    uint32_t i;
 
-    status = stats_make_rsp(st);
-    if (status != NC_OK) {
-        return status;
-    }
+    for (i = 0; i < array_n(src); i++) {
+        struct stats_metric *stm1, *stm2;
+
+        stm1 = array_get(src, i);
+        stm2 = array_get(dst, i);
+
+        ASSERT(stm1->type == stm2->type);
+
+        switch (stm1->type) {
+        case STATS_COUNTER:
+            stm2->value.counter += stm1->value.counter;
+            break;
+
+        case STATS_GAUGE:
+            stm2->value.counter += stm1->value.counter;
+            break;
+
+        case STATS_TIMESTAMP:
+            if (stm1->value.timestamp) {
+                stm2->value.timestamp = stm1->value.timestamp;
+            }
+            break;
+
+        default:
+            NOT_REACHED();
+        }
+    }
+}
+
+static void
+stats_aggregate_command(struct stats_command *dst, struct stats_command *src)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < MSG_SENTINEL; i++) {
+        if (src[i].requests == 0 && src[i].response_bytes == 0) {
+            continue;
+        }
+
+        dst[i].requests += src[i].requests;
+        dst[i].request_bytes += src[i].request_bytes;
+        dst[i].response_bytes += src[i].response_bytes;
+        for (j = 0; j < STATS_LATENCY_NBUCKET; j++) {
+            dst[i].latency[j] += src[i].latency[j];
+        }
+    }
+}
+
+static void
+stats_aggregate_stage(struct stats_pool *dst, struct stats_pool *src)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < STATS_NSTAGE; i++) {
+        for (j = 0; j < STATS_LATENCY_NBUCKET; j++) {
+            dst->stage[i][j] += src->stage[i][j];
+        }
+    }
+}
+
+static void
+stats_aggregate_loop(struct stats_loop *dst, struct stats_loop *src)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < STATS_LOOP_NFIELD; i++) {
+        for (j = 0; j < STATS_LATENCY_NBUCKET; j++) {
+            dst->time[i][j] += src->time[i][j];
+        }
+    }
+
+    for (i = 0; i < STATS_EVENTS_NBUCKET; i++) {
+        dst->events[i] += src->events[i];
+    }
+}
+
+static void
+stats_aggregate(struct stats *st)
+{
+    uint32_t i;
+
+    if (st->aggregate == 0) {
+        log_debug(LOG_PVERB, "skip aggregate of shadow %p to sum %p as "
+                  "generator is slow", st->shadow.elem, st->sum.elem);
+        return;
+    }
+
+    log_debug(LOG_PVERB, "aggregate stats shadow %p to sum %p", st->shadow.elem,
+              st->sum.elem);
+
+    stats_aggregate_loop(&st->loop_sum, st->loop_shadow);
+
+    for (i = 0; i < array_n(&st->shadow); i++) {
+        struct stats_pool *stp1, *stp2;
+        uint32_t j;
+
+        stp1 = array_get(&st->shadow, i);
+        stp2 = array_get(&st->sum, i);
+        stats_aggregate_metric(&stp2->metric, &stp1->metric);
+        stats_aggregate_command(stp2->command, stp1->command);
+        stats_aggregate_stage(stp2, stp1);
+
+        for (j = 0; j < array_n(&stp1->server); j++) {
+            struct stats_server *sts1, *sts2;
+
+            sts1 = array_get(&stp1->server, j);
+            sts2 = array_get(&stp2->server, j);
+            stats_aggregate_metric(&sts2->metric, &sts1->metric);
+        }
+    }
+
+    st->aggregate = 0;
+}
+
+static rstatus_t
+stats_make_rsp(struct stats *st)
+{
+    rstatus_t status;
+    uint32_t i;
+
+    status = stats_add_header(st);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    /* copy event loop stats from sum(c) to buffer */
+    status = stats_copy_loop(st);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < array_n(&st->sum); i++) {
+        struct stats_pool *stp = array_get(&st->sum, i);
+        uint32_t j;
+
+        status = stats_begin_nesting(st, &stp->name);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        /* copy pool metric from sum(c) to buffer */
+        status = stats_copy_metric(st, &stp->metric);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        /* copy command stats from sum(c) to buffer */
+        status = stats_copy_command(st, stp);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        /* copy stage stats from sum(c) to buffer */
+        status = stats_copy_stage(st, stp);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        for (j = 0; j < array_n(&stp->server); j++) {
+            struct stats_server *sts = array_get(&stp->server, j);
+
+            status = stats_begin_nesting(st, &sts->name);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            /* copy server metric from sum(c) to buffer */
+            status = stats_copy_metric(st, &sts->metric);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            status = stats_end_nesting(st);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        status = stats_end_nesting(st);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    status = stats_add_footer(st);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return NC_OK;
+}
+
+/*
+ * The metrics text is the stats in sum (c) in the openmetrics text format,
+ * served over http on the stats port. It is built once and then, on each
+ * scrape, only the values of the samples that changed since the last one are
+ * formatted again and patched in place, so that a scrape costs a walk over
+ * the values rather than a printf per sample. The text is built again when the shape
+ * of it changes: on reload, or when a command or a stage is first seen.
+ * Values that need more or fewer digits than they had are spliced in with
+ * one copy of the text, without formatting the labels again.
+ */
+static rstatus_t
+stats_metrics_append(struct stats *st, const char *data, size_t len)
+{
+    struct stats_buffer *buf = &st->metrics;
+
+    if (buf->len + len > buf->size) {
+        uint8_t *grown;
+        size_t size;
+
+        size = buf->size == 0 ? STATS_METRICS_SIZE : buf->size;
+        while (size < buf->len + len) {
+            size *= 2;
+        }
+
+        grown = nc_realloc(buf->data, size);
+        if (grown == NULL) {
+            return NC_ENOMEM;
+        }
+
+        buf->data = grown;
+        buf->size = size;
+    }
+
+    nc_memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+
+    return NC_OK;
+}
+
+static rstatus_t
+stats_metrics_printf(struct stats *st, const char *fmt, ...)
+{
+    char line[256];
+    va_list args;
+    int n;
+
+    va_start(args, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    if (n < 0 || n >= (int)sizeof(line)) {
+        return NC_ERROR;
+    }
+
+    return stats_metrics_append(st, line, (size_t)n);
+}
+
+/*
+ * Append label name="value", escaping the value as the text format wants
+ */
+static rstatus_t
+stats_metrics_label(struct stats *st, const char *name, struct string *value,
+                    bool first)
+{
+    rstatus_t status;
+    uint32_t i, j;
+
+    status = stats_metrics_printf(st, "%s%s=\"", first ? "" : ",", name);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0, j = 0; j < value->len; j++) {
+        const char *esc;
+
+        switch (value->data[j]) {
+        case '\\':
+            esc = "\\\\";
+            break;
+
+        case '"':
+            esc = "\\\"";
+            break;
+
+        case '\n':
+            esc = "\\n";
+            break;
+
+        default:
+            continue;
+        }
+
+        status = stats_metrics_append(st, (char *)value->data + i, j - i);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_metrics_append(st, esc, 2);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        i = j + 1;
+    }
+
+    status = stats_metrics_append(st, (char *)value->data + i, j - i);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return stats_metrics_append(st, "\"", 1);
+}
+
+/*
+ * Append the type and help of metric family nutcracker_<prefix><name>
+ */
+static rstatus_t
+stats_metrics_family(struct stats *st, const char *prefix, const char *name,
+                     const char *type, const char *help)
+{
+    if (!st->metrics_build) {
+        return NC_OK;
+    }
+
+    return stats_metrics_printf(st, "# TYPE nutcracker_%s%s %s\n"
+                                "# HELP nutcracker_%s%s %s\n", prefix, name,
+                                type, prefix, name, help);
+}
+
+/*
+ * Append sample nutcracker_<prefix><name><suffix> with its labels and
+ * value when building the metrics text; otherwise patch the value of the
+ * next sample in place if it changed. The labels are only looked at when
+ * building, the value is formatted only when building or when it changed
+ */
+static rstatus_t
+stats_metrics_sample(struct stats *st, const char *prefix, const char *name,
+                     const char *suffix, struct string *pool,
+                     const char *lname, struct string *lvalue, const char *le,
+                     int64_t value)
+{
+    rstatus_t status;
+    struct stats_sample *sm;
+    char digits[32];
+    int n;
+
+    if (!st->metrics_build) {
+        if (st->metrics_next >= array_n(&st->metrics_sample)) {
+            st->metrics_stale = 1;
+            return NC_OK;
+        }
+
+        sm = array_get(&st->metrics_sample, st->metrics_next++);
+        if (sm->value == value) {
+            return NC_OK;
+        }
+
+        sm->value = value;
+
+        n = nc_scnprintf(digits, sizeof(digits), "%"PRId64, value);
+        if ((uint32_t)n != sm->len) {
+            sm->resize = 1;
+            st->metrics_resize = 1;
+            return NC_OK;
+        }
+
+        nc_memcpy(st->metrics.data + sm->off, digits, (size_t)n);
+
+        return NC_OK;
+    }
+
+    status = stats_metrics_printf(st, "nutcracker_%s%s%s", prefix, name,
+                                  suffix);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    if (pool != NULL || lname != NULL || le != NULL) {
+        status = stats_metrics_append(st, "{", 1);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        if (pool != NULL) {
+            status = stats_metrics_label(st, "pool", pool, true);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        if (lname != NULL) {
+            status = stats_metrics_label(st, lname, lvalue, pool == NULL);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        if (le != NULL) {
+            status = stats_metrics_printf(st, "%sle=\"%s\"",
+                                          pool == NULL && lname == NULL ?
+                                          "" : ",", le);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        status = stats_metrics_append(st, "}", 1);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    status = stats_metrics_append(st, " ", 1);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    sm = array_push(&st->metrics_sample);
+    if (sm == NULL) {
+        return NC_ENOMEM;
+    }
+
+    n = nc_scnprintf(digits, sizeof(digits), "%"PRId64, value);
+    sm->value = value;
+    sm->off = st->metrics.len;
+    sm->len = (uint32_t)n;
+    sm->resize = 0;
+
+    status = stats_metrics_append(st, digits, (size_t)n);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return stats_metrics_append(st, "\n", 1);
+}
+
+/*
+ * Append histogram nutcracker_<prefix><name> over buckets with upper
+ * bounds in bound, as cumulative _bucket samples and a _count sample.
+ * Bounds are in usec and are given in seconds when usec is set. The
+ * last bound of every codec is INT64_MAX, which is +Inf
+ */
+static rstatus_t
+stats_metrics_histogram(struct stats *st, const char *prefix,
+                        const char *name, struct string *pool,
+                        const char *lname, struct string *lvalue,
+                        int64_t *bucket, int64_t *bound, uint32_t nbucket,
+                        bool usec)
+{
+    rstatus_t status;
+    char le[32];
+    int64_t count;
+    uint32_t i;
+
+    le[0] = '\0';
+
+    for (count = 0, i = 0; i < nbucket; i++) {
+        count += bucket[i];
+
+        if (st->metrics_build) {
+            if (bound[i] == INT64_MAX) {
+                nc_scnprintf(le, sizeof(le), "+Inf");
+            } else if (usec) {
+                nc_scnprintf(le, sizeof(le), "%g", (double)bound[i] / 1000000);
+                if (strpbrk(le, ".e") == NULL) {
+                    nc_scnprintf(le + strlen(le), sizeof(le) - strlen(le),
+                                 ".0");
+                }
+            } else {
+                nc_scnprintf(le, sizeof(le), "%"PRId64, bound[i]);
+            }
+        }
+
+        status = stats_metrics_sample(st, prefix, name, "_bucket", pool, lname,
+                                      lvalue, le, count);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return stats_metrics_sample(st, prefix, name, "_count", pool, lname,
+                                lvalue, NULL, count);
+}
+
+/*
+ * Walk the stats in sum (c) in the order of the metrics text, family by
+ * family, either building the text or patching the values in it
+ */
+static rstatus_t
+stats_metrics_walk(struct stats *st)
+{
+    rstatus_t status;
+    uint32_t i, j, k;
+    msg_type_t type;
+
+    status = stats_metrics_family(st, "", "uptime_seconds", "gauge",
+                                  "time since nutcracker started");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_sample(st, "", "uptime_seconds", "", NULL, NULL,
+                                  NULL, NULL,
+                                  (int64_t)time(NULL) - st->start_ts);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_family(st, "", "loop_seconds", "histogram",
+                                  "time spent in each part of the event loop");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < STATS_LOOP_NFIELD; i++) {
+        status = stats_metrics_histogram(st, "", "loop_seconds", NULL, "part",
+                                         &stats_loop_names[i],
+                                         st->loop_sum.time[i],
+                                         stats_latency_bounds,
+                                         STATS_LATENCY_NBUCKET, true);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    status = stats_metrics_family(st, "", "loop_events", "histogram",
+                                  "events per wakeup of the event loop");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_histogram(st, "", "loop_events", NULL, NULL, NULL,
+                                     st->loop_sum.events, stats_events_bounds,
+                                     STATS_EVENTS_NBUCKET, false);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (j = 0; j < STATS_POOL_NFIELD; j++) {
+        bool counter = stats_pool_codec[j].type == STATS_COUNTER;
+
+        status = stats_metrics_family(st, "pool_", stats_pool_desc[j].name,
+                                      counter ? "counter" : "gauge",
+                                      stats_pool_desc[j].desc);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        for (i = 0; i < array_n(&st->sum); i++) {
+            struct stats_pool *stp = array_get(&st->sum, i);
+            struct stats_metric *stm = array_get(&stp->metric, j);
+
+            status = stats_metrics_sample(st, "pool_", stats_pool_desc[j].name,
+                                          counter ? "_total" : "", &stp->name,
+                                          NULL, NULL, NULL,
+                                          stm->value.counter);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+    }
+
+    for (j = 0; j < STATS_SERVER_NFIELD; j++) {
+        bool counter = stats_server_codec[j].type == STATS_COUNTER;
+        const char *name = stats_server_desc[j].name;
+
+        /* server_eof of a server is nutcracker_server_eof */
+        if (strncmp(name, "server_", 7) == 0) {
+            name += 7;
+        }
+
+        status = stats_metrics_family(st, "server_", name,
+                                      counter ? "counter" : "gauge",
+                                      stats_server_desc[j].desc);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        for (i = 0; i < array_n(&st->sum); i++) {
+            struct stats_pool *stp = array_get(&st->sum, i);
+
+            for (k = 0; k < array_n(&stp->server); k++) {
+                struct stats_server *sts = array_get(&stp->server, k);
+                struct stats_metric *stm = array_get(&sts->metric, j);
+
+                status = stats_metrics_sample(st, "server_", name,
+                                              counter ? "_total" : "",
+                                              &stp->name, "server",
+                                              &sts->name, NULL,
+                                              stm->value.counter);
+                if (status != NC_OK) {
+                    return status;
+                }
+            }
+        }
+    }
+
+    /* commands and stages that were seen at all, as in the json stats */
+
+    for (j = 0; j < NELEMS(stats_command_desc); j++) {
+        status = stats_metrics_family(st, "", stats_command_desc[j].name,
+                                      "counter", stats_command_desc[j].desc);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        for (i = 0; i < array_n(&st->sum); i++) {
+            struct stats_pool *stp = array_get(&st->sum, i);
+
+            for (type = stats_command_first(stp);
+                 type <= stats_command_last(stp); type++) {
+                struct stats_command *stc = &stp->command[type];
+                int64_t value;
+
+                if (stc->requests == 0) {
+                    continue;
+                }
+
+                value = j == 0 ? stc->requests : j == 1 ?
+                        stc->request_bytes : stc->response_bytes;
+
+                status = stats_metrics_sample(st, "",
+                                              stats_command_desc[j].name,
+                                              "_total", &stp->name, "command",
+                                              msg_type_string(type), NULL,
+                                              value);
+                if (status != NC_OK) {
+                    return status;
+                }
+            }
+        }
+    }
+
+    status = stats_metrics_family(st, "", "command_latency_seconds",
+                                  "histogram", "time from request enqueued "
+                                  "to server to response parsed");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < array_n(&st->sum); i++) {
+        struct stats_pool *stp = array_get(&st->sum, i);
+
+        for (type = stats_command_first(stp); type <= stats_command_last(stp);
+             type++) {
+            struct stats_command *stc = &stp->command[type];
+
+            if (stc->requests == 0) {
+                continue;
+            }
+
+            status = stats_metrics_histogram(st, "", "command_latency_seconds",
+                                             &stp->name, "command",
+                                             msg_type_string(type),
+                                             stc->latency,
+                                             stats_latency_bounds,
+                                             STATS_LATENCY_NBUCKET, true);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+    }
+
+    status = stats_metrics_family(st, "", "stage_seconds", "histogram",
+                                  "time sampled requests spent in each "
+                                  "stage inside the proxy");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < array_n(&st->sum); i++) {
+        struct stats_pool *stp = array_get(&st->sum, i);
+
+        for (j = 0; j < STATS_NSTAGE; j++) {
+            int64_t n;
+
+            for (n = 0, k = 0; k < STATS_LATENCY_NBUCKET; k++) {
+                n += stp->stage[j][k];
+            }
+            if (n == 0) {
+                continue;
+            }
+
+            status = stats_metrics_histogram(st, "", "stage_seconds",
+                                             &stp->name, "stage",
+                                             &stats_stage_names[j],
+                                             stp->stage[j],
+                                             stats_latency_bounds,
+                                             STATS_LATENCY_NBUCKET, true);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+    }
+
+    if (st->metrics_build) {
+        return stats_metrics_append(st, "# EOF\n", 6);
+    }
+
+    if (st->metrics_next != array_n(&st->metrics_sample)) {
+        st->metrics_stale = 1;
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Copy the metrics text into a new buffer, with the values that changed
+ * length formatted in place of the old ones, and move the samples along
+ */
+static rstatus_t
+stats_metrics_splice(struct stats *st)
+{
+    struct stats_buffer *buf = &st->metrics;
+    uint8_t *data, *pos;
+    size_t size, from;
+    ssize_t shift;
+    uint32_t i;
+
+    /* every value fits in 20 digits and a sign */
+    size = buf->len;
+    for (i = 0; i < array_n(&st->metrics_sample); i++) {
+        struct stats_sample *sm = array_get(&st->metrics_sample, i);
+
+        if (sm->resize) {
+            size += 21;
+        }
+    }
+
+    data = nc_alloc(size);
+    if (data == NULL) {
+        return NC_ENOMEM;
+    }
+
+    pos = data;
+    from = 0;
+    shift = 0;
+
+    for (i = 0; i < array_n(&st->metrics_sample); i++) {
+        struct stats_sample *sm = array_get(&st->metrics_sample, i);
+        int n;
+
+        if (!sm->resize) {
+            /* moves along with the resized values before it */
+            sm->off = (size_t)((ssize_t)sm->off + shift);
+            continue;
+        }
+
+        nc_memcpy(pos, buf->data + from, sm->off - from);
+        pos += sm->off - from;
+        from = sm->off + sm->len;
+
+        n = nc_scnprintf(pos, 22, "%"PRId64, sm->value);
+        shift += (ssize_t)n - (ssize_t)sm->len;
+        sm->off = (size_t)(pos - data);
+        sm->len = (uint32_t)n;
+        sm->resize = 0;
+        pos += n;
+    }
+
+    nc_memcpy(pos, buf->data + from, buf->len - from);
+    pos += buf->len - from;
+
+    nc_free(buf->data);
+    buf->data = data;
+    buf->len = (size_t)(pos - data);
+    buf->size = size;
+
+    st->metrics_resize = 0;
+
+    return NC_OK;
+}
+
+static rstatus_t
+stats_make_metrics(struct stats *st)
+{
+    rstatus_t status;
+
+    if (!st->metrics_stale) {
+        st->metrics_build = 0;
+        st->metrics_resize = 0;
+        st->metrics_next = 0;
+
+        status = stats_metrics_walk(st);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        if (!st->metrics_stale && st->metrics_resize) {
+            status = stats_metrics_splice(st);
+            if (status != NC_OK) {
+                st->metrics_stale = 1;
+            }
+        }
+
+        if (!st->metrics_stale) {
+            return NC_OK;
+        }
+    }
+
+    log_debug(LOG_VERB, "build metrics text after %"PRIu32" of %"PRIu32" "
+              "samples", st->metrics_next, array_n(&st->metrics_sample));
+
+    st->metrics.len = 0;
+    st->metrics_sample.nelem = 0;
+    st->metrics_build = 1;
+
+    status = stats_metrics_walk(st);
+
+    st->metrics_build = 0;
+    st->metrics_stale = status != NC_OK ? 1 : 0;
+
+    return status;
+}
+
+/*
+ * Read the command that a collector sent on accepted stats descriptor sd,
+ * without waiting for it. Return NC_EAGAIN if nothing was sent yet; the
+ * caller waits for it in the stats loop, up to a short deadline. Collectors
+ * that send nothing and just read get the stats, as they always did
+ */
+static rstatus_t
+stats_recv_cmd(int sd, stats_cmd_t *cmd, uint32_t *count)
+{
+    char buf[STATS_CMD_SIZE], *arg;
+    ssize_t n;
+
+    *cmd = STATS_CMD_STATS;
+    *count = 0;
+
+    n = recv(sd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return NC_EAGAIN;
+    }
+    if (n <= 0) {
+        return NC_OK;
+    }
+    buf[n] = '\0';
+    buf[strcspn(buf, "\r\n")] = '\0';
+
+    log_debug(LOG_VERB, "recv stats cmd '%s' on sd %d", buf, sd);
+
+    if (strncmp(buf, "GET ", 4) == 0) {
+        char rest[STATS_CMD_SIZE];
+
+        /*
+         * Drain the rest of the http request, which we do not look at,
+         * so that close does not reset the connection under the response
+         */
+        while (recv(sd, rest, sizeof(rest), MSG_DONTWAIT) > 0) {
+            /* void */
+        }
+
+        arg = buf + 4;
+        if (strcspn(arg, " ?") == 8 && strncmp(arg, "/metrics", 8) == 0) {
+            *cmd = STATS_CMD_METRICS;
+        } else {
+            *cmd = STATS_CMD_NOT_FOUND;
+        }
+
+        return NC_OK;
+    }
+
+    if (strncmp(buf, "slowlog", 7) != 0 || (buf[7] != '\0' && buf[7] != ' ')) {
+        return NC_OK;
+    }
+
+    arg = buf + 7;
+    arg += strspn(arg, " ");
+
+    if (strncmp(arg, "reset", 5) == 0) {
+        *cmd = STATS_CMD_SLOWLOG_RESET;
+        return NC_OK;
+    }
+
+    if (strncmp(arg, "get", 3) == 0) {
+        arg += 3;
+        arg += strspn(arg, " ");
+        if (*arg != '\0') {
+            int c = nc_atoi(arg, strlen(arg));
+            *count = c > 0 ? (uint32_t)c : 0;
+        }
+    }
+
+    *cmd = STATS_CMD_SLOWLOG;
+
+    return NC_OK;
+}
+
+/*
+ * Answer command cmd on accepted stats descriptor sd and close it
+ */
+static rstatus_t
+stats_send_rsp(struct stats *st, int sd, stats_cmd_t cmd, uint32_t count)
+{
+    rstatus_t status;
+    uint8_t *data, *alloc;
+    char reply[256];
+    size_t len;
+    ssize_t n;
+
+    alloc = NULL;
+
+    switch (cmd) {
+    case STATS_CMD_SLOWLOG:
+        alloc = slowlog_dump(count, &len);
+        if (alloc == NULL) {
+            close(sd);
+            return NC_ENOMEM;
+        }
+        data = alloc;
+        break;
+
+    case STATS_CMD_SLOWLOG_RESET:
+        len = (size_t)nc_scnprintf(reply, sizeof(reply), "{\"reset\":%"PRIu32"}\n",
+                                   slowlog_reset());
+        data = (uint8_t *)reply;
+        break;
+
+    case STATS_CMD_METRICS:
+        status = stats_make_metrics(st);
+        if (status != NC_OK) {
+            close(sd);
+            return status;
+        }
+        len = (size_t)nc_scnprintf(reply, sizeof(reply), "HTTP/1.1 200 OK\r\n"
+                                   "Content-Type: application/openmetrics-text; "
+                                   "version=1.0.0; charset=utf-8\r\n"
+                                   "Content-Length: %zu\r\n"
+                                   "Connection: close\r\n\r\n",
+                                   st->metrics.len);
+        n = nc_sendn(sd, reply, len);
+        if (n < 0) {
+            log_error("send stats on sd %d failed: %s", sd, strerror(errno));
+            close(sd);
+            return NC_ERROR;
+        }
+        data = st->metrics.data;
+        len = st->metrics.len;
+        break;
+
+    case STATS_CMD_NOT_FOUND:
+        len = (size_t)nc_scnprintf(reply, sizeof(reply), "HTTP/1.1 404 Not Found"
+                                   "\r\nContent-Length: 0\r\n"
+                                   "Connection: close\r\n\r\n");
+        data = (uint8_t *)reply;
+        break;
+
+    case STATS_CMD_STATS:
+    default:
+        status = stats_make_rsp(st);
+        if (status != NC_OK) {
+            close(sd);
+            return status;
+        }
+        data = st->buf.data;
+        len = st->buf.len;
+        break;
+    }
+
+    log_debug(LOG_VERB, "send stats on sd %d %zu bytes", sd, len);
+
+    n = nc_sendn(sd, data, len);
+    if (alloc != NULL) {
+        nc_free(alloc);
+    }
+    if (n < 0) {
+        log_error("send stats on sd %d failed: %s", sd, strerror(errno));
+        close(sd);
+        return NC_ERROR;
+    }
+
+    close(sd);
+
+    return NC_OK;
+}
+
+static rstatus_t
+stats_accept(struct stats *st)
+{
+    rstatus_t status;
+    stats_cmd_t cmd;
+    uint32_t count;
+    int sd;
 
     sd = accept(st->sd, NULL, NULL);
     if (sd < 0) {
@@ -755,18 +2012,99 @@ stats_send_rsp(struct stats *st)
         return NC_ERROR;
     }
 
-    log_debug(LOG_VERB, "send stats on sd %d %d bytes", sd, st->buf.len);
+    status = stats_recv_cmd(sd, &cmd, &count);
+    if (status == NC_EAGAIN && st->npending < STATS_CMD_NPENDING) {
+        struct stats_conn *sc = &st->pending[st->npending++];
+
+        /* a command sent right after connecting may still be on its way */
+        sc->sd = sd;
+        sc->deadline = nc_usec_now() + STATS_CMD_TIMEOUT * 1000LL;
+        st->timeout = 1;
+
+        return NC_OK;
+    }
+
+    return stats_send_rsp(st, sd, cmd, count);
+}
 
-    n = nc_sendn(sd, st->buf.data, st->buf.len);
-    if (n < 0) {
-        log_error("send stats on sd %d failed: %s", sd, strerror(errno));
-        close(sd);
-        return NC_ERROR;
+/*
+ * Answer the pending connections that sent a command since, or that
+ * reached their deadline without one, and keep waiting on the others
+ */
+static void
+stats_serve_pending(struct stats *st)
+{
+    rstatus_t status;
+    stats_cmd_t cmd;
+    uint32_t i, npending, count;
+    int64_t now;
+
+    if (st->npending == 0) {
+        return;
     }
 
-    close(sd);
+    now = nc_usec_now();
 
-    return NC_OK;
+    for (i = 0, npending = 0; i < st->npending; i++) {
+        struct stats_conn *sc = &st->pending[i];
+
+        status = stats_recv_cmd(sc->sd, &cmd, &count);
+        if (status == NC_EAGAIN && now < sc->deadline) {
+            st->pending[npending++] = *sc;
+            continue;
+        }
+
+        stats_send_rsp(st, sc->sd, cmd, count);
+    }
+
+    st->npending = npending;
+    st->timeout = npending != 0 ? 1 : st->interval;
+}
+
+static void
+stats_close_pending(struct stats *st)
+{
+    uint32_t i;
+
+    for (i = 0; i < st->npending; i++) {
+        close(st->pending[i].sd);
+    }
+    st->npending = 0;
+}
+
+/*
+ * Install the shadow (b) and sum (c) stats that the main thread remapped on
+ * reload, and size the output buffer for them
+ */
+static void
+stats_install_remap(struct stats *st)
+{
+    rstatus_t status;
+
+    if (st->remap == 0) {
+        return;
+    }
+
+    stats_pool_unmap(&st->shadow);
+    stats_pool_unmap(&st->sum);
+    st->shadow = st->remap_shadow;
+    st->sum = st->remap_sum;
+    array_null(&st->remap_shadow);
+    array_null(&st->remap_sum);
+
+    stats_destroy_buf(st);
+    status = stats_create_buf(st);
+    if (status != NC_OK) {
+        log_error("remap stats failed, stats are not sent till the next "
+                  "reload");
+    }
+
+    st->metrics_stale = 1;
+
+    log_debug(LOG_NOTICE, "remap stats shadow %p sum %p", st->shadow.elem,
+              st->sum.elem);
+
+    st->remap = 0;
 }
 
 static void
@@ -775,15 +2113,29 @@ stats_loop_callback(void *arg1, void *arg2)
     struct stats *st = arg1;
     int n = *((int *)arg2);
 
+    /* stats descriptor was handed off on upgrade or stats are destroyed */
+    if (st->stop) {
+        stats_close_pending(st);
+        close(st->sd);
+        st->sd = -1;
+        return;
+    }
+
+    /* take up remapped shadow (b) and sum (c) */
+    stats_install_remap(st);
+
     /* aggregate stats from shadow (b) -> sum (c) */
     stats_aggregate(st);
 
+    /* answer collectors that were waited on for a command */
+    stats_serve_pending(st);
+
     if (n == 0) {
         return;
     }
 
-    /* send aggregate stats sum (c) to collector */
-    stats_send_rsp(st);
+    /* send aggregate stats sum (c) or answer the command of collector */
+    stats_accept(st);
 }
 
 static void *
@@ -799,6 +2151,13 @@ stats_listen(struct stats *st)
     rstatus_t status;
     struct sockinfo si;
 
+    /* stats descriptor taken over on upgrade is listening already */
+    if (st->sd >= 0) {
+        log_debug(LOG_NOTICE, "m %d listening on '%.*s:%u'", st->sd,
+                  st->addr.len, st->addr.data, st->port);
+        return NC_OK;
+    }
+
     status = nc_resolve(&st->addr, st->port, &si);
     if (status < 0) {
         return status;
@@ -849,6 +2208,12 @@ stats_start_aggregator(struct stats *st)
         return status;
     }
 
+    status = pipe(st->wakeup);
+    if (status < 0) {
+        log_error("pipe failed: %s", strerror(errno));
+        return NC_ERROR;
+    }
+
     status = pthread_create(&st->tid, NULL, stats_loop, st);
     if (status < 0) {
         log_error("stats aggregator create failed: %s", strerror(status));
@@ -858,19 +2223,44 @@ stats_start_aggregator(struct stats *st)
     return NC_OK;
 }
 
+/*
+ * Stop the aggregator and close the stats descriptor. The descriptor
+ * belongs to the aggregator while it runs, so it is woken up to close the
+ * descriptor itself before it is joined.
+ */
 static void
 stats_stop_aggregator(struct stats *st)
 {
-    if (!stats_enabled) {
-        return;
+    char c = 0;
+
+    if (st->tid != (pthread_t) -1) {
+        st->stop = 1;
+
+        if (write(st->wakeup[1], &c, 1) != 1) {
+            log_warn("wake up of stats aggregator failed, ignored: %s",
+                     strerror(errno));
+        }
+
+        pthread_join(st->tid, NULL);
+        st->tid = (pthread_t) -1;
     }
 
-    close(st->sd);
+    if (st->sd >= 0) {
+        close(st->sd);
+        st->sd = -1;
+    }
+
+    if (st->wakeup[0] >= 0) {
+        close(st->wakeup[0]);
+        close(st->wakeup[1]);
+        st->wakeup[0] = -1;
+        st->wakeup[1] = -1;
+    }
 }
 
 struct stats *
 stats_create(uint16_t stats_port, char *stats_ip, int stats_interval,
-             char *source, struct array *server_pool)
+             char *source, struct array *server_pool, int sd)
 {
     rstatus_t status;
     struct stats *st;
@@ -890,12 +2280,31 @@ stats_create(uint16_t stats_port, char *stats_ip, int stats_interval,
     st->buf.data = NULL;
     st->buf.size = 0;
 
+    st->metrics.len = 0;
+    st->metrics.data = NULL;
+    st->metrics.size = 0;
+    array_null(&st->metrics_sample);
+    st->metrics_next = 0;
+    st->metrics_build = 0;
+    st->metrics_stale = 1;
+
     array_null(&st->current);
     array_null(&st->shadow);
     array_null(&st->sum);
+    array_null(&st->remap_shadow);
+    array_null(&st->remap_sum);
+
+    memset(st->loop, 0, sizeof(st->loop));
+    st->loop_current = &st->loop[0];
+    st->loop_shadow = &st->loop[1];
+    memset(&st->loop_sum, 0, sizeof(st->loop_sum));
 
     st->tid = (pthread_t) -1;
-    st->sd = -1;
+    st->sd = sd;
+    st->wakeup[0] = -1;
+    st->wakeup[1] = -1;
+    st->timeout = stats_interval;
+    st->npending = 0;
 
     string_set_text(&st->service_str, "service");
     string_set_text(&st->service, "nutcracker");
@@ -908,9 +2317,14 @@ stats_create(uint16_t stats_port, char *stats_ip, int stats_interval,
 
     string_set_text(&st->uptime_str, "uptime");
     string_set_text(&st->timestamp_str, "timestamp");
+    string_set_text(&st->resolve_str, "resolve_time");
+    string_set_text(&st->loop_str, "loop");
+    string_set_text(&st->events_str, "events");
 
     st->updated = 0;
     st->aggregate = 0;
+    st->remap = 0;
+    st->stop = 0;
 
     /* map server pool to current (a), shadow (b) and sum (c) */
 
@@ -934,6 +2348,12 @@ stats_create(uint16_t stats_port, char *stats_ip, int stats_interval,
         goto error;
     }
 
+    status = array_init(&st->metrics_sample, STATS_METRICS_NSAMPLE,
+                        sizeof(struct stats_sample));
+    if (status != NC_OK) {
+        goto error;
+    }
+
     status = stats_start_aggregator(st);
     if (status != NC_OK) {
         goto error;
@@ -950,21 +2370,31 @@ void
 stats_destroy(struct stats *st)
 {
     stats_stop_aggregator(st);
+    stats_close_pending(st);
+    stats_pool_unmap(&st->remap_sum);
+    stats_pool_unmap(&st->remap_shadow);
     stats_pool_unmap(&st->sum);
     stats_pool_unmap(&st->shadow);
     stats_pool_unmap(&st->current);
     stats_destroy_buf(st);
+    if (st->metrics.data != NULL) {
+        nc_free(st->metrics.data);
+    }
+    st->metrics_sample.nelem = 0;
+    array_deinit(&st->metrics_sample);
     nc_free(st);
 }
 
 void
 stats_swap(struct stats *st)
 {
+    struct stats_loop *stl;
+
     if (!stats_enabled) {
         return;
     }
 
-    if (st->aggregate == 1) {
+    if (st->aggregate == 1 || st->remap == 1) {
         log_debug(LOG_PVERB, "skip swap of current %p shadow %p as aggregator "
                   "is busy", st->current.elem, st->shadow.elem);
         return;
@@ -980,17 +2410,157 @@ stats_swap(struct stats *st)
               st->shadow.elem);
 
     array_swap(&st->current, &st->shadow);
+    stl = st->loop_current;
+    st->loop_current = st->loop_shadow;
+    st->loop_shadow = stl;
 
     /*
      * Reset current (a) stats before giving it back to generator to keep
      * stats addition idempotent
      */
     stats_pool_reset(&st->current);
+    memset(st->loop_current, 0, sizeof(*st->loop_current));
     st->updated = 0;
 
     st->aggregate = 1;
 }
 
+/*
+ * Carry the values of the metrics in src over to dst
+ */
+static void
+stats_carry_metric(struct array *dst, struct array *src)
+{
+    uint32_t i;
+
+    for (i = 0; i < array_n(src); i++) {
+        struct stats_metric *stm1, *stm2;
+
+        stm1 = array_get(src, i);
+        stm2 = array_get(dst, i);
+
+        ASSERT(stm1->type == stm2->type);
+        stm2->value = stm1->value;
+    }
+}
+
+/*
+ * Carry the stats of the pools and of the servers kept on reload from
+ * stats_pool[] src over to stats_pool[] dst, remapped for the reloaded
+ * server_pool[]. A kept server may have moved to another index, and the
+ * stats of the servers that are gone are dropped.
+ */
+static void
+stats_pool_carry(struct array *dst, struct array *src,
+                 struct array *server_pool)
+{
+    uint32_t i, j, nserver;
+
+    for (i = 0; i < array_n(dst); i++) {
+        struct server_pool *sp = array_get(server_pool, i);
+        struct stats_pool *stp1 = array_get(src, i);
+        struct stats_pool *stp2 = array_get(dst, i);
+
+        stats_carry_metric(&stp2->metric, &stp1->metric);
+        nc_memcpy(stp2->command, stp1->command,
+                  MSG_SENTINEL * sizeof(*stp2->command));
+        nc_memcpy(stp2->stage, stp1->stage, sizeof(stp2->stage));
+
+        nserver = array_n(&sp->server);
+        for (j = 0; j < array_n(&stp2->server); j++) {
+            struct server *s = j < nserver ?
+                               array_get(&sp->server, j) :
+                               array_get(&sp->read_replica, j - nserver);
+            struct stats_server *sts1, *sts2;
+
+            if (s->prev_idx == UINT32_MAX) {
+                continue;
+            }
+
+            sts1 = array_get(&stp1->server, s->prev_idx);
+            sts2 = array_get(&stp2->server, j);
+            stats_carry_metric(&sts2->metric, &sts1->metric);
+        }
+    }
+}
+
+/*
+ * Remap the stats to the reloaded server_pool[]. The current (a) stats are
+ * remapped in place, as they belong to the main thread. The shadow (b) and
+ * sum (c) stats are handed over to the aggregator, which takes them up on
+ * its next run; swaps are held off till then. The caller makes sure that
+ * the aggregator is not busy with the shadow (b) stats.
+ */
+rstatus_t
+stats_remap(struct stats *st, struct array *server_pool)
+{
+    rstatus_t status;
+    struct array current, shadow, sum;
+
+    ASSERT(st->aggregate == 0 && st->remap == 0);
+
+    array_null(&current);
+    array_null(&shadow);
+    array_null(&sum);
+
+    status = stats_pool_map(&current, server_pool);
+    if (status != NC_OK) {
+        goto error;
+    }
+
+    status = stats_pool_map(&shadow, server_pool);
+    if (status != NC_OK) {
+        goto error;
+    }
+
+    status = stats_pool_map(&sum, server_pool);
+    if (status != NC_OK) {
+        goto error;
+    }
+
+    stats_pool_carry(&current, &st->current, server_pool);
+    stats_pool_carry(&sum, &st->sum, server_pool);
+
+    stats_pool_unmap(&st->current);
+    st->current = current;
+
+    st->remap_shadow = shadow;
+    st->remap_sum = sum;
+
+    if (!stats_enabled) {
+        stats_install_remap(st);
+        return NC_OK;
+    }
+
+    st->remap = 1;
+
+    return NC_OK;
+
+error:
+    stats_pool_unmap(&sum);
+    stats_pool_unmap(&shadow);
+    stats_pool_unmap(&current);
+    return status;
+}
+
+/*
+ * Return true once the aggregator has taken up the stats remapped on reload
+ */
+bool
+stats_remapped(struct stats *st)
+{
+    return st->remap == 0;
+}
+
+/*
+ * Stop serving stats once the stats descriptor is handed off on upgrade
+ */
+void
+stats_handoff(struct stats *st)
+{
+    stats_stop_aggregator(st);
+}
+
 static struct stats_metric *
 stats_pool_to_metric(struct context *ctx, struct server_pool *pool,
                      stats_pool_field_t fidx)
@@ -1099,6 +2669,11 @@ stats_server_to_metric(struct context *ctx, struct server *server,
     struct stats_metric *stm;
     uint32_t pidx, sidx;
 
+    /* a server retired on reload has no stats of its own anymore */
+    if (server->retired) {
+        return NULL;
+    }
+
     sidx = server->idx;
     pidx = server->owner->idx;
 
@@ -1122,6 +2697,9 @@ _stats_server_incr(struct context *ctx, struct server *server,
     struct stats_metric *stm;
 
     stm = stats_server_to_metric(ctx, server, fidx);
+    if (stm == NULL) {
+        return;
+    }
 
     ASSERT(stm->type == STATS_COUNTER || stm->type == STATS_GAUGE);
     stm->value.counter++;
@@ -1137,6 +2715,9 @@ _stats_server_decr(struct context *ctx, struct server *server,
     struct stats_metric *stm;
 
     stm = stats_server_to_metric(ctx, server, fidx);
+    if (stm == NULL) {
+        return;
+    }
 
     ASSERT(stm->type == STATS_GAUGE);
     stm->value.counter--;
@@ -1152,6 +2733,9 @@ _stats_server_incr_by(struct context *ctx, struct server *server,
     struct stats_metric *stm;
 
     stm = stats_server_to_metric(ctx, server, fidx);
+    if (stm == NULL) {
+        return;
+    }
 
     ASSERT(stm->type == STATS_COUNTER || stm->type == STATS_GAUGE);
     stm->value.counter += val;
@@ -1167,6 +2751,9 @@ _stats_server_decr_by(struct context *ctx, struct server *server,
     struct stats_metric *stm;
 
     stm = stats_server_to_metric(ctx, server, fidx);
+    if (stm == NULL) {
+        return;
+    }
 
     ASSERT(stm->type == STATS_GAUGE);
     stm->value.counter -= val;
@@ -1182,6 +2769,9 @@ _stats_server_set_ts(struct context *ctx, struct server *server,
     struct stats_metric *stm;
 
     stm = stats_server_to_metric(ctx, server, fidx);
+    if (stm == NULL) {
+        return;
+    }
 
     ASSERT(stm->type == STATS_TIMESTAMP);
     stm->value.timestamp = val;
@@ -1189,3 +2779,157 @@ _stats_server_set_ts(struct context *ctx, struct server *server,
     log_debug(LOG_VVVERB, "set ts field '%.*s' to %"PRId64"", stm->name.len,
               stm->name.data, stm->value.timestamp);
 }
+
+/*
+ * Return the latency bucket that latency in usec falls in
+ */
+static uint32_t
+stats_latency_bucket(int64_t latency)
+{
+    uint32_t i;
+
+    for (i = 0; latency > stats_latency_bounds[i]; i++) {
+        /* the last bucket is unbounded */
+    }
+
+    return i;
+}
+
+static struct stats_command *
+stats_pool_to_command(struct context *ctx, struct server_pool *pool, int type)
+{
+    struct stats *st;
+    struct stats_pool *stp;
+
+    ASSERT(type > MSG_UNKNOWN && type < MSG_SENTINEL);
+
+    st = ctx->stats;
+    stp = array_get(&st->current, pool->idx);
+
+    st->updated = 1;
+
+    return &stp->command[type];
+}
+
+void
+_stats_command_request(struct context *ctx, struct server_pool *pool,
+                       int type, int64_t bytes)
+{
+    struct stats_command *stc;
+
+    stc = stats_pool_to_command(ctx, pool, type);
+
+    stc->requests++;
+    stc->request_bytes += bytes;
+
+    log_debug(LOG_VVVERB, "incr command '%.*s' in pool %"PRIu32" to "
+              "%"PRId64"", msg_type_string(type)->len,
+              msg_type_string(type)->data, pool->idx, stc->requests);
+}
+
+void
+_stats_command_response(struct context *ctx, struct server_pool *pool,
+                        int type, int64_t bytes, int64_t latency)
+{
+    struct stats_command *stc;
+
+    stc = stats_pool_to_command(ctx, pool, type);
+
+    stc->response_bytes += bytes;
+    stc->latency[stats_latency_bucket(latency)]++;
+}
+
+/*
+ * Return the time in usec that timed request msg spent in stage, from its
+ * stamps, or -1 if it did not get through the stage, like the server stage
+ * of a request that timed out
+ */
+int64_t
+stats_stage_usec(struct msg *msg, stats_stage_t stage)
+{
+    int64_t from, to, server;
+
+    ASSERT(msg->request && msg->timed);
+    ASSERT(stage < STATS_NSTAGE);
+
+    from = msg->stamp[stats_stage_from[stage]];
+    to = msg->stamp[stats_stage_to[stage]];
+    if (from <= 0 || to < from) {
+        return -1;
+    }
+
+    if (stage == STATS_STAGE_proxy) {
+        server = stats_stage_usec(msg, STATS_STAGE_server);
+        if (server < 0) {
+            return -1;
+        }
+        to -= server;
+    }
+
+    return to - from;
+}
+
+struct string *
+stats_stage_name(stats_stage_t stage)
+{
+    ASSERT(stage < STATS_NSTAGE);
+
+    return &stats_stage_names[stage];
+}
+
+/*
+ * Account the stages that sampled request msg of pool went through
+ */
+void
+_stats_pool_stage(struct context *ctx, struct server_pool *pool,
+                  struct msg *msg)
+{
+    struct stats *st;
+    struct stats_pool *stp;
+    uint32_t i;
+
+    ASSERT(msg->request && msg->sampled);
+
+    st = ctx->stats;
+    stp = array_get(&st->current, pool->idx);
+
+    for (i = 0; i < STATS_NSTAGE; i++) {
+        int64_t usec = stats_stage_usec(msg, i);
+
+        if (usec < 0) {
+            continue;
+        }
+
+        stp->stage[i][stats_latency_bucket(usec)]++;
+    }
+
+    st->updated = 1;
+
+    log_debug(LOG_VVVERB, "stage req %"PRIu64" in pool %"PRIu32" in "
+              "%"PRId64" usec", msg->id, pool->idx,
+              msg->stamp[MSG_STAMP_DONE] - msg->stamp[MSG_STAMP_RECV]);
+}
+
+void
+_stats_loop_time(struct context *ctx, stats_loop_field_t fidx, int64_t usec)
+{
+    struct stats *st = ctx->stats;
+
+    ASSERT(fidx < STATS_LOOP_NFIELD);
+
+    st->loop_current->time[fidx][stats_latency_bucket(usec)]++;
+    st->updated = 1;
+}
+
+void
+_stats_loop_events(struct context *ctx, int nevent)
+{
+    struct stats *st = ctx->stats;
+    uint32_t i;
+
+    for (i = 0; nevent > stats_events_bounds[i]; i++) {
+        /* the last bucket is unbounded */
+    }
+    st->loop_current->events[i]++;
+    st->updated = 1;
+}
@@ -27,7 +27,18 @@
     ACTION( client_connections,     STATS_GAUGE,        "# active client connections")                              \
     /* pool behavior */                                                                                             \
     ACTION( server_ejects,          STATS_COUNTER,      "# times backend server was ejected")                       \
+    ACTION( outlier_ejects,         STATS_COUNTER,      "# times backend server was ejected as latency outlier")    \
     /* forwarder behavior */                                                                                        \
+    ACTION( retries,                STATS_COUNTER,      "# requests retried")                                       \
+    ACTION( retries_denied,         STATS_COUNTER,      "# retries denied by the retry budget")                     \
+    ACTION( hedges,                 STATS_COUNTER,      "# hedged requests sent")                                   \
+    ACTION( hedges_won,             STATS_COUNTER,      "# hedged requests answered first by the hedge")            \
+    ACTION( hedges_denied,          STATS_COUNTER,      "# hedges denied by the hedge budget")                      \
+    ACTION( replicated,             STATS_COUNTER,      "# writes fanned out to replicas")                          \
+    ACTION( replica_failed,         STATS_COUNTER,      "# replicated writes that failed to be acked")              \
+    ACTION( throttled,              STATS_COUNTER,      "# times client reads were paused by rate limits")          \
+    ACTION( rate_limited,           STATS_COUNTER,      "# requests rejected by rate limits")                       \
+    ACTION( batch_clients,          STATS_COUNTER,      "# client connections classified as batch")                 \
     ACTION( forward_error,          STATS_COUNTER,      "# times we encountered a forwarding error")                \
     ACTION( fragments,              STATS_COUNTER,      "# fragments created from a multi-vector request")          \
 
@@ -37,7 +48,18 @@
     ACTION( server_err,             STATS_COUNTER,      "# errors on server connections")                           \
     ACTION( server_timedout,        STATS_COUNTER,      "# timeouts on server connections")                         \
     ACTION( server_connections,     STATS_GAUGE,        "# active server connections")                              \
+    ACTION( server_scale_ups,       STATS_COUNTER,      "# server connections opened above the minimum")            \
+    ACTION( server_scale_downs,     STATS_COUNTER,      "# idle server connections drained and closed")             \
+    ACTION( window_full,            STATS_COUNTER,      "# times requests waited for the pipeline window")          \
+    ACTION( window_shrinks,         STATS_COUNTER,      "# times the pipeline window was halved")                   \
+    ACTION( flush_batches,          STATS_COUNTER,      "# batches of requests held back to flush")                 \
+    ACTION( flush_timedout,         STATS_COUNTER,      "# batches of requests flushed on their deadline")          \
     ACTION( server_ejected_at,      STATS_TIMESTAMP,    "timestamp when server was ejected in usec since epoch")    \
+    ACTION( request_timeout,        STATS_GAUGE,        "adaptive request timeout in msec")                         \
+    ACTION( health_checks,          STATS_COUNTER,      "# health checks sent")                                     \
+    ACTION( health_failures,        STATS_COUNTER,      "# failed health checks")                                   \
+    ACTION( requests_shed,          STATS_COUNTER,      "# requests shed on a full server queue")                   \
+    ACTION( queue_timedout,         STATS_COUNTER,      "# requests timed out before being sent")                   \
     /* data behavior */                                                                                             \
     ACTION( requests,               STATS_COUNTER,      "# requests")                                               \
     ACTION( request_bytes,          STATS_COUNTER,      "total request bytes")                                      \
@@ -48,9 +70,76 @@
     ACTION( out_queue,              STATS_GAUGE,        "# requests in outgoing queue")                             \
     ACTION( out_queue_bytes,        STATS_GAUGE,        "current request bytes in outgoing queue")                  \
 
+#define STATS_LATENCY_CODEC(ACTION)                                                                 \
+    ACTION( latency_100us,         100LL,             "# responses in upto 100 usec")               \
+    ACTION( latency_250us,         250LL,             "# responses in 100 usec to 250 usec")        \
+    ACTION( latency_500us,         500LL,             "# responses in 250 usec to 500 usec")        \
+    ACTION( latency_1ms,           1000LL,            "# responses in 500 usec to 1 msec")          \
+    ACTION( latency_2500us,        2500LL,            "# responses in 1 msec to 2.5 msec")          \
+    ACTION( latency_5ms,           5000LL,            "# responses in 2.5 msec to 5 msec")          \
+    ACTION( latency_10ms,          10000LL,           "# responses in 5 msec to 10 msec")           \
+    ACTION( latency_25ms,          25000LL,           "# responses in 10 msec to 25 msec")          \
+    ACTION( latency_50ms,          50000LL,           "# responses in 25 msec to 50 msec")          \
+    ACTION( latency_100ms,         100000LL,          "# responses in 50 msec to 100 msec")         \
+    ACTION( latency_250ms,         250000LL,          "# responses in 100 msec to 250 msec")        \
+    ACTION( latency_500ms,         500000LL,          "# responses in 250 msec to 500 msec")        \
+    ACTION( latency_1s,            1000000LL,         "# responses in 500 msec to 1 sec")           \
+    ACTION( latency_inf,           INT64_MAX,         "# responses slower than 1 sec")              \
+
+/*
+ * Stages of a sampled request, each timed from one msg_stamp_t to another,
+ * into the buckets of the latency codec. The proxy stage is the total time
+ * less the time spent in the server.
+ */
+#define STATS_STAGE_CODEC(ACTION)                                                                                   \
+    ACTION( read,     MSG_STAMP_RECV,       MSG_STAMP_PARSED,     "first byte read to request parsed")              \
+    ACTION( route,    MSG_STAMP_PARSED,     MSG_STAMP_ENQUEUED,   "request parsed to enqueued to server")           \
+    ACTION( queue,    MSG_STAMP_ENQUEUED,   MSG_STAMP_SENT,       "enqueued to written to server")                  \
+    ACTION( server,   MSG_STAMP_SENT,       MSG_STAMP_RSP_PARSED, "written to server to response parsed")           \
+    ACTION( coalesce, MSG_STAMP_RSP_PARSED, MSG_STAMP_COALESCED,  "response parsed to coalesced")                   \
+    ACTION( reply,    MSG_STAMP_COALESCED,  MSG_STAMP_DONE,       "response coalesced to written to client")        \
+    ACTION( total,    MSG_STAMP_RECV,       MSG_STAMP_DONE,       "first byte read to response written")            \
+    ACTION( proxy,    MSG_STAMP_RECV,       MSG_STAMP_DONE,       "total less written to response parsed")          \
+
+/*
+ * Event loop of the context, with the time spent in each part of it kept
+ * in the buckets of the latency codec, and the number of events returned
+ * per wakeup in the buckets of the events codec
+ */
+#define STATS_LOOP_CODEC(ACTION)                                                                                    \
+    ACTION( wait,   "time blocked waiting for events per wakeup")                                                   \
+    ACTION( busy,   "time spent after waking up, before waiting again")                                             \
+    ACTION( client, "time spent handling an event on a client connection")                                          \
+    ACTION( server, "time spent handling an event on a server connection")                                          \
+    ACTION( proxy,  "time spent handling an event on a proxy connection")                                           \
+    ACTION( timer,  "time spent expiring timed out requests per wakeup")                                            \
+    ACTION( stats,  "time spent handing stats to the aggregator per wakeup")                                        \
+
+#define STATS_EVENTS_CODEC(ACTION)                                                                                  \
+    ACTION( events_0,              0LL,               "# wakeups with no events")                                   \
+    ACTION( events_1,              1LL,               "# wakeups with 1 event")                                     \
+    ACTION( events_4,              4LL,               "# wakeups with 2 to 4 events")                               \
+    ACTION( events_16,             16LL,              "# wakeups with 5 to 16 events")                              \
+    ACTION( events_64,             64LL,              "# wakeups with 17 to 64 events")                             \
+    ACTION( events_256,            256LL,             "# wakeups with 65 to 256 events")                            \
+    ACTION( events_inf,            INT64_MAX,         "# wakeups with more than 256 events")                        \
+
 #define STATS_ADDR      "0.0.0.0"
 #define STATS_PORT      22222
 #define STATS_INTERVAL  (30 * 1000) /* in msec */
+#define STATS_CMD_TIMEOUT       5       /* wait for a command on the stats port in msec */
+#define STATS_CMD_SIZE          128     /* max command length on the stats port */
+#define STATS_CMD_NPENDING      16      /* max # connections waited on for a command */
+#define STATS_METRICS_SIZE      16384   /* initial metrics text buffer size */
+#define STATS_METRICS_NSAMPLE   1024    /* initial # samples in metrics text */
+
+typedef enum stats_cmd {
+    STATS_CMD_STATS,          /* dump stats (no command) */
+    STATS_CMD_SLOWLOG,        /* dump slowlog: 'slowlog [get [count]]' */
+    STATS_CMD_SLOWLOG_RESET,  /* empty slowlog: 'slowlog reset' */
+    STATS_CMD_METRICS,        /* openmetrics text: 'GET /metrics' over http */
+    STATS_CMD_NOT_FOUND,      /* any other http request */
+} stats_cmd_t;
 
 typedef enum stats_type {
     STATS_INVALID,
@@ -69,15 +158,58 @@ struct stats_metric {
     } value;
 };
 
+#define DEFINE_ACTION(_name, _usec, _desc) STATS_##_name,
+typedef enum stats_latency_bucket {
+    STATS_LATENCY_CODEC(DEFINE_ACTION)
+    STATS_LATENCY_NBUCKET
+} stats_latency_bucket_t;
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _from, _to, _desc) STATS_STAGE_##_name,
+typedef enum stats_stage {
+    STATS_STAGE_CODEC(DEFINE_ACTION)
+    STATS_NSTAGE
+} stats_stage_t;
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _desc) STATS_LOOP_##_name,
+typedef enum stats_loop_field {
+    STATS_LOOP_CODEC(DEFINE_ACTION)
+    STATS_LOOP_NFIELD
+} stats_loop_field_t;
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _n, _desc) STATS_##_name,
+typedef enum stats_events_bucket {
+    STATS_EVENTS_CODEC(DEFINE_ACTION)
+    STATS_EVENTS_NBUCKET
+} stats_events_bucket_t;
+#undef DEFINE_ACTION
+
+struct stats_command {
+    int64_t requests;                       /* # requests */
+    int64_t request_bytes;                  /* total request bytes */
+    int64_t response_bytes;                 /* total response bytes */
+    int64_t latency[STATS_LATENCY_NBUCKET]; /* # responses by latency bucket */
+};
+
+struct stats_loop {
+    int64_t time[STATS_LOOP_NFIELD][STATS_LATENCY_NBUCKET]; /* # by time bucket */
+    int64_t events[STATS_EVENTS_NBUCKET];                   /* # wakeups by events */
+};
+
 struct stats_server {
     struct string name;   /* server name (ref) */
     struct array  metric; /* stats_metric[] for server codec */
 };
 
 struct stats_pool {
-    struct string name;   /* pool name (ref) */
-    struct array  metric; /* stats_metric[] for pool codec */
-    struct array  server; /* stats_server[] */
+    struct string        name;     /* pool name (ref) */
+    struct array         metric;   /* stats_metric[] for pool codec */
+    struct array         server;   /* stats_server[] */
+    struct stats_command *command; /* stats_command[] by msg type */
+    int64_t              stage[STATS_NSTAGE][STATS_LATENCY_NBUCKET]; /* # sampled by stage */
+    unsigned             redis:1;  /* redis pool? */
 };
 
 struct stats_buffer {
@@ -86,6 +218,26 @@ struct stats_buffer {
     size_t   size;  /* buffer alloc size */
 };
 
+/*
+ * Accepted connection on the stats port that has not sent a command yet.
+ * It gets the stats if none comes by the deadline
+ */
+struct stats_conn {
+    int     sd;       /* accepted descriptor */
+    int64_t deadline; /* command deadline in usec */
+};
+
+/*
+ * Sample in the metrics text: the value it was last formatted with, and
+ * where the value sits in the text, so that it can be patched in place
+ */
+struct stats_sample {
+    int64_t  value;     /* sample value */
+    size_t   off;       /* value offset in metrics text */
+    uint32_t len;       /* value length in metrics text */
+    unsigned resize:1;  /* value length changed? */
+};
+
 struct stats {
     uint16_t            port;           /* stats monitoring port */
     int                 interval;       /* stats aggregation interval */
@@ -93,13 +245,28 @@ struct stats {
 
     int64_t             start_ts;       /* start timestamp of nutcracker */
     struct stats_buffer buf;            /* output buffer */
+    struct stats_buffer metrics;        /* openmetrics text buffer */
+    struct array        metrics_sample; /* stats_sample[] in metrics text */
+    uint32_t            metrics_next;   /* next sample to update */
+    unsigned            metrics_build:1;  /* building metrics text? */
+    unsigned            metrics_resize:1; /* metrics text to be spliced? */
+    unsigned            metrics_stale:1;  /* metrics text to be rebuilt? */
 
     struct array        current;        /* stats_pool[] (a) */
     struct array        shadow;         /* stats_pool[] (b) */
     struct array        sum;            /* stats_pool[] (c = a + b) */
 
+    struct stats_loop   loop[2];        /* stats_loop (a) and (b) */
+    struct stats_loop   *loop_current;  /* stats_loop (a) */
+    struct stats_loop   *loop_shadow;   /* stats_loop (b) */
+    struct stats_loop   loop_sum;       /* stats_loop (c = a + b) */
+
     pthread_t           tid;            /* stats aggregator thread */
     int                 sd;             /* stats descriptor */
+    int                 wakeup[2];      /* pipe to wake up aggregator */
+    int                 timeout;        /* stats loop wait timeout in msec */
+    struct stats_conn   pending[STATS_CMD_NPENDING]; /* awaiting a command */
+    uint32_t            npending;       /* # pending connections */
 
     struct string       service_str;    /* service string */
     struct string       service;        /* service */
@@ -109,9 +276,17 @@ struct stats {
     struct string       version;        /* version */
     struct string       uptime_str;     /* uptime string */
     struct string       timestamp_str;  /* timestamp string */
+    struct string       resolve_str;    /* resolve time string */
+    struct string       loop_str;       /* event loop string */
+    struct string       events_str;     /* events per wakeup string */
+
+    struct array        remap_shadow;   /* stats_pool[] (b) on reload */
+    struct array        remap_sum;      /* stats_pool[] (c) on reload */
 
     volatile int        aggregate;      /* shadow (b) aggregate? */
     volatile int        updated;        /* current (a) updated? */
+    volatile int        remap;          /* shadow (b) and sum (c) remapped? */
+    volatile int        stop;           /* stop aggregator? */
 };
 
 #define DEFINE_ACTION(_name, _type, _desc) STATS_POOL_##_name,
@@ -170,6 +345,26 @@ typedef enum stats_server_field {
      _stats_server_set_ts(_ctx, _server, STATS_SERVER_##_name, _val);   \
 } while (0)
 
+#define stats_command_request(_ctx, _pool, _type, _bytes) do {          \
+    _stats_command_request(_ctx, _pool, _type, _bytes);                 \
+} while (0)
+
+#define stats_command_response(_ctx, _pool, _type, _bytes, _latency) do { \
+    _stats_command_response(_ctx, _pool, _type, _bytes, _latency);      \
+} while (0)
+
+#define stats_pool_stage(_ctx, _pool, _msg) do {                        \
+    _stats_pool_stage(_ctx, _pool, _msg);                               \
+} while (0)
+
+#define stats_loop_time(_ctx, _field, _usec) do {                       \
+    _stats_loop_time(_ctx, _field, _usec);                              \
+} while (0)
+
+#define stats_loop_events(_ctx, _nevent) do {                           \
+    _stats_loop_events(_ctx, _nevent);                                  \
+} while (0)
+
 #else
 
 #define stats_pool_incr(_ctx, _pool, _name)
@@ -188,11 +383,23 @@ typedef enum stats_server_field {
 
 #define stats_server_decr_by(_ctx, _server, _name, _val)
 
+#define stats_command_request(_ctx, _pool, _type, _bytes)
+
+#define stats_command_response(_ctx, _pool, _type, _bytes, _latency)
+
+#define stats_pool_stage(_ctx, _pool, _msg)
+
+#define stats_loop_time(_ctx, _field, _usec)
+
+#define stats_loop_events(_ctx, _nevent)
+
 #endif
 
 #define stats_enabled   NC_STATS
 
 void stats_describe(void);
+int64_t stats_stage_usec(struct msg *msg, stats_stage_t stage);
+struct string *stats_stage_name(stats_stage_t stage);
 
 void _stats_pool_incr(struct context *ctx, struct server_pool *pool, stats_pool_field_t fidx);
 void _stats_pool_decr(struct context *ctx, struct server_pool *pool, stats_pool_field_t fidx);
@@ -206,8 +413,18 @@ void _stats_server_incr_by(struct context *ctx, struct server *server, stats_ser
 void _stats_server_decr_by(struct context *ctx, struct server *server, stats_server_field_t fidx, int64_t val);
 void _stats_server_set_ts(struct context *ctx, struct server *server, stats_server_field_t fidx, int64_t val);
 
-struct stats *stats_create(uint16_t stats_port, char *stats_ip, int stats_interval, char *source, struct array *server_pool);
+void _stats_command_request(struct context *ctx, struct server_pool *pool, int type, int64_t bytes);
+void _stats_command_response(struct context *ctx, struct server_pool *pool, int type, int64_t bytes, int64_t latency);
+void _stats_pool_stage(struct context *ctx, struct server_pool *pool, struct msg *msg);
+
+void _stats_loop_time(struct context *ctx, stats_loop_field_t fidx, int64_t usec);
+void _stats_loop_events(struct context *ctx, int nevent);
+
+struct stats *stats_create(uint16_t stats_port, char *stats_ip, int stats_interval, char *source, struct array *server_pool, int sd);
 void stats_destroy(struct stats *stats);
 void stats_swap(struct stats *stats);
+rstatus_t stats_remap(struct stats *stats, struct array *server_pool);
+bool stats_remapped(struct stats *stats);
+void stats_handoff(struct stats *stats);
 
 #endif
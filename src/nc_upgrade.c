@@ -0,0 +1,835 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <nc_core.h>
+#include <nc_server.h>
+#include <nc_upgrade.h>
+
+/*
+ * Hot upgrade of a running nutcracker by handing off its listening sockets.
+ *
+ * With an upgrade socket (-u), nutcracker listens on that unix socket for
+ * the process that is to replace it. An upgrade goes as follows:
+ *
+ * 1). The new process connects to the upgrade socket while it starts up,
+ *     and the old process sends it the listening sockets of its pools and
+ *     of its stats, along with their listen addresses, over SCM_RIGHTS.
+ * 2). The new process listens on the sockets whose address it has in its
+ *     own configuration, closes the others and acknowledges the handoff.
+ * 3). The old process confirms the acknowledgement, stops accepting and
+ *     drains its clients: a client is closed as soon as it has no requests
+ *     outstanding, and all of them once the drain timeout (-w) expires.
+ *     The old process then exits.
+ * 4). The new process takes over the upgrade socket for the next upgrade
+ *     once the handoff is confirmed, and exits if it is not.
+ *
+ * The listening sockets stay open throughout, so that connections keep
+ * queueing up in their backlog and no client is refused. The old process
+ * hands off through its event loop, and keeps running as if nothing
+ * happened if the new process fails before it acknowledges the handoff,
+ * or does not acknowledge it within UPGRADE_TIMEOUT.
+ */
+
+void
+upgrade_ref(struct conn *conn, void *owner)
+{
+    struct context *ctx = owner;
+    struct upgrade *up = ctx->upgrade;
+
+    ASSERT(conn->upgrade);
+    ASSERT(conn->owner == NULL);
+
+    conn->family = AF_UNIX;
+    conn->addrlen = sizeof(up->addr);
+    conn->addr = (struct sockaddr *)&up->addr;
+
+    /* connections accepted on the listener hand off to the new process */
+    if (up->l_conn == NULL) {
+        up->l_conn = conn;
+    } else {
+        ASSERT(up->h_conn == NULL);
+        up->h_conn = conn;
+    }
+
+    conn->owner = owner;
+
+    log_debug(LOG_VVERB, "ref conn %p owner %p into upgrade", conn, ctx);
+}
+
+void
+upgrade_unref(struct conn *conn)
+{
+    struct context *ctx;
+    struct upgrade *up;
+
+    ASSERT(conn->upgrade);
+    ASSERT(conn->owner != NULL);
+
+    ctx = conn->owner;
+    conn->owner = NULL;
+
+    up = ctx->upgrade;
+    if (conn == up->l_conn) {
+        up->l_conn = NULL;
+    } else {
+        up->h_conn = NULL;
+
+        if (up->hbuf != NULL) {
+            nc_free(up->hbuf);
+            up->hbuf = NULL;
+        }
+    }
+
+    log_debug(LOG_VVERB, "unref conn %p owner %p from upgrade", conn, ctx);
+}
+
+void
+upgrade_close(struct context *ctx, struct conn *conn)
+{
+    rstatus_t status;
+
+    ASSERT(conn->upgrade);
+
+    conn_tmo_delete(conn);
+
+    conn->unref(conn);
+
+    if (conn->sd >= 0) {
+        status = close(conn->sd);
+        if (status < 0) {
+            log_error("close u %d failed, ignored: %s", conn->sd,
+                      strerror(errno));
+        }
+        conn->sd = -1;
+    }
+
+    conn_put(conn);
+}
+
+static void
+upgrade_stats_name(char *buf, size_t size, uint8_t *addr, size_t len,
+                   uint16_t port)
+{
+    nc_snprintf(buf, size, "stats %.*s:%"PRIu16"", (int)len, addr, port);
+}
+
+static rstatus_t
+upgrade_set_timeout(int sd)
+{
+    struct timeval tv;
+    rstatus_t status;
+
+    tv.tv_sec = UPGRADE_TIMEOUT;
+    tv.tv_usec = 0;
+
+    status = setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (status < 0) {
+        return NC_ERROR;
+    }
+
+    status = setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (status < 0) {
+        return NC_ERROR;
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Prepare the handoff of the listening sockets of the pools and of the
+ * stats: a header followed by their newline terminated names
+ */
+static rstatus_t
+upgrade_prepare(struct context *ctx, struct upgrade *up)
+{
+    struct stats *st = ctx->stats;
+    uint32_t hdr[2], i, npool, nfd;
+    char *buf;
+    size_t len;
+
+    buf = nc_alloc(sizeof(hdr) + UPGRADE_MAX_FD * UPGRADE_MAX_NAMELEN);
+    if (buf == NULL) {
+        return NC_ENOMEM;
+    }
+
+    nfd = 0;
+    len = sizeof(hdr);
+
+    for (i = 0, npool = array_n(&ctx->pool); i < npool; i++) {
+        struct server_pool *sp = array_get(&ctx->pool, i);
+
+        if (sp->p_conn == NULL || sp->p_conn->sd < 0) {
+            continue;
+        }
+
+        if (nfd == UPGRADE_MAX_FD - 1 ||
+            sp->addrstr.len >= UPGRADE_MAX_NAMELEN) {
+            log_warn("upgrade cannot hand off listening socket of pool '%.*s'",
+                     sp->name.len, sp->name.data);
+            continue;
+        }
+
+        nc_memcpy(buf + len, sp->addrstr.data, sp->addrstr.len);
+        len += sp->addrstr.len;
+        buf[len++] = '\n';
+
+        up->hfd[nfd++] = sp->p_conn->sd;
+    }
+
+    if (st->sd >= 0) {
+        upgrade_stats_name(buf + len, UPGRADE_MAX_NAMELEN, st->addr.data,
+                           st->addr.len, st->port);
+        len += nc_strlen(buf + len);
+        buf[len++] = '\n';
+
+        up->hfd[nfd++] = st->sd;
+    }
+
+    hdr[0] = nfd;
+    hdr[1] = (uint32_t)(len - sizeof(hdr));
+    nc_memcpy(buf, hdr, sizeof(hdr));
+
+    up->hnfd = nfd;
+    up->hbuf = buf;
+    up->hlen = len;
+    up->hoff = 0;
+
+    return NC_OK;
+}
+
+/*
+ * Send the sockets along with the first byte of the handoff on the
+ * connection sd
+ */
+static ssize_t
+upgrade_sendmsg(struct upgrade *up, int sd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr cm;
+        char           buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FD)];
+    } control;
+
+    iov.iov_base = up->hbuf;
+    iov.iov_len = up->hlen;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (up->hnfd != 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * up->hnfd);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * up->hnfd);
+        nc_memcpy(CMSG_DATA(cmsg), up->hfd, sizeof(int) * up->hnfd);
+    }
+
+    return sendmsg(sd, &msg, 0);
+}
+
+/*
+ * Send the handoff to the new process on the handoff connection as far as
+ * the connection takes it, and wait for the acknowledgement once it is all
+ * sent
+ */
+rstatus_t
+upgrade_send(struct context *ctx, struct conn *conn)
+{
+    struct upgrade *up = ctx->upgrade;
+    ssize_t n;
+
+    ASSERT(conn == up->h_conn);
+
+    if (up->hoff == up->hlen) {
+        return NC_OK;
+    }
+
+    while (up->hoff < up->hlen) {
+        if (up->hoff == 0) {
+            n = upgrade_sendmsg(up, conn->sd);
+        } else {
+            n = send(conn->sd, up->hbuf + up->hoff, up->hlen - up->hoff, 0);
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn->send_ready = 0;
+                return NC_OK;
+            }
+
+            log_warn("upgrade send on u %d failed, keep running: %s",
+                     conn->sd, strerror(errno));
+            conn->err = errno;
+            return NC_ERROR;
+        }
+
+        up->hoff += (size_t)n;
+    }
+
+    log_debug(LOG_NOTICE, "upgrade handed off %"PRIu32" sockets on u %d",
+              up->hnfd, conn->sd);
+
+    return event_del_out(ctx->evb, conn);
+}
+
+/*
+ * Take the acknowledgement of the handoff from the new process and confirm
+ * it. The handoff is done once it is confirmed.
+ */
+static rstatus_t
+upgrade_recv_ack(struct context *ctx, struct conn *conn)
+{
+    struct upgrade *up = ctx->upgrade;
+    ssize_t n;
+    char ack;
+
+    ASSERT(conn == up->h_conn);
+
+    for (;;) {
+        n = read(conn->sd, &ack, 1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn->recv_ready = 0;
+                return NC_OK;
+            }
+
+            log_warn("upgrade ack on u %d failed, keep running: %s", conn->sd,
+                     strerror(errno));
+            conn->err = errno;
+            return NC_ERROR;
+        }
+
+        break;
+    }
+
+    if (n == 0 || ack != UPGRADE_ACK || up->hoff != up->hlen) {
+        log_warn("upgrade ack on u %d failed, keep running: %s", conn->sd,
+                 n == 0 ? "eof" : "invalid ack");
+        return NC_ERROR;
+    }
+
+    n = send(conn->sd, &ack, 1, 0);
+    if (n != 1) {
+        log_warn("upgrade confirm on u %d failed, keep running: %s", conn->sd,
+                 n < 0 ? strerror(errno) : "short write");
+        return NC_ERROR;
+    }
+
+    log_debug(LOG_NOTICE, "upgrade at '%s' confirmed on u %d", up->path,
+              conn->sd);
+
+    up->handoff = 1;
+    conn->done = 1;
+
+    return NC_OK;
+}
+
+/*
+ * Accept the new process on the upgrade socket listener and start handing
+ * off to it on the event loop, or take the acknowledgement on the handoff
+ * connection
+ */
+rstatus_t
+upgrade_recv(struct context *ctx, struct conn *conn)
+{
+    struct upgrade *up = ctx->upgrade;
+    struct conn *h_conn;
+    rstatus_t status;
+    int sd;
+
+    ASSERT(conn->upgrade);
+    ASSERT(conn->recv_active);
+
+    if (conn != up->l_conn) {
+        return upgrade_recv_ack(ctx, conn);
+    }
+
+    for (;;) {
+        sd = accept(conn->sd, NULL, NULL);
+        if (sd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn->recv_ready = 0;
+                return NC_OK;
+            }
+
+            log_error("accept on u %d failed: %s", conn->sd, strerror(errno));
+            return NC_ERROR;
+        }
+
+        break;
+    }
+
+    /* one upgrade at a time */
+    if (up->handoff || up->h_conn != NULL) {
+        close(sd);
+        return NC_OK;
+    }
+
+    log_debug(LOG_NOTICE, "upgrade requested on u %d at '%s'", sd, up->path);
+
+    status = nc_set_nonblocking(sd);
+    if (status < 0) {
+        log_warn("set nonblock on u %d failed, keep running: %s", sd,
+                 strerror(errno));
+        close(sd);
+        return NC_OK;
+    }
+
+    h_conn = conn_get_upgrade(ctx);
+    if (h_conn == NULL) {
+        close(sd);
+        return NC_OK;
+    }
+    h_conn->sd = sd;
+
+    status = upgrade_prepare(ctx, up);
+    if (status != NC_OK) {
+        h_conn->close(ctx, h_conn);
+        return NC_OK;
+    }
+
+    status = event_add_conn(ctx->evb, h_conn);
+    if (status < 0) {
+        log_warn("event add conn u %d failed, keep running: %s", sd,
+                 strerror(errno));
+        h_conn->close(ctx, h_conn);
+        return NC_OK;
+    }
+
+    /* give up on the new process if it does not acknowledge in time */
+    conn_tmo_insert(h_conn, UPGRADE_TIMEOUT * 1000);
+
+    return NC_OK;
+}
+
+/*
+ * Return the listening socket named name that was taken over from the old
+ * process, or -1 if there is none
+ */
+int
+upgrade_take(struct context *ctx, struct string *name)
+{
+    struct upgrade *up = ctx->upgrade;
+    uint32_t i;
+    int sd;
+
+    if (up == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < up->nfd; i++) {
+        if (up->fd[i] < 0 || nc_strlen(up->name[i]) != name->len ||
+            nc_strncmp(up->name[i], name->data, name->len) != 0) {
+            continue;
+        }
+
+        sd = up->fd[i];
+        up->fd[i] = -1;
+
+        log_debug(LOG_NOTICE, "upgrade takes over socket %d on '%s'", sd,
+                  up->name[i]);
+
+        return sd;
+    }
+
+    return -1;
+}
+
+int
+upgrade_take_stats(struct context *ctx, char *addr, uint16_t port)
+{
+    char buf[UPGRADE_MAX_NAMELEN];
+    struct string name;
+
+    upgrade_stats_name(buf, sizeof(buf), (uint8_t *)addr, nc_strlen(addr),
+                       port);
+    string_set_raw(&name, buf);
+
+    return upgrade_take(ctx, &name);
+}
+
+bool
+upgrade_handed_off(struct context *ctx)
+{
+    return ctx->upgrade != NULL && ctx->upgrade->handoff;
+}
+
+static void
+upgrade_release(struct upgrade *up)
+{
+    uint32_t i;
+
+    for (i = 0; i < up->nfd; i++) {
+        if (up->fd[i] >= 0) {
+            close(up->fd[i]);
+            up->fd[i] = -1;
+        }
+    }
+    up->nfd = 0;
+
+    if (up->buf != NULL) {
+        nc_free(up->buf);
+        up->buf = NULL;
+    }
+
+    if (up->sd >= 0) {
+        close(up->sd);
+        up->sd = -1;
+    }
+}
+
+/*
+ * Take over the listening sockets of the process running on the upgrade
+ * socket, if any. The handoff connection stays open till upgrade_listen
+ * acknowledges it.
+ */
+static rstatus_t
+upgrade_takeover(struct upgrade *up)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr cm;
+        char           buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FD)];
+    } control;
+    uint32_t hdr[2], i;
+    char *p, *end;
+    ssize_t n;
+    int sd;
+
+    sd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sd < 0) {
+        log_error("upgrade socket failed: %s", strerror(errno));
+        return NC_ERROR;
+    }
+
+    if (connect(sd, (struct sockaddr *)&up->addr, sizeof(up->addr)) < 0) {
+        log_debug(LOG_NOTICE, "upgrade finds no process to take over at "
+                  "'%s': %s", up->path, strerror(errno));
+        close(sd);
+        return NC_OK;
+    }
+    up->sd = sd;
+
+    if (upgrade_set_timeout(sd) != NC_OK) {
+        log_error("upgrade set timeout on u %d failed: %s", sd,
+                  strerror(errno));
+        goto error;
+    }
+
+    iov.iov_base = hdr;
+    iov.iov_len = sizeof(hdr);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    n = recvmsg(sd, &msg, 0);
+    if (n <= 0) {
+        log_error("upgrade recv on u %d failed: %s", sd,
+                  n < 0 ? strerror(errno) : "eof");
+        goto error;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        up->nfd = (uint32_t)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        nc_memcpy(up->fd, CMSG_DATA(cmsg), sizeof(int) * up->nfd);
+    }
+
+    if (n < (ssize_t)sizeof(hdr) &&
+        nc_recvn(sd, (char *)hdr + n, sizeof(hdr) - (size_t)n) !=
+        (ssize_t)(sizeof(hdr) - (size_t)n)) {
+        log_error("upgrade recv on u %d failed: short read", sd);
+        goto error;
+    }
+
+    if ((msg.msg_flags & MSG_CTRUNC) || hdr[0] != up->nfd ||
+        hdr[1] > UPGRADE_MAX_FD * UPGRADE_MAX_NAMELEN) {
+        log_error("upgrade recv on u %d failed: invalid handoff of %"PRIu32
+                  " sockets", sd, hdr[0]);
+        goto error;
+    }
+
+    up->buf = nc_alloc(hdr[1] + 1);
+    if (up->buf == NULL) {
+        goto error;
+    }
+
+    n = nc_recvn(sd, up->buf, hdr[1]);
+    if (n != (ssize_t)hdr[1]) {
+        log_error("upgrade recv on u %d failed: short read", sd);
+        goto error;
+    }
+    up->buf[hdr[1]] = '\0';
+
+    p = up->buf;
+    end = up->buf + hdr[1];
+    for (i = 0; i < up->nfd; i++) {
+        char *q = memchr(p, '\n', (size_t)(end - p));
+        if (q == NULL) {
+            log_error("upgrade recv on u %d failed: invalid socket names", sd);
+            goto error;
+        }
+        *q = '\0';
+
+        up->name[i] = p;
+        p = q + 1;
+    }
+
+    log_debug(LOG_NOTICE, "upgrade took over %"PRIu32" sockets at '%s'",
+              up->nfd, up->path);
+
+    return NC_OK;
+
+error:
+    upgrade_release(up);
+    return NC_ERROR;
+}
+
+rstatus_t
+upgrade_init(struct context *ctx, char *path, int drain_timeout)
+{
+    rstatus_t status;
+    struct upgrade *up;
+
+    ctx->upgrade = NULL;
+
+    if (path == NULL) {
+        return NC_OK;
+    }
+
+    if (nc_strlen(path) >= sizeof(up->addr.sun_path)) {
+        log_error("upgrade socket '%s' is too long", path);
+        return NC_ERROR;
+    }
+
+    up = nc_zalloc(sizeof(*up));
+    if (up == NULL) {
+        return NC_ENOMEM;
+    }
+
+    up->path = path;
+    up->drain_timeout = drain_timeout;
+    up->addr.sun_family = AF_UNIX;
+    nc_memcpy(up->addr.sun_path, path, nc_strlen(path));
+    up->l_conn = NULL;
+    up->h_conn = NULL;
+    up->hnfd = 0;
+    up->hbuf = NULL;
+    up->hlen = 0;
+    up->hoff = 0;
+    up->sd = -1;
+    up->nfd = 0;
+    up->buf = NULL;
+    up->drain_deadline = 0;
+    up->handoff = 0;
+
+    ctx->upgrade = up;
+
+    status = upgrade_takeover(up);
+    if (status != NC_OK) {
+        nc_free(up);
+        ctx->upgrade = NULL;
+        return status;
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Acknowledge the handoff from the old process, if any, and wait for it to
+ * confirm that it stops accepting. Returns NC_ERROR if the old process is
+ * not known to stop, so that this process does not serve alongside it.
+ */
+rstatus_t
+upgrade_ack(struct context *ctx)
+{
+    struct upgrade *up = ctx->upgrade;
+    uint32_t i;
+    ssize_t n;
+    char ack;
+
+    if (up == NULL || up->sd < 0) {
+        return NC_OK;
+    }
+
+    for (i = 0; i < up->nfd; i++) {
+        if (up->fd[i] >= 0) {
+            log_warn("upgrade closes socket on '%s' that is not in the conf",
+                     up->name[i]);
+        }
+    }
+
+    ack = UPGRADE_ACK;
+    n = nc_sendn(up->sd, &ack, 1);
+    if (n != 1) {
+        log_error("upgrade ack on u %d failed: %s", up->sd, strerror(errno));
+        upgrade_release(up);
+        return NC_ERROR;
+    }
+
+    n = nc_recvn(up->sd, &ack, 1);
+    if (n != 1 || ack != UPGRADE_ACK) {
+        log_error("upgrade confirm on u %d failed: %s", up->sd,
+                  n < 0 ? strerror(errno) :
+                  (n == 0 ? "eof" : "invalid confirm"));
+        upgrade_release(up);
+        return NC_ERROR;
+    }
+
+    log_debug(LOG_NOTICE, "upgrade at '%s' confirmed on u %d", up->path,
+              up->sd);
+
+    upgrade_release(up);
+
+    return NC_OK;
+}
+
+/*
+ * Listen on the upgrade socket for the next upgrade
+ */
+rstatus_t
+upgrade_listen(struct context *ctx)
+{
+    struct upgrade *up = ctx->upgrade;
+    rstatus_t status;
+    struct conn *conn;
+    int sd;
+
+    if (up == NULL) {
+        return NC_OK;
+    }
+
+    sd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sd < 0) {
+        log_error("upgrade socket failed: %s", strerror(errno));
+        return NC_ERROR;
+    }
+
+    /* the old process, if any, is done with the path */
+    unlink(up->path);
+
+    status = bind(sd, (struct sockaddr *)&up->addr, sizeof(up->addr));
+    if (status < 0) {
+        log_error("bind on u %d to '%s' failed: %s", sd, up->path,
+                  strerror(errno));
+        close(sd);
+        return NC_ERROR;
+    }
+
+    status = listen(sd, 1);
+    if (status < 0) {
+        log_error("listen on u %d on '%s' failed: %s", sd, up->path,
+                  strerror(errno));
+        close(sd);
+        return NC_ERROR;
+    }
+
+    status = nc_set_nonblocking(sd);
+    if (status < 0) {
+        log_error("set nonblock on u %d on '%s' failed: %s", sd, up->path,
+                  strerror(errno));
+        close(sd);
+        return NC_ERROR;
+    }
+
+    conn = conn_get_upgrade(ctx);
+    if (conn == NULL) {
+        close(sd);
+        return NC_ENOMEM;
+    }
+    conn->sd = sd;
+
+    status = event_add_conn(ctx->evb, conn);
+    if (status < 0) {
+        log_error("event add conn u %d on '%s' failed: %s", sd, up->path,
+                  strerror(errno));
+        conn->close(ctx, conn);
+        return NC_ERROR;
+    }
+
+    status = event_del_out(ctx->evb, conn);
+    if (status < 0) {
+        log_error("event del out u %d on '%s' failed: %s", sd, up->path,
+                  strerror(errno));
+        event_del_conn(ctx->evb, conn);
+        conn->close(ctx, conn);
+        return NC_ERROR;
+    }
+
+    log_debug(LOG_NOTICE, "u %d listening on '%s' for upgrades", sd, up->path);
+
+    return NC_OK;
+}
+
+void
+upgrade_deinit(struct context *ctx)
+{
+    struct upgrade *up = ctx->upgrade;
+
+    if (up == NULL) {
+        return;
+    }
+
+    if (up->h_conn != NULL) {
+        up->h_conn->close(ctx, up->h_conn);
+    }
+
+    if (up->l_conn != NULL) {
+        up->l_conn->close(ctx, up->l_conn);
+
+        /* the upgrade socket belongs to the new process after a handoff */
+        if (!up->handoff) {
+            unlink(up->path);
+        }
+    }
+
+    upgrade_release(up);
+
+    nc_free(up);
+    ctx->upgrade = NULL;
+}
@@ -0,0 +1,66 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_UPGRADE_H_
+#define _NC_UPGRADE_H_
+
+#include <nc_core.h>
+
+#define UPGRADE_DRAIN_TIMEOUT   30000   /* default drain timeout in msec */
+#define UPGRADE_TIMEOUT         10      /* handoff timeout in sec */
+#define UPGRADE_MAX_FD          250     /* max # sockets handed off */
+#define UPGRADE_MAX_NAMELEN     256     /* max length of socket name */
+#define UPGRADE_ACK             'k'     /* handoff ack and confirmation */
+
+struct upgrade {
+    char               *path;            /* upgrade socket path (ref in argv[]) */
+    int                drain_timeout;    /* drain timeout in msec */
+    struct sockaddr_un addr;             /* upgrade socket address */
+    struct conn        *l_conn;          /* upgrade socket listener */
+    struct conn        *h_conn;          /* handoff connection to new process */
+    uint32_t           hnfd;             /* # sockets handed off */
+    int                hfd[UPGRADE_MAX_FD];  /* sockets handed off */
+    char               *hbuf;            /* handoff header and socket names */
+    size_t             hlen;             /* length of hbuf */
+    size_t             hoff;             /* # bytes of hbuf sent */
+
+    int                sd;               /* handoff connection to old process */
+    uint32_t           nfd;              /* # sockets taken over */
+    int                fd[UPGRADE_MAX_FD];   /* sockets taken over */
+    char               *name[UPGRADE_MAX_FD]; /* socket names (ref in buf) */
+    char               *buf;             /* socket names */
+
+    int64_t            drain_deadline;   /* drain deadline in msec */
+    unsigned           handoff:1;        /* sockets handed off? */
+};
+
+void upgrade_ref(struct conn *conn, void *owner);
+void upgrade_unref(struct conn *conn);
+void upgrade_close(struct context *ctx, struct conn *conn);
+rstatus_t upgrade_recv(struct context *ctx, struct conn *conn);
+rstatus_t upgrade_send(struct context *ctx, struct conn *conn);
+
+int upgrade_take(struct context *ctx, struct string *name);
+int upgrade_take_stats(struct context *ctx, char *addr, uint16_t port);
+bool upgrade_handed_off(struct context *ctx);
+
+rstatus_t upgrade_init(struct context *ctx, char *path, int drain_timeout);
+rstatus_t upgrade_ack(struct context *ctx);
+rstatus_t upgrade_listen(struct context *ctx);
+void upgrade_deinit(struct context *ctx);
+
+#endif
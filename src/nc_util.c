@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <time.h>
 
 #include <sys/time.h>
 #include <sys/types.h>
@@ -433,6 +434,30 @@ nc_usec_now(void)
     return usec;
 }
 
+/*
+ * Return the current time in microseconds on a monotonic clock, which is
+ * cheap to read on platforms that serve it from the cycle counter, like
+ * Linux does through the vdso. The time is only useful for intervals.
+ */
+int64_t
+nc_usec_mono(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec now;
+    int status;
+
+    status = clock_gettime(CLOCK_MONOTONIC, &now);
+    if (status < 0) {
+        log_error("clock_gettime failed: %s", strerror(errno));
+        return -1;
+    }
+
+    return (int64_t)now.tv_sec * 1000000LL + (int64_t)now.tv_nsec / 1000LL;
+#else
+    return nc_usec_now();
+#endif
+}
+
 /*
  * Return the current time in milliseconds since Epoch
  */
@@ -442,6 +467,58 @@ nc_msec_now(void)
     return nc_usec_now() / 1000LL;
 }
 
+void
+bucket_init(struct bucket *b)
+{
+    b->tokens = 0LL;
+    b->last = 0LL;
+}
+
+/*
+ * Refill bucket b at rate tokens per second up to time now, and return the
+ * time in msec till it is out of debt. A bucket with rate 0 never runs out
+ * of tokens.
+ */
+int
+bucket_delay(struct bucket *b, uint32_t rate, int64_t now)
+{
+    int64_t max = (int64_t)rate * 1000000LL;
+
+    if (rate == 0) {
+        return 0;
+    }
+
+    if (b->last == 0) {
+        /* first use; bucket starts out full */
+        b->tokens = max;
+    } else if (now > b->last) {
+        /*
+         * No more time counts than it takes to fill the bucket, so that
+         * the refill of a bucket idle for long does not overflow
+         */
+        int64_t elapsed = MIN(now - b->last, (max - b->tokens) / rate + 1);
+
+        b->tokens = MIN(b->tokens + elapsed * rate, max);
+    }
+    b->last = now;
+
+    if (b->tokens >= 0) {
+        return 0;
+    }
+
+    return (int)((-b->tokens / rate + 999) / 1000);
+}
+
+void
+bucket_take(struct bucket *b, uint32_t rate, uint32_t ntoken)
+{
+    if (rate == 0) {
+        return;
+    }
+
+    b->tokens -= (int64_t)ntoken * 1000000LL;
+}
+
 static int
 nc_resolve_inet(struct string *name, int port, struct sockinfo *si)
 {
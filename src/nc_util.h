@@ -190,6 +190,23 @@ int _scnprintf(char *buf, size_t size, const char *fmt, ...);
 int _vscnprintf(char *buf, size_t size, const char *fmt, va_list args);
 int64_t nc_usec_now(void);
 int64_t nc_msec_now(void);
+int64_t nc_usec_mono(void);
+
+/*
+ * Token bucket that is refilled at a rate of tokens per second and holds
+ * at most a second worth of tokens. Tokens are kept in millionths, so that
+ * the refill is exact at usec granularity. Taking more tokens than are
+ * available puts the bucket in debt, which later refills pay off first.
+ */
+
+struct bucket {
+    int64_t tokens;  /* tokens available in millionths */
+    int64_t last;    /* last refill time in usec */
+};
+
+void bucket_init(struct bucket *b);
+int bucket_delay(struct bucket *b, uint32_t rate, int64_t now);
+void bucket_take(struct bucket *b, uint32_t rate, uint32_t ntoken);
 
 /*
  * Address resolution for internet (ipv4 and ipv6) and unix domain
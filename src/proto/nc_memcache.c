@@ -121,6 +121,46 @@ memcache_delete(struct msg *r)
     return false;
 }
 
+/*
+ * Return true, if the memcache command only reads data and can safely be
+ * sent to a server more than once, otherwise return false
+ */
+bool
+memcache_read(struct msg *r)
+{
+    return memcache_retrieval(r);
+}
+
+/*
+ * Return true, if the memcache command modifies data, otherwise return
+ * false
+ */
+bool
+memcache_write(struct msg *r)
+{
+    return memcache_storage(r) || memcache_arithmetic(r) || memcache_delete(r);
+}
+
+/*
+ * Return true, if the memcache response reports a failure to carry out
+ * the request, otherwise return false
+ */
+bool
+memcache_failure(struct msg *r)
+{
+    switch (r->type) {
+    case MSG_RSP_MC_ERROR:
+    case MSG_RSP_MC_CLIENT_ERROR:
+    case MSG_RSP_MC_SERVER_ERROR:
+        return true;
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
 void
 memcache_parse_req(struct msg *r)
 {
@@ -845,6 +885,11 @@ memcache_parse_rsp(struct msg *r)
                         break;
                     }
 
+                    if (str7cmp(m, 'V', 'E', 'R', 'S', 'I', 'O', 'N')) {
+                        r->type = MSG_RSP_MC_VERSION;
+                        break;
+                    }
+
                     break;
 
                 case 9:
@@ -901,6 +946,7 @@ memcache_parse_rsp(struct msg *r)
                     state = SW_CRLF;
                     break;
 
+                case MSG_RSP_MC_VERSION:
                 case MSG_RSP_MC_CLIENT_ERROR:
                 case MSG_RSP_MC_SERVER_ERROR:
                     state = SW_RUNTO_CRLF;
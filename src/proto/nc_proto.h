@@ -138,6 +138,9 @@
     (str15icmp(m, c0, c1, c2, c3, c4, c5, c6, c7, c8, c9, c10, c11, c12, c13, c14) &&       \
      (m[15] == c15 || m[15] == (c15 ^ 0x20)))
 
+bool memcache_read(struct msg *r);
+bool memcache_write(struct msg *r);
+bool memcache_failure(struct msg *r);
 void memcache_parse_req(struct msg *r);
 void memcache_parse_rsp(struct msg *r);
 void memcache_pre_splitcopy(struct mbuf *mbuf, void *arg);
@@ -145,6 +148,7 @@ rstatus_t memcache_post_splitcopy(struct msg *r);
 void memcache_pre_coalesce(struct msg *r);
 void memcache_post_coalesce(struct msg *r);
 
+bool redis_read(struct msg *r);
 void redis_parse_req(struct msg *r);
 void redis_parse_rsp(struct msg *r);
 void redis_pre_splitcopy(struct mbuf *mbuf, void *arg);
@@ -251,6 +251,60 @@ redis_argeval(struct msg *r)
     return false;
 }
 
+/*
+ * Return true, if the redis command only reads data and can safely be sent
+ * to a server more than once, otherwise return false
+ */
+bool
+redis_read(struct msg *r)
+{
+    switch (r->type) {
+    case MSG_REQ_REDIS_EXISTS:
+    case MSG_REQ_REDIS_PTTL:
+    case MSG_REQ_REDIS_TTL:
+    case MSG_REQ_REDIS_TYPE:
+    case MSG_REQ_REDIS_BITCOUNT:
+    case MSG_REQ_REDIS_DUMP:
+    case MSG_REQ_REDIS_GET:
+    case MSG_REQ_REDIS_GETBIT:
+    case MSG_REQ_REDIS_GETRANGE:
+    case MSG_REQ_REDIS_MGET:
+    case MSG_REQ_REDIS_STRLEN:
+    case MSG_REQ_REDIS_HEXISTS:
+    case MSG_REQ_REDIS_HGET:
+    case MSG_REQ_REDIS_HGETALL:
+    case MSG_REQ_REDIS_HKEYS:
+    case MSG_REQ_REDIS_HLEN:
+    case MSG_REQ_REDIS_HMGET:
+    case MSG_REQ_REDIS_HVALS:
+    case MSG_REQ_REDIS_LINDEX:
+    case MSG_REQ_REDIS_LLEN:
+    case MSG_REQ_REDIS_LRANGE:
+    case MSG_REQ_REDIS_SCARD:
+    case MSG_REQ_REDIS_SDIFF:
+    case MSG_REQ_REDIS_SINTER:
+    case MSG_REQ_REDIS_SISMEMBER:
+    case MSG_REQ_REDIS_SMEMBERS:
+    case MSG_REQ_REDIS_SRANDMEMBER:
+    case MSG_REQ_REDIS_SUNION:
+    case MSG_REQ_REDIS_ZCARD:
+    case MSG_REQ_REDIS_ZCOUNT:
+    case MSG_REQ_REDIS_ZRANGE:
+    case MSG_REQ_REDIS_ZRANGEBYSCORE:
+    case MSG_REQ_REDIS_ZRANK:
+    case MSG_REQ_REDIS_ZREVRANGE:
+    case MSG_REQ_REDIS_ZREVRANGEBYSCORE:
+    case MSG_REQ_REDIS_ZREVRANK:
+    case MSG_REQ_REDIS_ZSCORE:
+        return true;
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
 /*
  * Reference: http://redis.io/topics/protocol
  *